@@ -52,6 +52,8 @@
 #include "../modules/config/config.h"
 #include "../modules/echo/echo.h"
 #include "../modules/messenger/message-service.h"
+#include "../modules/backlog/backlog.h"
+#include "../modules/aggregate/aggregate.h"
 #include "../modules/command/message.h"
 #include "../modules/command/command.h"
 #include "../modules/sensors/analog.h"
@@ -67,10 +69,13 @@
 #define LOG_MODULE "AIR"
 #define LOG_LEVEL LOG_LEVEL_DBG
 
-static int sequence = 0;
 static int failure_counter = 0;
 
 static int sensor_done_evt = 0;
+
+// readings on their way into frames
+static aggregate_t readings;
+
 PROCESS_NAME(sensor_process);
 
 static int red = 1;
@@ -143,6 +148,7 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 
 	// result
 	static bool rc = false;
+	static int queued = 0;
 
 	PROCESS_BEGIN( );
 
@@ -161,7 +167,7 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 
 	memset (&message, 0, sizeof(message));
 	message.header = AIRBORNE_CAL_HEADER;
-	message.sequence = sequence++;
+	message.sequence = config_use_sequence(1);
 	message.rssi = messenger_recvd_rssi();
 
 	message.caldata[0] = mcal.sens;
@@ -183,15 +189,16 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 		LOG_INFO("**************************\n");
 	}
 
-	// dispatch the message to the message queue
-	static uip_ip6addr_t addr;
-	config_get_receiver (&addr);
-
-	messenger_send (&addr, message.sequence, (void*) &message, sizeof(message));
-	etimer_set(&et, config_get_retry_interval() * CLOCK_SECOND);
+	// dispatch the message to the message queue, the messenger reports
+	// once it has the ACK or has given up retrying (however long that takes)
+	queued = messenger_send (NULL, message.sequence, (void*) &message, sizeof(message), MESSENGER_PRIO_CAL);
+	if (!queued) {
+		LOG_INFO("calibration data could not be queued\n");
+		failure_counter++;
+	}
 
 
-	while(1) {
+	while(queued) {
 		PROCESS_WAIT_EVENT();
 
 		LOG_DBG("Process %p was poked, ev=%d\n", &send_cal_proc, ev);
@@ -199,6 +206,11 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 		// messenger responded...
 		if (ev == PROCESS_EVENT_MSG) {
 
+			// completion for some other queued message, keep waiting
+			if (((messenger_result_t *) data)->sequence != message.sequence) {
+				continue;
+			}
+
 			if (messenger_last_result_okack ()) {
 				LOG_INFO("calibration data sent OK\n");
 
@@ -215,12 +227,6 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 			break;
 		}
 
-		else if (etimer_expired(&et)) {
-			failure_counter++;
-			LOG_DBG("timeout waiting for remote, failures: %u\n", (unsigned int ) failure_counter);
-			break;
-		}
-
 		else {
 			LOG_DBG("Unknown event, ignoring\n");
 			continue;
@@ -257,7 +263,7 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 //	memset (&message, 0, sizeof(message));
 //
 //	message.header = AIRBORNE_CAL_HEADER;
-//	message.sequence = sequence++;
+//	message.sequence = config_use_sequence(1);
 //
 //	// order matters
 //	message.caldata[0] = data.sens;
@@ -284,7 +290,7 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 //	// request the messenger to start sending the message
 //	// the messenger process will take it from here, sending asynchrously
 //	// and posting a status message when its done
-//	messenger_send (&addr, (void*) &message, sizeof(message));
+//	messenger_send (NULL, (void*) &message, sizeof(message));
 //}
 //
 
@@ -311,14 +317,19 @@ PROCESS_THREAD(send_data_proc, ev, data)
 	static clock_t start = 0;
 	static clock_t now = 0;
 
-	static uip_ip6addr_t addr;
 	static bool rc = false;
+	static int queued = 0;
+
+	// what is actually handed to the messenger
+	static const void *payload = NULL;
+	static int payload_len = 0;
+	static uint32_t payload_seq = 0;
 
 
 	// start preparing the message to send
 	memset (&message, 0, sizeof(message));
 	message.header = AIRBORNE_HEADER;
-	message.sequence = sequence++;
+	message.sequence = config_get_sequence();
 	message.rssi = messenger_recvd_rssi();
 
 	// turn on the auxillary bus
@@ -386,20 +397,31 @@ PROCESS_THREAD(send_data_proc, ev, data)
 		LOG_INFO("* Battery    : %10u      *\n", (unsigned int ) message.battery);
 		LOG_INFO("***********************************\n");
 
-	// dispatch the message to the messenger service for delivery
-		config_get_receiver (&addr);
-
 		//dispatch the message to the messenger service for delivery
 		green = 1;
-		messenger_send (&addr, message.sequence, (void*) &message, sizeof(message));
+		payload = aggregate_take(&readings, &message, sizeof(message), &payload_len, &payload_seq);
+
+		// no timer of our own: the messenger's report is the only outcome, so a
+		// message is never backlogged while it still holds it
+		rc = (payload == NULL);
+		queued = (payload != NULL) && messenger_send (NULL, payload_seq, payload, payload_len, MESSENGER_PRIO_DATA);
+		if ((payload != NULL) && !queued) {
+			LOG_INFO("sensor data could not be queued\n");
+			failure_counter++;
+		}
 
 
-		while(1) {
+		while(queued) {
 			PROCESS_WAIT_EVENT();
 
 			// messenger responded...
 			if (ev == PROCESS_EVENT_MSG) {
 
+				// completion for some other queued message, keep waiting
+				if (((messenger_result_t *) data)->sequence != payload_seq) {
+					continue;
+				}
+
 
 				if (messenger_last_result_okack ()) {
 					LOG_INFO("sensor data sent OK\n");
@@ -409,7 +431,10 @@ PROCESS_THREAD(send_data_proc, ev, data)
 				}
 				// calibration did not send
 				else {
-					LOG_INFO("sensor data sent, NAK\n");
+					if (((messenger_result_t *) data)->refused)
+						LOG_INFO("sensor data refused, the collector has no reference\n");
+					else
+						LOG_INFO("sensor data sent, NAK\n");
 					rc = false;
 					failure_counter++;
 				}
@@ -417,13 +442,6 @@ PROCESS_THREAD(send_data_proc, ev, data)
 				break;
 			}
 
-			else if (etimer_expired(&et)) {
-				failure_counter++;
-				LOG_DBG("timeout waiting for remote, failures: %u\n", (unsigned int ) failure_counter);
-				rc = false;
-				break;
-			}
-
 			else {
 				LOG_DBG("Unknown event, ignoring\n");
 				continue;
@@ -431,6 +449,12 @@ PROCESS_THREAD(send_data_proc, ev, data)
 
 		} // end while ... event processing loop
 
+		// keep what the server did not get, catch up once it answers again
+		// (a reading held for the next aggregate was not sent at all)
+		aggregate_result(&readings, payload, payload_len, rc == true);
+		if ((payload != NULL) && (rc == true))
+			backlog_drain( );
+
 		// report our success
 		process_post(&sensor_process, sensor_done_evt, &rc);
 
@@ -489,7 +513,13 @@ PROCESS_THREAD(sensor_process, ev, data)
 
 		config_init ( AIRBORNE_SENSOR_DEVTYPE );
 
-		// initialize the messenger service - used for bidirectional comms with server
+		// readings that could not be delivered are kept in flash
+		backlog_init( );
+
+		// readings sent several to a frame, CONFIG_SAMPLES_PER_SEND
+	aggregate_init(&readings, &aggregate_airborne);
+
+	// initialize the messenger service - used for bidirectional comms with server
 		messenger_init ();
 
 		// enable the "echo" service - a test service used for diagnostics
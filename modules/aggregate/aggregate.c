@@ -0,0 +1,279 @@
+/**
+ * @file aggregate.c
+ * @brief Readings held back and sent several to a frame
+ *
+ * A node's send_data_proc hands each reading to aggregate_take() and
+ * sends whatever it returns.  With CONFIG_SAMPLES_PER_SEND at 1 and no
+ * compression that is the data message itself, as before aggregation;
+ * otherwise the reading is held until K are held, and they go out in
+ * one raw frame or one delta coded frame.
+ *
+ * Delta frames are coded against the last reading the collector ACK'd,
+ * with a keyframe (coded against zero) every KEYFRAME_INTERVAL frames
+ * and whenever the node has no reference.  A delta frame that is not
+ * taken drops the reference: the collector may have lost it (a restart,
+ * or it aged out), so the next frame is a keyframe, and the frame's
+ * readings are backlogged as keyframes so no record depends on it.
+ *
+ * Readings are held for the coding CONFIG_COMPRESSION gave when they
+ * were taken.  If it changes under them they are backlogged as
+ * keyframes, as they need not fit a frame of the other coding.
+ */
+
+#include <contiki.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "../../modules/backlog/backlog.h"
+#include "../../modules/command/message-codec.h"
+#include "../../modules/config/config.h"
+#include "../../modules/messenger/message-service.h"
+
+// contiki-ism for logging the data -
+#include "sys/log.h"
+#define LOG_MODULE "AGG"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+#ifdef DEBUG
+#undef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DBG
+#endif
+
+// delta coded frames send a full (keyframe) reading this often
+#define KEYFRAME_INTERVAL (16)
+
+// the i'th held reading
+#define HELD(a, i) (&(a)->held[(i) * (a)->type->reading_size])
+
+
+static void store_water(void *reading, const void *data)
+{
+	water_reading_t *r = (water_reading_t *) reading;
+	const water_data_t *message = (const water_data_t *) data;
+
+	r->pressure = message->pressure;
+	r->temppressure = message->temppressure;
+	r->battery = message->battery;
+	r->color_blue = message->color_blue;
+	r->color_clear = message->color_clear;
+	r->color_green = message->color_green;
+	r->color_red = message->color_red;
+	r->ambient = message->ambient;
+	r->range1 = message->range1;
+	r->range2 = message->range2;
+	r->range3 = message->range3;
+	r->range4 = message->range4;
+	r->range5 = message->range5;
+	r->temperature = message->temperature;
+	r->hall = message->hall;
+}
+
+static int encode_water(const void *ref, const void *readings, int count, uint8_t *out, int maxlen, int *used)
+{
+	return codec_encode_water(ref, readings, count, out, maxlen, used);
+}
+
+const aggregate_type_t aggregate_water = {
+	WATER_AGG_HEADER, sizeof(water_reading_t), WATER_AGG_MAX, store_water, encode_water
+};
+
+static void store_airborne(void *reading, const void *data)
+{
+	airborne_reading_t *r = (airborne_reading_t *) reading;
+	const airborne_t *message = (const airborne_t *) data;
+
+	r->ms5637_pressure = message->ms5637_pressure;
+	r->ms5637_temp = message->ms5637_temp;
+	r->si7020_humid = message->si7020_humid;
+	r->si7020_temp = message->si7020_temp;
+	r->battery = message->battery;
+	r->i2cerror = message->i2cerror;
+}
+
+static int encode_airborne(const void *ref, const void *readings, int count, uint8_t *out, int maxlen, int *used)
+{
+	return codec_encode_airborne(ref, readings, count, out, maxlen, used);
+}
+
+const aggregate_type_t aggregate_airborne = {
+	AIRBORNE_AGG_HEADER, sizeof(airborne_reading_t), AIRBORNE_AGG_MAX, store_airborne, encode_airborne
+};
+
+
+void aggregate_init(aggregate_t *a, const aggregate_type_t *type)
+{
+	memset(a, 0, sizeof(*a));
+	a->type = type;
+
+	// CONFIG_SAMPLES_PER_SEND reads back what is sent
+	config_set_samples_raw_max(type->raw_max);
+}
+
+/**
+ * Backlog the readings of a delta coded frame that was not taken as
+ * keyframes, so each record decodes without a reference the collector
+ * may have lost by the time the backlog drains.  The frame's sequences
+ * are re-used, one per reading.
+ */
+static void backlog_keyframes(aggregate_t *a, const uint8_t *readings, int count)
+{
+	agg_delta_t *frame = &a->frame.delta;
+	uint32_t sequence = frame->sequence;
+	int n, used;
+
+	while (count > 0) {
+		frame->sequence = sequence;
+		frame->flags = AGG_FLAG_DELTA | AGG_FLAG_KEYFRAME;
+		frame->ref_sequence = 0;
+		n = a->type->encode(NULL, readings, count, frame->data, sizeof(frame->data), &used);
+		if (n <= 0)
+			break;
+		frame->count = n;
+		backlog_append(frame, AGG_DELTA_HEADER_SIZE + used);
+
+		sequence += n;
+		readings += n * a->type->reading_size;
+		count -= n;
+	}
+}
+
+// the seconds since each held reading was taken
+static void age_held(aggregate_t *a)
+{
+	uint16_t age;
+	int i;
+
+	for (i = 0; i < a->held_count; i++) {
+		age = clock_seconds( ) - a->sampled_at[i];
+		memcpy(HELD(a, i), &age, sizeof(age));
+	}
+}
+
+/**
+ * Backlog every held reading as keyframes, under sequences of their own.
+ * Readings held for a frame of one coding do not go out in the other,
+ * where they need not fit: a raw frame carries a reading or two.
+ */
+static void backlog_held(aggregate_t *a)
+{
+	LOG_INFO("%d held readings backlogged as keyframes\n", a->held_count);
+
+	age_held(a);
+	memset(&a->frame, 0, sizeof(a->frame));
+	a->frame.delta.header = a->type->header;
+	a->frame.delta.rssi = messenger_recvd_rssi();
+	a->frame.delta.sequence = config_use_sequence(a->held_count);
+	backlog_keyframes(a, a->held, a->held_count);
+	a->held_count = 0;
+}
+
+const void *aggregate_take(aggregate_t *a, void *message, int length,
+                           int *frame_length, uint32_t *frame_sequence)
+{
+	agg_delta_t *zframe = &a->frame.delta;
+	water_agg_t *agg = &a->frame.water;
+	int compress = config_get_compression( );
+	unsigned int samples = config_get_samples_per_send( );
+	unsigned int limit = compress ? AGG_DELTA_MAX : a->type->raw_max;
+	int used;
+
+	if (samples > limit)
+		samples = limit;
+
+	a->sent_count = 0;
+	a->delta = 0;
+
+	// CONFIG_COMPRESSION changed under the held readings, or they never fit a frame
+	if ((a->held_count > 0) && ((a->held_compressed != compress) || (a->held_count >= AGG_DELTA_MAX)))
+		backlog_held(a);
+	a->held_compressed = compress;
+
+	if ((samples <= 1) && !compress && (a->held_count == 0)) {
+		// after any sequences backlog_held() took
+		*frame_sequence = config_use_sequence(1);
+		memcpy((uint8_t *) message + sizeof(uint32_t), frame_sequence, sizeof(*frame_sequence));
+		*frame_length = length;
+		return message;
+	}
+
+	a->type->store(HELD(a, a->held_count), message);
+	a->sampled_at[a->held_count++] = clock_seconds( );
+
+	if (a->held_count < samples) {
+		LOG_INFO("Holding reading %d of %u\n", a->held_count, samples);
+		return NULL;
+	}
+
+	age_held(a);
+
+	if (compress) {
+		// code against the last ACK'd reading, with a periodic keyframe
+		a->keyframe = !a->have_ref || (a->frames_since_key >= KEYFRAME_INTERVAL);
+		a->delta = 1;
+
+		memset(zframe, 0, sizeof(*zframe));
+		zframe->header = a->type->header;
+		zframe->sequence = config_get_sequence();
+		zframe->rssi = messenger_recvd_rssi();
+		zframe->flags = AGG_FLAG_DELTA | (a->keyframe ? AGG_FLAG_KEYFRAME : 0);
+		zframe->ref_sequence = a->keyframe ? 0 : a->ref_sequence;
+
+		a->sent_count = a->type->encode(a->keyframe ? NULL : a->ref, a->held, a->held_count,
+		                                zframe->data, sizeof(zframe->data), &used);
+		zframe->count = a->sent_count;
+		*frame_length = AGG_DELTA_HEADER_SIZE + used;
+	}
+	else {
+		// the raw frames share water_agg_t's header, the readings follow it
+		a->sent_count = (a->held_count < a->type->raw_max) ? a->held_count : a->type->raw_max;
+
+		memset(&a->frame, 0, sizeof(a->frame));
+		agg->header = a->type->header;
+		agg->sequence = config_get_sequence();
+		agg->rssi = messenger_recvd_rssi();
+		agg->count = a->sent_count;
+		memcpy((uint8_t *) agg + AGG_HEADER_SIZE, a->held, a->sent_count * a->type->reading_size);
+		*frame_length = AGG_HEADER_SIZE + agg->count * a->type->reading_size;
+	}
+
+	*frame_sequence = config_use_sequence(a->sent_count);
+	return &a->frame;
+}
+
+void aggregate_result(aggregate_t *a, const void *frame, int frame_length, int ok)
+{
+	int sent = a->sent_count;
+
+	if (frame == NULL)
+		return;
+
+	if (ok) {
+		if (a->delta) {
+			memcpy(a->ref, HELD(a, sent - 1), a->type->reading_size);
+			a->ref_sequence = a->frame.delta.sequence + sent - 1;
+			a->have_ref = 1;
+			a->frames_since_key = a->keyframe ? 1 : a->frames_since_key + 1;
+		}
+	}
+	else if (a->delta) {
+		// the collector may have lost the reference (a restart, or it aged out),
+		// so the next frame is a keyframe and the backlog keeps keyframes only
+		a->have_ref = 0;
+		if (a->keyframe)
+			backlog_append(frame, frame_length);
+		else
+			backlog_keyframes(a, a->held, sent);
+	}
+	else {
+		backlog_append(frame, frame_length);
+	}
+
+	// readings that went out are delivered or backlogged, keep the rest
+	if (sent > 0) {
+		a->held_count -= sent;
+		memmove(a->held, HELD(a, sent), a->held_count * a->type->reading_size);
+		memmove(a->sampled_at, &a->sampled_at[sent], a->held_count * sizeof(a->sampled_at[0]));
+	}
+	a->sent_count = 0;
+}
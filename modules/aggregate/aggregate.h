@@ -0,0 +1,85 @@
+/*
+ * aggregate.h
+ *
+ * The sensor nodes' readings on their way into frames: held back until
+ * CONFIG_SAMPLES_PER_SEND of them can go out together, in a raw frame
+ * (water_agg_t / airborne_agg_t) or, with CONFIG_COMPRESSION, delta
+ * coded against the last reading the collector ACK'd (agg_delta_t).
+ * What is not delivered goes to the backlog.
+ *
+ * Each node keeps one aggregate_t for the reading type it sends, named
+ * by an aggregate_type_t (aggregate_water, aggregate_airborne).
+ */
+
+#ifndef MODULES_AGGREGATE_AGGREGATE_H_
+#define MODULES_AGGREGATE_AGGREGATE_H_
+
+#include <stdint.h>
+#include "../../modules/command/message.h"
+
+/*
+ * A reading type.  Every reading starts with its uint16_t age, and the
+ * node's data message with its 32-bit header and sequence.
+ */
+typedef struct {
+	uint32_t header;			// WATER_AGG_HEADER, AIRBORNE_AGG_HEADER
+	uint16_t reading_size;
+	uint16_t raw_max;			// readings in one raw frame
+
+	// the reading in one of the node's data messages
+	void (*store)(void *reading, const void *message);
+
+	// codec_encode_water(), codec_encode_airborne()
+	int (*encode)(const void *ref, const void *readings, int count, uint8_t *out, int maxlen, int *used);
+} aggregate_type_t;
+
+extern const aggregate_type_t aggregate_water;
+extern const aggregate_type_t aggregate_airborne;
+
+// the largest reading type
+#define AGGREGATE_READING_MAX (sizeof(water_reading_t))
+
+typedef struct {
+	const aggregate_type_t *type;
+
+	// readings held back until K of them can go out in one frame
+	uint8_t held[AGG_DELTA_MAX * AGGREGATE_READING_MAX];
+	unsigned long sampled_at[AGG_DELTA_MAX];
+	int held_count;
+	int held_compressed;		// CONFIG_COMPRESSION they were held under
+
+	// the last frame handed out, and the held readings it carries
+	union {
+		agg_delta_t delta;
+		water_agg_t water;
+		airborne_agg_t airborne;
+	} frame;
+	int sent_count;
+	int delta;					// coded against ref, or a keyframe
+	int keyframe;
+
+	// the last reading the collector ACK'd, delta frames are coded against it
+	uint8_t ref[AGGREGATE_READING_MAX];
+	uint32_t ref_sequence;
+	int have_ref;
+	int frames_since_key;
+} aggregate_t;
+
+void aggregate_init(aggregate_t *a, const aggregate_type_t *type);
+
+/*
+ * Take the reading in the node's data message (length bytes).  Returns
+ * what to send now - the message itself, its sequence set, or a frame
+ * of held readings - and sets *frame_length / *frame_sequence, or
+ * returns NULL while the reading is held for a later frame.
+ */
+const void *aggregate_take(aggregate_t *a, void *message, int length,
+                           int *frame_length, uint32_t *frame_sequence);
+
+/*
+ * Report what became of the frame aggregate_take() returned: ACK'd
+ * (ok), or not, and then it is backlogged.
+ */
+void aggregate_result(aggregate_t *a, const void *frame, int frame_length, int ok);
+
+#endif /* MODULES_AGGREGATE_AGGREGATE_H_ */
@@ -0,0 +1,336 @@
+/**
+ * @file backlog.c
+ * @brief Store-and-forward backlog of undelivered messages
+ *
+ * When a reading cannot be delivered to the server it is appended to
+ * a fixed-size ring kept in a SPIFFS file (the file system mounted by
+ * nvs_init()).  When the server starts ACK'ing again, the application
+ * calls backlog_drain() and the stored readings are re-sent, oldest
+ * first, a burst at a time so the backlog does not monopolize the radio.
+ *
+ * The file holds a small header followed by BACKLOG_CAPACITY slots of
+ * BACKLOG_RECORD_SIZE bytes.  When the ring is full the oldest record
+ * is overwritten.
+ *
+ * Every message must start with its 32-bit header and 32-bit sequence
+ * (as all of the frames in message.h do); the stored sequence is re-used
+ * when the message is re-sent so the server can recognize duplicates.
+ * The backlog outlives a reboot, which is why the node's sequences carry
+ * on across reboots (config_use_sequence()): a stored message never
+ * shares its sequence with one sent live.
+ *
+ * The nodes store delta coded readings as keyframes, so a record does
+ * not depend on a reference the collector may no longer hold.  A record
+ * the collector refuses anyway (ACK_NO_REF, from older firmware) can
+ * never be taken and is dropped rather than stalling the drain.
+ */
+
+#include <contiki.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <spiffs.h>
+
+#include "backlog.h"
+#include "../../modules/config/config.h"
+#include "../../modules/config/config_nvs.h"
+#include "../../modules/messenger/message-service.h"
+
+// contiki-ism for logging the data -
+#include "sys/log.h"
+#define LOG_MODULE "BACKLOG"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+#ifdef DEBUG
+#undef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DBG
+#endif
+
+/**
+ * @brief number of messages the backlog holds before evicting the oldest
+ */
+#ifdef BACKLOG_CONF_CAPACITY
+#define BACKLOG_CAPACITY BACKLOG_CONF_CAPACITY
+#else
+#define BACKLOG_CAPACITY (256)
+#endif
+
+/**
+ * @brief messages re-sent per burst, and the pause between bursts
+ */
+#ifdef BACKLOG_CONF_BURST
+#define BACKLOG_BURST BACKLOG_CONF_BURST
+#else
+#define BACKLOG_BURST (4)
+#endif
+
+#define BACKLOG_DRAIN_INTERVAL (CLOCK_SECOND * 2)
+
+#define BACKLOG_FILE "backlog.dat"
+#define BACKLOG_MAGIC (0xBAC10000U | BACKLOG_RECORD_SIZE)
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t capacity;
+	uint16_t head;			// slot of the oldest record
+	uint16_t count;			// number of records stored
+} backlog_header_t;
+
+typedef struct __attribute__((packed)) {
+	uint16_t length;
+	uint8_t data[BACKLOG_RECORD_SIZE];
+} backlog_record_t;
+
+static backlog_header_t header;
+static int backlog_ok = 0;
+
+#define RECORD_OFFSET(slot) (sizeof(backlog_header_t) + (slot) * sizeof(backlog_record_t))
+
+
+static int write_header(spiffs *fs, spiffs_file fd)
+{
+	if (SPIFFS_lseek(fs, fd, 0, SPIFFS_SEEK_SET) < 0)
+		return -1;
+
+	if (SPIFFS_write(fs, fd, &header, sizeof(header)) < 0)
+		return -1;
+
+	return 0;
+}
+
+int backlog_init( )
+{
+	spiffs *fs = nvs_get_fs();
+	spiffs_file fd;
+	int rc;
+
+	backlog_ok = 0;
+
+	fd = SPIFFS_open(fs, BACKLOG_FILE, SPIFFS_CREAT | SPIFFS_RDWR, 0);
+	if (fd < 0) {
+		LOG_ERR("Error - could not open %s\n", BACKLOG_FILE);
+		return -1;
+	}
+
+	rc = SPIFFS_read(fs, fd, &header, sizeof(header));
+
+	// new file, or a file written with a different geometry
+	if ((rc != sizeof(header)) || (header.magic != BACKLOG_MAGIC) ||
+	    (header.capacity != BACKLOG_CAPACITY) || (header.count > BACKLOG_CAPACITY)) {
+		LOG_INFO("Starting a new backlog of %d records\n", BACKLOG_CAPACITY);
+
+		header.magic = BACKLOG_MAGIC;
+		header.capacity = BACKLOG_CAPACITY;
+		header.head = 0;
+		header.count = 0;
+
+		if (write_header(fs, fd) < 0) {
+			LOG_ERR("Error - could not write backlog header\n");
+			SPIFFS_close(fs, fd);
+			return -1;
+		}
+	}
+
+	SPIFFS_close(fs, fd);
+
+	LOG_INFO("Backlog holds %u records\n", (unsigned int) header.count);
+	backlog_ok = 1;
+	return header.count;
+}
+
+int backlog_append(const void *data, int length)
+{
+	spiffs *fs = nvs_get_fs();
+	spiffs_file fd;
+	backlog_record_t record;
+	uint16_t slot;
+
+	if (!backlog_ok)
+		return -1;
+
+	if ((length <= 0) || (length > BACKLOG_RECORD_SIZE)) {
+		LOG_ERR("Error - %d bytes will not fit in a backlog record\n", length);
+		return -1;
+	}
+
+	fd = SPIFFS_open(fs, BACKLOG_FILE, SPIFFS_RDWR, 0);
+	if (fd < 0) {
+		LOG_ERR("Error - could not open %s\n", BACKLOG_FILE);
+		return -1;
+	}
+
+	// full - overwrite the oldest record
+	if (header.count >= BACKLOG_CAPACITY) {
+		LOG_WARN("Backlog full, dropping oldest record\n");
+		header.head = (header.head + 1) % BACKLOG_CAPACITY;
+		header.count--;
+	}
+
+	slot = (header.head + header.count) % BACKLOG_CAPACITY;
+
+	memset(&record, 0, sizeof(record));
+	record.length = length;
+	memcpy(record.data, data, length);
+
+	if ((SPIFFS_lseek(fs, fd, RECORD_OFFSET(slot), SPIFFS_SEEK_SET) < 0) ||
+	    (SPIFFS_write(fs, fd, &record, sizeof(record)) < 0)) {
+		LOG_ERR("Error - could not write backlog record\n");
+		SPIFFS_close(fs, fd);
+		return -1;
+	}
+
+	header.count++;
+	write_header(fs, fd);
+	SPIFFS_close(fs, fd);
+
+	LOG_DBG("Backlog appended %d bytes at slot %u, %u stored\n",
+	        length, (unsigned int) slot, (unsigned int) header.count);
+
+	return header.count;
+}
+
+int backlog_peek(int index, void *data, int maxlen)
+{
+	spiffs *fs = nvs_get_fs();
+	spiffs_file fd;
+	backlog_record_t record;
+	uint16_t slot;
+	int rc;
+
+	if (!backlog_ok || (index < 0) || (index >= header.count))
+		return -1;
+
+	fd = SPIFFS_open(fs, BACKLOG_FILE, SPIFFS_RDONLY, 0);
+	if (fd < 0) {
+		LOG_ERR("Error - could not open %s\n", BACKLOG_FILE);
+		return -1;
+	}
+
+	slot = (header.head + index) % BACKLOG_CAPACITY;
+
+	rc = SPIFFS_lseek(fs, fd, RECORD_OFFSET(slot), SPIFFS_SEEK_SET);
+	if (rc >= 0)
+		rc = SPIFFS_read(fs, fd, &record, sizeof(record));
+
+	SPIFFS_close(fs, fd);
+
+	if ((rc != sizeof(record)) || (record.length > BACKLOG_RECORD_SIZE)) {
+		LOG_ERR("Error - could not read backlog record %u\n", (unsigned int) slot);
+		return -1;
+	}
+
+	if (maxlen > record.length)
+		maxlen = record.length;
+
+	memcpy(data, record.data, maxlen);
+	return maxlen;
+}
+
+void backlog_drop(int count)
+{
+	spiffs *fs = nvs_get_fs();
+	spiffs_file fd;
+
+	if (!backlog_ok || (count <= 0))
+		return;
+
+	if (count > header.count)
+		count = header.count;
+
+	header.head = (header.head + count) % BACKLOG_CAPACITY;
+	header.count -= count;
+
+	fd = SPIFFS_open(fs, BACKLOG_FILE, SPIFFS_RDWR, 0);
+	if (fd < 0) {
+		LOG_ERR("Error - could not open %s\n", BACKLOG_FILE);
+		return;
+	}
+
+	write_header(fs, fd);
+	SPIFFS_close(fs, fd);
+}
+
+int backlog_count( )
+{
+	return header.count;
+}
+
+
+/**
+ * Re-send the backlog, BACKLOG_BURST messages at a time.  A burst only
+ * retires the leading run of ACK'd (or refused) messages; if anything in the burst
+ * is not ACK'd the server is presumed unreachable again and draining
+ * stops until the application calls backlog_drain() again.
+ */
+PROCESS(backlog_drain_proc, "Backlog drain");
+PROCESS_THREAD(backlog_drain_proc, ev, data)
+{
+	static struct etimer et;
+	static uint8_t buffer[BACKLOG_RECORD_SIZE];
+	static uint32_t sequences[BACKLOG_BURST];
+	static uint8_t acked[BACKLOG_BURST];
+	static int burst, outstanding, done, i;
+	int length;
+
+	PROCESS_BEGIN();
+
+	while (backlog_count() > 0) {
+
+		burst = (backlog_count() < BACKLOG_BURST) ? backlog_count() : BACKLOG_BURST;
+		outstanding = 0;
+
+		for (i = 0; i < burst; i++) {
+			acked[i] = 0;
+			length = backlog_peek(i, buffer, sizeof(buffer));
+			if (length < 8)
+				break;
+
+			// bytes 4..7 carry the message's own sequence
+			memcpy(&sequences[i], &buffer[4], sizeof(sequences[i]));
+
+			if (messenger_send_bulk(NULL, sequences[i], buffer, length) == 0)
+				break;
+
+			outstanding++;
+		}
+		burst = outstanding;
+
+		LOG_INFO("Draining %d of %d backlog records\n", burst, backlog_count());
+
+		while (outstanding > 0) {
+			PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_MSG);
+
+			for (i = 0; i < burst; i++) {
+				if (sequences[i] == ((messenger_result_t *) data)->sequence) {
+					acked[i] = ((messenger_result_t *) data)->ok || ((messenger_result_t *) data)->refused;
+					if (((messenger_result_t *) data)->refused)
+						LOG_WARN("Backlog record seq %u refused, dropping it\n", (unsigned int) sequences[i]);
+					outstanding--;
+					break;
+				}
+			}
+		}
+
+		for (done = 0; (done < burst) && acked[done]; done++)
+			;
+
+		backlog_drop(done);
+
+		if ((burst == 0) || (done < burst)) {
+			LOG_INFO("Backlog drain stopped, %d records remain\n", backlog_count());
+			break;
+		}
+
+		etimer_set(&et, BACKLOG_DRAIN_INTERVAL);
+		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
+	}
+
+	PROCESS_END();
+}
+
+void backlog_drain( )
+{
+	if (backlog_ok && (backlog_count() > 0) && !process_is_running(&backlog_drain_proc)) {
+		process_start(&backlog_drain_proc, NULL);
+	}
+}
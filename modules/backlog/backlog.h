@@ -0,0 +1,37 @@
+/*
+ * backlog.h
+ *
+ *  Created on: Mar 2, 2021
+ *      Author: contiki
+ */
+
+#ifndef MODULES_BACKLOG_BACKLOG_H_
+#define MODULES_BACKLOG_BACKLOG_H_
+
+#include <contiki.h>
+#include "../../modules/command/message.h"
+
+// largest message that can be stored in the backlog
+#define BACKLOG_RECORD_SIZE (MESSAGE_FRAME_BUDGET)
+
+// open (or create) the backlog file, call after nvs_init()
+int backlog_init( );
+
+// store a message that could not be delivered, evicting the oldest if full
+int backlog_append(const void *data, int length);
+
+// copy the index'th oldest message into data, returns its length
+int backlog_peek(int index, void *data, int maxlen);
+
+// discard the count oldest messages
+void backlog_drop(int count);
+
+// number of messages waiting in the backlog
+int backlog_count( );
+
+// start re-sending stored messages (no-op if already draining or empty)
+void backlog_drain( );
+
+PROCESS_NAME(backlog_drain_proc);
+
+#endif /* MODULES_BACKLOG_BACKLOG_H_ */
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <string.h>
 #include <contiki.h>
 #include "../../modules/messenger/message-service.h"
 #include "command.h"
@@ -49,6 +50,28 @@ static void command_handle_set(const command_set_t *const req, command_ret_t *re
 
 		break;
 
+	case CONFIG_COLLECTOR2:
+	case CONFIG_COLLECTOR3:
+		id = (req->token == CONFIG_COLLECTOR2) ? 1 : 2;
+		LOG_INFO("Set CONFIG_COLLECTOR%d...", id + 1);
+		LOG_6ADDR(LOG_LEVEL_INFO,&req->value.address);
+		LOG_INFO_("\n");
+
+		config_set_collector(id, &req->value.address);
+		config_get_collector(id, &ret->value.ipaddr);
+		ret->valid = uip_ipaddr_cmp(&ret->value.ipaddr, &req->value.address);
+		ret->length = sizeof(uip_ipaddr_t);
+
+		break;
+
+	case CONFIG_COLLECTOR_MODE:
+		LOG_INFO("Set CONFIG_COLLECTOR_MODE...%d\n", (int) req->value.intval);
+		config_set_collector_mode(req->value.intval);
+		ret->value.uivalue = config_get_collector_mode();
+		ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
+		ret->length = 4;
+		break;
+
 	case CONFIG_SENSOR_INTERVAL:
 		LOG_INFO("Set CONFIG_SENSOR_INTERVAL...%d\n", (int) req->value.intval);
 		config_set_sensor_interval(req->value.intval);
@@ -80,6 +103,46 @@ static void command_handle_set(const command_set_t *const req, command_ret_t *re
 			config_timeout_change();
 			break;
 
+	case CONFIG_SAMPLES_PER_SEND:
+			LOG_INFO("Set CONFIG_SAMPLES_PER_SEND...%d\n", (int) req->value.intval);
+			config_set_samples_per_send(req->value.intval);
+			ret->value.uivalue = config_get_samples_per_send();
+			ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
+			ret->length = 4;
+			break;
+
+	case CONFIG_COMPRESSION:
+			LOG_INFO("Set CONFIG_COMPRESSION...%d\n", (int) req->value.intval);
+			config_set_compression(req->value.intval);
+			ret->value.uivalue = config_get_compression();
+			ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
+			ret->length = 4;
+			break;
+
+	case CONFIG_TRANSPORT:
+			LOG_INFO("Set CONFIG_TRANSPORT...%d\n", (int) req->value.intval);
+			config_set_transport(req->value.intval);
+			ret->value.uivalue = config_get_transport();
+			ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
+			ret->length = 4;
+			break;
+
+	case CONFIG_AIRTIME_RATE:
+			LOG_INFO("Set CONFIG_AIRTIME_RATE...%d\n", (int) req->value.intval);
+			config_set_airtime_rate(req->value.intval);
+			ret->value.uivalue = config_get_airtime_rate();
+			ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
+			ret->length = 4;
+			break;
+
+	case CONFIG_AIRTIME_BURST:
+			LOG_INFO("Set CONFIG_AIRTIME_BURST...%d\n", (int) req->value.intval);
+			config_set_airtime_burst(req->value.intval);
+			ret->value.uivalue = config_get_airtime_burst();
+			ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
+			ret->length = 4;
+			break;
+
 	case CONFIG_CAL1:
 	case CONFIG_CAL2:
 	case CONFIG_CAL3:
@@ -92,7 +155,7 @@ static void command_handle_set(const command_set_t *const req, command_ret_t *re
 			LOG_INFO("Set CONFIG_CAL%d...%d\n", id + 1, (int) req->value.intval);
 
 			config_set_calibration(id, (uint16_t) req->value.intval);
-			ret->value.uivalue = config_get_retry_interval();
+			ret->value.uivalue = config_get_calibration(id);
 			ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
 			ret->length = 4;
 
@@ -105,7 +168,8 @@ static void command_handle_set(const command_set_t *const req, command_ret_t *re
 		break;
 	}
 
-	*num_bytes = ret->length;
+	// header, token, valid and length ahead of the value, as for a get
+	*num_bytes = 13 + ret->length;
 
 }
 
@@ -114,6 +178,11 @@ static void command_handle_get(const command_set_t *const req, command_ret_t *re
 {
 	int idx;
 	float value;
+	uip_ipaddr_t addr;
+	uint32_t srtt, rttvar, rto;
+	messenger_class_stats_t stats;
+	uint32_t throttled_ms, throttled_bytes;
+	uint32_t collector, failovers;
 
 	ret->header = CMD_RET_HEADER;
 	ret->token = req->token;
@@ -134,6 +203,27 @@ static void command_handle_get(const command_set_t *const req, command_ret_t *re
 		ret->length += sizeof(ret->value.ipaddr);
 		break;
 
+	case CONFIG_COLLECTOR2:
+	case CONFIG_COLLECTOR3:
+		LOG_INFO("Get CONFIG_COLLECTOR...\n");
+		ret->valid = config_get_collector((req->token == CONFIG_COLLECTOR2) ? 1 : 2, &(ret->value.ipaddr));
+		ret->length += sizeof(ret->value.ipaddr);
+		break;
+
+	case CONFIG_COLLECTOR_MODE:
+		LOG_INFO("Get CONFIG_COLLECTOR_MODE...\n");
+		ret->value.uivalue = config_get_collector_mode();
+		ret->length += sizeof(ret->value.uivalue);
+		break;
+
+	case CONFIG_MSG_COLLECTOR:
+	case CONFIG_MSG_FAILOVERS:
+		LOG_INFO("Get CONFIG_MSG_COLLECTOR / FAILOVERS...\n");
+		messenger_get_failover(&collector, &failovers);
+		ret->value.uivalue = (req->token == CONFIG_MSG_COLLECTOR) ? collector : failovers;
+		ret->length += sizeof(ret->value.uivalue);
+		break;
+
 	case CONFIG_DEVTYPE:
 		LOG_INFO("Get CONFIG_DEVTYPE...\n");
 		ret->value.uivalue = config_get_devtype();
@@ -164,6 +254,36 @@ static void command_handle_get(const command_set_t *const req, command_ret_t *re
 				ret->length += sizeof(ret->value.uivalue);
 				break;
 
+	case CONFIG_SAMPLES_PER_SEND:
+				LOG_INFO("Get CONFIG_SAMPLES_PER_SEND...\n");
+				ret->value.uivalue = config_get_samples_per_send();
+				ret->length += sizeof(ret->value.uivalue);
+				break;
+
+	case CONFIG_COMPRESSION:
+				LOG_INFO("Get CONFIG_COMPRESSION...\n");
+				ret->value.uivalue = config_get_compression();
+				ret->length += sizeof(ret->value.uivalue);
+				break;
+
+	case CONFIG_TRANSPORT:
+				LOG_INFO("Get CONFIG_TRANSPORT...\n");
+				ret->value.uivalue = config_get_transport();
+				ret->length += sizeof(ret->value.uivalue);
+				break;
+
+	case CONFIG_AIRTIME_RATE:
+				LOG_INFO("Get CONFIG_AIRTIME_RATE...\n");
+				ret->value.uivalue = config_get_airtime_rate();
+				ret->length += sizeof(ret->value.uivalue);
+				break;
+
+	case CONFIG_AIRTIME_BURST:
+				LOG_INFO("Get CONFIG_AIRTIME_BURST...\n");
+				ret->value.uivalue = config_get_airtime_burst();
+				ret->length += sizeof(ret->value.uivalue);
+				break;
+
 		case CONFIG_CAL1:
 		case CONFIG_CAL2:
 		case CONFIG_CAL3:
@@ -227,6 +347,41 @@ static void command_handle_get(const command_set_t *const req, command_ret_t *re
 		ret->length += sizeof(ret->value.uivalue);
 		break;
 
+	case CONFIG_MSG_RTO:
+	case CONFIG_MSG_SRTT:
+	case CONFIG_MSG_RTTVAR:
+		LOG_INFO("Get CONFIG_MSG_RTT...\n");
+
+		messenger_get_collector(&addr);
+		messenger_get_rtt(&addr, &srtt, &rttvar, &rto);
+		ret->value.uivalue = (req->token == CONFIG_MSG_RTO) ? rto :
+				(req->token == CONFIG_MSG_SRTT) ? srtt :
+						rttvar;
+		ret->length += sizeof(ret->value.uivalue);
+		break;
+
+	case CONFIG_MSG_THROTTLED_MS:
+	case CONFIG_MSG_THROTTLED_BYTES:
+		LOG_INFO("Get CONFIG_MSG_THROTTLED...\n");
+
+		messenger_get_airtime(&throttled_ms, &throttled_bytes);
+		ret->value.uivalue = (req->token == CONFIG_MSG_THROTTLED_MS) ? throttled_ms : throttled_bytes;
+		ret->length += sizeof(ret->value.uivalue);
+		break;
+
+	case CONFIG_MSG_QDEPTH:
+	case CONFIG_MSG_QWAIT:
+	case CONFIG_MSG_QMAXWAIT:
+		LOG_INFO("Get CONFIG_MSG_Q... class %d\n", (int) req->value.intval);
+
+		ret->valid = (req->value.intval < MESSENGER_PRIO_COUNT) ? 1 : 0;
+		messenger_get_class_stats(req->value.intval, &stats);
+		ret->value.uivalue = (req->token == CONFIG_MSG_QDEPTH) ? stats.depth :
+				(req->token == CONFIG_MSG_QWAIT) ? stats.wait_avg_ms :
+						stats.wait_max_ms;
+		ret->length += sizeof(ret->value.uivalue);
+		break;
+
 	default:
 		LOG_ERR("Get unknown token %x\n", req->token);
 		ret->length = 0;
@@ -278,6 +433,113 @@ int command_handler(const uint8_t *inputdata, int inputlength, uint8_t *outputda
 }
 
 
+/*
+ * Whether a batch entry can be run: a get of any token, or a set of a
+ * token whose value is a 32 bit integer.  An address token's value does
+ * not fit in an entry, so setting one would store an address built from
+ * 32 bits.
+ */
+static int command_batch_entry_ok(const command_entry_t *entry)
+{
+	if (entry->op == CMD_REQ_CONFIG)
+		return 1;
+	if (entry->op != CMD_SET_CONFIG)
+		return 0;
+
+	switch (entry->token) {
+	case CONFIG_CTIME:
+	case CONFIG_COLLECTOR_MODE:
+	case CONFIG_SENSOR_INTERVAL:
+	case CONFIG_MAX_FAILURES:
+	case CONFIG_RETRY_INTERVAL:
+	case CONFIG_SAMPLES_PER_SEND:
+	case CONFIG_COMPRESSION:
+	case CONFIG_TRANSPORT:
+	case CONFIG_AIRTIME_RATE:
+	case CONFIG_AIRTIME_BURST:
+	case CONFIG_CAL1:
+	case CONFIG_CAL2:
+	case CONFIG_CAL3:
+	case CONFIG_CAL4:
+	case CONFIG_CAL5:
+	case CONFIG_CAL6:
+	case CONFIG_CAL7:
+	case CONFIG_CAL8:
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+int command_batch_handler(const uint8_t *inputdata, int inputlength, uint8_t *outputdata, int *maxoutputlen)
+{
+	const command_batch_t *req = (const command_batch_t *) inputdata;
+	command_batch_ret_t *response = (command_batch_ret_t *) outputdata;
+	command_set_t single;
+	command_ret_t ret;
+	int i, count, num_bytes;
+
+	if (*maxoutputlen < sizeof(command_batch_ret_t)) {
+		LOG_ERR("Error - output buffer is too small!!\n");
+		return 0;
+	}
+
+	count = (inputlength - sizeof(command_batch_t)) / sizeof(command_entry_t);
+	if (count > req->count)
+		count = req->count;
+
+	// only run the entries we have room to report
+	if (count > (*maxoutputlen - sizeof(command_batch_ret_t)) / sizeof(command_result_t))
+		count = (*maxoutputlen - sizeof(command_batch_ret_t)) / sizeof(command_result_t);
+
+	response->header = CMD_BATCH_RET_HEADER;
+
+	// check every entry before running any, a refused batch changes nothing
+	for (i = 0; i < count; i++) {
+		if (!command_batch_entry_ok(&req->entries[i]))
+			break;
+	}
+
+	if (i < count) {
+		LOG_ERR("Batch entry %d (op %d token %d) refused, nothing applied\n", i,
+		        (int) req->entries[i].op, (int) req->entries[i].token);
+
+		count = i + 1;
+		for (i = 0; i < count; i++) {
+			response->results[i].token = req->entries[i].token;
+			response->results[i].valid = 0;
+			response->results[i].value = 0;
+		}
+	}
+	else {
+		for (i = 0; i < count; i++) {
+			memset(&single, 0, sizeof(single));
+			single.header = CMD_SET_HEADER;
+			single.config_type = req->entries[i].op;
+			single.token = req->entries[i].token;
+			single.value.intval = req->entries[i].value;
+
+			if (single.config_type == CMD_SET_CONFIG)
+				command_handle_set(&single, &ret, &num_bytes);
+			else
+				command_handle_get(&single, &ret, &num_bytes);
+
+			response->results[i].token = single.token;
+			response->results[i].valid = (ret.length <= sizeof(uint32_t)) ? ret.valid : 0;
+			response->results[i].value = ret.value.uivalue;
+		}
+	}
+
+	LOG_DBG("Batch processed %d of %d entries\n", count, (int) req->count);
+
+	response->count = count;
+	*maxoutputlen = sizeof(command_batch_ret_t) + count * sizeof(command_result_t);
+
+	return *maxoutputlen;
+}
+
+
 #define ADDR_DIFF(x,y) ((int) &x.y - (int) &x)
 void command_init( )
 {
@@ -290,4 +552,6 @@ void command_init( )
 	LOG_DBG("   intval %d - %d\n", ADDR_DIFF(test,value.intval), sizeof(test.value.intval));
 
     messenger_add_handler(0x0beed1eU,   4,  sizeof(command_set_t), command_handler);
+    messenger_add_handler(CMD_BATCH_HEADER, sizeof(command_batch_t), INT32_MAX, command_batch_handler);
+    messenger_add_stream(STREAM_CONFIG_LIST, config_list_read);
 }
@@ -0,0 +1,245 @@
+/**
+ * @file message-codec.c
+ * @brief Delta + varint coding of sensor readings
+ *
+ * Each reading is flattened into a vector of 32-bit fields.  A field is
+ * sent as the zig-zag coded difference from the same field of the
+ * previous reading, as a little-endian base-128 varint (7 bits per byte,
+ * high bit set on all but the last byte).  Fields that did not change
+ * cost one byte; slowly drifting ones two.
+ *
+ * Differences are taken modulo 2^32 so unsigned and signed fields of any
+ * width round-trip exactly.
+ */
+
+#include <string.h>
+
+#include "message-codec.h"
+
+#define WATER_FIELDS (16)
+#define AIRBORNE_FIELDS (7)
+
+int codec_put_varint(uint8_t *out, int maxlen, uint32_t v)
+{
+	int n = 0;
+
+	do {
+		if (n >= maxlen)
+			return -1;
+
+		out[n] = v & 0x7f;
+		v >>= 7;
+		if (v != 0)
+			out[n] |= 0x80;
+		n++;
+	} while (v != 0);
+
+	return n;
+}
+
+int codec_get_varint(const uint8_t *in, int len, uint32_t *v)
+{
+	uint32_t value = 0;
+	int n;
+
+	for (n = 0; (n < len) && (n < CODEC_VARINT_MAX); n++) {
+		value |= (uint32_t) (in[n] & 0x7f) << (7 * n);
+		if ((in[n] & 0x80) == 0) {
+			*v = value;
+			return n + 1;
+		}
+	}
+
+	return -1;
+}
+
+static void water_to_fields(const water_reading_t *r, uint32_t *f)
+{
+	f[0] = r->age;
+	f[1] = r->pressure;
+	f[2] = r->temppressure;
+	f[3] = r->battery;
+	f[4] = r->color_blue;
+	f[5] = r->color_clear;
+	f[6] = r->color_green;
+	f[7] = r->color_red;
+	f[8] = r->ambient;
+	f[9] = r->range1;
+	f[10] = r->range2;
+	f[11] = r->range3;
+	f[12] = r->range4;
+	f[13] = r->range5;
+	f[14] = r->temperature;
+	f[15] = (uint32_t) (int32_t) r->hall;
+}
+
+static void fields_to_water(const uint32_t *f, water_reading_t *r)
+{
+	r->age = f[0];
+	r->pressure = f[1];
+	r->temppressure = f[2];
+	r->battery = f[3];
+	r->color_blue = f[4];
+	r->color_clear = f[5];
+	r->color_green = f[6];
+	r->color_red = f[7];
+	r->ambient = f[8];
+	r->range1 = f[9];
+	r->range2 = f[10];
+	r->range3 = f[11];
+	r->range4 = f[12];
+	r->range5 = f[13];
+	r->temperature = f[14];
+	r->hall = (int16_t) f[15];
+}
+
+static void airborne_to_fields(const airborne_reading_t *r, uint32_t *f)
+{
+	f[0] = r->age;
+	f[1] = r->ms5637_pressure;
+	f[2] = r->ms5637_temp;
+	f[3] = r->si7020_humid;
+	f[4] = r->si7020_temp;
+	f[5] = r->battery;
+	f[6] = r->i2cerror;
+}
+
+static void fields_to_airborne(const uint32_t *f, airborne_reading_t *r)
+{
+	r->age = f[0];
+	r->ms5637_pressure = f[1];
+	r->ms5637_temp = f[2];
+	r->si7020_humid = f[3];
+	r->si7020_temp = f[4];
+	r->battery = f[5];
+	r->i2cerror = f[6];
+}
+
+/**
+ * Code one field vector against prev, returns bytes written or -1.
+ */
+static int encode_fields(const uint32_t *prev, const uint32_t *cur, int nfields, uint8_t *out, int maxlen)
+{
+	int i, n, used = 0;
+
+	for (i = 0; i < nfields; i++) {
+		n = codec_put_varint(out + used, maxlen - used, CODEC_ZIGZAG(cur[i] - prev[i]));
+		if (n < 0)
+			return -1;
+		used += n;
+	}
+
+	return used;
+}
+
+static int decode_fields(const uint32_t *prev, uint32_t *cur, int nfields, const uint8_t *in, int len)
+{
+	uint32_t delta;
+	int i, n, used = 0;
+
+	for (i = 0; i < nfields; i++) {
+		n = codec_get_varint(in + used, len - used, &delta);
+		if (n < 0)
+			return -1;
+		cur[i] = prev[i] + (uint32_t) CODEC_UNZIGZAG(delta);
+		used += n;
+	}
+
+	return used;
+}
+
+int codec_encode_water(const water_reading_t *ref, const water_reading_t *readings, int count,
+                       uint8_t *out, int maxlen, int *used)
+{
+	uint32_t prev[WATER_FIELDS], cur[WATER_FIELDS];
+	int i, n;
+
+	memset(prev, 0, sizeof(prev));
+	if (ref != NULL)
+		water_to_fields(ref, prev);
+
+	*used = 0;
+	for (i = 0; i < count; i++) {
+		water_to_fields(&readings[i], cur);
+
+		n = encode_fields(prev, cur, WATER_FIELDS, out + *used, maxlen - *used);
+		if (n < 0)
+			break;
+
+		*used += n;
+		memcpy(prev, cur, sizeof(prev));
+	}
+
+	return i;
+}
+
+int codec_decode_water(const water_reading_t *ref, water_reading_t *readings, int count,
+                       const uint8_t *in, int len)
+{
+	uint32_t prev[WATER_FIELDS], cur[WATER_FIELDS];
+	int i, n, used = 0;
+
+	memset(prev, 0, sizeof(prev));
+	if (ref != NULL)
+		water_to_fields(ref, prev);
+
+	for (i = 0; i < count; i++) {
+		n = decode_fields(prev, cur, WATER_FIELDS, in + used, len - used);
+		if (n < 0)
+			return -1;
+
+		fields_to_water(cur, &readings[i]);
+		used += n;
+		memcpy(prev, cur, sizeof(prev));
+	}
+
+	return used;
+}
+
+int codec_encode_airborne(const airborne_reading_t *ref, const airborne_reading_t *readings, int count,
+                          uint8_t *out, int maxlen, int *used)
+{
+	uint32_t prev[AIRBORNE_FIELDS], cur[AIRBORNE_FIELDS];
+	int i, n;
+
+	memset(prev, 0, sizeof(prev));
+	if (ref != NULL)
+		airborne_to_fields(ref, prev);
+
+	*used = 0;
+	for (i = 0; i < count; i++) {
+		airborne_to_fields(&readings[i], cur);
+
+		n = encode_fields(prev, cur, AIRBORNE_FIELDS, out + *used, maxlen - *used);
+		if (n < 0)
+			break;
+
+		*used += n;
+		memcpy(prev, cur, sizeof(prev));
+	}
+
+	return i;
+}
+
+int codec_decode_airborne(const airborne_reading_t *ref, airborne_reading_t *readings, int count,
+                          const uint8_t *in, int len)
+{
+	uint32_t prev[AIRBORNE_FIELDS], cur[AIRBORNE_FIELDS];
+	int i, n, used = 0;
+
+	memset(prev, 0, sizeof(prev));
+	if (ref != NULL)
+		airborne_to_fields(ref, prev);
+
+	for (i = 0; i < count; i++) {
+		n = decode_fields(prev, cur, AIRBORNE_FIELDS, in + used, len - used);
+		if (n < 0)
+			return -1;
+
+		fields_to_airborne(cur, &readings[i]);
+		used += n;
+		memcpy(prev, cur, sizeof(prev));
+	}
+
+	return used;
+}
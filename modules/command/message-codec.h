@@ -0,0 +1,48 @@
+/*
+ * message-codec.h
+ *
+ * Delta + zig-zag / varint coding of sensor readings for the compressed
+ * aggregate frames (AGG_FLAG_DELTA in message.h).  Plain C with no
+ * Contiki dependencies so the same code builds on the host (tests/codec).
+ */
+
+#ifndef MODULES_COMMAND_MESSAGE_CODEC_H_
+#define MODULES_COMMAND_MESSAGE_CODEC_H_
+
+#include <stdint.h>
+#include "message.h"
+
+// zig-zag maps small signed values onto small unsigned ones
+#define CODEC_ZIGZAG(v) ((uint32_t) (((uint32_t) (v) << 1) ^ (uint32_t) ((int32_t) (v) >> 31)))
+#define CODEC_UNZIGZAG(u) ((int32_t) (((uint32_t) (u) >> 1) ^ (uint32_t) -(int32_t) ((u) & 1)))
+
+// largest encoding of one 32-bit value
+#define CODEC_VARINT_MAX (5)
+
+// append v as a varint, returns bytes written or -1 if it does not fit
+int codec_put_varint(uint8_t *out, int maxlen, uint32_t v);
+
+// read one varint, returns bytes consumed or -1 if truncated / too long
+int codec_get_varint(const uint8_t *in, int len, uint32_t *v);
+
+/*
+ * Encode as many of the count readings as fit in maxlen bytes.  Reading 0
+ * is coded against ref (or against zero if ref is NULL - a keyframe), each
+ * later reading against the one before it.  Returns the number of readings
+ * encoded and sets *used to the bytes written.
+ */
+int codec_encode_water(const water_reading_t *ref, const water_reading_t *readings, int count,
+                       uint8_t *out, int maxlen, int *used);
+int codec_encode_airborne(const airborne_reading_t *ref, const airborne_reading_t *readings, int count,
+                          uint8_t *out, int maxlen, int *used);
+
+/*
+ * Decode count readings produced by the matching encoder, using the same
+ * ref.  Returns the bytes consumed, or -1 if the data is malformed.
+ */
+int codec_decode_water(const water_reading_t *ref, water_reading_t *readings, int count,
+                       const uint8_t *in, int len);
+int codec_decode_airborne(const airborne_reading_t *ref, airborne_reading_t *readings, int count,
+                          const uint8_t *in, int len);
+
+#endif /* MODULES_COMMAND_MESSAGE_CODEC_H_ */
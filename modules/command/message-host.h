@@ -0,0 +1,24 @@
+/*
+ * message-host.h
+ *
+ * Stand-ins for the few Contiki types that appear in the message
+ * layouts, so that host tools (see tests/) can include message.h and
+ * config.h without a Contiki tree.  Only used when CONTIKI is not
+ * defined; the Contiki build always defines it.
+ */
+
+#ifndef MODULES_COMMAND_MESSAGE_HOST_H_
+#define MODULES_COMMAND_MESSAGE_HOST_H_
+
+#include <stdint.h>
+
+typedef union {
+	uint8_t u8[16];
+	uint16_t u16[8];
+} uip_ip6addr_t;
+
+typedef uip_ip6addr_t uip_ipaddr_t;
+
+typedef unsigned char process_event_t;
+
+#endif /* MODULES_COMMAND_MESSAGE_HOST_H_ */
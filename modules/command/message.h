@@ -9,10 +9,38 @@
 #define MODULES_COMMAND_MESSAGE_H_
 
 #include <stdint.h>
+#ifdef CONTIKI
 #include <contiki.h>
 #include <contiki-net.h>
+#endif
 #include <../config/config.h>
 
+/*
+ * What is left of one 802.15.4 frame (127 bytes) for a message once the
+ * lower layers have taken their share, worst case for a node's uplink:
+ * * MAC header with long addresses and PAN ID compression, and the FCS
+ * * 6LoWPAN IPHC with the source address elided (derived from the MAC
+ *   address) and the collector's address carried inline
+ * * the RPL hop-by-hop option on upward traffic
+ * * compressed UDP header (NHC), ports and checksum inline
+ */
+#define FRAME_802154_SIZE (127)
+#define FRAME_MAC_OVERHEAD (21 + 2)
+#define FRAME_IPHC_OVERHEAD (2 + 16)
+#define FRAME_RPL_OVERHEAD (8)
+#define FRAME_UDP_OVERHEAD (7)
+
+/*
+ * The largest message carried in one datagram - sized so a frame goes
+ * out in a single radio frame, without 6LoWPAN fragmentation.
+ */
+#ifdef MESSAGE_CONF_FRAME_BUDGET
+#define MESSAGE_FRAME_BUDGET MESSAGE_CONF_FRAME_BUDGET
+#else
+#define MESSAGE_FRAME_BUDGET (FRAME_802154_SIZE - FRAME_MAC_OVERHEAD - FRAME_IPHC_OVERHEAD - \
+                              FRAME_RPL_OVERHEAD - FRAME_UDP_OVERHEAD)
+#endif
+
 #define CMD_SET_HEADER (0x0beed1eU)
 
 typedef enum cmd_type {
@@ -46,6 +74,100 @@ typedef struct __attribute__((__packed__)) {
         } value;
 } command_ret_t;
 
+/*
+ * Batch configuration - several get/set operations in one exchange.
+ * Entries are processed in order; op is a command_type_t.  Only 32-bit
+ * values are carried, so a get of an address-valued token (CONFIG_ROUTER,
+ * CONFIG_COLLECTOR2/3) comes back with valid == 0.  Every entry is checked
+ * before any is run: a set of an address-valued or unknown token, or an
+ * unknown op, refuses the whole batch and nothing is applied - the reply
+ * then ends at the refused entry and every result in it has valid == 0.
+ * Otherwise the reply holds one result per entry processed and stops
+ * early (count < request count) when the output buffer is full.
+ */
+#define CMD_BATCH_HEADER (0x0beed1fU)
+#define CMD_BATCH_RET_HEADER (0xdde323f4U)
+typedef struct __attribute__((__packed__)) {
+        uint8_t token;
+        uint8_t op;
+        uint32_t value;
+} command_entry_t;
+
+typedef struct __attribute__((__packed__)) {
+        uint32_t header;
+        uint8_t count;
+        command_entry_t entries[];
+} command_batch_t;
+
+typedef struct __attribute__((__packed__)) {
+        uint8_t token;
+        uint8_t valid;
+        uint32_t value;
+} command_result_t;
+
+typedef struct __attribute__((__packed__)) {
+        uint32_t header;
+        uint8_t count;
+        command_result_t results[];
+} command_batch_ret_t;
+
+/*
+ * Streamed responses - results too big for one reply are pulled as a
+ * series of chunks.  The request names the stream and the byte offset
+ * to start at; each chunk carries its offset, the stream's total length
+ * and up to STREAM_CHUNK_MAX bytes.  Over UDP one chunk answers each
+ * request.  Over TCP the node keeps sending chunks on the connection
+ * until 'chunks' have gone (0 for all of them) or the stream ends.
+ */
+#define STREAM_REQ_HEADER (0x0beed20U)
+#define STREAM_RET_HEADER (0xdde323f5U)
+
+#define STREAM_CONFIG_LIST (1)		// SPIFFS directory, "size name\n" lines
+
+typedef struct __attribute__((__packed__)) {
+        uint32_t header;
+        uint16_t stream;
+        uint16_t chunks;
+        uint32_t offset;
+} stream_request_t;
+
+typedef struct __attribute__((__packed__)) {
+        uint32_t header;
+        uint16_t stream;
+        uint8_t valid;		// 0 if the stream is unknown or failed
+        uint32_t offset;
+        uint32_t total;
+        uint16_t length;
+        uint8_t data[];
+} stream_chunk_t;
+
+#define STREAM_CHUNK_MAX (128 - sizeof(stream_chunk_t))
+
+/*
+ * On-demand sample - the node takes a reading out of schedule and
+ * answers with it, as the frame it sends the collector (water_data_t on
+ * a water node).  The request is just the header.  A reading takes
+ * about a second, so the node defers the answer (messenger_defer()).
+ */
+#define CMD_SAMPLE_HEADER (0x0beed21U)
+
+/*
+ * Sent in place of the answer to a request that was deferred and never
+ * answered within MESSENGER_CONF_PENDING_TIMEOUT (CMD_ERROR_TIMEOUT), or
+ * whose handler claimed to defer it without messenger_defer()
+ * (CMD_ERROR_HANDLER).  'request' is the failed request's header.
+ */
+#define CMD_ERROR_HEADER (0xdde323f6U)
+
+#define CMD_ERROR_TIMEOUT (1)
+#define CMD_ERROR_HANDLER (2)
+
+typedef struct __attribute__((__packed__)) {
+        uint32_t header;
+        uint32_t request;
+        uint8_t error;
+} command_error_t;
+
 
 #define WATER_CAL_HEADER (0x3536370U)
 typedef struct __attribute__((packed)) {
@@ -99,6 +221,76 @@ typedef struct __attribute__((packed)) {
 
 
 
+/*
+ * Aggregate frames - several readings sampled between transmits that
+ * share one node header.  Reading i carries sequence (sequence + i),
+ * so the frame is ACK'd by an ack_t for its first sequence or by an
+ * ack_window_t covering the readings, and age is the number of seconds
+ * between taking the reading and sending the frame.
+ */
+typedef struct __attribute__((packed)) {
+        uint16_t age;
+
+        uint32_t pressure;
+        uint32_t temppressure;
+        uint16_t battery;
+        uint16_t color_blue;
+        uint16_t color_clear;
+        uint16_t color_green;
+        uint16_t color_red;
+        uint16_t ambient;
+        uint16_t range1;
+        uint16_t range2;
+        uint16_t range3;
+        uint16_t range4;
+        uint16_t range5;
+        uint16_t temperature;
+        int16_t hall;
+} water_reading_t;
+
+#define AGG_HEADER_SIZE (14)
+#define WATER_AGG_MAX ((MESSAGE_FRAME_BUDGET - AGG_HEADER_SIZE) / sizeof(water_reading_t))
+
+#define WATER_AGG_HEADER (0x34323234U)
+typedef struct __attribute__((packed)) {
+        uint32_t header;
+        uint32_t sequence;
+        int32_t rssi;
+        uint8_t count;
+        uint8_t flags;
+
+        water_reading_t readings[WATER_AGG_MAX];
+} water_agg_t;
+
+
+
+/*
+ * Compressed aggregate frames use the same headers as water_agg_t /
+ * airborne_agg_t with AGG_FLAG_DELTA set in flags.  The readings follow
+ * ref_sequence as a zig-zag / varint coded delta stream (see
+ * message-codec.h): reading 0 against the reading the server already
+ * has as ref_sequence, or against zero when AGG_FLAG_KEYFRAME is set,
+ * and each later reading against the one before it.
+ */
+#define AGG_FLAG_DELTA (0x01)
+#define AGG_FLAG_KEYFRAME (0x02)
+
+#define AGG_DELTA_HEADER_SIZE (AGG_HEADER_SIZE + 4)
+#define AGG_DELTA_MAX (16)
+
+typedef struct __attribute__((packed)) {
+        uint32_t header;
+        uint32_t sequence;
+        int32_t rssi;
+        uint8_t count;
+        uint8_t flags;
+        uint32_t ref_sequence;
+
+        uint8_t data[MESSAGE_FRAME_BUDGET - AGG_DELTA_HEADER_SIZE];
+} agg_delta_t;
+
+
+
 #define AIRBORNE_CAL_HEADER (0x65bce4f0U)
 typedef struct {
     uint32_t header;
@@ -122,7 +314,39 @@ typedef struct __attribute__((packed)) {
     uint16_t i2cerror;
 } airborne_t;
 
+// see water_reading_t
+typedef struct __attribute__((packed)) {
+    uint16_t age;
+
+    uint32_t ms5637_pressure;
+    uint32_t ms5637_temp;
+    uint32_t si7020_humid;
+    uint32_t si7020_temp;
+    uint16_t battery;
+    uint16_t i2cerror;
+} airborne_reading_t;
+
+#define AIRBORNE_AGG_MAX ((MESSAGE_FRAME_BUDGET - AGG_HEADER_SIZE) / sizeof(airborne_reading_t))
+
+#define AIRBORNE_AGG_HEADER (0x54ab23f0U)
+typedef struct __attribute__((packed)) {
+    uint32_t header;
+    uint32_t sequence;
+    int32_t rssi;
+    uint8_t count;
+    uint8_t flags;
+
+    airborne_reading_t readings[AIRBORNE_AGG_MAX];
+} airborne_agg_t;
+
+/*
+ * An ack_value of 1 means the message was taken.  ACK_NO_REF refuses a
+ * delta coded frame whose reference the collector does not hold (it
+ * restarted, or the reference aged out): the node is not to resend it
+ * as it is, and codes its next frame as a keyframe.
+ */
 #define ACK_HEADER (0x90983323)
+#define ACK_NO_REF (2)
 typedef struct __attribute__((packed)) {
         uint32_t header;
         uint32_t sequence;
@@ -130,6 +354,58 @@ typedef struct __attribute__((packed)) {
         uint32_t ack_value;
 } ack_t;
 
+/*
+ * Window acknowledgement - confirms a burst of messages in one frame.
+ * Bit i of ack_bitmap set means sequence (ack_base + i) was received,
+ * so a run of set bits starting at bit 0 acknowledges everything from
+ * ack_base up to the first clear bit.  Nothing below ack_base is implied.
+ */
+#define ACK_WINDOW_HEADER (0x90983324)
+typedef struct __attribute__((packed)) {
+        uint32_t header;
+        uint32_t sequence;
+        uint32_t ack_base;
+        uint32_t ack_bitmap;
+} ack_window_t;
+
+/*
+ * Calibration request - a collector got readings from the node without
+ * holding its calibration (e.g. the cal frame sent at boot was lost) and
+ * asks for it again.  The node sends its cal frame with its next
+ * readings.  Sent to the port the readings came from, after their ACK,
+ * and the size of an ack_t so it takes the same path on the node; older
+ * nodes drop it as a stray reply.
+ */
+#define CAL_REQUEST_HEADER (0x90983325)
+typedef struct __attribute__((packed)) {
+        uint32_t header;
+        uint32_t sequence;		// of the reading that had no calibration
+        uint32_t cal_header;	// WATER_CAL_HEADER or AIRBORNE_CAL_HEADER
+        uint32_t reserved;
+} cal_request_t;
+
+/*
+ * Connectionless command request - wraps any frame accepted on the TCP
+ * command port (e.g. command_set_t) for delivery over UDP.  The node
+ * answers with a command_reply_t carrying the same request_id; a repeated
+ * request_id from the same remote gets the cached reply again rather than
+ * being executed twice, as long as it is among the node's last few
+ * replies to anyone (MESSENGER_CONF_REPLY_CACHE).
+ */
+#define UDP_COMMAND_HEADER (0x75647063U)
+#define UDP_REPLY_HEADER (0x75647072U)
+typedef struct __attribute__((packed)) {
+        uint32_t header;
+        uint16_t request_id;
+        uint8_t data[];
+} command_request_t;
+
+typedef struct __attribute__((packed)) {
+        uint32_t header;
+        uint16_t request_id;
+        uint8_t data[];
+} command_reply_t;
+
 
 
 #endif /* MODULES_COMMAND_MESSAGE_H_ */
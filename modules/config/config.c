@@ -6,6 +6,7 @@
  */
 
 #include <contiki.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -31,10 +32,75 @@ config_t config;
 static unsigned int config_dev_type = 0;
 static unsigned int calibration_changed = 0;
 
+/*
+ * Message sequences carry on from one run to the next, so nothing sent
+ * before a reboot (still in the backlog, or remembered by the collector)
+ * shares a sequence with what is sent after it.  They are reserved in
+ * config.dat a block at a time, so the flash is written once per block;
+ * a reboot skips whatever was left of its block.
+ */
+#define SEQUENCE_BLOCK (256)
+
+static uint32_t sequence_next = 0;
+
+/*
+ * Readings one raw frame holds, set by the node's reading aggregation.
+ * CONFIG_SAMPLES_PER_SEND is kept as set, but without compression only
+ * this many go to a frame; a water reading fills a raw frame on its own.
+ */
+static uint32_t samples_raw_max = 16;
+
 process_event_t config_cmd_run;
 
+// was the field among the first len bytes of config.dat?
+#define CONFIG_HAS(len, field) ((len) >= (int) (offsetof(config_t, field) + sizeof(config.field)))
+
+/*
+ * Defaults for the fields not among the first len bytes read: all of
+ * them for a new (or foreign) configuration, the fields appended since
+ * for one an older version wrote.
+ */
+static void config_defaults (int len)
+{
+	uip_ip6addr_t server;
+
+	if (!CONFIG_HAS(len, local_calibration)) {
+		config_set_sensor_interval (10); // seconds to wait to send next sensor reading
+		config_set_maxfailures (100);  // consecutive failures before reboot
+		config_set_retry_interval (15);	// retry sending msgs in seconds
+
+		uiplib_ip6addrconv ("fd00::1", &server);
+		config_set_receiver (&server);
+
+		config_set_calibration(0, 2); // Si7210 set 20mT, Neodymium magnet
+		config_set_calibration(1, 0); // TCS3472 gain of 1
+		config_set_calibration(2, 64); //
+	}
+
+	if (!CONFIG_HAS(len, samples_per_send))
+		config_set_samples_per_send (1); // readings batched into one message
+	if (!CONFIG_HAS(len, compression))
+		config_set_compression (0); // send readings uncompressed
+	if (!CONFIG_HAS(len, transport))
+		config_set_transport (CONFIG_TRANSPORT_UDP);
+	if (!CONFIG_HAS(len, airtime_rate))
+		config_set_airtime_rate (0); // no airtime limit
+	if (!CONFIG_HAS(len, airtime_burst))
+		config_set_airtime_burst (512);
+	if (!CONFIG_HAS(len, collector_mode))
+		config_set_collector_mode (CONFIG_COLLECTOR_ORDERED);
+
+	if (!CONFIG_HAS(len, collectors)) {
+		uip_create_unspecified (&server);
+		config_set_collector (1, &server);
+		config_set_collector (2, &server);
+	}
+}
+
 void config_init (unsigned int dev_type)
 {
+	int len;
+
 	// store dev_type
 	config_dev_type = dev_type;
 
@@ -43,35 +109,36 @@ void config_init (unsigned int dev_type)
 
 
 	// handled by target / platform
-	config_read (&config);
+	len = config_read (&config);
 
-	if ((config.magic != CONFIG_MAGIC) || (config.device_type != dev_type)) {
+	if ((len < (int) offsetof(config_t, samples_per_send)) || (config.magic != CONFIG_MAGIC) ||
+			(config.device_type != dev_type)) {
 		LOG_INFO("Configuration magic (%-8.8X != %-8.8X) not found, using defaults\r\n", (unsigned int ) config.magic,
 							(unsigned int)CONFIG_MAGIC);
 
+		memset (&config, 0, sizeof(config));
 		config.magic = CONFIG_MAGIC;
 		config.device_type = dev_type;
 		config_set_major_version (VERSION_MAJOR);
 		config_set_minor_version (VERSION_MINOR);
+		config_defaults (0);
 
-		config_set_sensor_interval (10); // seconds to wait to send next sensor reading
-		config_set_maxfailures (100);  // consecutive failures before reboot
-		config_set_retry_interval (15);	// retry sending msgs in seconds
-
-		uip_ip6addr_t server;
-		uiplib_ip6addrconv ("fd00::1", &server);
-		config_set_receiver (&server);
-
-
-		config_set_calibration(0, 2); // Si7210 set 20mT, Neodymium magnet
-		config_set_calibration(1, 0); // TCS3472 gain of 1
-		config_set_calibration(2, 64); //
+		printf("Writing config\n");
+		config_write(&config);
+	}
+	else if ((len < (int) sizeof(config_t)) || (config.minor_version != VERSION_MINOR)) {
+		LOG_INFO("Configuration from version %u.%u, upgrading\r\n", (unsigned int ) config.major_version,
+							(unsigned int ) config.minor_version);
 
+		memset ((uint8_t *) &config + len, 0, sizeof(config) - len);
+		config_set_minor_version (VERSION_MINOR);
+		config_defaults (len);
 
-		printf("Writing config\n");
 		config_write(&config);
 	}
 
+	sequence_next = config.sequence_reserved;
+
 	// print config
 	LOG_INFO("Configuration:\r\n");
 	LOG_INFO("Version number: %u.%u\r\n", (unsigned int ) config.major_version, (unsigned int ) config.minor_version);
@@ -79,12 +146,21 @@ void config_init (unsigned int dev_type)
 	LOG_INFO("Sensor interval: %d\r\n\n", (unsigned int ) config.sensor_interval);
 	LOG_INFO("Max failures: %d\r\n\n", (unsigned int ) config.max_failures);
 	LOG_INFO("Retry interval: %d\r\n\n", (unsigned int ) config.retry_interval);
+	LOG_INFO("Samples per send: %d (%d)\r\n\n", (unsigned int ) config.samples_per_send, (unsigned int ) config_get_samples_per_send());
+	LOG_INFO("Compression: %d\r\n\n", (unsigned int ) config.compression);
+	LOG_INFO("Transport: %d\r\n\n", (unsigned int ) config.transport);
+	LOG_INFO("Airtime limit: %d B/s, burst %d\r\n\n", (unsigned int ) config.airtime_rate, (unsigned int ) config.airtime_burst);
+
+	LOG_INFO("Collector mode: %d\r\n\n", (unsigned int ) config.collector_mode);
 
-	LOG_INFO("Stored destination address: ");
 	uip_ip6addr_t addr;
-	config_get_receiver (&addr);
-	LOG_6ADDR(LOG_LEVEL_INFO, &addr);
-	LOG_INFO_("\n");
+	for (int i = 0; i < CONFIG_COLLECTORS; i++) {
+		if (config_get_collector (i, &addr) || (i == 0)) {
+			LOG_INFO("Stored destination address %d: ", i);
+			LOG_6ADDR(LOG_LEVEL_INFO, &addr);
+			LOG_INFO_("\n");
+		}
+	}
 
 
 
@@ -167,6 +243,12 @@ int config_get (const int configID)
 		case CONFIG_SENSOR_INTERVAL: return config_get_sensor_interval( );
 		case CONFIG_MAX_FAILURES: return config_get_maxfailures ( );
 		case CONFIG_RETRY_INTERVAL: return config_get_retry_interval ( );
+		case CONFIG_SAMPLES_PER_SEND: return config_get_samples_per_send ( );
+		case CONFIG_COMPRESSION: return config_get_compression ( );
+		case CONFIG_TRANSPORT: return config_get_transport ( );
+		case CONFIG_AIRTIME_RATE: return config_get_airtime_rate ( );
+		case CONFIG_AIRTIME_BURST: return config_get_airtime_burst ( );
+		case CONFIG_COLLECTOR_MODE: return config_get_collector_mode ( );
 		case CONFIG_CAL1:	return config_get_calibration (0);
 		case CONFIG_CAL2: return config_get_calibration (1);
 		case CONFIG_CAL3: return config_get_calibration (2);
@@ -203,6 +285,30 @@ void config_set (const int configID, const int value)
 			config_set_retry_interval (value);
 			break;
 
+		case CONFIG_SAMPLES_PER_SEND:
+			config_set_samples_per_send (value);
+			break;
+
+		case CONFIG_COMPRESSION:
+			config_set_compression (value);
+			break;
+
+		case CONFIG_TRANSPORT:
+			config_set_transport (value);
+			break;
+
+		case CONFIG_AIRTIME_RATE:
+			config_set_airtime_rate (value);
+			break;
+
+		case CONFIG_AIRTIME_BURST:
+			config_set_airtime_burst (value);
+			break;
+
+		case CONFIG_COLLECTOR_MODE:
+			config_set_collector_mode (value);
+			break;
+
 		case CONFIG_CAL1:
 			config_set_calibration (0, value);
 			break;
@@ -241,24 +347,56 @@ void config_set (const int configID, const int value)
 }
 
 void config_get_receiver (uip_ipaddr_t *receiver)
+{
+	config_get_collector (0, receiver);
+}
+
+void config_set_receiver (const uip_ipaddr_t *receiver)
+{
+	config_set_collector (0, receiver);
+}
+
+int config_get_collector (int index, uip_ip6addr_t *collector)
 {
 	int i;
 
+	if ((index < 0) || (index >= CONFIG_COLLECTORS)) {
+		uip_create_unspecified (collector);
+		return 0;
+	}
+
 	for (i = 0; i < 8; i++) {
-		receiver->u16[i] = config.server[i];
+		collector->u16[i] = (index == 0) ? config.server[i] : config.collectors[index - 1][i];
 	}
 
+	return !uip_is_addr_unspecified (collector);
 }
 
-void config_set_receiver (const uip_ipaddr_t *receiver)
+void config_set_collector (int index, const uip_ip6addr_t *collector)
 {
 	int i;
 
+	if ((index < 0) || (index >= CONFIG_COLLECTORS))
+		return;
+
 	for (i = 0; i < 8; i++) {
-		config.server[i] = receiver->u16[i];
+		if (index == 0)
+			config.server[i] = collector->u16[i];
+		else
+			config.collectors[index - 1][i] = collector->u16[i];
 	}
 }
 
+uint32_t config_get_collector_mode ()
+{
+	return config.collector_mode;
+}
+
+void config_set_collector_mode (uint32_t mode)
+{
+	config.collector_mode = (mode == CONFIG_COLLECTOR_HASHED) ? CONFIG_COLLECTOR_HASHED : CONFIG_COLLECTOR_ORDERED;
+}
+
 
 uint16_t config_get_remote_port( )
 {
@@ -290,6 +428,88 @@ void config_set_retry_interval (uint32_t seconds)
 					seconds;
 }
 
+uint32_t config_get_samples_per_send ()
+{
+	if (!config.compression && (config.samples_per_send > samples_raw_max))
+		return samples_raw_max;
+	return config.samples_per_send;
+}
+
+void config_set_samples_per_send (uint32_t samples)
+{
+	config.samples_per_send = (samples < 1) ? 1 :
+			(samples > 16) ? 16 :
+					samples;
+}
+
+void config_set_samples_raw_max (uint32_t samples)
+{
+	samples_raw_max = (samples < 1) ? 1 : samples;
+}
+
+uint32_t config_get_compression ()
+{
+	return config.compression;
+}
+
+void config_set_compression (uint32_t enable)
+{
+	config.compression = (enable != 0) ? 1 : 0;
+}
+
+uint32_t config_get_transport ()
+{
+	return config.transport;
+}
+
+void config_set_transport (uint32_t transport)
+{
+	config.transport = (transport > CONFIG_TRANSPORT_AUTO) ? CONFIG_TRANSPORT_UDP : transport;
+}
+
+uint32_t config_get_airtime_rate ()
+{
+	return config.airtime_rate;
+}
+
+void config_set_airtime_rate (uint32_t bytes_per_sec)
+{
+	config.airtime_rate = bytes_per_sec;
+}
+
+uint32_t config_get_airtime_burst ()
+{
+	return config.airtime_burst;
+}
+
+void config_set_airtime_burst (uint32_t bytes)
+{
+	// at least one full frame
+	config.airtime_burst = (bytes < 128) ? 128 :
+			(bytes > 8192) ? 8192 :
+					bytes;
+}
+
+uint32_t config_get_sequence ()
+{
+	return sequence_next;
+}
+
+uint32_t config_use_sequence (int count)
+{
+	uint32_t first = sequence_next;
+
+	sequence_next += count;
+
+	// reserved before any of them goes out
+	if (sequence_next > config.sequence_reserved) {
+		config.sequence_reserved = sequence_next + SEQUENCE_BLOCK;
+		config_write_part (&config, offsetof(config_t, sequence_reserved), sizeof(config.sequence_reserved));
+	}
+
+	return first;
+}
+
 void config_clear_calbration_changed( )
 {
 	calibration_changed = 0;
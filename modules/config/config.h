@@ -9,10 +9,14 @@
 #define CONFIG_H_
 
 #define VERSION_MAJOR 1
-#define VERSION_MINOR 0
+#define VERSION_MINOR 5
 
+#ifdef CONTIKI
 #include <contiki.h>
 #include <contiki-net.h>
+#else
+#include "../command/message-host.h"
+#endif
 
 extern process_event_t config_cmd_run;
 
@@ -30,9 +34,28 @@ typedef enum {
 	CONFIG_ENERGEST_LISTEN = 17,		//0x11
 	CONFIG_ENERGEST_DEEP_LPM = 18,		//0x12
 
+	CONFIG_MSG_RTO = 19,				//0x13  --- messenger retransmit timeout (ms, read only)
+	CONFIG_MSG_SRTT = 20,				//0x14  --- messenger smoothed round trip (ms, read only)
+	CONFIG_MSG_RTTVAR = 21,			//0x15  --- messenger round trip variance (ms, read only)
+	CONFIG_MSG_QDEPTH = 22,			//0x16  --- queued messages of class <value> (read only)
+	CONFIG_MSG_QWAIT = 23,				//0x17  --- average queue wait of class <value> (ms, read only)
+	CONFIG_MSG_QMAXWAIT = 24,		//0x18  --- longest queue wait of class <value> (ms, read only)
+	CONFIG_MSG_THROTTLED_MS = 25,	//0x19  --- time sends were held by the airtime limit (ms, read only)
+	CONFIG_MSG_THROTTLED_BYTES = 26,	//0x1A  --- bytes held by the airtime limit (read only)
+	CONFIG_MSG_COLLECTOR = 27,		//0x1B  --- index of the collector in use (read only)
+	CONFIG_MSG_FAILOVERS = 28,		//0x1C  --- times the sender moved to another collector (read only)
+
 	CONFIG_SENSOR_INTERVAL = 32,		//0x20
 	CONFIG_MAX_FAILURES = 33,					// 0x21
 	CONFIG_RETRY_INTERVAL = 34,				// 0x22
+	CONFIG_SAMPLES_PER_SEND = 35,			// 0x23  --- readings to a frame, no more than a raw frame holds without compression
+	CONFIG_COMPRESSION = 36,					// 0x24  --- 0 = raw readings, 1 = delta coded
+	CONFIG_TRANSPORT = 37,						// 0x25  --- see CONFIG_TRANSPORT_* below
+	CONFIG_AIRTIME_RATE = 38,					// 0x26  --- airtime limit in bytes/second, 0 = no limit
+	CONFIG_AIRTIME_BURST = 39,				// 0x27  --- bytes that may be sent back to back
+	CONFIG_COLLECTOR2 = 40,						// 0x28  --- second collector address (:: = none)
+	CONFIG_COLLECTOR3 = 41,						// 0x29  --- third collector address (:: = none)
+	CONFIG_COLLECTOR_MODE = 42,				// 0x2A  --- see CONFIG_COLLECTOR_* below
 
 	// device specific calibration values
 	CONFIG_CAL1 = 64,			// 0x40  --- this is used by Si7210 for selecting compensation
@@ -45,8 +68,25 @@ typedef enum {
 	CONFIG_CAL8 = 71
 } configtype_t;
 
-// see wikipedia - https://en.wikipedia.org/wiki/Hexspeak
-#define CONFIG_MAGIC (0x0B160000 | (VERSION_MAJOR << 4) | VERSION_MINOR)
+// values for CONFIG_TRANSPORT
+#define CONFIG_TRANSPORT_UDP (0)
+#define CONFIG_TRANSPORT_TCP (1)
+#define CONFIG_TRANSPORT_AUTO (2)		// UDP, with the backlog drained over a TCP session
+
+// the collectors a node may report to - CONFIG_ROUTER is the first
+#define CONFIG_COLLECTORS (3)
+
+// values for CONFIG_COLLECTOR_MODE
+#define CONFIG_COLLECTOR_ORDERED (0)	// use the first healthy one in list order
+#define CONFIG_COLLECTOR_HASHED (1)		// start from one picked by hashing the node ID
+
+/*
+ * see wikipedia - https://en.wikipedia.org/wiki/Hexspeak
+ * The minor version is not part of the magic: a minor version only
+ * appends fields to config_t, so a node keeps its stored configuration
+ * across an upgrade and config_init() gives the new fields defaults.
+ */
+#define CONFIG_MAGIC (0x0B160000 | (VERSION_MAJOR << 4))
 
 typedef struct {
 	uint32_t magic;
@@ -59,15 +99,32 @@ typedef struct {
 
 	uint16_t server[8];
 	uint16_t local_calibration[8];
+
+	// 1.1 on - new fields go at the end
+	uint32_t samples_per_send;
+	uint32_t compression;
+	uint32_t transport;
+	uint32_t airtime_rate;
+	uint32_t airtime_burst;
+	uint32_t collector_mode;
+	uint16_t collectors[CONFIG_COLLECTORS - 1][8];		// CONFIG_COLLECTOR2, CONFIG_COLLECTOR3
+	uint32_t sequence_reserved;		// message sequences below this may have been used
 } config_t;
 
 
 
 void config_init( unsigned int dev_type );
+// returns the bytes read, less than sizeof(config_t) for an older layout
 int config_read(config_t *config);
 int config_write(config_t *config);
+
+// write just length bytes at offset, leaving the rest of the stored configuration as it is
+int config_write_part(config_t *config, int offset, int length);
 void config_list( );
 
+// the directory listing as text, from offset on (a messenger stream_t)
+int config_list_read(uint32_t offset, uint8_t *buf, int maxlen, uint32_t *total);
+
 void config_set_magic(uint32_t magic);
 uint32_t config_get_magic( );
 int config_is_magic( );
@@ -92,12 +149,41 @@ void config_get_receiver(uip_ip6addr_t *receiver);
 void config_set_receiver(const uip_ip6addr_t *receiver);
 uint16_t config_get_remote_port( );
 
+// collector 0 is the receiver, returns 0 if the entry is not set (::)
+int config_get_collector(int index, uip_ip6addr_t *collector);
+void config_set_collector(int index, const uip_ip6addr_t *collector);
+
+uint32_t config_get_collector_mode();
+void config_set_collector_mode(uint32_t mode);
+
 uint32_t config_get_maxfailures();
 void config_set_maxfailures(uint32_t max);
 
 uint32_t config_get_retry_interval();
 void config_set_retry_interval(uint32_t seconds);
 
+// what is sent: the value set, or fewer without compression
+uint32_t config_get_samples_per_send();
+void config_set_samples_per_send(uint32_t samples);
+// the readings one raw frame holds
+void config_set_samples_raw_max(uint32_t samples);
+
+uint32_t config_get_compression();
+void config_set_compression(uint32_t enable);
+
+uint32_t config_get_transport();
+void config_set_transport(uint32_t transport);
+
+uint32_t config_get_airtime_rate();
+void config_set_airtime_rate(uint32_t bytes_per_sec);
+
+uint32_t config_get_airtime_burst();
+void config_set_airtime_burst(uint32_t bytes);
+
+// the next message sequence, and take count of them (returns the first)
+uint32_t config_get_sequence( );
+uint32_t config_use_sequence(int count);
+
 void config_clear_calbration_changed( );
 void config_set_calibration_change( );
 int config_did_calibration_change( );
@@ -2,6 +2,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <spiffs.h>
 #include <SPIFFSNVS.h>
@@ -206,6 +208,14 @@ static PT_THREAD(cmd_ids(struct pt *pt, shell_output_func output, char *args))
 	SHELL_OUTPUT(output,"CONFIG_SENSOR_INTERVAL = 32\n");
   SHELL_OUTPUT(output,"CONFIG_MAX_FAILURES = 33\n");
   SHELL_OUTPUT(output,"CONFIG_RETRY_INTERVAL = 34\n");
+  SHELL_OUTPUT(output,"CONFIG_SAMPLES_PER_SEND = 35\n");
+  SHELL_OUTPUT(output,"CONFIG_COMPRESSION = 36\n");
+  SHELL_OUTPUT(output,"CONFIG_TRANSPORT = 37\n");
+  SHELL_OUTPUT(output,"CONFIG_AIRTIME_RATE = 38\n");
+  SHELL_OUTPUT(output,"CONFIG_AIRTIME_BURST = 39\n");
+  SHELL_OUTPUT(output,"CONFIG_COLLECTOR2 = 40\n");
+  SHELL_OUTPUT(output,"CONFIG_COLLECTOR3 = 41\n");
+  SHELL_OUTPUT(output,"CONFIG_COLLECTOR_MODE = 42\n");
 
 		// device specific calibration values
 	SHELL_OUTPUT(output,"CONFIG_CAL1 = 64\n");
@@ -329,6 +339,11 @@ int nvs_init( )
 	return status;
 }
 
+spiffs *nvs_get_fs( )
+{
+	return &fs;
+}
+
 int config_read(config_t *config)
 {
 
@@ -338,9 +353,11 @@ int config_read(config_t *config)
 			return -1;
 		}
 
+		// an older version's config.dat is shorter, rc says how much of it there is
 		int rc = SPIFFS_read(&fs, fd, config, sizeof(config_t));
 		if (rc < 0) {
-			LOG_ERR("Error could not write config data.\n");
+			LOG_ERR("Error could not read config data.\n");
+			SPIFFS_close(&fs, fd);
 			return rc;
 		}
 
@@ -375,6 +392,26 @@ int  config_write(config_t *config)
 }
 
 
+int config_write_part(config_t *config, int offset, int length)
+{
+	int fd = SPIFFS_open(&fs, "config.dat", SPIFFS_RDWR, 0);
+	if (fd < 0) {
+		LOG_ERR("Error - could not open config.dat for writing.\n");
+		return -1;
+	}
+
+	int rc = SPIFFS_lseek(&fs, fd, offset, SPIFFS_SEEK_SET);
+	if (rc >= 0)
+		rc = SPIFFS_write(&fs, fd, (uint8_t *) config + offset, length);
+	if (rc < 0)
+		LOG_ERR("Error could not write config data.\n");
+
+	SPIFFS_close(&fs, fd);
+
+	return rc;
+}
+
+
 void config_list( )
 {
 	spiffs_DIR dir;
@@ -396,3 +433,44 @@ void config_list( )
 	LOG_INFO("-------------\n");
 }
 
+/*
+ * The directory listing as text ("size name\n" per file), the part of it
+ * from offset on.  The directory is walked again for each call, so no
+ * listing is kept in memory.
+ */
+int config_list_read(uint32_t offset, uint8_t *buf, int maxlen, uint32_t *total)
+{
+	spiffs_DIR dir;
+	struct spiffs_dirent ent;
+	char line[SPIFFS_OBJ_NAME_LEN + 16];
+	uint32_t pos = 0;
+	int len, skip, n, count = 0;
+
+	if (SPIFFS_opendir(&fs, "/", &dir) == NULL) {
+		LOG_ERR("could not open directory list.");
+		return -1;
+	}
+
+	while (SPIFFS_readdir(&dir, &ent) != NULL) {
+		len = snprintf(line, sizeof(line), "%d %s\n", (int) ent.size, ent.name);
+		if (len >= sizeof(line))
+			len = sizeof(line) - 1;
+
+		// copy whatever part of this line falls in the window
+		if ((pos + len > offset) && (count < maxlen)) {
+			skip = (offset > pos) ? offset - pos : 0;
+			n = len - skip;
+			if (n > maxlen - count)
+				n = maxlen - count;
+			memcpy(buf + count, line + skip, n);
+			count += n;
+		}
+		pos += len;
+	}
+
+	SPIFFS_closedir(&dir);
+
+	*total = pos;
+	return count;
+}
+
@@ -9,7 +9,11 @@
 #define MODULES_CONFIG_CONFIG_NVS_H_
 
 #include <contiki.h>
+#include <spiffs.h>
 
 int nvs_init( );
 
+// the file system mounted by nvs_init( ), for other modules' files
+spiffs *nvs_get_fs( );
+
 #endif /* MODULES_CONFIG_CONFIG_NVS_H_ */
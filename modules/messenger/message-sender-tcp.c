@@ -4,16 +4,26 @@
  * @brief The message delivery utility
  *
  * The message sender encapsulates the ability to act
- * as a client of a remote server.  This code allows the
- * sensor to open a connection to the remote server, send
- * a message (e.g. sensor readings), collect the result,
- * and then close the socket.
+ * as a client of a remote server.  The connection is kept open across
+ * messages: queued messages are streamed over the open session, each
+ * prefixed by its length (2 bytes, network order), and the collector's
+ * ACKs come back framed the same way.  The session is closed after
+ * MESSENGER_CONF_TCP_IDLE of inactivity and re-opened on demand; a
+ * session that fails with messages outstanding is re-opened and the
+ * unACK'd messages resent.
+ *
+ * With MESSENGER_CONF_TCP_SESSION set to 0, for a server that only
+ * takes bare messages, each message instead opens a connection of its
+ * own, is sent unframed, and the connection is closed once the ACK is
+ * in.  tests/collector/collector takes either.
  */
 
 #define DEBUG
 
 #include "../../modules/messenger/message-service.h"
+#include "../../modules/messenger/message-transport.h"
 #include "../../modules/command/message.h"
+#include "../../modules/config/config.h"
 
 #include <contiki.h>
 #include <sys/clock.h>
@@ -43,80 +53,443 @@
 #error "Check the values of: NETSTACK_CONF_WITH_IPV6, UIP_CONF_ROUTER, UIP_CONF_IPV6_RPL"
 #endif
 
-#define MAX_SEND_BUFFER 128
+#define ACK_OK (1)
+
+// keep the connection open between messages, see message-transport.h
+#define TCP_SESSION MESSENGER_TCP_SESSION
+
+/**
+ * @brief how long an idle session is kept open
+ */
+#ifdef MESSENGER_CONF_TCP_IDLE
+#define TCP_IDLE MESSENGER_CONF_TCP_IDLE
+#else
+#define TCP_IDLE (CLOCK_SECOND * 30)
+#endif
+
+/**
+ * @brief number of messages that can be queued / outstanding at once
+ */
+#ifdef MESSENGER_CONF_TCP_QUEUE_SIZE
+#define TCP_QUEUE_SIZE MESSENGER_CONF_TCP_QUEUE_SIZE
+#else
+#define TCP_QUEUE_SIZE (4)
+#endif
+
+// how long to wait for a connection or an ACK
+#define ACK_TIMEOUT (CLOCK_SECOND * 15)
+
+// connections a message may be tried on before it is reported as failed
+#define MAX_ATTEMPTS (3)
+
+// pause before re-opening a failed session, doubled per failure
+#define RECONNECT_DELAY (CLOCK_SECOND * 2)
+
+#define FRAME_PREFIX (2)
+
+#define MAX_MESSAGE_SIZE (MESSAGE_FRAME_BUDGET)
+#define MAX_SEND_BUFFER ((TCP_SESSION) ? 2 * (MAX_MESSAGE_SIZE + FRAME_PREFIX) : MAX_MESSAGE_SIZE)
 #define MAX_RECV_BUFFER 128
 static uint8_t send_buffer[MAX_SEND_BUFFER];
 static uint8_t rcv_buffer[MAX_RECV_BUFFER];
-static int send_length, recv_length;
-static volatile int send_started = 0;
 static struct tcp_socket snd_socket;
-static uip_ip6addr_t message_addr;
-static struct process *requestor;
+
+// a timer for connect / ACK deadlines, idle close and reconnect pauses
+static struct etimer msg_timer;
+
+/**
+ * @brief one outbound message and its delivery state
+ */
+struct send_slot {
+	struct send_slot *next;			// needed for list
+	struct process *requestor;	// the process to notify when done
+	uip_ipaddr_t addr;					// where the message is going
+	uint32_t sequence;					// sequence the ACK must carry
+	uint8_t prio;								// messenger_prio_t class
+	uint8_t attempt;						// connections it was tried on
+	uint8_t deferred;						// held back by the airtime limiter
+	uint8_t to_collector;				// follows the collector in use
+	uint8_t refused;						// answered with ACK_NO_REF
+	enum {
+		SLOT_QUEUED, SLOT_SENT, SLOT_ACKED
+	} state;
+	clock_time_t queued_at;			// when messenger_send() accepted it
+	clock_time_t sent_at;				// when it was written to the socket
+	uint16_t length;
+	uint8_t data[MAX_MESSAGE_SIZE];
+};
+
+/**
+ * Memory pool and outbound messages, highest class first and
+ * FIFO within a class
+ */
+MEMB(slots_memb, struct send_slot, TCP_QUEUE_SIZE);
+LIST(send_queue);
+
+/**
+ * @brief the connection to the collector
+ */
+static enum {
+	SESSION_CLOSED, SESSION_CONNECTING, SESSION_OPEN, SESSION_CLOSING
+} session_state = SESSION_CLOSED;
+static uip_ip6addr_t session_addr;
+static clock_time_t session_deadline;		// connect deadline / idle close time
+static clock_time_t reconnect_at;
+static uint8_t session_failures = 0;
+static uint8_t session_sent = 0;				// messages written on this connection
+
+/*
+ * Round trip from writing a message to its ACK, estimated as in RFC
+ * 6298 (see message-sender-udp.c): srtt scaled by 8, rttvar by 4.  A
+ * message resent on a new connection is timed from that write, the
+ * ACK for the old one went with the old connection.
+ */
+static long srtt = 0;
+static long rttvar = 0;
+static uint8_t rtt_samples = 0;
 
 static radio_value_t last_dag_rssi = 0;
 
-process_event_t sender_start_event;
-process_event_t sender_fin_event;
+PROCESS(tcp_sender, "TCP Sender");
+
+/**
+ * Fold one round trip measurement (in clock ticks) into the estimate,
+ * the first one standing for the whole estimate.
+ */
+static void rtt_sample(long rtt)
+{
+	long delta;
 
-PROCESS(messenger_sender, "Messenger Sender");
+	if (rtt_samples == 0) {
+		srtt = rtt << 3;
+		rttvar = rtt << 1;
+	}
+	else {
+		delta = rtt - (srtt >> 3);
+		srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		rttvar += delta - (rttvar >> 2);
+	}
 
-int messenger_send_result (void *data, int *max_length)
+	if (rtt_samples < 255)
+		rtt_samples++;
+
+	LOG_DBG("RTT sample %ld ticks, srtt %ld rttvar %ld\n", rtt, srtt >> 3, rttvar >> 2);
+}
+
+/**
+ * Remove a slot from the queue and report the outcome to the
+ * process that queued it (synchronously, as the UDP sender does).
+ */
+static void finish_slot(struct send_slot *slot, int ok)
 {
-	if (recv_length < 0) {
-		*max_length = 0;
-		return 0;
+	messenger_result_t result;
+	struct process *requestor = slot->requestor;
+	messenger_prio_t result_prio = slot->prio;
+
+	result.sequence = slot->sequence;
+	result.ok = ok && !slot->refused;
+	result.refused = slot->refused;
+	result.attempts = slot->attempt;
+
+	list_remove(send_queue, slot);
+	memb_free(&slots_memb, slot);
+	messenger_class_done(result_prio);
+
+	LOG_DBG("Sender: finished seq=%u ok?=%d tries=%d\n", (unsigned int) result.sequence, ok, result.attempts);
+
+	messenger_report(requestor, &result);
+}
+
+/**
+ * The session went away - put its unACK'd messages back in the queue
+ * to go out on the next connection.  One that never opened (refused,
+ * timed out, or the deadline passed) uses up an attempt of the first
+ * message it was for, so a collector that is not there fails the
+ * message in the end and moves the sender on.
+ */
+static void session_lost( )
+{
+	struct send_slot *slot;
+	int connecting = (session_state == SESSION_CONNECTING);
+
+	for (slot = list_head(send_queue); slot != NULL; slot = list_item_next(slot)) {
+		if (slot->state == SLOT_SENT)
+			slot->state = SLOT_QUEUED;
+		else if (connecting && (slot->state == SLOT_QUEUED) && uip_ipaddr_cmp(&slot->addr, &session_addr)) {
+			slot->attempt++;
+			connecting = 0;
+		}
 	}
 
-	if (*max_length < recv_length)
-		recv_length = *max_length;
+	if (session_state == SESSION_CONNECTING)
+		messenger_collector_timeout(&session_addr);
 
-	memcpy (data, rcv_buffer, recv_length);
-	return 1;
+	// a close we asked for is not a failure
+	if ((session_state != SESSION_CLOSING) && (list_head(send_queue) != NULL)) {
+		if (session_failures < 4)
+			session_failures++;
+		reconnect_at = clock_time() + (RECONNECT_DELAY << (session_failures - 1));
+	}
+
+	session_state = SESSION_CLOSED;
 }
 
-void messenger_send (const uip_ipaddr_t *remote_addr, const void *data, int length)
+static void arm_timer(clock_time_t now, clock_time_t when)
 {
-	LOG_DBG("message_send ");
-	LOG_6ADDR(LOG_LEVEL_DBG, remote_addr);
-	LOG_DBG_(" length %d", length);
-	LOG_DBG_(" send_started: %d\n", send_started);
+	etimer_set(&msg_timer, CLOCK_LT(now, when) ? when - now : 1);
+}
 
-	if (send_started != 0) {
-		LOG_ERR("Send already in progress...");
-		return;
+/**
+ * Start closing the session.  A failed session has its unACK'd messages
+ * re-queued straight away; the socket's closed event finishes the job
+ * (or the deadline does, should that event never come).
+ */
+static void close_session(int failed)
+{
+	clock_time_t now = clock_time();
+
+	if (failed)
+		session_lost();
+
+	tcp_socket_close(&snd_socket);
+	session_state = SESSION_CLOSING;
+	session_deadline = now + ACK_TIMEOUT;
+	arm_timer(now, session_deadline);
+}
+
+/**
+ * Write one message to the open session.  Returns 0 if the socket's
+ * buffer has no room for it yet.
+ */
+static int transmit_slot(struct send_slot *slot)
+{
+	uint8_t prefix[FRAME_PREFIX];
+
+	if (TCP_SESSION) {
+		if (tcp_socket_max_sendlen(&snd_socket) < slot->length + FRAME_PREFIX)
+			return 0;
+
+		prefix[0] = slot->length >> 8;
+		prefix[1] = slot->length & 0xff;
+		tcp_socket_send(&snd_socket, prefix, FRAME_PREFIX);
 	}
+	else if (tcp_socket_max_sendlen(&snd_socket) < slot->length) {
+		return 0;
+	}
+
+	tcp_socket_send(&snd_socket, slot->data, slot->length);
 
-	send_started = 1;
-	if (length > MAX_SEND_BUFFER) {
-		LOG_ERR("Request exceeds maximum transfer (%d > %d)", length, MAX_SEND_BUFFER);
+	slot->state = SLOT_SENT;
+	slot->sent_at = clock_time();
+	if (slot->attempt == 0)
+		messenger_class_sent(slot->prio, slot->sent_at - slot->queued_at);
+	slot->attempt++;
+	session_sent++;
+
+	LOG_DBG("Sent seq=%u, %d bytes\n", (unsigned int) slot->sequence, slot->length);
+	return 1;
+}
+
+/**
+ * Walk the queue and the session: complete ACK'd messages, fail the
+ * ones out of attempts, open / close the connection as needed, and
+ * stream queued messages over it.
+ */
+static void service_queue( )
+{
+	struct send_slot *slot, *next;
+	clock_time_t now = clock_time();
+	clock_time_t earliest, wait;
+	int in_flight = 0;
+	int blocked = 0;		// no more writes this pass (buffer full / airtime)
+	int waiting = 0;		// messages for this collector still to write
+	int window = messenger_get_window();
+
+	for (slot = list_head(send_queue); slot != NULL; slot = next) {
+		next = list_item_next(slot);
+
+		if (slot->state == SLOT_ACKED) {
+			finish_slot(slot, 1);
+		}
+		else if ((slot->state == SLOT_QUEUED) && (slot->attempt >= MAX_ATTEMPTS)) {
+			LOG_DBG("Sender: seq %u failed after %d connections\n", (unsigned int) slot->sequence, slot->attempt);
+			finish_slot(slot, 0);
+		}
+		else if (slot->state == SLOT_SENT) {
+			in_flight++;
+		}
+		else if (slot->to_collector) {
+			// after a failover, unsent messages go to the new collector
+			messenger_get_collector(&slot->addr);
+		}
 	}
 
-	requestor = process_current;
+	slot = list_head(send_queue);
+
+	switch (session_state) {
+	case SESSION_CLOSED:
+		if (slot == NULL) {
+			etimer_stop(&msg_timer);
+			break;
+		}
+
+		if (CLOCK_LT(now, reconnect_at)) {
+			arm_timer(now, reconnect_at);
+			break;
+		}
+
+		LOG_DBG("Connecting to ");
+		LOG_6ADDR(LOG_LEVEL_DBG, &slot->addr);
+		LOG_DBG_(" port %d\n", MESSAGE_SERVER_PORT);
 
-	memcpy (&message_addr, remote_addr, sizeof(uip_ipaddr_t));
-	memcpy (send_buffer, data, length);
-	send_length = length;
+		uip_ipaddr_copy(&session_addr, &slot->addr);
+		session_state = SESSION_CONNECTING;
+		session_deadline = now + ACK_TIMEOUT;
 
-	LOG_DBG("Notifying message sender...\n");
-	process_post_synch (&messenger_sender, sender_start_event, NULL);
+		if (tcp_socket_connect(&snd_socket, &session_addr, MESSAGE_SERVER_PORT) < 0) {
+			LOG_ERR("Error - socket could not connect\n");
+			close_session(1);
+			break;
+		}
+		arm_timer(now, session_deadline);
+		break;
+
+	case SESSION_CONNECTING:
+		if (!CLOCK_LT(now, session_deadline)) {
+			LOG_INFO("Error - connect timed out\n");
+			close_session(1);
+			break;
+		}
+		arm_timer(now, session_deadline);
+		break;
+
+	case SESSION_OPEN:
+		earliest = now + TCP_IDLE;
+
+		for (; slot != NULL; slot = list_item_next(slot)) {
+			if (slot->state == SLOT_QUEUED) {
+				// one session talks to one collector, others wait for it to close
+				if (!uip_ipaddr_cmp(&slot->addr, &session_addr))
+					continue;
+
+				waiting++;
+
+				// without a session, each connection carries a single message
+				if (blocked || (in_flight >= window) || (!TCP_SESSION && session_sent > 0))
+					continue;
+
+				wait = messenger_airtime_wait(slot->length + (TCP_SESSION ? FRAME_PREFIX : 0), &slot->deferred);
+				if (wait != 0) {
+					LOG_DBG("Sender: seq %u deferred by airtime limit\n", (unsigned int) slot->sequence);
+					if (CLOCK_LT(now + wait, earliest))
+						earliest = now + wait;
+					blocked = 1;
+					continue;
+				}
+
+				if (!transmit_slot(slot)) {
+					blocked = 1;
+					continue;
+				}
+
+				waiting--;
+				in_flight++;
+			}
+
+			if (slot->state == SLOT_SENT) {
+				if (!CLOCK_LT(now, slot->sent_at + ACK_TIMEOUT)) {
+					LOG_INFO("Error - no ACK for seq %u, dropping session\n", (unsigned int) slot->sequence);
+					messenger_collector_timeout(&session_addr);
+					close_session(1);
+					return;
+				}
+
+				if (CLOCK_LT(slot->sent_at + ACK_TIMEOUT, earliest))
+					earliest = slot->sent_at + ACK_TIMEOUT;
+			}
+		}
+
+		if (list_head(send_queue) != NULL) {
+			// anything left for another collector (or, without a session,
+			// the next message) needs its own connection
+			if ((in_flight == 0) && ((waiting == 0) || (!TCP_SESSION && session_sent > 0))) {
+				LOG_DBG("Closing session to switch collector\n");
+				close_session(0);
+				break;
+			}
+			session_deadline = now + TCP_IDLE;
+			arm_timer(now, earliest);
+		}
+		else if (!TCP_SESSION || !CLOCK_LT(now, session_deadline)) {
+			LOG_DBG("Closing idle session\n");
+			close_session(0);
+		}
+		else {
+			arm_timer(now, session_deadline);
+		}
+		break;
+
+	case SESSION_CLOSING:
+		if (!CLOCK_LT(now, session_deadline)) {
+			LOG_INFO("Error - close never completed\n");
+			session_lost();
+			process_poll(&tcp_sender);
+		}
+		break;
+	}
 }
 
-//void messenger_get_last_result (int *sendlen, int *recvlen, int maxlen, void *dest)
-//{
-//	if (maxlen > recv_length)
-//		maxlen = recv_length;
-//
-//	memcpy (dest, rcv_buffer, maxlen);
-//	*sendlen = send_length;
-//	*recvlen = recv_length;
-//}
+/**
+ * Handle one reply from the collector.  Returns 1 if it ACK'd a message.
+ */
+static int ack_sequence(uint32_t sequence, int refused)
+{
+	struct send_slot *slot;
+
+	for (slot = list_head(send_queue); slot != NULL; slot = list_item_next(slot)) {
+		if ((slot->state == SLOT_SENT) && (slot->sequence == sequence)) {
+			rtt_sample((long) (clock_time() - slot->sent_at));
+			slot->state = SLOT_ACKED;
+			slot->refused = refused;
+			messenger_collector_ack(&slot->addr);
+			LOG_DBG("Received %s for seq %u\n", refused ? "NAK" : "ACK", (unsigned int) sequence);
+			return 1;
+		}
+	}
 
-static bool received_valid_ACK = false;
+	return 0;
+}
 
-int messenger_last_result_okack ()
+static int handle_reply(const uint8_t *inputptr, int inputdatalen)
 {
-	LOG_DBG("last result OK? %d\n", received_valid_ACK);
-	return  received_valid_ACK;
+	const ack_t *ack = (const ack_t *) inputptr;
+	const ack_window_t *wack = (const ack_window_t *) inputptr;
+	int matched = 0;
+	int i;
+
+	if (inputdatalen != sizeof(ack_t)) {
+		LOG_DBG("Sender got %d bytes back from remote\n", inputdatalen);
+		return 0;
+	}
+
+	if ((ack->header == ACK_HEADER) && ((ack->ack_value == ACK_OK) || (ack->ack_value == ACK_NO_REF))) {
+		matched = ack_sequence(ack->ack_seq, ack->ack_value == ACK_NO_REF);
+	}
+	else if (wack->header == ACK_WINDOW_HEADER) {
+		for (i = 0; i < 32; i++) {
+			if (wack->ack_bitmap & (1UL << i))
+				matched += ack_sequence(wack->ack_base + i, 0);
+		}
+	}
+	else if (ack->header == CAL_REQUEST_HEADER) {
+		// see message-sender-udp.c
+		LOG_INFO("Collector asked for calibration\n");
+		config_set_calibration_change( );
+	}
+
+	return matched;
 }
 
 /* ****************************************************************
@@ -128,43 +501,48 @@ static int sender_recv_bytes (struct tcp_socket *s, void *ptr,
 															const uint8_t *inputptr,
 															int inputdatalen)
 {
-
-	uint32_t *vals = (uint32_t *) inputptr;
-	recv_length = inputdatalen;
+	int matched = 0;
+	int flen;
 
 	NETSTACK_RADIO.get_value(RADIO_PARAM_LAST_RSSI, &last_dag_rssi);
 
 	LOG_DBG("sender_recv_bytes: %p %p %p %d RSSI=%d\n", s, ptr, inputptr, inputdatalen, (int) last_dag_rssi);
-	if (send_length <= 0) {
-		LOG_DBG("not OK, send_length <= 0\n");
-	}
 
-	else if (inputdatalen == 0) {
-		LOG_DBG("not OK, recv_length %d <= 16\n", inputdatalen);
+	if (!TCP_SESSION) {
+		if (handle_reply(inputptr, inputdatalen)) {
+			process_post(&tcp_sender, sender_fin_event, NULL);
+		}
 		return 0;
 	}
-	else if (inputdatalen != 16) {
-		LOG_DBG("not OK, recv_length %d <= 16\n", inputdatalen);
-	}
 
-	else if (vals[0] == ACK_HEADER) {
-		received_valid_ACK = vals[3];
-		tcp_socket_close (s);
+	// split the stream into frames, keeping any partial frame for next time
+	while (inputdatalen >= FRAME_PREFIX) {
+		flen = (inputptr[0] << 8) | inputptr[1];
+		if ((flen > MAX_RECV_BUFFER - FRAME_PREFIX) ||
+				(inputdatalen < FRAME_PREFIX + flen)) {
+			break;
+		}
+
+		matched += handle_reply(inputptr + FRAME_PREFIX, flen);
+		inputptr += FRAME_PREFIX + flen;
+		inputdatalen -= FRAME_PREFIX + flen;
 	}
 
-	else if (inputdatalen > 0) {
-		LOG_DBG("Sender got %d bytes back from remote\n", inputdatalen);
-		for (int i = 0; i < inputdatalen; i++) {
-			printf("%-2.2x ", inputptr[i]);
-		}
-		printf("\n");
+	// a frame that can never fit means the stream is out of step
+	if ((inputdatalen >= FRAME_PREFIX) && (((inputptr[0] << 8) | inputptr[1]) > MAX_RECV_BUFFER - FRAME_PREFIX)) {
+		LOG_ERR("Error - bad frame length, dropping session\n");
+		close_session(1);
+		inputdatalen = 0;
 	}
 
+	if (matched > 0) {
+		process_post(&tcp_sender, sender_fin_event, NULL);
+	}
 
-	return 0;
+	return inputdatalen;
 }
 
-int messenger_recvd_rssi( )
+static int tcp_recvd_rssi( )
 {
 	return last_dag_rssi;
 }
@@ -176,13 +554,11 @@ static void sender_recv_event (struct tcp_socket *s, void *ptr, tcp_socket_event
 		{
 		// start of connection
 		case TCP_SOCKET_CONNECTED:		// 0
-			if ((send_length > 0) && (send_length <= MAX_SEND_BUFFER)) {
-				LOG_DBG_("Socket connected event, sending data %p, %d\n", s, send_length);
-				tcp_socket_send (s, send_buffer, send_length);
-
-				// start of a new connection...
-				received_valid_ACK = false;
-			}
+			LOG_DBG_("Socket connected event\n");
+			session_state = SESSION_OPEN;
+			session_failures = 0;
+			session_sent = 0;
+			session_deadline = clock_time() + TCP_IDLE;
 			break;
 
 			// during connection
@@ -193,34 +569,30 @@ static void sender_recv_event (struct tcp_socket *s, void *ptr, tcp_socket_event
 			// closing the connection (normally)
 		case TCP_SOCKET_CLOSED:			// 1
 			LOG_DBG_("Socket closed event\n");
-			send_started = 0;
+			session_lost();
 			break;
 
 			// closing the connect (abnormally)
 		case TCP_SOCKET_TIMEDOUT:		// 2
 			LOG_DBG_("Socket timed out\n");
-			send_started = 0;
-			send_length = -1;
+			session_lost();
 			break;
 
 		case TCP_SOCKET_ABORTED:		// 3
 			LOG_DBG_("Socket aborted\n");
-			send_started = 0;
-			send_length = -1;
+			session_lost();
 			break;
 		}
 
-	if (send_started == 0) {
-		process_post (&messenger_sender, sender_fin_event, NULL);
-	}
+	process_post (&tcp_sender, sender_fin_event, NULL);
 }
 
-PROCESS_THREAD(messenger_sender, ev, data)
+PROCESS_THREAD(tcp_sender, ev, data)
 {
-	static struct etimer timer;
 	int rc;
 
 	PROCESS_BEGIN()	;
+	etimer_stop(&msg_timer);
 
 	rc = tcp_socket_register (&snd_socket, NULL,
 														send_buffer,
@@ -234,50 +606,17 @@ PROCESS_THREAD(messenger_sender, ev, data)
 		LOG_DBG("Error - could not register TCP socket! Aborting process");
 		goto error;
 	}
-	LOG_DBG("Message sender starting on %d\n", MESSAGE_SERVER_PORT);
-	while (1) {
-
-		PROCESS_WAIT_EVENT_UNTIL(ev == sender_start_event);
-		LOG_DBG("Message sender was awoken... connecting... to ");
-		LOG_6ADDR(LOG_LEVEL_DBG, &message_addr);
-		LOG_DBG_(" port %d ", MESSAGE_SERVER_PORT);
-		LOG_DBG_(" sending %d bytes\n", send_length);
+	LOG_DBG("Message sender starting on %d (%s)\n", MESSAGE_SERVER_PORT,
+			TCP_SESSION ? "session" : "per message");
 
-		etimer_reset (&timer);
-		etimer_set (&timer, CLOCK_SECOND * 15);
-
-		rc = tcp_socket_connect (&snd_socket, &message_addr, MESSAGE_SERVER_PORT);
-		if (rc < 0) {
-			LOG_ERR("Error - socket could not connect: %d\n", rc);
-			tcp_socket_close(&snd_socket);
+	while (1) {
+		PROCESS_WAIT_EVENT();
 
-			send_started = 0;
-			send_length = -1;
+		// a new packet was queued, an ACK / socket event arrived, or a deadline passed
+		if (ev == sender_start_event || ev == sender_fin_event ||
+		    ev == PROCESS_EVENT_POLL || etimer_expired(&msg_timer)) {
+			service_queue();
 		}
-		else
-		{
-			LOG_DBG("socket connecting, waiting for sender event\n");
-			while (1) {
-				PROCESS_WAIT_EVENT();
-
-				LOG_DBG("Event was receved: %d\n", ev);
-
-				if (etimer_expired(&timer)) {
-					LOG_INFO("Error - connect timed out\n");
-					tcp_socket_close(&snd_socket);
-					send_started = 0;
-					send_length = -1;
-					break;
-				}
-				if (ev == sender_fin_event) {
-					LOG_INFO("Finished sending, sent %d bytes\n", send_length);
-					break;
-				}
-			}
-		}
-		LOG_INFO("Reporting len %d to requestor\n", send_length);
-		process_post (requestor, PROCESS_EVENT_MSG, NULL);
-
 	}
 error:
 	LOG_DBG("Message sender process exiting\n");
@@ -285,10 +624,83 @@ error:
 PROCESS_END();
 }
 
-void messenger_sender_init ()
+static int tcp_send (const uip_ipaddr_t *remote_addr, uint32_t sequence, const void *data, int length, messenger_prio_t prio)
 {
-sender_start_event = process_alloc_event ();
-sender_fin_event = process_alloc_event ();
+	struct send_slot *slot, *prev, *curr;
+
+	LOG_DBG("message_send ");
+	LOG_6ADDR(LOG_LEVEL_DBG, remote_addr);
+	LOG_DBG_(" length %d", length);
+	LOG_DBG_(" queued: %d\n", list_length(send_queue));
 
-process_start (&messenger_sender, NULL);
+	if ((length <= 0) || (length > MAX_MESSAGE_SIZE)) {
+		LOG_ERR("Request exceeds maximum transfer (%d > %d)\n", length, MAX_MESSAGE_SIZE);
+		return 0;
+	}
+
+	slot = messenger_class_admit(prio, list_length(send_queue), TCP_QUEUE_SIZE) ?
+			memb_alloc(&slots_memb) : NULL;
+	if (slot == NULL) {
+		LOG_ERR("Send queue full, seq %u not sent\n", (unsigned int) sequence);
+		return 0;
+	}
+
+	slot->requestor = process_current;
+	slot->to_collector = (remote_addr == NULL);
+	if (slot->to_collector)
+		messenger_get_collector(&slot->addr);
+	else
+		uip_ipaddr_copy(&slot->addr, remote_addr);
+	slot->sequence = sequence;
+	slot->prio = prio;
+	slot->attempt = 0;
+	slot->deferred = 0;
+	slot->refused = 0;
+	slot->state = SLOT_QUEUED;
+	slot->queued_at = clock_time();
+
+	memcpy(slot->data, data, length);
+	slot->length = length;
+
+	// behind everything of the same or a higher class
+	prev = NULL;
+	for (curr = list_head(send_queue); curr != NULL; curr = list_item_next(curr)) {
+		if (curr->prio < prio)
+			break;
+		prev = curr;
+	}
+
+	if (prev == NULL)
+		list_push(send_queue, slot);
+	else
+		list_insert(send_queue, prev, slot);
+
+	messenger_class_queued(prio);
+	process_post(&tcp_sender, sender_start_event, NULL);
+
+	return 1;
+}
+
+static void tcp_get_rtt(const uip_ipaddr_t *addr, uint32_t *srtt_ms, uint32_t *rttvar_ms, uint32_t *rto_ms)
+{
+	// TCP does its own retransmission, report the ACK round trip only
+	*srtt_ms = ((srtt >> 3) * 1000UL) / CLOCK_SECOND;
+	*rttvar_ms = ((rttvar >> 2) * 1000UL) / CLOCK_SECOND;
+	*rto_ms = (ACK_TIMEOUT * 1000UL) / CLOCK_SECOND;
 }
+
+static void tcp_init ()
+{
+	memb_init(&slots_memb);
+	list_init(send_queue);
+
+	process_start (&tcp_sender, NULL);
+}
+
+const struct messenger_transport tcp_transport = {
+	"tcp",
+	tcp_init,
+	tcp_send,
+	tcp_get_rtt,
+	tcp_recvd_rssi
+};
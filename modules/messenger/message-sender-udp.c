@@ -13,7 +13,9 @@
 #define DEBUG
 
 #include "../../modules/messenger/message-service.h"
+#include "../../modules/messenger/message-transport.h"
 #include "../../modules/command/message.h"
+#include "../../modules/config/config.h"
 
 #include <contiki.h>
 #include <contiki-net.h>
@@ -35,155 +37,495 @@
 #endif
 
 #define MAX_ATTEMPTS (8)
-#define RETRY_DELAY (CLOCK_CONF_SECOND * 2 )
 #define ACK_OK (1)
 
-// events used within the messenger module
-process_event_t sender_start_event;
-process_event_t sender_fin_event;
+/**
+ * @brief retransmit timeout bounds (RFC 6298 style estimator)
+ *
+ * RTO_INITIAL is used until a destination has an RTT sample, and the
+ * backed-off timeout never exceeds RTO_MAX.
+ */
+#define RTO_INITIAL (CLOCK_CONF_SECOND * 2 )
+#define RTO_MIN (CLOCK_CONF_SECOND / 4 )
+#define RTO_MAX (CLOCK_CONF_SECOND * 8 )
+
+/**
+ * @brief number of destinations to keep RTT estimates for
+ */
+#ifdef MESSENGER_CONF_RTT_DESTINATIONS
+#define MESSENGER_RTT_DESTINATIONS MESSENGER_CONF_RTT_DESTINATIONS
+#else
+#define MESSENGER_RTT_DESTINATIONS (2)
+#endif
+
+/**
+ * @brief number of messages that can be queued / outstanding at once
+ */
+#ifdef MESSENGER_CONF_QUEUE_SIZE
+#define MESSENGER_QUEUE_SIZE MESSENGER_CONF_QUEUE_SIZE
+#else
+#define MESSENGER_QUEUE_SIZE (8)
+#endif
+
+/**
+ * @brief largest message that a queue slot can hold
+ */
+#define MAX_MESSAGE_SIZE (MESSAGE_FRAME_BUDGET)
 
 // the UDP connection to use / listen to
 static struct simple_udp_connection conn;
 
-// the process that is requesting the send
-static struct process *requestor;
-
 // a timer used to control resending the data
 static struct etimer msg_timer;
 
-// the data buffer,length, and sequence that is currently be sent/resent
-static uint8_t current_data[UIP_BUFSIZE];
-static uint16_t current_length = 0;
-static uint16_t current_sequence = 0;
+/**
+ * @brief one outbound message and its delivery state
+ */
+struct send_slot {
+	struct send_slot *next;			// needed for list
+	struct process *requestor;	// the process to notify when done
+	uip_ipaddr_t addr;					// where the message is going
+	uint32_t sequence;					// sequence the ACK must carry
+	uint8_t prio;								// messenger_prio_t class
+	uint8_t attempt;						// how many times it was (re)sent
+	uint8_t deferred;						// held back by the airtime limiter
+	uint8_t to_collector;				// follows the collector in use
+	uint8_t refused;						// answered with ACK_NO_REF
+	enum {
+		SLOT_QUEUED, SLOT_SENT, SLOT_ACKED
+	} state;
+	clock_time_t queued_at;			// when messenger_send() accepted it
+	clock_time_t next_send;			// when to resend if not ACK'd
+	clock_time_t first_send;		// when it was first transmitted
+	clock_time_t acked_at;			// when the ACK arrived
+	clock_time_t rto;						// current (backed-off) timeout
+	uint16_t length;
+	uint8_t data[MAX_MESSAGE_SIZE];
+};
 
-// how many attempts to deliver this segment?
-static int current_attempt = 0;
+/**
+ * Memory pool and outbound messages, highest class first and
+ * FIFO within a class
+ */
+MEMB(slots_memb, struct send_slot, MESSENGER_QUEUE_SIZE);
+LIST(send_queue);
+
+/**
+ * @brief smoothed round trip estimate for one destination
+ *
+ * srtt is kept scaled by 8 and rttvar by 4 so the RFC 6298 gains
+ * (1/8 and 1/4) are plain shifts on clock ticks.
+ */
+struct rtt_entry {
+	struct rtt_entry *next;			// needed for list
+	uip_ipaddr_t addr;
+	long srtt;
+	long rttvar;
+	clock_time_t rto;
+	uint8_t samples;
+};
+
+/**
+ * Memory pool and most-recently-used list of RTT estimates
+ */
+MEMB(rtt_memb, struct rtt_entry, MESSENGER_RTT_DESTINATIONS);
+LIST(rtt_list);
 
 // the last RSSI
 static radio_value_t last_dag_rssi = 0;
 
-// how did the last transaction end?
-static int last_ack_ok = 0;
-static int send_started = 0;
 
+/**
+ * Find the RTT estimate for a destination, creating one (and recycling
+ * the least recently used) if needed.  Never returns NULL.
+ */
+static struct rtt_entry *rtt_lookup(const uip_ipaddr_t *addr)
+{
+	struct rtt_entry *e;
+
+	for (e = list_head(rtt_list); e != NULL; e = list_item_next(e)) {
+		if (uip_ipaddr_cmp(&e->addr, addr))
+			break;
+	}
+
+	if (e == NULL) {
+		e = memb_alloc(&rtt_memb);
+		if (e == NULL) {
+			e = list_chop(rtt_list);
+		}
+		uip_ipaddr_copy(&e->addr, addr);
+		e->srtt = 0;
+		e->rttvar = 0;
+		e->rto = RTO_INITIAL;
+		e->samples = 0;
+	}
+	else {
+		list_remove(rtt_list, e);
+	}
+
+	list_push(rtt_list, e);
+	return e;
+}
 
 /**
- * Process for sending / resending data.
+ * Fold one round trip measurement (in clock ticks) into the estimate.
  */
-PROCESS(messenger_sender, "Messenger Sender");
-PROCESS_THREAD(messenger_sender, ev, data)
+static void rtt_sample(struct rtt_entry *e, long rtt)
 {
-	PROCESS_BEGIN()	;
-	etimer_stop(&msg_timer);
+	long delta;
 
-	while (1) {
-		PROCESS_WAIT_EVENT();
+	if (e->samples == 0) {
+		e->srtt = rtt << 3;
+		e->rttvar = rtt << 1;
+	}
+	else {
+		delta = rtt - (e->srtt >> 3);
+		e->srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		e->rttvar += delta - (e->rttvar >> 2);
+	}
 
-		// a new packet is to be sent
-		if (ev == sender_start_event)
-		{
-			if (send_started == 1) {
-				LOG_DBG("Started new send, %d bytes.  Retry interval: %d\n", current_length, RETRY_DELAY);
+	if (e->samples < 255)
+		e->samples++;
 
-				current_attempt = 0;
-				simple_udp_send(&conn, &current_data, current_length);
-				etimer_set(&msg_timer, RETRY_DELAY);
-			}
+	e->rto = (e->srtt >> 3) + ((e->rttvar > 1) ? e->rttvar : 1);
+	e->rto = (e->rto < RTO_MIN) ? RTO_MIN :
+			(e->rto > RTO_MAX) ? RTO_MAX :
+					e->rto;
+
+	LOG_DBG("RTT sample %ld ticks, srtt %ld rttvar %ld rto %lu\n",
+	        rtt, e->srtt >> 3, e->rttvar >> 2, (unsigned long) e->rto);
+}
+
+/**
+ * Remove a slot from the queue and report the outcome to the
+ * process that queued it.  The result is delivered synchronously,
+ * so the requestor may inspect it (and messenger_last_result_okack())
+ * before the slot is reused.
+ */
+static void finish_slot(struct send_slot *slot, int ok)
+{
+	messenger_result_t result;
+	struct process *requestor = slot->requestor;
+	messenger_prio_t result_prio = slot->prio;
+
+	result.sequence = slot->sequence;
+	result.ok = ok && !slot->refused;
+	result.refused = slot->refused;
+	result.attempts = slot->attempt + 1;
+
+	// Karn's rule: a retransmitted message gives an ambiguous sample
+	if (ok && (slot->attempt == 0)) {
+		rtt_sample(rtt_lookup(&slot->addr), (long) (slot->acked_at - slot->first_send));
+	}
+
+	list_remove(send_queue, slot);
+	memb_free(&slots_memb, slot);
+	messenger_class_done(result_prio);
+
+	LOG_DBG("Sender: finished seq=%u ok?=%d tries=%d rssi=%d\n",
+	        result.sequence, ok, result.attempts, last_dag_rssi);
+
+	messenger_report(requestor, &result);
+}
+
+/**
+ * May this slot go on the air now?  If not, it is rescheduled for when
+ * the airtime limiter will have room.  Once one slot is held back in a
+ * pass (*held set), everything after it waits too, so a small message
+ * of a lower class cannot slip in ahead of a larger one.
+ */
+static int airtime_ok(struct send_slot *slot, clock_time_t now, int *held, clock_time_t *until)
+{
+	clock_time_t wait;
+
+	if (!*held) {
+		wait = messenger_airtime_wait(slot->length, &slot->deferred);
+		if (wait == 0)
+			return 1;
+
+		*held = 1;
+		*until = now + wait;
+	}
+
+	slot->deferred = 1;
+	slot->next_send = *until;
+	LOG_DBG("Sender: seq %u deferred by airtime limit\n", (unsigned int) slot->sequence);
+	return 0;
+}
+
+static void transmit_slot(struct send_slot *slot)
+{
+	clock_time_t now = clock_time();
+
+	// after a failover, resends go to the new collector
+	if (slot->to_collector)
+		messenger_get_collector(&slot->addr);
+
+	// start from the destination's estimate, double it on every resend
+	if (slot->attempt == 0) {
+		messenger_class_sent(slot->prio, now - slot->queued_at);
+		slot->first_send = now;
+		slot->rto = rtt_lookup(&slot->addr)->rto;
+	}
+	else {
+		slot->rto = (slot->rto >= RTO_MAX / 2) ? RTO_MAX : slot->rto * 2;
+	}
+
+	simple_udp_sendto(&conn, slot->data, slot->length, &slot->addr);
+	slot->state = SLOT_SENT;
+	slot->next_send = now + slot->rto;
+}
+
+// messages of this class or above awaiting an ACK
+static int in_flight_from(int prio)
+{
+	struct send_slot *slot;
+	int count = 0;
+
+	for (slot = list_head(send_queue); slot != NULL; slot = list_item_next(slot)) {
+		if ((slot->state == SLOT_SENT) && (slot->prio >= prio))
+			count++;
+	}
+
+	return count;
+}
+
+
+/**
+ * Walk the queue: complete ACK'd messages, send new ones, resend
+ * the ones whose timer ran out, and re-arm the timer for the next
+ * pending deadline.
+ *
+ * The queue is ordered highest class first.  A new message only counts
+ * in-flight messages of its own class or above against the window, and
+ * while one is left waiting, due retransmits of lower classes are held
+ * back so the waiting class gets the airtime first.
+ */
+static void service_queue( )
+{
+	struct send_slot *slot, *next;
+	clock_time_t now = clock_time();
+	clock_time_t earliest = 0;
+	int pending = 0;
+	int window = messenger_get_window();
+	int waiting = -1;		// highest class left waiting for the window
+	int held = 0;				// the airtime limiter said wait
+	clock_time_t held_until = 0;
+
+	// retire everything that was ACK'd first, freeing up the window
+	for (slot = list_head(send_queue); slot != NULL; slot = next) {
+		next = list_item_next(slot);
+
+		if (slot->state == SLOT_ACKED) {
+			finish_slot(slot, 1);
 		}
+	}
 
+	for (slot = list_head(send_queue); slot != NULL; slot = next) {
+		next = list_item_next(slot);
 
-		// a valid response to this packet was receved from server
-		else if (ev == sender_fin_event)
-		{
-			if (send_started == 1) {
-				send_started = 0;
-				LOG_DBG("Sender: finished seq=%d ok?=%d rssi=%d\n", current_sequence, last_ack_ok, last_dag_rssi);
-				etimer_stop(&msg_timer);
+		// ACK'd after the first pass, the fin event will retire it
+		if (slot->state == SLOT_ACKED)
+			continue;
 
-				process_post (requestor, PROCESS_EVENT_MSG, NULL);
-				etimer_stop(&msg_timer);
+		if (slot->state == SLOT_QUEUED) {
+			// window is full, wait for an ACK (the fin event wakes us)
+			if (in_flight_from(slot->prio) >= window) {
+				if (slot->prio > waiting)
+					waiting = slot->prio;
+				continue;
 			}
-			else {
-				LOG_DBG("Sender: got duplicate fin event\n");
-				etimer_stop(&msg_timer);
+
+			if (!airtime_ok(slot, now, &held, &held_until))
+				goto schedule;
+
+			transmit_slot(slot);
+			LOG_DBG("Started new send seq=%u class %d, %d bytes.  Retry interval: %lu\n",
+			        slot->sequence, slot->prio, slot->length, (unsigned long) slot->rto);
+		}
+		else if (!CLOCK_LT(now, slot->next_send) && (slot->prio < waiting)) {
+			// preempted - keep it out of the air until the higher class is sent
+			LOG_DBG("Sender: seq %u retransmit held for class %d\n", (unsigned int) slot->sequence, waiting);
+			slot->next_send = now + slot->rto;
+		}
+		else if (!CLOCK_LT(now, slot->next_send)) {
+			// a timeout, unless it was only the airtime limiter that held it
+			if (!slot->deferred)
+				messenger_collector_timeout(&slot->addr);
+
+			// the message was a failure, record that
+			if (slot->attempt + 1 >= MAX_ATTEMPTS) {
+				LOG_DBG("Sender: seq %u timed out after %d tries\n", (unsigned int) slot->sequence, slot->attempt + 1);
+				slot->attempt++;
+				finish_slot(slot, 0);
+				continue;
 			}
+
+			if (!airtime_ok(slot, now, &held, &held_until))
+				goto schedule;
+
+			// try again
+			slot->attempt++;
+			LOG_DBG("Sender: seq %u try again %d\n", (unsigned int) slot->sequence, slot->attempt);
+			transmit_slot(slot);
 		}
 
-		// a timeout while awaiting a response from the server
-		else if (etimer_expired(&msg_timer)) {
-			if (send_started) {
-				// the message was a failure, record that
-				if (++current_attempt >= MAX_ATTEMPTS) {
-					last_ack_ok = 0;
-					send_started = 0;
-
-					LOG_DBG("Sender: seq %d timed out after %d tries\n", current_sequence, current_attempt);
-					process_post (requestor, PROCESS_EVENT_MSG, NULL);
-					etimer_stop(&msg_timer);
-				}
-
-				// try again
-				else {
-					LOG_DBG("Sender: try again %d\n", current_attempt);
-					simple_udp_send(&conn, &current_data, current_length);
-					etimer_set(&msg_timer, RETRY_DELAY);
-				}
-			}
+schedule:
+		if (!pending || CLOCK_LT(slot->next_send, earliest)) {
+			earliest = slot->next_send;
 		}
+		pending = 1;
+	}
+
+	if (pending) {
+		now = clock_time();
+		etimer_set(&msg_timer, CLOCK_LT(now, earliest) ? earliest - now : 1);
+	}
+	else {
+		etimer_stop(&msg_timer);
+	}
+}
 
 
+/**
+ * Process for sending / resending data.
+ */
+PROCESS(udp_sender, "UDP Sender");
+PROCESS_THREAD(udp_sender, ev, data)
+{
+	PROCESS_BEGIN()	;
+	etimer_stop(&msg_timer);
+
+	while (1) {
+		PROCESS_WAIT_EVENT();
+
+		// a new packet was queued, an ACK arrived, or a resend is due
+		if (ev == sender_start_event || ev == sender_fin_event ||
+		    ev == PROCESS_EVENT_POLL || etimer_expired(&msg_timer)) {
+			service_queue();
+		}
 	}
 	PROCESS_END()	;
 }
 
 
 
-void messenger_send (const uip_ipaddr_t *remote_addr, uint16_t sequence, const void *data, int length)
+static int udp_send (const uip_ipaddr_t *remote_addr, uint32_t sequence, const void *data, int length, messenger_prio_t prio)
 {
+	struct send_slot *slot, *prev, *curr;
+
 	LOG_DBG("message_send ");
 	LOG_6ADDR(LOG_LEVEL_DBG, remote_addr);
 	LOG_DBG_(" length %d", length);
-	LOG_DBG_(" send_started: %d\n", send_started);
+	LOG_DBG_(" queued: %d\n", list_length(send_queue));
 
-	if (send_started != 0) {
-		LOG_ERR("Send already in progress...");
-		return;
+	if ((length <= 0) || (length > MAX_MESSAGE_SIZE)) {
+		LOG_ERR("Request exceeds maximum transfer (%d > %d)\n", length, MAX_MESSAGE_SIZE);
+		return 0;
 	}
 
-	last_ack_ok = 0;
-	send_started = 1;
-	current_sequence = sequence;
-	requestor = process_current;
-	current_attempt = 0;
+	slot = messenger_class_admit(prio, list_length(send_queue), MESSENGER_QUEUE_SIZE) ?
+			memb_alloc(&slots_memb) : NULL;
+	if (slot == NULL) {
+		LOG_ERR("Send queue full, seq %u not sent\n", (unsigned int) sequence);
+		return 0;
+	}
+
+	slot->requestor = process_current;
+	slot->to_collector = (remote_addr == NULL);
+	if (slot->to_collector)
+		messenger_get_collector(&slot->addr);
+	else
+		uip_ipaddr_copy(&slot->addr, remote_addr);
+	slot->sequence = sequence;
+	slot->prio = prio;
+	slot->attempt = 0;
+	slot->deferred = 0;
+	slot->refused = 0;
+	slot->state = SLOT_QUEUED;
+	slot->queued_at = clock_time();
+	slot->next_send = slot->queued_at;
+
+	memcpy(slot->data, data, length);
+	slot->length = length;
+
+	// behind everything of the same or a higher class
+	prev = NULL;
+	for (curr = list_head(send_queue); curr != NULL; curr = list_item_next(curr)) {
+		if (curr->prio < prio)
+			break;
+		prev = curr;
+	}
 
-	memcpy(current_data, data, length);
-	current_length = length;
+	if (prev == NULL)
+		list_push(send_queue, slot);
+	else
+		list_insert(send_queue, prev, slot);
 
-	process_post(&messenger_sender, sender_start_event, NULL);
+	messenger_class_queued(prio);
+	process_post(&udp_sender, sender_start_event, NULL);
 
+	return 1;
 }
 
 
-int messenger_recvd_rssi()
+static int udp_recvd_rssi()
 {
 	return last_dag_rssi;
 }
 
+static void udp_get_rtt(const uip_ipaddr_t *addr, uint32_t *srtt_ms, uint32_t *rttvar_ms, uint32_t *rto_ms)
+{
+	struct rtt_entry *e;
+
+	for (e = list_head(rtt_list); e != NULL; e = list_item_next(e)) {
+		if (uip_ipaddr_cmp(&e->addr, addr))
+			break;
+	}
 
+	if (e == NULL) {
+		*srtt_ms = 0;
+		*rttvar_ms = 0;
+		*rto_ms = (RTO_INITIAL * 1000UL) / CLOCK_SECOND;
+		return;
+	}
 
+	*srtt_ms = ((e->srtt >> 3) * 1000UL) / CLOCK_SECOND;
+	*rttvar_ms = ((e->rttvar >> 2) * 1000UL) / CLOCK_SECOND;
+	*rto_ms = (e->rto * 1000UL) / CLOCK_SECOND;
+}
 
-int messenger_last_result_okack( )
+/**
+ * Mark the in-flight message with this sequence as answered, taken or
+ * (refused set) turned away for good.  Returns 1 if a message matched.
+ */
+static int ack_sequence(uint32_t sequence, int refused)
 {
-	return last_ack_ok;
+	struct send_slot *slot;
+
+	for (slot = list_head(send_queue); slot != NULL; slot = list_item_next(slot)) {
+		if ((slot->state == SLOT_SENT) && (slot->sequence == sequence)) {
+			slot->state = SLOT_ACKED;
+			slot->refused = refused;
+			slot->acked_at = clock_time();
+			messenger_collector_ack(&slot->addr);
+			LOG_DBG("Received %s for seq %u\n", refused ? "NAK" : "ACK", (unsigned int) sequence);
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
-void messenger_callback(struct simple_udp_connection *c,
+static void messenger_callback(struct simple_udp_connection *c,
                          const uip_ipaddr_t *src_addr, uint16_t src_port,
                          const uip_ipaddr_t *dest_addr, uint16_t dest_port,
                          const uint8_t *data, uint16_t data_len)
 {
 
-	/* only expect an acknowledgement packet.
+	/* expect an acknowledgement packet, either for a single message
 	 * #define ACK_HEADER (0x90983323)
 			typedef struct __attribute__((packed)) {
         uint32_t header;
@@ -191,32 +533,51 @@ void messenger_callback(struct simple_udp_connection *c,
         uint32_t ack_seq;
         uint32_t ack_value;
 			} ack_t;
+	 * or for a window of messages (see ack_window_t in message.h)
 	 */
-	ack_t *ack = (ack_t *) data;
+	const ack_t *ack = (const ack_t *) data;
+	const ack_window_t *wack = (const ack_window_t *) data;
+	int matched = 0;
+	int i;
 
 	if (data_len != sizeof(ack_t)) goto error;
 
-	if (ack->header != ACK_HEADER) goto error;
+	if (ack->header == ACK_HEADER) {
+		// a refusal still ends the message, resending it cannot help
+		if ((ack->ack_value != ACK_OK) && (ack->ack_value != ACK_NO_REF)) goto error;
 
-	if (ack->ack_value != ACK_OK) goto error;
+		matched = ack_sequence(ack->ack_seq, ack->ack_value == ACK_NO_REF);
+	}
+	else if (wack->header == ACK_WINDOW_HEADER) {
+		for (i = 0; i < 32; i++) {
+			if (wack->ack_bitmap & (1UL << i))
+				matched += ack_sequence(wack->ack_base + i, 0);
+		}
+	}
+	else if (ack->header == CAL_REQUEST_HEADER) {
+		// the collector lost our calibration, the sensor loop sends it on its next pass
+		LOG_INFO("Collector asked for calibration\n");
+		config_set_calibration_change( );
+		return;
+	}
 
-	if (ack->ack_seq != current_sequence) goto error;
+	if (matched == 0) goto error;
 
 
 	NETSTACK_RADIO.get_value(RADIO_PARAM_LAST_RSSI, &last_dag_rssi);
-	last_ack_ok = 1;
 
-	LOG_DBG("Received ACK for seq %d RSSI=%d\n", current_sequence, (int) last_dag_rssi);
+	LOG_DBG("ACK'd %d messages RSSI=%d\n", matched, (int) last_dag_rssi);
 
 	// found a valid ack
-	process_post(&messenger_sender, sender_fin_event, NULL);
+	process_post(&udp_sender, sender_fin_event, NULL);
+	return;
 
 error:
 	// this packet is not for me.
-	LOG_DBG("Received message %d =? %d, header %x =? %x, seq %d =? %d, value %d =? %d\n",
+	LOG_DBG("Received message %d =? %d, header %x =? %x, seq %u, value %d =? %d\n",
 	        (int) data_len, (int) sizeof(ack_t),
 	        (unsigned int) ack->header, (unsigned int) ACK_HEADER,
-	        (int) ack->ack_seq, (int) current_sequence,
+	        (int) ack->ack_seq,
 	        (int) ack->ack_value, ACK_OK);
 }
 
@@ -224,15 +585,14 @@ error:
 
 static int open_connection( )
 {
-	uip_ip6addr_t remote_addr;
 	uint16_t remote_port;
 
-	config_get_receiver (&remote_addr);
 	remote_port = config_get_remote_port();
 
+	// any remote - the ACKs come from whichever collector is in use
 	int rc = simple_udp_register(&conn,		// the connection to register
 	                             0, 			// the local port, 0=ephemeral
-	                             &remote_addr,	// remote address
+	                             NULL,				// remote address
 	                             remote_port,  // remote port number
 	                             messenger_callback  //  callback function
 								);
@@ -244,13 +604,23 @@ static int open_connection( )
 	return rc;
 }
 
-void messenger_sender_init ()
+static void udp_init ()
 {
-	sender_start_event = process_alloc_event ();
-	sender_fin_event = process_alloc_event ();
+	memb_init(&slots_memb);
+	list_init(send_queue);
+	memb_init(&rtt_memb);
+	list_init(rtt_list);
 
-	process_start(&messenger_sender, NULL);
+	process_start(&udp_sender, NULL);
 
 	open_connection();
 
 }
+
+const struct messenger_transport udp_transport = {
+	"udp",
+	udp_init,
+	udp_send,
+	udp_get_rtt,
+	udp_recvd_rssi
+};
@@ -0,0 +1,417 @@
+/*
+ * @file message-sender.c
+ * @brief The messenger's sending front end
+ *
+ * Both transports are built into every image; the one used for a
+ * message is picked from the node's configuration (CONFIG_TRANSPORT)
+ * when it is queued:
+ * * CONFIG_TRANSPORT_UDP - datagrams with messenger-level retransmits
+ * * CONFIG_TRANSPORT_TCP - a (possibly persistent) TCP stream
+ * * CONFIG_TRANSPORT_AUTO - UDP for live readings, TCP for bulk
+ *   traffic such as draining the backlog (messenger_send_bulk()) -
+ *   over one session, so a build without TCP sessions keeps bulk on
+ *   UDP rather than open a connection per message
+ *
+ * Messages already queued on a transport finish there if the
+ * configuration changes.
+ *
+ * Each message carries a class (messenger_prio_t); the backends send
+ * higher classes first and keep MESSENGER_CONF_ALARM_RESERVE queue
+ * slots free for alarms.  Per-class queue statistics are kept here.
+ *
+ * All transmissions draw from one token bucket (CONFIG_AIRTIME_RATE
+ * bytes per second, up to CONFIG_AIRTIME_BURST bytes saved up).  A
+ * backend whose message does not fit in the bucket defers it until it
+ * does, rather than dropping it; a rate of 0 turns the limiter off.
+ *
+ * Messages sent to a NULL address go to the collector in use, picked
+ * from the configured list (CONFIG_ROUTER, CONFIG_COLLECTOR2/3).  After
+ * MESSENGER_CONF_FAILOVER_TIMEOUTS timeouts in a row without an ACK
+ * the sender moves on to the next configured collector, and messages
+ * still queued follow it.  In CONFIG_COLLECTOR_HASHED mode a node
+ * starts from a collector picked by its link address, so a fleet
+ * spreads across the list.
+ */
+
+#include "../../modules/messenger/message-service.h"
+#include "../../modules/messenger/message-transport.h"
+#include "../../modules/config/config.h"
+
+#include <contiki.h>
+#include <contiki-net.h>
+#include <string.h>
+
+// contiki-ism for logging the data -
+#include "sys/log.h"
+#define LOG_MODULE "SENDER"
+#define LOG_LEVEL LOG_LEVEL_INFO
+
+/**
+ * @brief largest window that can be set, the UDP queue size
+ */
+#ifdef MESSENGER_CONF_QUEUE_SIZE
+#define MESSENGER_QUEUE_SIZE MESSENGER_CONF_QUEUE_SIZE
+#else
+#define MESSENGER_QUEUE_SIZE (8)
+#endif
+
+/**
+ * @brief default number of messages allowed in flight (unACK'd) at once
+ */
+#ifdef MESSENGER_CONF_WINDOW
+#define MESSENGER_WINDOW MESSENGER_CONF_WINDOW
+#else
+#define MESSENGER_WINDOW (4)
+#endif
+
+/**
+ * @brief queue slots only alarms may use
+ */
+#ifdef MESSENGER_CONF_ALARM_RESERVE
+#define ALARM_RESERVE MESSENGER_CONF_ALARM_RESERVE
+#else
+#define ALARM_RESERVE (1)
+#endif
+
+/**
+ * @brief per class queue accounting, wait times in clock ticks
+ */
+struct class_stats {
+	uint16_t depth;
+	uint16_t max_depth;
+	uint32_t sent;
+	uint32_t wait_total;
+	clock_time_t wait_max;
+};
+
+static struct class_stats class_stats[MESSENGER_PRIO_COUNT];
+
+/**
+ * @brief the airtime token bucket, in bytes scaled by CLOCK_SECOND
+ */
+static uint32_t bucket = 0;
+static clock_time_t bucket_filled = 0;
+
+// accounting for deferred transmissions
+static uint8_t throttled = 0;
+static clock_time_t throttle_start;
+static uint32_t throttled_ticks = 0;
+static uint32_t throttled_bytes = 0;
+
+/**
+ * @brief timeouts in a row before giving up on a collector
+ */
+#ifdef MESSENGER_CONF_FAILOVER_TIMEOUTS
+#define FAILOVER_TIMEOUTS MESSENGER_CONF_FAILOVER_TIMEOUTS
+#else
+#define FAILOVER_TIMEOUTS (4)
+#endif
+
+// the collector in use (index into the config list), -1 = not picked yet
+static int collector = -1;
+static uint8_t collector_timeouts = 0;
+static uint32_t collector_failovers = 0;
+
+// events used within the messenger module
+process_event_t sender_start_event;
+process_event_t sender_fin_event;
+
+// how many messages may be in flight, 1 = stop-and-wait
+static int window = MESSENGER_WINDOW;
+
+// how did the last transaction end?
+static int last_ack_ok = 0;
+
+// the transport that carried the last message, for RSSI / RTT queries
+static const struct messenger_transport *last_transport = &udp_transport;
+
+
+static const struct messenger_transport *select_transport(int bulk)
+{
+	switch (config_get_transport()) {
+	case CONFIG_TRANSPORT_TCP:
+		return &tcp_transport;
+
+	case CONFIG_TRANSPORT_AUTO:
+		return (bulk && MESSENGER_TCP_SESSION) ? &tcp_transport : &udp_transport;
+
+	default:
+		return &udp_transport;
+	}
+}
+
+static int send_via(const struct messenger_transport *t, const uip_ipaddr_t *remote_addr,
+		uint32_t sequence, const void *data, int length, messenger_prio_t prio)
+{
+	LOG_DBG("Sending seq %u class %d via %s\n", (unsigned int) sequence, prio, t->name);
+
+	if (prio >= MESSENGER_PRIO_COUNT)
+		prio = MESSENGER_PRIO_ALARM;
+
+	last_transport = t;
+	return t->send(remote_addr, sequence, data, length, prio);
+}
+
+int messenger_send (const uip_ipaddr_t *remote_addr, uint32_t sequence, const void *data, int length, messenger_prio_t prio)
+{
+	return send_via(select_transport(0), remote_addr, sequence, data, length, prio);
+}
+
+int messenger_send_bulk (const uip_ipaddr_t *remote_addr, uint32_t sequence, const void *data, int length)
+{
+	return send_via(select_transport(1), remote_addr, sequence, data, length, MESSENGER_PRIO_BULK);
+}
+
+int messenger_class_admit(messenger_prio_t prio, int used, int size)
+{
+	if (prio == MESSENGER_PRIO_ALARM)
+		return used < size;
+
+	return used < size - ALARM_RESERVE;
+}
+
+void messenger_class_queued(messenger_prio_t prio)
+{
+	struct class_stats *c = &class_stats[prio];
+
+	if (++c->depth > c->max_depth)
+		c->max_depth = c->depth;
+}
+
+void messenger_class_sent(messenger_prio_t prio, clock_time_t waited)
+{
+	struct class_stats *c = &class_stats[prio];
+
+	c->sent++;
+	c->wait_total += waited;
+	if (waited > c->wait_max)
+		c->wait_max = waited;
+}
+
+void messenger_class_done(messenger_prio_t prio)
+{
+	if (class_stats[prio].depth > 0)
+		class_stats[prio].depth--;
+}
+
+void messenger_get_class_stats(messenger_prio_t prio, messenger_class_stats_t *stats)
+{
+	const struct class_stats *c;
+
+	if (prio >= MESSENGER_PRIO_COUNT) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	c = &class_stats[prio];
+	stats->depth = c->depth;
+	stats->max_depth = c->max_depth;
+	stats->sent = c->sent;
+	stats->wait_avg_ms = (c->sent == 0) ? 0 : ((c->wait_total / c->sent) * 1000UL) / CLOCK_SECOND;
+	stats->wait_max_ms = (c->wait_max * 1000UL) / CLOCK_SECOND;
+}
+
+/**
+ * Bring the bucket up to date.  Returns its capacity (0 if unlimited).
+ */
+static uint32_t bucket_refill(clock_time_t now)
+{
+	uint32_t rate = config_get_airtime_rate();
+	uint32_t cap = config_get_airtime_burst() * CLOCK_SECOND;
+	clock_time_t elapsed = now - bucket_filled;
+
+	bucket_filled = now;
+
+	if (rate == 0)
+		return 0;
+
+	if ((elapsed >= cap / rate) || (bucket + elapsed * rate >= cap))
+		bucket = cap;
+	else
+		bucket += elapsed * rate;
+
+	return cap;
+}
+
+clock_time_t messenger_airtime_wait(int bytes, uint8_t *deferred)
+{
+	clock_time_t now = clock_time();
+	uint32_t cap = bucket_refill(now);
+	uint32_t need = bytes * CLOCK_SECOND;
+
+	// a message larger than the burst goes out once the bucket is full
+	if (need > cap)
+		need = cap;
+
+	if (bucket < need) {
+		if (!throttled) {
+			throttled = 1;
+			throttle_start = now;
+		}
+		*deferred = 1;
+		return (need - bucket + config_get_airtime_rate() - 1) / config_get_airtime_rate();
+	}
+
+	bucket -= need;
+
+	if (throttled) {
+		throttled = 0;
+		throttled_ticks += now - throttle_start;
+	}
+	if (*deferred) {
+		*deferred = 0;
+		throttled_bytes += bytes;
+	}
+
+	return 0;
+}
+
+void messenger_airtime_charge(int bytes)
+{
+	uint32_t need = bytes * CLOCK_SECOND;
+
+	if (bucket_refill(clock_time()) == 0)
+		return;
+
+	bucket = (bucket > need) ? bucket - need : 0;
+}
+
+void messenger_get_airtime(uint32_t *throttled_ms, uint32_t *bytes)
+{
+	uint32_t ticks = throttled_ticks;
+
+	if (throttled)
+		ticks += clock_time() - throttle_start;
+
+	*throttled_ms = (ticks * 1000ULL) / CLOCK_SECOND;
+	*bytes = throttled_bytes;
+}
+
+/**
+ * The collector to start from - the first configured one, or in hashed
+ * mode one picked from the configured ones by this node's link address.
+ */
+static int collector_home( )
+{
+	uip_ip6addr_t addr;
+	int configured[CONFIG_COLLECTORS];
+	int count = 0;
+	uint32_t hash = 2166136261UL;
+	int i;
+
+	for (i = 0; i < CONFIG_COLLECTORS; i++) {
+		if (config_get_collector(i, &addr))
+			configured[count++] = i;
+	}
+
+	if (count == 0)
+		return 0;
+
+	if (config_get_collector_mode() != CONFIG_COLLECTOR_HASHED)
+		return configured[0];
+
+	// FNV-1a over the link address
+	for (i = 0; i < LINKADDR_SIZE; i++) {
+		hash = (hash ^ linkaddr_node_addr.u8[i]) * 16777619UL;
+	}
+
+	return configured[hash % count];
+}
+
+void messenger_get_collector(uip_ipaddr_t *addr)
+{
+	// first use, or the entry in use was cleared
+	if ((collector < 0) || !config_get_collector(collector, addr)) {
+		collector = collector_home();
+		collector_timeouts = 0;
+		config_get_collector(collector, addr);
+	}
+}
+
+void messenger_collector_ack(const uip_ipaddr_t *addr)
+{
+	uip_ip6addr_t current;
+
+	messenger_get_collector(&current);
+	if (uip_ipaddr_cmp(addr, &current))
+		collector_timeouts = 0;
+}
+
+void messenger_collector_timeout(const uip_ipaddr_t *addr)
+{
+	uip_ip6addr_t current, next;
+	int i, index;
+
+	messenger_get_collector(&current);
+	if (!uip_ipaddr_cmp(addr, &current))
+		return;
+
+	if (++collector_timeouts < FAILOVER_TIMEOUTS)
+		return;
+
+	collector_timeouts = 0;
+
+	for (i = 1; i < CONFIG_COLLECTORS; i++) {
+		index = (collector + i) % CONFIG_COLLECTORS;
+		if (config_get_collector(index, &next)) {
+			LOG_INFO("Collector %d not answering, failing over to %d: ", collector, index);
+			LOG_6ADDR(LOG_LEVEL_INFO, &next);
+			LOG_INFO_("\n");
+
+			collector = index;
+			collector_failovers++;
+			return;
+		}
+	}
+}
+
+void messenger_get_failover(uint32_t *index, uint32_t *failovers)
+{
+	uip_ip6addr_t current;
+
+	messenger_get_collector(&current);
+	*index = collector;
+	*failovers = collector_failovers;
+}
+
+void messenger_report(struct process *requestor, const messenger_result_t *result)
+{
+	last_ack_ok = result->ok;
+	process_post_synch (requestor, PROCESS_EVENT_MSG, (void *) result);
+}
+
+int messenger_last_result_okack( )
+{
+	return last_ack_ok;
+}
+
+int messenger_recvd_rssi( )
+{
+	return last_transport->rssi();
+}
+
+void messenger_set_window(int size)
+{
+	window = (size < 1) ? 1 :
+			(size > MESSENGER_QUEUE_SIZE) ? MESSENGER_QUEUE_SIZE :
+					size;
+}
+
+int messenger_get_window( )
+{
+	return window;
+}
+
+void messenger_get_rtt(const uip_ipaddr_t *addr, uint32_t *srtt_ms, uint32_t *rttvar_ms, uint32_t *rto_ms)
+{
+	select_transport(0)->get_rtt(addr, srtt_ms, rttvar_ms, rto_ms);
+}
+
+void messenger_sender_init ()
+{
+	sender_start_event = process_alloc_event ();
+	sender_fin_event = process_alloc_event ();
+
+	udp_transport.init();
+	tcp_transport.init();
+}
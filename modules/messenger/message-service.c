@@ -10,13 +10,16 @@
  *
  * At initialization (through a call to message_init()), the
  * service creates a TCP socket and listens for incoming
- * connections on port (COMMAND_SERVER_PORT in message-service.h).
+ * connections on port (COMMAND_SERVER_PORT in message-service.h).  The same
+ * handlers are reachable without a handshake through UDP datagrams on the
+ * same port number, wrapped in a command_request_t (see message.h).
  *
  * Applications register call-backs through calls to messenger_add_handler()
- * and messenger_remove_handler().  When a message is received, the service
- * will iterate through the list of registered handlers and compare the
- * matching criteria.  The first handler to match the criteria will be
- * invoked.  At this time, only the first matching handler will be called.
+ * and messenger_remove_handler().  Handlers are kept in a small hash table
+ * keyed on the message pre-amble, so finding the candidates for a message
+ * does not depend on how many services are registered.  Several handlers
+ * may register the same pre-amble; they are tried in registration order
+ * until one of them produces a response.
  *
  * The matching criteria are:
  * * Pre-amble of the message (the first 32-bits must match)
@@ -30,9 +33,28 @@
  * matches this, the function echo_handler() will be called with arguments
  * containing a pointer to the datagram and the number of received bytes.
  *
+ * A handler that cannot answer straight away (e.g. it has to wait for a
+ * sensor) calls messenger_defer() and returns MESSENGER_PENDING.  The
+ * request is parked - its TCP connection left open, or its UDP reply
+ * slot reserved - and the receiver goes on accepting other requests.
+ * The reply goes out when the handler calls messenger_complete(); a
+ * request left unanswered for MESSENGER_CONF_PENDING_TIMEOUT is answered
+ * with a command_error_t instead, as is one whose handler returned
+ * MESSENGER_PENDING without deferring it.  The water node's on-demand
+ * sample (CMD_SAMPLE_HEADER) is answered this way.
+ *
+ * Results bigger than one reply are served as streams: a producer
+ * registered with messenger_add_stream() regenerates the part of its
+ * output at a given offset, and the service frames it as stream_chunk_t
+ * (offset / total / length).  UDP clients pull one chunk per request;
+ * on TCP the chunks follow each other on the connection, one per
+ * data-sent event, so only one chunk is ever held in RAM.
+ *
  */
 
 #include "../../modules/messenger/message-service.h"
+#include "../../modules/messenger/message-transport.h"
+#include "../../modules/command/message.h"
 
 #include <contiki.h>
 #include <stdio.h>
@@ -64,7 +86,7 @@
  * @brief Listener services
  */
 struct listener {
-	struct listener *next;		// needed for list
+	struct listener *next;		// next handler in the same bucket
 	uint32_t header;			// header for message
 	uint32_t min_len;			// minimum acceptable length
 	uint32_t max_len;			// maximum acceptable length
@@ -72,9 +94,18 @@ struct listener {
 };
 
 /**
- * @brief maximum number of observers in the list
+ * @brief maximum number of observers in the table
  */
-#define MAX_HANDLERS 8
+#ifdef MESSENGER_CONF_MAX_HANDLERS
+#define MAX_HANDLERS MESSENGER_CONF_MAX_HANDLERS
+#else
+#define MAX_HANDLERS 16
+#endif
+
+/**
+ * @brief number of hash buckets, must be a power of two
+ */
+#define HANDLER_BUCKETS 16
 
 /**
  * Memory pool for handlers
@@ -82,94 +113,492 @@ struct listener {
 MEMB(handlers_memb, struct listener, MAX_HANDLERS);
 
 /**
- * @brief the list of handlers
+ * @brief the handler table, each bucket chained in registration order
  */
-LIST(handlers_list);
+static struct listener *handlers[HANDLER_BUCKETS];
+
+static unsigned int header_hash(uint32_t header)
+{
+	header ^= header >> 16;
+	header *= 0x45d9f3bU;
+	header ^= header >> 16;
+	return header & (HANDLER_BUCKETS - 1);
+}
 
 
 void messenger_add_handler(uint32_t header, uint32_t min_len, uint32_t max_len, handler_t handler)
 {
-	if (list_length(handlers_list) >= MAX_HANDLERS)
+	struct listener **tail;
+	struct listener *n = memb_alloc(&handlers_memb);
+
+	if (n == NULL) {
+		LOG_ERR("Error - handler table full, %x not registered\n", (unsigned int) header);
 		return;
+	}
 
-	struct listener *n = memb_alloc(&handlers_memb);
+	n->next = NULL;
 	n->header = header;
 	n->min_len = min_len;
 	n->max_len = max_len;
 	n->handler = handler;
 
-	list_add(handlers_list, n);
+	for (tail = &handlers[header_hash(header)]; *tail != NULL; tail = &(*tail)->next)
+		;
+	*tail = n;
 }
 
 
 void messenger_remove_handler(handler_t handler)
 {
+	struct listener **curr, *n;
+	int i;
+
+	for (i = 0; i < HANDLER_BUCKETS; i++) {
+		curr = &handlers[i];
+		while (*curr != NULL) {
+			if ((*curr)->handler == handler) {
+				n = *curr;
+				*curr = n->next;
+				memb_free(&handlers_memb, n);
+			}
+			else {
+				curr = &(*curr)->next;
+			}
+		}
+	}
+}
+
+
+// the header of the request being dispatched, and what messenger_defer() made of it
+static uint32_t dispatch_header;
+static int dispatch_deferred = -1;
+
+static void pending_cancel(int request);
+
+/**
+ * Write the command_error_t that answers a request in its stead.
+ */
+static int command_error(uint32_t request, uint8_t error, uint8_t *outputdata, int maxoutputlen)
+{
+	command_error_t *reply = (command_error_t *) outputdata;
+
+	if (maxoutputlen < sizeof(command_error_t))
+		return 0;
+
+	reply->header = CMD_ERROR_HEADER;
+	reply->request = request;
+	reply->error = error;
+	return sizeof(command_error_t);
+}
+
+/**
+ * Run the handlers registered for this message's pre-amble until one
+ * produces a response.  Returns the response length (0 if none), with
+ * the response in outputdata, or MESSENGER_PENDING if a handler will
+ * answer later through messenger_complete().
+ */
+static int message_dispatch(const uint8_t *inputptr, int inputdatalen, uint8_t *outputdata, int maxoutputlen)
+{
+	uint32_t header;
 	struct listener *curr;
+	int matched = 0;
 
-	if (list_length(handlers_list) >= MAX_HANDLERS)
-		return;
+	if ((inputptr == NULL) || (inputdatalen < sizeof(header)))
+		return 0;
+
+	memcpy(&header, inputptr, sizeof(header));
 
-	for (curr = list_head(handlers_list); curr != NULL; curr = list_item_next(curr))
+	for (curr = handlers[header_hash(header)]; curr != NULL; curr = curr->next)
 	{
-		if (curr->handler == handler)
-			break;
+		if (header != curr->header) continue;
+		if (inputdatalen > curr->max_len) continue;
+		if (inputdatalen < curr->min_len) continue;
+
+		matched++;
+		LOG_DBG("Matched handler %p (%u <= %u) (%u >= %u) (%x == %x)\n",
+                (void *) curr->handler,
+                (unsigned int) inputdatalen, (unsigned int)  curr->max_len,
+				(unsigned int)  inputdatalen, (unsigned int) curr->min_len,
+                (unsigned int) header, (unsigned int) curr->header);
+
+		int outputlen = maxoutputlen;
+		dispatch_header = header;
+		dispatch_deferred = -1;
+		int rc = curr->handler(inputptr, inputdatalen, outputdata, &outputlen);
+
+		LOG_DBG("Handler reported RC=%d and %d bytes\n", rc, outputlen);
+
+		// the handler took the request with messenger_defer(), it answers later
+		if ((rc == MESSENGER_PENDING) && (dispatch_deferred >= 0))
+			return MESSENGER_PENDING;
+
+		// answered now after all, nothing is left for messenger_complete()
+		if (dispatch_deferred >= 0)
+			pending_cancel(dispatch_deferred);
+
+		// nobody would ever answer it
+		if (rc == MESSENGER_PENDING) {
+			LOG_ERR("Error - handler %p deferred %x without messenger_defer()\n",
+					(void *) curr->handler, (unsigned int) header);
+			return command_error(header, CMD_ERROR_HANDLER, outputdata, maxoutputlen);
+		}
+
+		if ((rc > 0) && (outputlen > 0))
+			return outputlen;
 	}
 
-	if (curr == NULL) return;
+	if (matched == 0) {
+		LOG_DBG("No handlers for the message %x %u\n",(unsigned int) header,(unsigned int) inputdatalen);
+	}
 
-	list_remove(handlers_list, curr);
-	memb_free(&handlers_memb, curr);
+	return 0;
 }
 
 
-static struct tcp_socket rcv_socket;
+/**
+ * @brief number of TCP requests that can be open at once
+ */
+#ifdef MESSENGER_CONF_RX_SOCKETS
+#define RX_SOCKETS MESSENGER_CONF_RX_SOCKETS
+#else
+#define RX_SOCKETS 2
+#endif
 
-#define INPUTBUFSIZE 128
-static uint8_t inputbuf[INPUTBUFSIZE];
+/**
+ * @brief number of requests that can be awaiting messenger_complete()
+ */
+#ifdef MESSENGER_CONF_PENDING
+#define MAX_PENDING MESSENGER_CONF_PENDING
+#else
+#define MAX_PENDING 2
+#endif
 
+/**
+ * @brief how long a deferred request may stay unanswered
+ */
+#ifdef MESSENGER_CONF_PENDING_TIMEOUT
+#define PENDING_TIMEOUT MESSENGER_CONF_PENDING_TIMEOUT
+#else
+#define PENDING_TIMEOUT (CLOCK_SECOND * 30)
+#endif
+
+/**
+ * @brief number of streams that can be registered
+ */
+#ifdef MESSENGER_CONF_MAX_STREAMS
+#define MAX_STREAMS MESSENGER_CONF_MAX_STREAMS
+#else
+#define MAX_STREAMS 4
+#endif
+
+#define INPUTBUFSIZE 128
 #define OUTPUTBUFSIZE 128
+
+/**
+ * @brief one TCP command connection and its socket buffers
+ */
+struct rx_socket {
+	struct tcp_socket socket;		// must stay first
+	uint8_t inputbuf[INPUTBUFSIZE];
+	uint8_t outputbuf[OUTPUTBUFSIZE];
+
+	// a stream still being sent on this connection
+	stream_t producer;
+	uint16_t stream;
+	int32_t chunks_left;		// -1 for the whole stream
+	uint32_t offset;
+};
+
+static struct rx_socket rx_sockets[RX_SOCKETS];
+
+// handlers write their response here
 static uint8_t outputbuf[OUTPUTBUFSIZE];
 
+/**
+ * @brief number of UDP replies remembered for duplicate requests
+ *
+ * One cache shared by every remote, not one per remote: an entry is
+ * matched on address, port and request id, and the oldest entry is
+ * recycled whoever it belongs to.  A retry is only answered from the
+ * cache while fewer than REPLY_CACHE other requests came in since.
+ */
+#ifdef MESSENGER_CONF_REPLY_CACHE
+#define REPLY_CACHE MESSENGER_CONF_REPLY_CACHE
+#else
+#define REPLY_CACHE 3
+#endif
+
+#define REPLYBUFSIZE (sizeof(command_reply_t) + OUTPUTBUFSIZE)
 
+/**
+ * @brief a reply already sent (or still to be sent) on the UDP channel
+ */
+struct reply_entry {
+	uip_ipaddr_t addr;
+	uint16_t port;
+	uint16_t request_id;
+	uint16_t length;
+	uint8_t valid;
+	uint8_t pending;		// waiting for messenger_complete()
+	uint8_t data[REPLYBUFSIZE];
+};
 
-static int message_recv_bytes(struct tcp_socket *s, void *ptr,
-                             const uint8_t *inputptr, int inputdatalen)
+static struct reply_entry replies[REPLY_CACHE];
+static int next_reply = 0;
+
+static struct simple_udp_connection cmd_conn;
+
+/**
+ * @brief a request whose handler will answer later
+ */
+struct pending_request {
+	struct tcp_socket *socket;		// TCP request, or
+	struct reply_entry *entry;		// UDP request
+	clock_time_t deadline;
+	uint32_t header;				// for the error if it times out
+	uint16_t id;
+};
+
+static struct pending_request pending[MAX_PENDING];
+static uint16_t next_pending_id = 1;
+
+// where the request being dispatched came from, for messenger_defer()
+static struct pending_request origin;
+
+PROCESS(messenger_receiver, "Messenger Receiver");
+
+
+int messenger_defer( )
 {
-    LOG_DBG("Rcvd %d bytes\n", inputdatalen);
+	int i;
+
+	if ((origin.socket == NULL) && (origin.entry == NULL))
+		return -1;
+
+	for (i = 0; i < MAX_PENDING; i++) {
+		if ((pending[i].socket == NULL) && (pending[i].entry == NULL)) {
+			pending[i] = origin;
+			pending[i].deadline = clock_time() + PENDING_TIMEOUT;
+			pending[i].header = dispatch_header;
+			pending[i].id = next_pending_id++ * MAX_PENDING + i;
+			if (next_pending_id > (0x7fff / MAX_PENDING))
+				next_pending_id = 1;
+			dispatch_deferred = pending[i].id;
+
+			// have the receiver watch the deadline
+			process_poll(&messenger_receiver);
+			return pending[i].id;
+		}
+	}
 
-    uint32_t *header = (uint32_t *) inputptr;
-    struct listener *curr;
-    for (curr = list_head(handlers_list); curr != NULL; curr = list_item_next(curr))
-    {
-        if (inputdatalen > curr->max_len) continue;
-        if (inputdatalen < curr->min_len) continue;
+	LOG_ERR("Error - no room to defer a request\n");
+	return -1;
+}
 
-        if (inputptr == NULL) continue;
-        if (*header != curr->header) continue;
+/**
+ * Look up a deferred request by the id messenger_defer() gave out.
+ */
+static struct pending_request *pending_find(int request)
+{
+	struct pending_request *p;
 
-        LOG_DBG("Matched handler %p (%u <= %u) (%u >= %u) (%x == %x)\n",
-                (void *) curr->handler,
-                (unsigned int) inputdatalen, (unsigned int)  curr->max_len,
-				(unsigned int)  inputdatalen, (unsigned int) curr->min_len,
-                (unsigned int) *header, (unsigned int) curr->header);
+	if (request < 0)
+		return NULL;
 
-        int outputlen = sizeof(outputbuf);
-        int rc = curr->handler(inputptr, inputdatalen, (uint8_t *) &outputbuf, &outputlen);
+	p = &pending[request % MAX_PENDING];
+	if (((p->socket == NULL) && (p->entry == NULL)) || (p->id != request))
+		return NULL;
 
-        LOG_DBG("Handler reported RC=%d and %d bytes\n", rc, outputlen);
+	return p;
+}
 
-        if ((rc >0) && (outputlen > 0)) {
-            LOG_DBG("Sending response to remote\n");
-            tcp_socket_send(s, (uint8_t *) &outputbuf, outputlen);
-            break;
-        }
+static void pending_release(struct pending_request *p)
+{
+	if (p->entry != NULL) {
+		p->entry->pending = 0;
+	}
+	p->socket = NULL;
+	p->entry = NULL;
+}
+
+/**
+ * The handler that deferred a request answered it straight away after
+ * all - forget the deferral, the caller sends the answer.
+ */
+static void pending_cancel(int request)
+{
+	struct pending_request *p = pending_find(request);
+
+	if (p != NULL)
+		pending_release(p);
+}
+
+int messenger_complete(int request, const void *data, int length)
+{
+	struct pending_request *p = pending_find(request);
+	command_reply_t *reply;
+
+	if (p == NULL) {
+		LOG_DBG("Request %d already gone\n", request);
+		return 0;
+	}
+
+	if (length > OUTPUTBUFSIZE)
+		length = OUTPUTBUFSIZE;
+
+	if (p->socket != NULL) {
+		if (length > 0) {
+			messenger_airtime_charge(length);
+			tcp_socket_send(p->socket, data, length);
+		}
+		tcp_socket_close(p->socket);
+	}
+	else {
+		reply = (command_reply_t *) p->entry->data;
+		memcpy(reply->data, data, length);
+		p->entry->length = sizeof(command_reply_t) + length;
+
+		messenger_airtime_charge(p->entry->length);
+		simple_udp_sendto_port(&cmd_conn, p->entry->data, p->entry->length,
+				&p->entry->addr, p->entry->port);
+	}
+
+	pending_release(p);
+	return 1;
+}
+
+
+struct stream_entry {
+	uint16_t stream;
+	stream_t producer;
+};
+
+static struct stream_entry streams[MAX_STREAMS];
+
+int messenger_add_stream(uint16_t stream, stream_t producer)
+{
+	int i;
+
+	for (i = 0; i < MAX_STREAMS; i++) {
+		if ((streams[i].producer == NULL) || (streams[i].stream == stream)) {
+			streams[i].stream = stream;
+			streams[i].producer = producer;
+			return 1;
+		}
+	}
+
+	LOG_ERR("Error - no room for stream %u\n", stream);
+	return 0;
+}
+
+/**
+ * Build the chunk of a stream starting at offset.  Returns the chunk's
+ * size, and sets *more if the stream continues past it.
+ */
+static int stream_chunk(stream_t producer, uint16_t stream, uint32_t offset,
+		uint8_t *outputdata, int maxoutputlen, uint8_t *more)
+{
+	stream_chunk_t *chunk = (stream_chunk_t *) outputdata;
+	uint32_t total = 0;
+	int len = -1;
+
+	if (producer != NULL)
+		len = producer(offset, chunk->data, maxoutputlen - sizeof(stream_chunk_t), &total);
+
+	chunk->header = STREAM_RET_HEADER;
+	chunk->stream = stream;
+	chunk->valid = (len >= 0);
+	chunk->offset = offset;
+	chunk->total = total;
+	chunk->length = (len > 0) ? len : 0;
+
+	*more = (len > 0) && (offset + len < total);
+
+	return sizeof(stream_chunk_t) + chunk->length;
+}
+
+/**
+ * STREAM_REQ_HEADER - answer with the first chunk asked for.  A TCP
+ * connection is then left to stream_next() for the rest.
+ */
+static int stream_handler(const uint8_t *inputdata, int inputlength, uint8_t *outputdata, int *maxoutputlen)
+{
+	const stream_request_t *req = (const stream_request_t *) inputdata;
+	struct rx_socket *rx = (struct rx_socket *) origin.socket;
+	stream_t producer = NULL;
+	uint8_t more;
+	int i;
+
+	for (i = 0; i < MAX_STREAMS; i++) {
+		if ((streams[i].producer != NULL) && (streams[i].stream == req->stream))
+			producer = streams[i].producer;
+	}
+
+	if (producer == NULL)
+		LOG_WARN("Unknown stream %u\n", req->stream);
+
+	*maxoutputlen = stream_chunk(producer, req->stream, req->offset, outputdata, *maxoutputlen, &more);
+
+	if ((rx != NULL) && more && (req->chunks != 1)) {
+		rx->producer = producer;
+		rx->stream = req->stream;
+		rx->chunks_left = req->chunks ? req->chunks - 1 : -1;
+		rx->offset = req->offset + ((stream_chunk_t *) outputdata)->length;
+	}
+
+	return 1;
+}
+
+/**
+ * The last chunk on a TCP connection went out - send the next, or
+ * close once the stream (or the requested part of it) is done.
+ */
+static void stream_next(struct rx_socket *rx)
+{
+	uint8_t more;
+	int outputlen;
+
+	outputlen = stream_chunk(rx->producer, rx->stream, rx->offset,
+			outputbuf, sizeof(outputbuf), &more);
+	rx->offset += ((stream_chunk_t *) outputbuf)->length;
+	if (rx->chunks_left > 0)
+		rx->chunks_left--;
+
+	messenger_airtime_charge(outputlen);
+	tcp_socket_send(&rx->socket, outputbuf, outputlen);
+
+	if (!more || (rx->chunks_left == 0)) {
+		rx->producer = NULL;
+		tcp_socket_close(&rx->socket);
+	}
+}
+
+
+static int message_recv_bytes(struct tcp_socket *s, void *ptr,
+                             const uint8_t *inputptr, int inputdatalen)
+{
+    LOG_DBG("Rcvd %d bytes\n", inputdatalen);
+
+    origin.socket = s;
+    origin.entry = NULL;
+    int outputlen = message_dispatch(inputptr, inputdatalen, (uint8_t *) &outputbuf, sizeof(outputbuf));
+    origin.socket = NULL;
+
+    // the socket stays open until the handler completes the request
+    if (outputlen == MESSENGER_PENDING) {
+        LOG_DBG("Response deferred\n");
+        return 0;
     }
 
-    if (curr == NULL) {
-        LOG_DBG("No handlers for the message %x %u\n",(unsigned int) *header,(unsigned int) inputdatalen);
+    if (outputlen > 0) {
+        LOG_DBG("Sending response to remote\n");
+        messenger_airtime_charge(outputlen);
+        tcp_socket_send(s, (uint8_t *) &outputbuf, outputlen);
     }
 
-    tcp_socket_close(s);
+    // a stream carries on from the data-sent event
+    if (((struct rx_socket *) s)->producer == NULL)
+        tcp_socket_close(s);
 
     // consume all bytes
     return 0;
@@ -177,6 +606,8 @@ static int message_recv_bytes(struct tcp_socket *s, void *ptr,
 
 static void message_recv_event(struct tcp_socket *s, void *ptr, tcp_socket_event_t ev)
 {
+    int i;
+
     switch(ev) {
     case TCP_SOCKET_CONNECTED: LOG_DBG("Socket connected event\n"); break;
     case TCP_SOCKET_CLOSED: LOG_DBG("Socket closed event\n"); break;
@@ -184,23 +615,153 @@ static void message_recv_event(struct tcp_socket *s, void *ptr, tcp_socket_event
     case TCP_SOCKET_ABORTED: LOG_DBG("Socket aborted\n"); break;
     case TCP_SOCKET_DATA_SENT: LOG_DBG("Data sent\n"); break;
     }
+
+    if ((ev == TCP_SOCKET_DATA_SENT) && (((struct rx_socket *) s)->producer != NULL))
+        stream_next((struct rx_socket *) s);
+
+    // the remote went away, nobody is left to answer
+    if ((ev == TCP_SOCKET_CLOSED) || (ev == TCP_SOCKET_TIMEDOUT) || (ev == TCP_SOCKET_ABORTED)) {
+        ((struct rx_socket *) s)->producer = NULL;
+        for (i = 0; i < MAX_PENDING; i++) {
+            if (pending[i].socket == s)
+                pending_release(&pending[i]);
+        }
+    }
 }
 
 
-PROCESS(messenger_receiver, "Messenger Receiver");
+static void command_udp_recv(struct simple_udp_connection *c,
+		const uip_ipaddr_t *sender_addr, uint16_t sender_port,
+		const uip_ipaddr_t *receiver_addr, uint16_t receiver_port,
+		const uint8_t *data, uint16_t datalen)
+{
+	const command_request_t *req = (const command_request_t *) data;
+	command_reply_t *reply;
+	struct reply_entry *entry;
+	int i, outputlen;
+
+	if ((datalen < sizeof(command_request_t)) || (req->header != UDP_COMMAND_HEADER))
+		return;
+
+	// a retry of a request we've already run - answer it the same way
+	for (i = 0; i < REPLY_CACHE; i++) {
+		entry = &replies[i];
+		if (entry->valid && (entry->request_id == req->request_id) &&
+			(entry->port == sender_port) && uip_ipaddr_cmp(&entry->addr, sender_addr)) {
+			if (entry->pending) {
+				LOG_DBG("Duplicate request %u, still pending\n", req->request_id);
+				return;
+			}
+			LOG_DBG("Duplicate request %u, resending reply\n", req->request_id);
+			messenger_airtime_charge(entry->length);
+			simple_udp_sendto_port(c, entry->data, entry->length, sender_addr, sender_port);
+			return;
+		}
+	}
+
+	// recycle the oldest entry that isn't waiting on a deferred reply
+	for (i = 0; i < REPLY_CACHE; i++) {
+		entry = &replies[next_reply];
+		next_reply = (next_reply + 1) % REPLY_CACHE;
+		if (!entry->pending)
+			break;
+	}
+	if (entry->pending) {
+		LOG_ERR("Error - all replies pending, request %u dropped\n", req->request_id);
+		return;
+	}
+
+	reply = (command_reply_t *) entry->data;
+
+	// an empty reply still tells the remote the request was handled
+	reply->header = UDP_REPLY_HEADER;
+	reply->request_id = req->request_id;
+
+	uip_ipaddr_copy(&entry->addr, sender_addr);
+	entry->port = sender_port;
+	entry->request_id = req->request_id;
+	entry->valid = 1;
+	entry->pending = 1;
+
+	origin.socket = NULL;
+	origin.entry = entry;
+	outputlen = message_dispatch(req->data, datalen - sizeof(command_request_t),
+			reply->data, OUTPUTBUFSIZE);
+	origin.entry = NULL;
+
+	if (outputlen == MESSENGER_PENDING) {
+		LOG_DBG("Response to %u deferred\n", req->request_id);
+		return;
+	}
+
+	entry->pending = 0;
+	entry->length = sizeof(command_reply_t) + outputlen;
+
+	messenger_airtime_charge(entry->length);
+	simple_udp_sendto_port(c, entry->data, entry->length, sender_addr, sender_port);
+}
+
+
+/**
+ * Answer deferred requests that ran out of time with a command_error_t,
+ * freeing their slots, and return when the next one will.  A UDP retry
+ * of a timed out request gets the error again from the reply cache.
+ */
+static int expire_pending(clock_time_t *next)
+{
+	clock_time_t now = clock_time();
+	int i, active = 0, len;
+
+	for (i = 0; i < MAX_PENDING; i++) {
+		if ((pending[i].socket == NULL) && (pending[i].entry == NULL))
+			continue;
+
+		if (!CLOCK_LT(now, pending[i].deadline)) {
+			LOG_INFO("Deferred request %d timed out\n", pending[i].id);
+			len = command_error(pending[i].header, CMD_ERROR_TIMEOUT, outputbuf, sizeof(outputbuf));
+			messenger_complete(pending[i].id, outputbuf, len);
+			continue;
+		}
+
+		if (!active || CLOCK_LT(pending[i].deadline, *next))
+			*next = pending[i].deadline;
+		active = 1;
+	}
+
+	return active;
+}
+
 PROCESS_THREAD(messenger_receiver, ev, data)
 {
+    static struct etimer pending_timer;
+    clock_time_t next;
+    int i;
+
     PROCESS_BEGIN();
 
     LOG_DBG("Command receiver starting on %d\n", COMMAND_SERVER_PORT);
-    tcp_socket_register(&rcv_socket, NULL,
-                  inputbuf, sizeof(inputbuf),
-                  outputbuf, sizeof(outputbuf),
-                  message_recv_bytes, message_recv_event);
-     tcp_socket_listen(&rcv_socket, COMMAND_SERVER_PORT);
+    for (i = 0; i < RX_SOCKETS; i++) {
+        tcp_socket_register(&rx_sockets[i].socket, NULL,
+                      rx_sockets[i].inputbuf, sizeof(rx_sockets[i].inputbuf),
+                      rx_sockets[i].outputbuf, sizeof(rx_sockets[i].outputbuf),
+                      message_recv_bytes, message_recv_event);
+        tcp_socket_listen(&rx_sockets[i].socket, COMMAND_SERVER_PORT);
+    }
+
+     simple_udp_register(&cmd_conn, COMMAND_SERVER_PORT, NULL, 0, command_udp_recv);
 
      while(1) {
-         PROCESS_PAUSE();
+         PROCESS_WAIT_EVENT();
+
+         // a request was deferred, or one's deadline came up
+         if ((ev == PROCESS_EVENT_POLL) || etimer_expired(&pending_timer)) {
+             if (expire_pending(&next)) {
+                 etimer_set(&pending_timer, CLOCK_LT(clock_time(), next) ? next - clock_time() : 1);
+             }
+             else {
+                 etimer_stop(&pending_timer);
+             }
+         }
      }
 
 
@@ -212,6 +773,7 @@ void messenger_sender_init( );
 void messenger_init()
 {
 	messenger_sender_init( );
+	messenger_add_handler(STREAM_REQ_HEADER, sizeof(stream_request_t), sizeof(stream_request_t), stream_handler);
 	process_start(&messenger_receiver, NULL);
 
 }
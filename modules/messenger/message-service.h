@@ -30,18 +30,88 @@ extern process_event_t sender_fin_event;
  * * outputdata - the output data to be sent back to the remote
  * * maxoutputlenth - initially the maximum size of the buffer, the
  *       handler must set this to the number of bytes to actually return.
+ * A handler returns MESSENGER_PENDING after messenger_defer() to answer later;
+ * returned without a deferral, the remote is answered with a command_error_t.
  */
+#define MESSENGER_PENDING (-1)
+
 typedef int (*handler_t)(const uint8_t *inputdata, int inputlength, uint8_t *outputdata, int *maxoutputlen);
 
+/*
+ * The outcome of one messenger_send(), posted to the process that
+ * queued the message as the data of a PROCESS_EVENT_MSG event.
+ * * sequence - the sequence given to messenger_send()
+ * * ok - 1 if the remote ACK'd the message, 0 otherwise
+ * * attempts - how many times the message was transmitted (TCP: the
+ *   connections it was tried on, opened or not)
+ * * refused - the remote answered but would not take it (ACK_NO_REF)
+ */
+typedef struct {
+	uint32_t sequence;
+	uint8_t ok;
+	uint8_t attempts;
+	uint8_t refused;
+} messenger_result_t;
+
+/*
+ * Message classes, lowest first.  Queued messages go out highest class
+ * first (FIFO within a class), a due retransmit is held back while a
+ * higher class waits for the window, and the last queue slot(s) are
+ * kept for alarms so they never wait behind a full queue of backlog.
+ */
+typedef enum {
+	MESSENGER_PRIO_BULK = 0,	// backlog / catch-up traffic
+	MESSENGER_PRIO_DATA,		// routine readings
+	MESSENGER_PRIO_CAL,			// calibration frames
+	MESSENGER_PRIO_ALARM,		// events that must not wait
+	MESSENGER_PRIO_COUNT
+} messenger_prio_t;
+
+/*
+ * Per-class queue statistics, for tuning.
+ * * depth / max_depth - messages queued now / at most
+ * * sent - messages that have been transmitted at least once
+ * * wait_avg_ms / wait_max_ms - time from queueing to first transmit
+ */
+typedef struct {
+	uint16_t depth;
+	uint16_t max_depth;
+	uint32_t sent;
+	uint32_t wait_avg_ms;
+	uint32_t wait_max_ms;
+} messenger_class_stats_t;
+
 // initialize the messenger framework
 void messenger_init( void );
 
-// send a message to the given address
-void messenger_send (const uip_ipaddr_t *remote_addr,  uint16_t sequence,  const void *data, int length);
+// queue a message to the given address (NULL = the collector in use), returns 0 (and posts nothing) if it could not be queued
+int messenger_send (const uip_ipaddr_t *remote_addr,  uint32_t sequence,  const void *data, int length, messenger_prio_t prio);
+
+// as messenger_send() at MESSENGER_PRIO_BULK (e.g. the backlog) - goes over a TCP session in CONFIG_TRANSPORT_AUTO
+int messenger_send_bulk (const uip_ipaddr_t *remote_addr,  uint32_t sequence,  const void *data, int length);
 
 // get result of the last send (including any data received from the remote
 void messenger_get_last_result(int *sendlen, int *recvlen, int maxlen, void *dest);
 
+// set / get how many messages may be awaiting an ACK at once (1 = stop-and-wait)
+void messenger_set_window(int size);
+int messenger_get_window( );
+
+// smoothed RTT, RTT variance and current retransmit timeout (ms) for a destination
+void messenger_get_rtt(const uip_ipaddr_t *addr, uint32_t *srtt_ms, uint32_t *rttvar_ms, uint32_t *rto_ms);
+
+// queue statistics for one message class
+void messenger_get_class_stats(messenger_prio_t prio, messenger_class_stats_t *stats);
+
+// time spent with transmissions held back by the airtime limiter, and the bytes held back
+void messenger_get_airtime(uint32_t *throttled_ms, uint32_t *throttled_bytes);
+
+// the collector that messages to a NULL address go to now
+void messenger_get_collector(uip_ipaddr_t *addr);
+
+// index of the collector in use, and how many times the sender failed over
+void messenger_get_failover(uint32_t *index, uint32_t *failovers);
+
 // was the last result a valid ACK from the remote?
 int messenger_last_result_okack( );
 
@@ -51,6 +121,34 @@ void messenger_add_handler(uint32_t header, uint32_t min_len, uint32_t max_len,
 // remove a callback handler from the list
 void messenger_remove_handler(handler_t handler);
 
+/*
+ * Called from inside a handler: keep the request open for a later reply.
+ * Returns the request id to pass to messenger_complete(), or -1 if no
+ * more requests can be deferred (answer now instead).
+ */
+int messenger_defer( );
+
+/*
+ * Send the reply to a deferred request, from any process.  An empty
+ * reply just closes the request.  Returns 0 if the request has gone
+ * (timed out and answered with a command_error_t, or the remote
+ * disconnected).
+ */
+int messenger_complete(int request, const void *data, int length);
+
+/*
+ * The call-back template for a streamed response (see stream_request_t)
+ * * offset - where in the stream to start
+ * * outputdata / maxoutputlen - room for the chunk
+ * * total - set to the stream's full length
+ * Returns the bytes written (0 at the end), or -1 on error.  Producers
+ * are called once per chunk, so they regenerate rather than buffer.
+ */
+typedef int (*stream_t)(uint32_t offset, uint8_t *outputdata, int maxoutputlen, uint32_t *total);
+
+// serve a stream id through STREAM_REQ_HEADER requests
+int messenger_add_stream(uint16_t stream, stream_t producer);
+
 int messenger_recvd_rssi( );
 
 #endif /* APPS_MESSAGE_SERVICE_UDP_MESSAGE_SERVICE_H_ */
@@ -0,0 +1,84 @@
+/*
+ * message-transport.h
+ *
+ * The interface between the messenger front end (message-sender.c) and
+ * the transports that carry its messages.  Each backend queues and
+ * delivers messages its own way, and reports every outcome through
+ * messenger_report().
+ */
+
+#ifndef MODULES_MESSENGER_MESSAGE_TRANSPORT_H_
+#define MODULES_MESSENGER_MESSAGE_TRANSPORT_H_
+
+#include "message-service.h"
+
+struct messenger_transport {
+	const char *name;
+
+	// start the backend's process / sockets
+	void (*init)(void);
+
+	// queue a message, 0 if it cannot be accepted - a NULL addr means the collector in use
+	int (*send)(const uip_ipaddr_t *addr, uint32_t sequence, const void *data, int length, messenger_prio_t prio);
+
+	// round trip estimate towards a destination, in ms
+	void (*get_rtt)(const uip_ipaddr_t *addr, uint32_t *srtt_ms, uint32_t *rttvar_ms, uint32_t *rto_ms);
+
+	// RSSI of the last reply received
+	int (*rssi)(void);
+};
+
+extern const struct messenger_transport udp_transport;
+extern const struct messenger_transport tcp_transport;
+
+/*
+ * Whether the TCP transport keeps its connection open between messages
+ * (0 = a connection per message, for servers that only take bare ones).
+ */
+#ifdef MESSENGER_CONF_TCP_SESSION
+#define MESSENGER_TCP_SESSION MESSENGER_CONF_TCP_SESSION
+#else
+#define MESSENGER_TCP_SESSION (1)
+#endif
+
+/*
+ * Hand the outcome of a message back to the process that queued it.
+ * The result is delivered synchronously.
+ */
+void messenger_report(struct process *requestor, const messenger_result_t *result);
+
+/*
+ * Queue accounting for the per-class statistics: a message of the class
+ * was queued, transmitted for the first time (after waiting for some
+ * clock ticks), or left the queue.
+ */
+void messenger_class_queued(messenger_prio_t prio);
+void messenger_class_sent(messenger_prio_t prio, clock_time_t waited);
+void messenger_class_done(messenger_prio_t prio);
+
+/*
+ * May a message of this class take a queue slot when 'used' of the
+ * backend's 'size' slots are taken?  The last MESSENGER_CONF_ALARM_RESERVE
+ * slots are kept for alarms.
+ */
+int messenger_class_admit(messenger_prio_t prio, int used, int size);
+
+/*
+ * Ask the airtime limiter for room to transmit 'bytes'.  Returns 0 (and
+ * takes the bytes from the bucket) if the message may go now, otherwise
+ * the clock ticks to wait before asking again.  'deferred' is the
+ * message's own flag, used to count each throttled message once.
+ */
+clock_time_t messenger_airtime_wait(int bytes, uint8_t *deferred);
+
+// account for a transmission that cannot be deferred (e.g. a reply)
+void messenger_airtime_charge(int bytes);
+
+/*
+ * Collector health: a message to addr was ACK'd, or timed out.  Enough
+ * timeouts in a row on the collector in use move the sender to the next.
+ */
+void messenger_collector_ack(const uip_ipaddr_t *addr);
+void messenger_collector_timeout(const uip_ipaddr_t *addr);
+
+#endif /* MODULES_MESSENGER_MESSAGE_TRANSPORT_H_ */
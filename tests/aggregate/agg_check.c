@@ -0,0 +1,191 @@
+/*
+ * agg_check.c
+ *
+ * Check the nodes' reading aggregation (modules/aggregate/aggregate.c),
+ * built on the host against the stand-ins in ../messenger/contiki.
+ *
+ *   agg_check
+ *
+ * Readings are fed in with CONFIG_SAMPLES_PER_SEND and CONFIG_COMPRESSION
+ * changed between them, the way a configuration push changes them under
+ * a running node.  Every frame handed out and every backlog record is
+ * decoded: each reading has to come out exactly once, under a sequence
+ * of its own, no raw frame may carry more readings than it has room for,
+ * and nothing may be written past the aggregate_t.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "message.h"
+#include "message-codec.h"
+#include "../../modules/aggregate/aggregate.h"
+
+#define READINGS (200)
+#define CANARY (0xa5)
+
+static struct {
+	aggregate_t a;
+	uint8_t canary[256];
+} state;
+
+static int compression;
+static int samples_per_send = 1;
+static uint32_t sequence_next = 1;
+
+// the last coded reading ACK'd, what the collector decodes against
+static water_reading_t ref;
+
+// the sequence each reading went out under, 0 while it has not
+static uint32_t sent_as[READINGS];
+static int delivered;
+static int failures;
+
+/*
+ * What aggregate.c calls.
+ */
+uint32_t config_get_compression( ) { return compression; }
+uint32_t config_get_samples_per_send( ) { return samples_per_send; }
+uint32_t config_get_sequence( ) { return sequence_next; }
+void config_set_samples_raw_max(uint32_t samples) { }
+
+uint32_t config_use_sequence(int count)
+{
+	uint32_t first = sequence_next;
+
+	sequence_next += count;
+	return first;
+}
+
+int messenger_recvd_rssi( ) { return -70; }
+unsigned long clock_seconds(void) { return 1000; }
+
+static void check(const char *what, int ok)
+{
+	if (ok)
+		return;
+	printf("  %s\n", what);
+	failures++;
+}
+
+static void account(int reading, uint32_t sequence)
+{
+	int i;
+
+	if ((reading < 0) || (reading >= READINGS) || sent_as[reading]) {
+		check("reading sent once", 0);
+		return;
+	}
+	for (i = 0; i < READINGS; i++) {
+		if (sent_as[i] == sequence)
+			check("a sequence of its own", 0);
+	}
+	sent_as[reading] = sequence;
+	delivered++;
+}
+
+// decode whatever the node would send, and note the readings in it
+static void frame_out(const void *frame, int length, int live)
+{
+	const agg_delta_t *z = (const agg_delta_t *) frame;
+	water_reading_t readings[AGG_DELTA_MAX];
+	uint32_t header;
+	int i;
+
+	memcpy(&header, frame, sizeof(header));
+	if (header == WATER_DATA_HEADER) {
+		account(((const water_data_t *) frame)->pressure - 100000, ((const water_data_t *) frame)->sequence);
+	}
+	else if (z->flags & AGG_FLAG_DELTA) {
+		check("live frames only in the backlog as keyframes", live || (z->flags & AGG_FLAG_KEYFRAME));
+		check("delta frame decodes", codec_decode_water((z->flags & AGG_FLAG_KEYFRAME) ? NULL : &ref,
+		      readings, z->count, z->data, length - AGG_DELTA_HEADER_SIZE) >= 0);
+		for (i = 0; i < z->count; i++)
+			account(readings[i].pressure - 100000, z->sequence + i);
+		// every live frame is ACK'd as it goes
+		if (live && (z->count > 0))
+			ref = readings[z->count - 1];
+	}
+	else {
+		const water_agg_t *agg = (const water_agg_t *) frame;
+
+		check("raw frame within its room", (agg->count <= WATER_AGG_MAX) &&
+		      (length == AGG_HEADER_SIZE + agg->count * sizeof(water_reading_t)));
+		for (i = 0; (i < agg->count) && (i < WATER_AGG_MAX); i++)
+			account(agg->readings[i].pressure - 100000, agg->sequence + i);
+	}
+}
+
+int backlog_append(const void *data, int length)
+{
+	frame_out(data, length, 0);
+	return 1;
+}
+
+/*
+ * One reading through send_data_proc: taken, sent, and reported ACK'd.
+ */
+static void reading(int n)
+{
+	water_data_t message;
+	const void *frame;
+	uint32_t sequence;
+	int length;
+
+	memset(&message, 0, sizeof(message));
+	message.header = WATER_DATA_HEADER;
+	message.sequence = config_get_sequence( );
+	message.pressure = 100000 + n;
+	message.battery = 3300;
+
+	frame = aggregate_take(&state.a, &message, sizeof(message), &length, &sequence);
+	if (frame == NULL)
+		return;
+
+	frame_out(frame, length, 1);
+	aggregate_result(&state.a, frame, length, 1);
+}
+
+int main( )
+{
+	int n = 0, i, intact = 1;
+
+	aggregate_init(&state.a, &aggregate_water);
+	memset(state.canary, CANARY, sizeof(state.canary));
+
+	// one at a time, raw
+	for (i = 0; i < 10; i++)
+		reading(n++);
+	check("raw readings sent as taken", delivered == n);
+
+	// K = 16 coded: 15 held, then compression is turned off under them
+	compression = 1;
+	samples_per_send = AGG_DELTA_MAX;
+	for (i = 0; i < AGG_DELTA_MAX; i++)
+		reading(n++);
+	for (i = 0; i < AGG_DELTA_MAX - 1; i++)
+		reading(n++);
+	check("readings held when compression goes off", state.a.held_count > 0);
+	compression = 0;
+	reading(n++);
+	check("held readings backlogged on the change", delivered == n);
+
+	// and on again, with K above what a raw frame holds
+	for (i = 0; i < 20; i++)
+		reading(n++);
+	compression = 1;
+	samples_per_send = 5;
+	for (i = 0; i < 13; i++)
+		reading(n++);
+	compression = 0;
+	samples_per_send = 2;
+	for (i = 0; i < 6; i++)
+		reading(n++);
+
+	for (i = 0; i < sizeof(state.canary); i++)
+		intact &= (state.canary[i] == CANARY);
+	check("nothing written past the aggregate_t", intact);
+
+	printf("coding changes    : %d readings, %d sent or backlogged\n", n, delivered);
+	printf("aggregate checks  : %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
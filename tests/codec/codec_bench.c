@@ -0,0 +1,260 @@
+/*
+ * codec_bench.c
+ *
+ * Measure the compression ratio and CPU cost of the delta / varint
+ * reading codec (modules/command/message-codec.c).
+ *
+ *   codec_bench [-k samples] [-n readings] [-a] [trace]
+ *
+ * trace is a file of back-to-back water_data_t (or, with -a, airborne_t)
+ * frames as received from a node.  Without a trace a random-walk trace
+ * of -n readings is synthesized.  Readings are packed into compressed
+ * aggregate frames exactly as the nodes do (k per frame, a keyframe
+ * every 16 frames, delta against the last reading of the previous frame)
+ * and every frame is decoded again and compared with the input.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "message.h"
+#include "message-codec.h"
+
+#define KEYFRAME_INTERVAL 16
+
+static double now_ns( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int walk(int value, int step, int lo, int hi)
+{
+	value += (rand() % (2 * step + 1)) - step;
+	return (value < lo) ? lo : (value > hi) ? hi : value;
+}
+
+static int load_water(const char *path, water_reading_t **out)
+{
+	FILE *fp = fopen(path, "rb");
+	water_data_t m;
+	int n = 0, cap = 1024;
+	water_reading_t *r = malloc(cap * sizeof(*r));
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fread(&m, sizeof(m), 1, fp) == 1) {
+		if (m.header != WATER_DATA_HEADER)
+			continue;
+		if (n == cap)
+			r = realloc(r, (cap *= 2) * sizeof(*r));
+
+		memset(&r[n], 0, sizeof(r[n]));
+		r[n].pressure = m.pressure;
+		r[n].temppressure = m.temppressure;
+		r[n].battery = m.battery;
+		r[n].color_blue = m.color_blue;
+		r[n].color_clear = m.color_clear;
+		r[n].color_green = m.color_green;
+		r[n].color_red = m.color_red;
+		r[n].ambient = m.ambient;
+		r[n].range1 = m.range1;
+		r[n].range2 = m.range2;
+		r[n].range3 = m.range3;
+		r[n].range4 = m.range4;
+		r[n].range5 = m.range5;
+		r[n].temperature = m.temperature;
+		r[n].hall = m.hall;
+		n++;
+	}
+
+	fclose(fp);
+	*out = r;
+	return n;
+}
+
+static int load_airborne(const char *path, airborne_reading_t **out)
+{
+	FILE *fp = fopen(path, "rb");
+	airborne_t m;
+	int n = 0, cap = 1024;
+	airborne_reading_t *r = malloc(cap * sizeof(*r));
+
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fread(&m, sizeof(m), 1, fp) == 1) {
+		if (m.header != AIRBORNE_HEADER)
+			continue;
+		if (n == cap)
+			r = realloc(r, (cap *= 2) * sizeof(*r));
+
+		memset(&r[n], 0, sizeof(r[n]));
+		r[n].ms5637_pressure = m.ms5637_pressure;
+		r[n].ms5637_temp = m.ms5637_temp;
+		r[n].si7020_humid = m.si7020_humid;
+		r[n].si7020_temp = m.si7020_temp;
+		r[n].battery = m.battery;
+		r[n].i2cerror = m.i2cerror;
+		n++;
+	}
+
+	fclose(fp);
+	*out = r;
+	return n;
+}
+
+static int synth_water(int n, water_reading_t **out)
+{
+	water_reading_t *r = calloc(n, sizeof(*r));
+	water_reading_t cur = { 0 };
+	int i;
+
+	cur.pressure = 5300000;
+	cur.temppressure = 8400000;
+	cur.battery = 3000;
+	cur.temperature = 2100;
+	cur.range1 = 900;
+	cur.range3 = 300;
+
+	for (i = 0; i < n; i++) {
+		cur.age = 0;
+		cur.pressure = walk(cur.pressure, 40, 0, 16777215);
+		cur.temppressure = walk(cur.temppressure, 20, 0, 16777215);
+		cur.battery = walk(cur.battery, 1, 2000, 3300);
+		cur.color_red = walk(cur.color_red, 6, 0, 65535);
+		cur.color_green = walk(cur.color_green, 6, 0, 65535);
+		cur.color_blue = walk(cur.color_blue, 6, 0, 65535);
+		cur.color_clear = walk(cur.color_clear, 12, 0, 65535);
+		cur.ambient = walk(cur.ambient, 12, 0, 65535);
+		cur.range1 = walk(cur.range1, 3, 0, 4095);
+		cur.range2 = walk(cur.range2, 3, 0, 4095);
+		cur.range3 = walk(cur.range3, 3, 0, 4095);
+		cur.range4 = walk(cur.range4, 3, 0, 4095);
+		cur.range5 = walk(cur.range5, 3, 0, 4095);
+		cur.temperature = walk(cur.temperature, 2, 0, 4095);
+		cur.hall = walk(cur.hall, 4, -32768, 32767);
+		r[i] = cur;
+	}
+
+	*out = r;
+	return n;
+}
+
+static int synth_airborne(int n, airborne_reading_t **out)
+{
+	airborne_reading_t *r = calloc(n, sizeof(*r));
+	airborne_reading_t cur = { 0 };
+	int i;
+
+	cur.ms5637_pressure = 5300000;
+	cur.ms5637_temp = 8400000;
+	cur.si7020_humid = 30000;
+	cur.si7020_temp = 25000;
+	cur.battery = 3000;
+
+	for (i = 0; i < n; i++) {
+		cur.ms5637_pressure = walk(cur.ms5637_pressure, 40, 0, 16777215);
+		cur.ms5637_temp = walk(cur.ms5637_temp, 20, 0, 16777215);
+		cur.si7020_humid = walk(cur.si7020_humid, 30, 0, 65535);
+		cur.si7020_temp = walk(cur.si7020_temp, 10, 0, 65535);
+		cur.battery = walk(cur.battery, 1, 2000, 3300);
+		r[i] = cur;
+	}
+
+	*out = r;
+	return n;
+}
+
+/*
+ * Run the node's framing over the whole trace.  The codec calls are
+ * selected by the reading type so the loop is written once.
+ */
+#define RUN_FRAMES(type, encode, decode, readings, n, k, raw_size)                          \
+	do {                                                                                      \
+		type ref, back[AGG_DELTA_MAX];                                                          \
+		agg_delta_t frame;                                                                      \
+		int pos = 0, frames = 0, sent, used, keyframe, since_key = 0, have_ref = 0;             \
+		double t0, enc_ns = 0, dec_ns = 0;                                                      \
+		long bytes = 0;                                                                         \
+		while (pos < n) {                                                                       \
+			int count = (n - pos < k) ? n - pos : k;                                              \
+			keyframe = !have_ref || (since_key >= KEYFRAME_INTERVAL);                             \
+			t0 = now_ns();                                                                        \
+			sent = encode(keyframe ? NULL : &ref, &readings[pos], count,                          \
+			              frame.data, sizeof(frame.data), &used);                                 \
+			enc_ns += now_ns() - t0;                                                              \
+			t0 = now_ns();                                                                        \
+			if (decode(keyframe ? NULL : &ref, back, sent, frame.data, used) != used) {           \
+				fprintf(stderr, "decode failed at reading %d\n", pos);                              \
+				exit(1);                                                                            \
+			}                                                                                     \
+			dec_ns += now_ns() - t0;                                                              \
+			if (memcmp(back, &readings[pos], sent * sizeof(type)) != 0) {                         \
+				fprintf(stderr, "round trip mismatch at reading %d\n", pos);                        \
+				exit(1);                                                                            \
+			}                                                                                     \
+			ref = readings[pos + sent - 1];                                                       \
+			have_ref = 1;                                                                         \
+			since_key = keyframe ? 1 : since_key + 1;                                             \
+			bytes += AGG_DELTA_HEADER_SIZE + used;                                                \
+			pos += sent;                                                                          \
+			frames++;                                                                             \
+		}                                                                                       \
+		printf("readings          : %d\n", n);                                                  \
+		printf("frames            : %d (%.2f readings/frame)\n", frames, (double) n / frames);   \
+		printf("raw bytes         : %ld (one %d byte frame per reading)\n",                     \
+		       (long) n * (raw_size), (int) (raw_size));                                        \
+		printf("compressed bytes  : %ld\n", bytes);                                             \
+		printf("ratio             : %.2f : 1\n", (double) n * (raw_size) / bytes);              \
+		printf("encode            : %.1f ns/reading\n", enc_ns / n);                            \
+		printf("decode            : %.1f ns/reading\n", dec_ns / n);                            \
+	} while (0)
+
+int main(int argc, char **argv)
+{
+	int opt, n = 100000, k = AGG_DELTA_MAX, airborne = 0;
+
+	while ((opt = getopt(argc, argv, "ak:n:")) != -1) {
+		switch (opt) {
+		case 'a': airborne = 1; break;
+		case 'k': k = atoi(optarg); break;
+		case 'n': n = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-k samples] [-n readings] [-a] [trace]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if ((k < 1) || (k > AGG_DELTA_MAX))
+		k = AGG_DELTA_MAX;
+
+	srand(1);
+
+	if (airborne) {
+		airborne_reading_t *r;
+		n = (optind < argc) ? load_airborne(argv[optind], &r) : synth_airborne(n, &r);
+		if (n == 0)
+			return 1;
+		RUN_FRAMES(airborne_reading_t, codec_encode_airborne, codec_decode_airborne, r, n, k, sizeof(airborne_t));
+		free(r);
+	}
+	else {
+		water_reading_t *r;
+		n = (optind < argc) ? load_water(argv[optind], &r) : synth_water(n, &r);
+		if (n == 0)
+			return 1;
+		RUN_FRAMES(water_reading_t, codec_encode_water, codec_decode_water, r, n, k, sizeof(water_data_t));
+		free(r);
+	}
+
+	return 0;
+}
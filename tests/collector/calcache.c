@@ -0,0 +1,65 @@
+/*
+ * calcache.c
+ *
+ * Calibration log, see calcache.h.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "calcache.h"
+
+int calcache_load(const char *path, calcache_visit_t visit, void *ctx)
+{
+	calcache_record_t r;
+	FILE *f;
+	int count = 0;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		perror(path);
+		return -1;
+	}
+
+	// a short read at the end is a torn record
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		if ((r.magic != CALCACHE_MAGIC) || (r.length > sizeof(r.cal)))
+			continue;
+		visit(&r, ctx);
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+int calcache_open(const char *path)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+
+	// appending after a torn record would shift every later one
+	if ((fstat(fd, &sb) == 0) && (sb.st_size % sizeof(calcache_record_t))) {
+		if (ftruncate(fd, sb.st_size - sb.st_size % sizeof(calcache_record_t)) < 0)
+			perror(path);
+	}
+
+	return fd;
+}
+
+int calcache_append(int fd, const calcache_record_t *r)
+{
+	// O_APPEND and one write(), so records from several workers do not interleave
+	return (write(fd, r, sizeof(*r)) == sizeof(*r)) ? 0 : -1;
+}
@@ -0,0 +1,56 @@
+/*
+ * calcache.h
+ *
+ * The calibration frames the collector has received, kept on disk so a
+ * restarted collector still knows every node's calibration.
+ *
+ * The file is a log of fixed-size records, each appended with a single
+ * write() when a node's calibration of a kind changes.  A node resends
+ * the same frame at every boot, which is not a change.  Every record
+ * carries the version the collector gave that calibration: 1 for the
+ * node's first, one more for each change.  Stored readings carry the
+ * version they were joined to (STORE_COL_CALIBRATION), so the log also
+ * leads from a stored reading back to the coefficients it needs.  A
+ * record torn by a crash at the end of the log is dropped when the log
+ * is next opened.
+ */
+
+#ifndef TESTS_COLLECTOR_CALCACHE_H_
+#define TESTS_COLLECTOR_CALCACHE_H_
+
+#include <stdint.h>
+
+#include "message.h"
+
+#define CALCACHE_MAGIC (0x4c414343U)		// "CCAL"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	int64_t time_ms;		// when the frame arrived
+	uint8_t addr[16];
+	uint16_t port;			// 0 unless the collector keys nodes by port
+	uint8_t kind;			// enum store_kind
+	uint8_t reserved;
+	uint32_t length;		// of the frame in cal
+
+	union {
+		water_cal_t water;
+		airborne_cal_t airborne;
+	} cal;
+} calcache_record_t;
+
+/*
+ * Call visit for every record of the log, oldest first.  Returns the
+ * number of records, 0 if there is no log yet and -1 if it cannot be read.
+ */
+typedef void (*calcache_visit_t)(const calcache_record_t *r, void *ctx);
+int calcache_load(const char *path, calcache_visit_t visit, void *ctx);
+
+// open the log for appending, -1 on error
+int calcache_open(const char *path);
+
+// append a record, 0 on success; safe from several threads on one fd
+int calcache_append(int fd, const calcache_record_t *r);
+
+#endif /* TESTS_COLLECTOR_CALCACHE_H_ */
@@ -0,0 +1,1337 @@
+/*
+ * collector.c
+ *
+ * A Linux collector for the nodes' UDP messenger.  Frames arrive on the
+ * collector port (config_get_remote_port(), 5323), are decoded and
+ * answered with an ack_t carrying the frame's sequence - the same reply
+ * the nodes' message-sender-udp.c waits for.
+ *
+ *   collector [-p port] [-t TCP port] [-w workers] [-i stats seconds] [-o store]
+ *             [-F flush seconds] [-c calibration log] [-v] [-P]
+ *
+ * Each of the -w worker threads owns a non-blocking SO_REUSEPORT socket
+ * on the port and its own epoll loop.  Datagrams are read with
+ * recvmmsg() and the ACKs for a batch go out in one sendmmsg(), so a
+ * busy fleet costs a couple of system calls per RX_BATCH frames.  A
+ * classic BPF program on the reuseport group steers every source
+ * address to one worker, so the per-node state is sharded without locks.
+ * The main thread only prints statistics (timerfd) and handles the
+ * signals (signalfd).
+ *
+ * The nodes' TCP messenger (message-sender-tcp.c) is taken on -t
+ * (MESSAGE_SERVER_PORT, 5555; 0 for none), a listening socket per worker
+ * in a reuseport group steered the same way.  A connection carries
+ * either one bare message, answered with a bare ack_t, or a session of
+ * messages each prefixed by its length (2 bytes, network order), whose
+ * replies are framed the same way.  The first two bytes tell them apart:
+ * every header in message.h starts with a byte above 1 on the wire, so
+ * a frame never starts with what reads as a length up to RX_MAX.  A bare
+ * message is taken from the first read, as the node writes it in one
+ * segment.
+ *
+ * Understood frames: WATER_DATA_HEADER, AIRBORNE_HEADER, their
+ * aggregates (plain and AGG_FLAG_DELTA coded) and the two calibration
+ * frames.  Each node (by source address) keeps its calibration and the
+ * newest readings it had ACK'd, which the delta coded frames refer to.
+ * A delta frame whose reference is unknown (the collector restarted, or
+ * the reference is older than the REF_RING kept) is answered with
+ * ACK_NO_REF: the node stops resending it, backlogs its readings as
+ * keyframes and sends a keyframe next, which resynchronises it.  With
+ * -v every reading is printed.
+ *
+ * A node resends what is not ACK'd, so a lost ACK brings the same
+ * sequence back.  Each node has a window over its recent sequences (see
+ * dedup.h): a repeated reading is ACK'd again but not stored again.  A
+ * node's sequences carry on across its reboots, so a backlogged frame
+ * never shares one with a live frame; a node that does restart its
+ * sequence (a reset configuration) forgets its old delta references.
+ *
+ * Every reading is joined to the node's latest calibration of its kind
+ * and tagged with that calibration's version (see calcache.h).  The
+ * calibrations are logged to -c (calibration.log in the store by
+ * default) and loaded from it on start, so a restart does not lose
+ * them.  A reading from a node whose calibration is unknown is tagged
+ * 0 and counted as uncalibrated, and the node is sent a cal_request_t
+ * (at most once every CAL_REQUEST_MS) to make it send its cal frame.
+ *
+ * Simulated fleets on one host share an address; -P tells the nodes
+ * apart by source port as well.
+ *
+ * With -o the readings are kept in a columnar store under that directory
+ * (see store.h), stamped with their arrival time less their age.  A
+ * node's part-filled block is written out once it has been quiet for -F
+ * seconds (300 by default), and on exit.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "message.h"
+#include "message-codec.h"
+#include "calcache.h"
+#include "dedup.h"
+#include "store.h"
+
+#define ACK_OK (1)
+
+// datagrams read per recvmmsg()
+#define RX_BATCH 64
+
+// largest datagram accepted, anything bigger is not a node frame
+#define RX_MAX 256
+
+// open TCP connections per worker
+#define TCP_CONNS 64
+
+// a session's length prefix
+#define FRAME_PREFIX 2
+
+// delta references kept per node and reading type
+#define REF_RING 4
+
+// least time between calibration requests to one node
+#define CAL_REQUEST_MS (60 * 1000)
+
+struct water_ref {
+	uint32_t sequence;
+	uint8_t valid;
+	water_reading_t reading;
+};
+
+struct airborne_ref {
+	uint32_t sequence;
+	uint8_t valid;
+	airborne_reading_t reading;
+};
+
+// a node's identity - port is 0 unless nodes are keyed by port (-P)
+struct node_key {
+	struct in6_addr addr;
+	uint16_t port;
+};
+
+struct node {
+	struct node_key key;
+	uint8_t used;
+
+	dedup_t dedup;
+
+	// latest calibration of each kind, version 0 until there is one
+	uint32_t cal_version[STORE_KINDS];
+	int64_t cal_requested_ms[STORE_KINDS];
+	uint32_t want_cal;		// cal frame header to ask the node for, 0 for none
+	water_cal_t water_cal;
+	airborne_cal_t airborne_cal;
+
+	struct water_ref water_refs[REF_RING];
+	struct airborne_ref airborne_refs[REF_RING];
+
+	uint64_t frames;
+	uint64_t readings;
+
+	// readings on disk, opened on the first one (-o)
+	struct store_series *series[STORE_KINDS];
+};
+
+struct stats {
+	uint64_t nodes;
+	uint64_t strays;
+	uint64_t frames;
+	uint64_t readings;
+	uint64_t acks;
+	uint64_t malformed;
+	uint64_t unknown;
+	uint64_t no_ref;
+	uint64_t send_errors;
+	uint64_t store_errors;
+	uint64_t uncalibrated;
+	uint64_t cal_requests;
+	uint64_t cal_changes;
+	uint64_t duplicates;
+	uint64_t reboots;
+};
+
+// one node's TCP connection
+struct conn {
+	int fd;					// -1 when free
+	int framed;				// -1 until the first two bytes are in
+	int len;
+	struct sockaddr_in6 peer;
+	uint8_t buf[FRAME_PREFIX + RX_MAX];
+};
+
+/*
+ * A worker owns one SO_REUSEPORT socket (and TCP listener) and the nodes
+ * whose frames the kernel steers to it, so nothing on the receive path
+ * is shared.  Its
+ * counters have a single writer; the main thread sums them without locks.
+ */
+struct worker {
+	int index;
+	int sock;
+	int listener;			// -1 without TCP
+	int ep;
+	pthread_t thread;
+
+	struct node *nodes;
+	size_t node_cap;
+	size_t node_count;
+
+	int64_t now_ms;			// receive time of the batch being decoded
+	int64_t flushed_ms;		// last sweep for idle series
+
+	struct stats stats __attribute__((aligned(64)));
+
+	uint8_t bufs[RX_BATCH][RX_MAX];
+	struct sockaddr_in6 peers[RX_BATCH];
+	struct iovec rx_iov[RX_BATCH], tx_iov[2 * RX_BATCH];
+	struct mmsghdr rx[RX_BATCH], tx[2 * RX_BATCH];
+	ack_t acks[RX_BATCH];
+	cal_request_t cal_requests[RX_BATCH];
+
+	struct conn conns[TCP_CONNS];
+} __attribute__((aligned(64)));
+
+// bump a counter only its worker writes - no locked instruction needed
+#define STAT_ADD(w, field, n) \
+	__atomic_store_n(&(w)->stats.field, (w)->stats.field + (n), __ATOMIC_RELAXED)
+
+static struct worker *workers;
+static int worker_count = 1;
+static int stop_fd;
+
+static int verbose;
+static int key_port;
+static int tcp_port = 5555;
+
+static struct store *store;
+static int64_t flush_idle_ms = 300 * 1000;
+
+static int cal_fd = -1;
+
+/*
+ * Nodes are kept in an open-addressed table keyed on the source address,
+ * doubled when it gets more than half full.
+ */
+static uint32_t key_hash(const struct node_key *k)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		h ^= k->addr.s6_addr[i];
+		h *= 16777619U;
+	}
+	h ^= k->port;
+	h *= 16777619U;
+	return h;
+}
+
+static struct node *node_slot(struct node *table, size_t cap, const struct node_key *key)
+{
+	size_t i = key_hash(key) & (cap - 1);
+
+	while (table[i].used && ((table[i].key.port != key->port) ||
+	                         memcmp(&table[i].key.addr, &key->addr, sizeof(key->addr)) != 0))
+		i = (i + 1) & (cap - 1);
+
+	return &table[i];
+}
+
+static struct node *node_get(struct worker *w, const struct node_key *key)
+{
+	struct node *n, *grown;
+	size_t i;
+
+	n = node_slot(w->nodes, w->node_cap, key);
+	if (n->used)
+		return n;
+
+	if ((w->node_count + 1) * 2 > w->node_cap) {
+		grown = calloc(w->node_cap * 2, sizeof(*grown));
+		if (grown == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		for (i = 0; i < w->node_cap; i++) {
+			if (w->nodes[i].used)
+				*node_slot(grown, w->node_cap * 2, &w->nodes[i].key) = w->nodes[i];
+		}
+		free(w->nodes);
+		w->nodes = grown;
+		w->node_cap *= 2;
+		n = node_slot(w->nodes, w->node_cap, key);
+	}
+
+	memset(n, 0, sizeof(*n));
+	n->key = *key;
+	n->used = 1;
+	w->node_count++;
+	return n;
+}
+
+static struct node *node_lookup(struct worker *w, const struct sockaddr_in6 *from)
+{
+	struct node_key key;
+
+	memset(&key, 0, sizeof(key));
+	key.addr = from->sin6_addr;
+	key.port = key_port ? ntohs(from->sin6_port) : 0;
+	return node_get(w, &key);
+}
+
+static const char *node_name(const struct node *n)
+{
+	static __thread char buf[INET6_ADDRSTRLEN + 8];
+
+	inet_ntop(AF_INET6, &n->key.addr, buf, INET6_ADDRSTRLEN);
+	if (n->key.port)
+		sprintf(buf + strlen(buf), "#%u", n->key.port);
+	return buf;
+}
+
+/*
+ * Readings, however they arrived, end up here.
+ */
+static int64_t now_ms( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * The version of the node's calibration a reading of this kind joins,
+ * 0 if the collector has none - the node is then asked for it.
+ */
+static uint32_t cal_join(struct worker *w, struct node *n, enum store_kind kind)
+{
+	if (n->cal_version[kind])
+		return n->cal_version[kind];
+
+	STAT_ADD(w, uncalibrated, 1);
+	if (w->now_ms - n->cal_requested_ms[kind] >= CAL_REQUEST_MS)
+		n->want_cal = (kind == STORE_WATER) ? WATER_CAL_HEADER : AIRBORNE_CAL_HEADER;
+	return 0;
+}
+
+/*
+ * Append a reading to the node's series of that kind.  The reading was
+ * taken 'age' seconds before the frame arrived.
+ */
+static void store_reading(struct worker *w, struct node *n, enum store_kind kind,
+                          uint32_t sequence, uint32_t cal, uint16_t age, const void *r)
+{
+	char name[64];
+
+	if (store == NULL)
+		return;
+
+	if (n->series[kind] == NULL) {
+		store_node_name(name, sizeof(name), n->key.addr.s6_addr, n->key.port);
+		n->series[kind] = store_series_open(store, name, kind);
+	}
+
+	if ((n->series[kind] == NULL) || (store_append(n->series[kind], w->now_ms - age * 1000LL, sequence, cal, r) < 0))
+		STAT_ADD(w, store_errors, 1);
+}
+
+/*
+ * Write out the part-filled blocks of the series that have gone quiet
+ * (or all of them), so a slow node's readings reach the disk too.
+ */
+static void flush_series(struct worker *w, int64_t idle_ms)
+{
+	size_t i;
+	int k;
+
+	for (i = 0; i < w->node_cap; i++) {
+		if (!w->nodes[i].used)
+			continue;
+		for (k = 0; k < STORE_KINDS; k++) {
+			struct store_series *s = w->nodes[i].series[k];
+
+			if ((s != NULL) && (w->now_ms - store_series_last(s) >= idle_ms) && (store_series_flush(s) < 0))
+				STAT_ADD(w, store_errors, 1);
+		}
+	}
+	w->flushed_ms = w->now_ms;
+}
+
+/*
+ * Whether a sequence is new from the node.  Duplicates are counted, and
+ * a reboot drops the delta references of the node's previous run, whose
+ * sequences it is about to reuse.
+ */
+static int fresh(struct worker *w, struct node *n, uint32_t sequence)
+{
+	switch (dedup_check(&n->dedup, sequence, w->now_ms)) {
+	case DEDUP_DUPLICATE:
+		STAT_ADD(w, duplicates, 1);
+		return 0;
+
+	case DEDUP_REBOOT:
+		memset(n->water_refs, 0, sizeof(n->water_refs));
+		memset(n->airborne_refs, 0, sizeof(n->airborne_refs));
+		STAT_ADD(w, reboots, 1);
+		if (verbose)
+			printf("%s restarted at sequence %u\n", node_name(n), sequence);
+		return 1;
+
+	default:
+		return 1;
+	}
+}
+
+static void water_reading(struct worker *w, struct node *n, uint32_t sequence, const water_reading_t *r)
+{
+	uint32_t cal;
+
+	if (!fresh(w, n, sequence))
+		return;
+
+	cal = cal_join(w, n, STORE_WATER);
+	n->readings++;
+	STAT_ADD(w, readings, 1);
+	store_reading(w, n, STORE_WATER, sequence, cal, r->age, r);
+
+	if (verbose) {
+		printf("%s water seq=%u cal=%u age=%u p=%u tp=%u bat=%u rgbc=%u,%u,%u,%u amb=%u "
+		       "cond=%u,%u,%u,%u,%u temp=%u hall=%d\n",
+		       node_name(n), sequence, cal, r->age, r->pressure, r->temppressure, r->battery,
+		       r->color_red, r->color_green, r->color_blue, r->color_clear, r->ambient,
+		       r->range1, r->range2, r->range3, r->range4, r->range5,
+		       r->temperature, r->hall);
+	}
+}
+
+static void airborne_reading(struct worker *w, struct node *n, uint32_t sequence, const airborne_reading_t *r)
+{
+	uint32_t cal;
+
+	if (!fresh(w, n, sequence))
+		return;
+
+	cal = cal_join(w, n, STORE_AIRBORNE);
+	n->readings++;
+	STAT_ADD(w, readings, 1);
+	store_reading(w, n, STORE_AIRBORNE, sequence, cal, r->age, r);
+
+	if (verbose) {
+		printf("%s airborne seq=%u cal=%u age=%u p=%u tp=%u rh=%u t=%u bat=%u i2c=%u\n",
+		       node_name(n), sequence, cal, r->age, r->ms5637_pressure, r->ms5637_temp,
+		       r->si7020_humid, r->si7020_temp, r->battery, r->i2cerror);
+	}
+}
+
+/*
+ * Keep the REF_RING newest references of a kind.  A drained backlog
+ * record is older than the frames sent live meanwhile, and must not push
+ * out the reference the next live delta frame is coded against.
+ */
+static void water_remember(struct node *n, uint32_t sequence, const water_reading_t *r)
+{
+	struct water_ref *ref = NULL;
+	int i;
+
+	for (i = 0; i < REF_RING; i++) {
+		struct water_ref *e = &n->water_refs[i];
+
+		if (e->valid && (e->sequence == sequence)) {
+			ref = e;
+			break;
+		}
+		if ((ref == NULL) || (ref->valid && (!e->valid || ((int32_t) (e->sequence - ref->sequence) < 0))))
+			ref = e;
+	}
+
+	if (ref->valid && (ref->sequence != sequence) && ((int32_t) (sequence - ref->sequence) < 0))
+		return;
+	ref->sequence = sequence;
+	ref->reading = *r;
+	ref->valid = 1;
+}
+
+static void airborne_remember(struct node *n, uint32_t sequence, const airborne_reading_t *r)
+{
+	struct airborne_ref *ref = NULL;
+	int i;
+
+	for (i = 0; i < REF_RING; i++) {
+		struct airborne_ref *e = &n->airborne_refs[i];
+
+		if (e->valid && (e->sequence == sequence)) {
+			ref = e;
+			break;
+		}
+		if ((ref == NULL) || (ref->valid && (!e->valid || ((int32_t) (e->sequence - ref->sequence) < 0))))
+			ref = e;
+	}
+
+	if (ref->valid && (ref->sequence != sequence) && ((int32_t) (sequence - ref->sequence) < 0))
+		return;
+	ref->sequence = sequence;
+	ref->reading = *r;
+	ref->valid = 1;
+}
+
+static const water_reading_t *water_find_ref(const struct node *n, uint32_t sequence)
+{
+	int i;
+
+	for (i = 0; i < REF_RING; i++) {
+		if (n->water_refs[i].valid && (n->water_refs[i].sequence == sequence))
+			return &n->water_refs[i].reading;
+	}
+	return NULL;
+}
+
+static const airborne_reading_t *airborne_find_ref(const struct node *n, uint32_t sequence)
+{
+	int i;
+
+	for (i = 0; i < REF_RING; i++) {
+		if (n->airborne_refs[i].valid && (n->airborne_refs[i].sequence == sequence))
+			return &n->airborne_refs[i].reading;
+	}
+	return NULL;
+}
+
+static void water_from_data(water_reading_t *r, const water_data_t *m)
+{
+	memset(r, 0, sizeof(*r));
+	r->pressure = m->pressure;
+	r->temppressure = m->temppressure;
+	r->battery = m->battery;
+	r->color_blue = m->color_blue;
+	r->color_clear = m->color_clear;
+	r->color_green = m->color_green;
+	r->color_red = m->color_red;
+	r->ambient = m->ambient;
+	r->range1 = m->range1;
+	r->range2 = m->range2;
+	r->range3 = m->range3;
+	r->range4 = m->range4;
+	r->range5 = m->range5;
+	r->temperature = m->temperature;
+	r->hall = m->hall;
+}
+
+static void airborne_from_data(airborne_reading_t *r, const airborne_t *m)
+{
+	memset(r, 0, sizeof(*r));
+	r->ms5637_pressure = m->ms5637_pressure;
+	r->ms5637_temp = m->ms5637_temp;
+	r->si7020_humid = m->si7020_humid;
+	r->si7020_temp = m->si7020_temp;
+	r->battery = m->battery;
+	r->i2cerror = m->i2cerror;
+}
+
+/*
+ * The readings of an aggregate frame, plain or delta coded.  Returns 1
+ * if the frame was taken (and should be ACK'd).
+ */
+static int water_agg(struct worker *w, struct node *n, const uint8_t *data, int len)
+{
+	const water_agg_t *agg = (const water_agg_t *) data;
+	const agg_delta_t *z = (const agg_delta_t *) data;
+	water_reading_t readings[AGG_DELTA_MAX > WATER_AGG_MAX ? AGG_DELTA_MAX : WATER_AGG_MAX];
+	const water_reading_t *ref = NULL;
+	int i;
+
+	if (len < AGG_HEADER_SIZE)
+		return 0;
+
+	if (agg->flags & AGG_FLAG_DELTA) {
+		if ((len < AGG_DELTA_HEADER_SIZE) || (z->count > AGG_DELTA_MAX))
+			return 0;
+		if (!(z->flags & AGG_FLAG_KEYFRAME) && ((ref = water_find_ref(n, z->ref_sequence)) == NULL)) {
+			STAT_ADD(w, no_ref, 1);
+			return -1;
+		}
+		if (codec_decode_water(ref, readings, z->count, z->data, len - AGG_DELTA_HEADER_SIZE) < 0)
+			return 0;
+	}
+	else {
+		if ((agg->count > WATER_AGG_MAX) || (len < AGG_HEADER_SIZE + agg->count * sizeof(water_reading_t)))
+			return 0;
+		memcpy(readings, agg->readings, agg->count * sizeof(water_reading_t));
+	}
+
+	for (i = 0; i < agg->count; i++)
+		water_reading(w, n, agg->sequence + i, &readings[i]);
+	if (agg->count > 0)
+		water_remember(n, agg->sequence + agg->count - 1, &readings[agg->count - 1]);
+
+	return 1;
+}
+
+static int airborne_agg(struct worker *w, struct node *n, const uint8_t *data, int len)
+{
+	const airborne_agg_t *agg = (const airborne_agg_t *) data;
+	const agg_delta_t *z = (const agg_delta_t *) data;
+	airborne_reading_t readings[AGG_DELTA_MAX > AIRBORNE_AGG_MAX ? AGG_DELTA_MAX : AIRBORNE_AGG_MAX];
+	const airborne_reading_t *ref = NULL;
+	int i;
+
+	if (len < AGG_HEADER_SIZE)
+		return 0;
+
+	if (agg->flags & AGG_FLAG_DELTA) {
+		if ((len < AGG_DELTA_HEADER_SIZE) || (z->count > AGG_DELTA_MAX))
+			return 0;
+		if (!(z->flags & AGG_FLAG_KEYFRAME) && ((ref = airborne_find_ref(n, z->ref_sequence)) == NULL)) {
+			STAT_ADD(w, no_ref, 1);
+			return -1;
+		}
+		if (codec_decode_airborne(ref, readings, z->count, z->data, len - AGG_DELTA_HEADER_SIZE) < 0)
+			return 0;
+	}
+	else {
+		if ((agg->count > AIRBORNE_AGG_MAX) || (len < AGG_HEADER_SIZE + agg->count * sizeof(airborne_reading_t)))
+			return 0;
+		memcpy(readings, agg->readings, agg->count * sizeof(airborne_reading_t));
+	}
+
+	for (i = 0; i < agg->count; i++)
+		airborne_reading(w, n, agg->sequence + i, &readings[i]);
+	if (agg->count > 0)
+		airborne_remember(n, agg->sequence + agg->count - 1, &readings[agg->count - 1]);
+
+	return 1;
+}
+
+/*
+ * A calibration frame: a new version if the values differ from the ones
+ * held (or there are none), logged to the calibration log.
+ */
+static void calibration(struct worker *w, struct node *n, enum store_kind kind, const uint8_t *data, int len)
+{
+	uint8_t *cal = (kind == STORE_WATER) ? (uint8_t *) &n->water_cal : (uint8_t *) &n->airborne_cal;
+	size_t values = (kind == STORE_WATER) ? offsetof(water_cal_t, caldata) : offsetof(airborne_cal_t, caldata);
+	calcache_record_t rec;
+
+	// header, sequence and RSSI differ every time, a node resends the same values at each boot
+	if (n->cal_version[kind] && (memcmp(cal + values, data + values, len - values) == 0))
+		return;
+
+	memcpy(cal, data, len);
+	n->cal_version[kind]++;
+	n->want_cal = 0;
+	STAT_ADD(w, cal_changes, 1);
+
+	if (cal_fd >= 0) {
+		memset(&rec, 0, sizeof(rec));
+		rec.magic = CALCACHE_MAGIC;
+		rec.version = n->cal_version[kind];
+		rec.time_ms = w->now_ms;
+		memcpy(rec.addr, &n->key.addr, sizeof(rec.addr));
+		rec.port = n->key.port;
+		rec.kind = kind;
+		rec.length = len;
+		memcpy(&rec.cal, data, len);
+		if (calcache_append(cal_fd, &rec) < 0)
+			STAT_ADD(w, store_errors, 1);
+	}
+}
+
+/*
+ * Decode one frame from a node.  Returns 1 and fills in the ACK if the
+ * frame should be acknowledged, and sets req's header if the node
+ * should also be asked for its calibration (req is NULL where a request
+ * cannot be sent, it is left for a later frame).
+ */
+static int handle_frame(struct worker *w, const struct sockaddr_in6 *from, const uint8_t *data, int len,
+                        ack_t *ack, cal_request_t *req)
+{
+	uint32_t header, sequence;
+	struct node *n;
+	water_reading_t wr;
+	airborne_reading_t ar;
+	int rc = 0;
+
+	if (len < 8) {
+		STAT_ADD(w, malformed, 1);
+		return 0;
+	}
+
+	memcpy(&header, data, sizeof(header));
+	memcpy(&sequence, data + 4, sizeof(sequence));
+
+	n = node_lookup(w, from);
+	if (n->frames++ == 0)
+		STAT_ADD(w, nodes, 1);
+	STAT_ADD(w, frames, 1);
+
+	switch (header) {
+	case WATER_DATA_HEADER:
+		if (len != sizeof(water_data_t))
+			goto malformed;
+		water_from_data(&wr, (const water_data_t *) data);
+		water_reading(w, n, sequence, &wr);
+		water_remember(n, sequence, &wr);
+		break;
+
+	case AIRBORNE_HEADER:
+		if (len != sizeof(airborne_t))
+			goto malformed;
+		airborne_from_data(&ar, (const airborne_t *) data);
+		airborne_reading(w, n, sequence, &ar);
+		airborne_remember(n, sequence, &ar);
+		break;
+
+	case WATER_AGG_HEADER:
+		if ((rc = water_agg(w, n, data, len)) <= 0)
+			goto refused;
+		break;
+
+	case AIRBORNE_AGG_HEADER:
+		if ((rc = airborne_agg(w, n, data, len)) <= 0)
+			goto refused;
+		break;
+
+	case WATER_CAL_HEADER:
+		if (len != sizeof(water_cal_t))
+			goto malformed;
+		// a repeated cal frame changes nothing, but it may be the first of a new run
+		fresh(w, n, sequence);
+		calibration(w, n, STORE_WATER, data, len);
+		if (verbose)
+			printf("%s water calibration seq=%u version=%u\n", node_name(n), sequence,
+			       n->cal_version[STORE_WATER]);
+		break;
+
+	case AIRBORNE_CAL_HEADER:
+		if (len != sizeof(airborne_cal_t))
+			goto malformed;
+		fresh(w, n, sequence);
+		calibration(w, n, STORE_AIRBORNE, data, len);
+		if (verbose)
+			printf("%s airborne calibration seq=%u version=%u\n", node_name(n), sequence,
+			       n->cal_version[STORE_AIRBORNE]);
+		break;
+
+	default:
+		STAT_ADD(w, unknown, 1);
+		return 0;
+	}
+
+	ack->header = ACK_HEADER;
+	ack->sequence = sequence;
+	ack->ack_seq = sequence;
+	ack->ack_value = ACK_OK;
+
+	if (n->want_cal && (req != NULL)) {
+		req->header = CAL_REQUEST_HEADER;
+		req->sequence = sequence;
+		req->cal_header = n->want_cal;
+		req->reserved = 0;
+		n->cal_requested_ms[(n->want_cal == WATER_CAL_HEADER) ? STORE_WATER : STORE_AIRBORNE] = w->now_ms;
+		n->want_cal = 0;
+		STAT_ADD(w, cal_requests, 1);
+	}
+	return 1;
+
+refused:
+	// a missing delta reference is counted already, and is not the node's
+	// fault: tell it, so it stops resending and sends a keyframe next
+	if (rc < 0) {
+		ack->header = ACK_HEADER;
+		ack->sequence = sequence;
+		ack->ack_seq = sequence;
+		ack->ack_value = ACK_NO_REF;
+		return 1;
+	}
+malformed:
+	STAT_ADD(w, malformed, 1);
+	return 0;
+}
+
+/*
+ * The worker the steering program sends an address to: the low 32 bits
+ * of the source address (the IPv4 address for mapped ones), modulo the
+ * number of workers.
+ */
+static int address_worker(const struct in6_addr *addr)
+{
+	uint32_t low;
+
+	memcpy(&low, &addr->s6_addr[12], sizeof(low));
+	return ntohl(low) % worker_count;
+}
+
+// queue a 16 byte reply (ack_t or cal_request_t) to the sender of datagram i
+static void reply(struct worker *w, int n, int i, void *frame)
+{
+	w->tx_iov[n].iov_base = frame;
+	w->tx_iov[n].iov_len = sizeof(ack_t);
+	memset(&w->tx[n], 0, sizeof(w->tx[n]));
+	w->tx[n].msg_hdr.msg_name = &w->peers[i];
+	w->tx[n].msg_hdr.msg_namelen = w->rx[i].msg_hdr.msg_namelen;
+	w->tx[n].msg_hdr.msg_iov = &w->tx_iov[n];
+	w->tx[n].msg_hdr.msg_iovlen = 1;
+}
+
+/*
+ * Drain the socket: read batches until it would block, ACK each batch
+ * with one sendmmsg().
+ */
+static void drain(struct worker *w)
+{
+	int i, j, got, n, sent, acks;
+
+	while (1) {
+		for (i = 0; i < RX_BATCH; i++) {
+			w->rx[i].msg_hdr.msg_name = &w->peers[i];
+			w->rx[i].msg_hdr.msg_namelen = sizeof(w->peers[i]);
+		}
+
+		got = recvmmsg(w->sock, w->rx, RX_BATCH, MSG_DONTWAIT, NULL);
+		if (got <= 0) {
+			if ((got < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+				perror("recvmmsg");
+			return;
+		}
+
+		w->now_ms = now_ms();
+
+		for (i = 0, n = 0; i < got; i++) {
+			// state for this address lives in another worker too
+			if (!key_port && (address_worker(&w->peers[i].sin6_addr) != w->index))
+				STAT_ADD(w, strays, 1);
+
+			w->cal_requests[i].header = 0;
+			if (!handle_frame(w, &w->peers[i], w->bufs[i], w->rx[i].msg_len, &w->acks[i], &w->cal_requests[i]))
+				continue;
+
+			reply(w, n++, i, &w->acks[i]);
+			// after the ACK, so an older node has its answer first
+			if (w->cal_requests[i].header)
+				reply(w, n++, i, &w->cal_requests[i]);
+		}
+
+		for (i = 0; i < n; i += sent) {
+			sent = sendmmsg(w->sock, &w->tx[i], n - i, MSG_DONTWAIT);
+			if (sent <= 0) {
+				// a full send buffer loses the ACKs, the nodes will retry
+				STAT_ADD(w, send_errors, n - i);
+				break;
+			}
+			// the calibration requests among them were counted when they were made,
+			// the refusals as no-ref
+			for (j = i, acks = 0; j < i + sent; j++)
+				acks += (((const ack_t *) w->tx_iov[j].iov_base)->header == ACK_HEADER) &&
+				        (((const ack_t *) w->tx_iov[j].iov_base)->ack_value == ACK_OK);
+			STAT_ADD(w, acks, acks);
+		}
+
+		if (got < RX_BATCH)
+			return;
+	}
+}
+
+/*
+ * Answer a frame taken from a connection, framed for a session.  A
+ * connection that cannot take the reply right away is given up on, the
+ * node resends what it did not see ACK'd.
+ */
+static int conn_reply(struct worker *w, struct conn *c, const void *frame)
+{
+	uint8_t out[FRAME_PREFIX + sizeof(ack_t)];
+	const uint8_t *p = out;
+	int len = sizeof(out);
+
+	out[0] = sizeof(ack_t) >> 8;
+	out[1] = sizeof(ack_t) & 0xff;
+	memcpy(out + FRAME_PREFIX, frame, sizeof(ack_t));
+	if (!c->framed) {
+		p += FRAME_PREFIX;
+		len -= FRAME_PREFIX;
+	}
+
+	if (send(c->fd, p, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+		STAT_ADD(w, send_errors, 1);
+		return -1;
+	}
+	if ((((const ack_t *) frame)->header == ACK_HEADER) && (((const ack_t *) frame)->ack_value == ACK_OK))
+		STAT_ADD(w, acks, 1);
+	return 0;
+}
+
+static void conn_close(struct conn *c)
+{
+	close(c->fd);
+	c->fd = -1;
+}
+
+/*
+ * Decode one frame from a connection and answer it.  A bare connection
+ * gets the ACK alone, the node takes a reply of any other size for
+ * something else.
+ */
+static int conn_frame(struct worker *w, struct conn *c, const uint8_t *data, int len)
+{
+	ack_t ack;
+	cal_request_t req;
+
+	req.header = 0;
+	if (!handle_frame(w, &c->peer, data, len, &ack, c->framed ? &req : NULL))
+		return 0;
+	if (conn_reply(w, c, &ack) < 0)
+		return -1;
+	if (req.header && (conn_reply(w, c, &req) < 0))
+		return -1;
+	return 0;
+}
+
+// take the connections waiting on the worker's listener
+static void conn_accept(struct worker *w)
+{
+	struct sockaddr_in6 peer;
+	socklen_t peerlen;
+	struct epoll_event ev;
+	struct conn *c;
+	int fd, i;
+
+	while (1) {
+		peerlen = sizeof(peer);
+		fd = accept4(w->listener, (struct sockaddr *) &peer, &peerlen, SOCK_NONBLOCK);
+		if (fd < 0)
+			return;
+
+		for (i = 0, c = NULL; (i < TCP_CONNS) && (c == NULL); i++) {
+			if (w->conns[i].fd < 0)
+				c = &w->conns[i];
+		}
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+
+		c->fd = fd;
+		c->framed = -1;
+		c->len = 0;
+		c->peer = peer;
+
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		epoll_ctl(w->ep, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+/*
+ * Read what a connection has, and take the frames in it.  The connection
+ * is closed when the node closes it or falls out of step.
+ */
+static void conn_read(struct worker *w, struct conn *c)
+{
+	int got, flen, off;
+
+	while (1) {
+		got = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, MSG_DONTWAIT);
+		if (got <= 0) {
+			if ((got == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+				conn_close(c);
+			return;
+		}
+		c->len += got;
+		w->now_ms = now_ms();
+
+		if (c->framed < 0) {
+			if (c->len < FRAME_PREFIX)
+				continue;
+			c->framed = (((c->buf[0] << 8) | c->buf[1]) <= RX_MAX);
+		}
+
+		if (!c->framed) {
+			if (conn_frame(w, c, c->buf, c->len) < 0) {
+				conn_close(c);
+				return;
+			}
+			c->len = 0;
+			continue;
+		}
+
+		for (off = 0; c->len - off >= FRAME_PREFIX; off += FRAME_PREFIX + flen) {
+			flen = (c->buf[off] << 8) | c->buf[off + 1];
+			if (flen > RX_MAX) {
+				STAT_ADD(w, malformed, 1);
+				conn_close(c);
+				return;
+			}
+			if (c->len - off < FRAME_PREFIX + flen)
+				break;
+			if (conn_frame(w, c, c->buf + off + FRAME_PREFIX, flen) < 0) {
+				conn_close(c);
+				return;
+			}
+		}
+		memmove(c->buf, c->buf + off, c->len - off);
+		c->len -= off;
+	}
+}
+
+static struct conn *conn_find(struct worker *w, int fd)
+{
+	int i;
+
+	for (i = 0; i < TCP_CONNS; i++) {
+		if (w->conns[i].fd == fd)
+			return &w->conns[i];
+	}
+	return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event ev, events[16];
+	struct conn *c;
+	int i, n;
+
+	w->ep = epoll_create1(0);
+	ev.events = EPOLLIN;
+	ev.data.fd = w->sock;
+	epoll_ctl(w->ep, EPOLL_CTL_ADD, w->sock, &ev);
+	ev.data.fd = stop_fd;
+	epoll_ctl(w->ep, EPOLL_CTL_ADD, stop_fd, &ev);
+	if (w->listener >= 0) {
+		ev.data.fd = w->listener;
+		epoll_ctl(w->ep, EPOLL_CTL_ADD, w->listener, &ev);
+	}
+	for (i = 0; i < TCP_CONNS; i++)
+		w->conns[i].fd = -1;
+
+	while (1) {
+		// wake up once a second to write out idle series
+		n = epoll_wait(w->ep, events, 16, (store != NULL) ? 1000 : -1);
+		if ((n < 0) && (errno != EINTR)) {
+			perror("epoll_wait");
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == stop_fd)
+				goto stop;
+			if (events[i].data.fd == w->sock)
+				drain(w);
+			else if (events[i].data.fd == w->listener)
+				conn_accept(w);
+			else if ((c = conn_find(w, events[i].data.fd)) != NULL)
+				conn_read(w, c);
+		}
+
+		if (store != NULL) {
+			w->now_ms = now_ms();
+			if (w->now_ms - w->flushed_ms >= 1000)
+				flush_series(w, flush_idle_ms);
+		}
+	}
+
+stop:
+	for (i = 0; i < TCP_CONNS; i++) {
+		if (w->conns[i].fd >= 0)
+			conn_close(&w->conns[i]);
+	}
+	for (i = 0; i < w->node_cap; i++) {
+		for (n = 0; n < STORE_KINDS; n++)
+			store_series_close(w->nodes[i].series[n]);
+	}
+	close(w->ep);
+	return NULL;
+}
+
+/*
+ * A record of the calibration log, into the node of the worker its
+ * frames will reach.  With -P the kernel picks the worker from the port
+ * too, so every worker gets a copy.  Later records replace earlier ones.
+ */
+static void cal_loaded(const calcache_record_t *r, void *ctx)
+{
+	struct node_key key;
+	struct node *n;
+	int i, counted, *count = ctx;
+
+	if ((r->kind >= STORE_KINDS) ||
+	    (r->length != ((r->kind == STORE_WATER) ? sizeof(water_cal_t) : sizeof(airborne_cal_t))))
+		return;
+
+	memset(&key, 0, sizeof(key));
+	memcpy(&key.addr, r->addr, sizeof(key.addr));
+	key.port = r->port;
+
+	for (i = 0, counted = 0; i < worker_count; i++) {
+		if (!key_port && (i != address_worker(&key.addr)))
+			continue;
+
+		n = node_get(&workers[i], &key);
+		if ((n->cal_version[r->kind] == 0) && !counted++)
+			(*count)++;
+		memcpy((r->kind == STORE_WATER) ? (void *) &n->water_cal : (void *) &n->airborne_cal, &r->cal, r->length);
+		n->cal_version[r->kind] = r->version;
+	}
+}
+
+static void sum_stats(struct stats *total)
+{
+	uint64_t *t = (uint64_t *) total, *f;
+	int i, j;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < worker_count; i++) {
+		f = (uint64_t *) &workers[i].stats;
+		for (j = 0; j < sizeof(*total) / sizeof(uint64_t); j++)
+			t[j] += __atomic_load_n(&f[j], __ATOMIC_RELAXED);
+	}
+}
+
+static void print_stats(double elapsed)
+{
+	static struct stats last;
+	struct stats stats;
+
+	sum_stats(&stats);
+
+	fprintf(stderr, "nodes %llu  frames %llu (%.0f/s)  readings %llu  acks %llu  "
+	        "malformed %llu  unknown %llu  no-ref %llu  send-errors %llu  strays %llu  store-errors %llu  "
+	        "uncalibrated %llu  cal-requests %llu  cal-changes %llu  duplicates %llu  reboots %llu\n",
+	        (unsigned long long) stats.nodes,
+	        (unsigned long long) stats.frames, (stats.frames - last.frames) / elapsed,
+	        (unsigned long long) stats.readings, (unsigned long long) stats.acks,
+	        (unsigned long long) stats.malformed, (unsigned long long) stats.unknown,
+	        (unsigned long long) stats.no_ref, (unsigned long long) stats.send_errors,
+	        (unsigned long long) stats.strays, (unsigned long long) stats.store_errors,
+	        (unsigned long long) stats.uncalibrated, (unsigned long long) stats.cal_requests,
+	        (unsigned long long) stats.cal_changes, (unsigned long long) stats.duplicates,
+	        (unsigned long long) stats.reboots);
+	last = stats;
+}
+
+/*
+ * Steer each datagram to the socket address_worker() picks, so a node
+ * always reaches the same worker even when its source port changes (a
+ * reboot).  The program sees the packet from the UDP payload on, the IP
+ * header is reached through SKF_NET_OFF.
+ */
+static int steer_by_address(int sock)
+{
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 2),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 20),	// IPv6 source, low word
+		BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),	// IPv4 source
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, worker_count),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+	return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+static int open_socket(int port)
+{
+	struct sockaddr_in6 addr;
+	int s, on = 1, off = 0, rcvbuf = 8 << 20;
+
+	s = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (s < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	// dual stack, so IPv4 simulators on the host are answered too
+	setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+	setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(s, SOL_SOCKET, SO_SNDBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = htons(port);
+	addr.sin6_addr = in6addr_any;
+
+	if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	return s;
+}
+
+static int open_listener(int port)
+{
+	struct sockaddr_in6 addr;
+	int s, on = 1, off = 0;
+
+	s = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (s < 0) {
+		perror("socket");
+		exit(1);
+	}
+
+	setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = htons(port);
+	addr.sin6_addr = in6addr_any;
+
+	if ((bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) || (listen(s, 128) < 0)) {
+		perror("TCP bind");
+		exit(1);
+	}
+
+	return s;
+}
+
+int main(int argc, char **argv)
+{
+	const char *store_root = NULL, *cal_path = NULL;
+	char cal_default[512];
+	int opt, port = 5323, interval = 5, cals = 0;
+	int tfd, sfd, ep, i, n;
+	struct epoll_event ev, events[2];
+	struct itimerspec its;
+	sigset_t mask;
+	uint64_t ticks, one = 1;
+
+	while ((opt = getopt(argc, argv, "p:t:i:w:o:F:c:vP")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 't': tcp_port = atoi(optarg); break;
+		case 'i': interval = atoi(optarg); break;
+		case 'w': worker_count = atoi(optarg); break;
+		case 'o': store_root = optarg; break;
+		case 'F': flush_idle_ms = atoi(optarg) * 1000LL; break;
+		case 'c': cal_path = optarg; break;
+		case 'v': verbose = 1; break;
+		case 'P': key_port = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-t TCP port] [-w workers] [-i stats seconds] [-o store] "
+			        "[-F flush seconds] [-c calibration log] [-v] [-P]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (interval < 1)
+		interval = 1;
+	if (worker_count < 1)
+		worker_count = 1;
+
+	if ((store_root != NULL) && ((store = store_open(store_root)) == NULL))
+		return 1;
+
+	if ((cal_path == NULL) && (store_root != NULL)) {
+		snprintf(cal_default, sizeof(cal_default), "%s/calibration.log", store_root);
+		cal_path = cal_default;
+	}
+
+	// workers inherit the mask, so only this thread sees the signals
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_NONBLOCK);
+
+	stop_fd = eventfd(0, EFD_NONBLOCK);
+
+	if (posix_memalign((void **) &workers, 64, worker_count * sizeof(*workers)) != 0) {
+		perror("posix_memalign");
+		return 1;
+	}
+	memset(workers, 0, worker_count * sizeof(*workers));
+
+	// bind order is the socket's index in the reuseport group
+	for (i = 0; i < worker_count; i++) {
+		struct worker *w = &workers[i];
+		int j;
+
+		w->index = i;
+		w->node_cap = 1024;
+		w->nodes = calloc(w->node_cap, sizeof(*w->nodes));
+		w->sock = open_socket(port);
+		w->listener = tcp_port ? open_listener(tcp_port) : -1;
+		for (j = 0; j < RX_BATCH; j++) {
+			w->rx_iov[j].iov_base = w->bufs[j];
+			w->rx_iov[j].iov_len = sizeof(w->bufs[j]);
+			w->rx[j].msg_hdr.msg_iov = &w->rx_iov[j];
+			w->rx[j].msg_hdr.msg_iovlen = 1;
+		}
+	}
+
+	// the nodes' calibrations from the last run
+	if (cal_path != NULL) {
+		if ((calcache_load(cal_path, cal_loaded, &cals) < 0) || ((cal_fd = calcache_open(cal_path)) < 0))
+			return 1;
+		fprintf(stderr, "Loaded %d calibrations from %s\n", cals, cal_path);
+	}
+
+	// with -P the kernel's own (address, port) hash already shards by node
+	if (!key_port && (worker_count > 1) && (steer_by_address(workers[0].sock) < 0))
+		perror("SO_ATTACH_REUSEPORT_CBPF, nodes may move between workers");
+	if (!key_port && (worker_count > 1) && tcp_port && (steer_by_address(workers[0].listener) < 0))
+		perror("SO_ATTACH_REUSEPORT_CBPF on TCP, nodes may move between workers");
+
+	for (i = 0; i < worker_count; i++)
+		pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = interval;
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	ep = epoll_create1(0);
+	ev.events = EPOLLIN;
+	ev.data.fd = tfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+	ev.data.fd = sfd;
+	epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+
+	fprintf(stderr, "Collecting on UDP port %d, TCP port %d with %d worker%s\n", port, tcp_port, worker_count,
+	        (worker_count == 1) ? "" : "s");
+
+	while (1) {
+		n = epoll_wait(ep, events, 2, -1);
+		if ((n < 0) && (errno != EINTR)) {
+			perror("epoll_wait");
+			return 1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == tfd) {
+				if (read(tfd, &ticks, sizeof(ticks)) == sizeof(ticks))
+					print_stats(ticks * interval);
+			}
+			else if (events[i].data.fd == sfd) {
+				if (write(stop_fd, &one, sizeof(one)) < 0)
+					perror("write");
+				for (i = 0; i < worker_count; i++)
+					pthread_join(workers[i].thread, NULL);
+				print_stats(interval);
+				if (store != NULL)
+					store_close(store);
+				return 0;
+			}
+		}
+	}
+}
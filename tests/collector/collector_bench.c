@@ -0,0 +1,203 @@
+/*
+ * collector_bench.c
+ *
+ * Flood a collector with water_data_t frames and measure the ACK rate.
+ *
+ *   collector_bench [-h host] [-p port] [-t threads] [-n nodes] [-w window] [-d seconds]
+ *
+ * Each of the -t sender threads drives its share of the -n synthetic
+ * nodes.  Every node has its own socket bound to its own loopback address
+ * (127.0.x.y), so the collector's per-address steering spreads them over
+ * its workers as it would a real fleet.  A node keeps up to -w frames
+ * unACK'd, which keeps the collector busy without just filling its
+ * socket buffer.  Run the collector with increasing -w worker counts
+ * against the same load to see how it scales, e.g.
+ *
+ *   for w in 1 2 4 8; do
+ *       ./collector -w $w -i 60 & sleep 1
+ *       ./collector_bench -t 8 -n 512 -d 10
+ *       kill %1; wait
+ *   done
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "message.h"
+
+#define BURST 16
+
+struct sender {
+	pthread_t thread;
+	int first, count;
+	int *socks;
+	uint32_t *next_seq, *acked;
+	uint64_t sent, acks;
+};
+
+static struct sockaddr_in collector;
+static int window = 32;
+static volatile int running = 1;
+
+static double now_s( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_node(int node)
+{
+	struct sockaddr_in addr;
+	int s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(0x7f000000 | (node + 2));	// 127.0.0.2 on
+
+	if ((s < 0) || (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+		perror("node socket");
+		exit(1);
+	}
+	return s;
+}
+
+static void *sender_main(void *arg)
+{
+	struct sender *s = arg;
+	water_data_t frames[BURST];
+	struct iovec iov[BURST];
+	struct mmsghdr msgs[BURST];
+	ack_t acks[BURST];
+	int i, j, n, got;
+
+	memset(frames, 0, sizeof(frames));
+	memset(msgs, 0, sizeof(msgs));
+
+	while (running) {
+		for (i = 0; i < s->count; i++) {
+			// top up the node's window
+			n = window - (int) (s->next_seq[i] - s->acked[i]);
+			if (n > BURST)
+				n = BURST;
+			for (j = 0; j < n; j++) {
+				frames[j].header = WATER_DATA_HEADER;
+				frames[j].sequence = s->next_seq[i] + j;
+				frames[j].pressure = 5300000 + j;
+				iov[j].iov_base = &frames[j];
+				iov[j].iov_len = sizeof(water_data_t);
+				msgs[j].msg_hdr.msg_name = &collector;
+				msgs[j].msg_hdr.msg_namelen = sizeof(collector);
+				msgs[j].msg_hdr.msg_iov = &iov[j];
+				msgs[j].msg_hdr.msg_iovlen = 1;
+			}
+			if ((n > 0) && ((got = sendmmsg(s->socks[i], msgs, n, MSG_DONTWAIT)) > 0)) {
+				s->next_seq[i] += got;
+				s->sent += got;
+			}
+
+			// collect whatever came back
+			for (j = 0; j < BURST; j++) {
+				iov[j].iov_base = &acks[j];
+				iov[j].iov_len = sizeof(ack_t);
+				msgs[j].msg_hdr.msg_name = NULL;
+				msgs[j].msg_hdr.msg_namelen = 0;
+			}
+			got = recvmmsg(s->socks[i], msgs, BURST, MSG_DONTWAIT, NULL);
+			for (j = 0; j < got; j++) {
+				if ((msgs[j].msg_len == sizeof(ack_t)) && (acks[j].header == ACK_HEADER)) {
+					s->acks++;
+					s->acked[i]++;
+				}
+			}
+
+			// a frame lost on the way: give its window slot back
+			if ((s->next_seq[i] - s->acked[i]) >= window)
+				s->acked[i] = s->next_seq[i] - window / 2;
+		}
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	int opt, port = 5323, threads = 4, nodes = 256, seconds = 10, i;
+	struct sender *senders;
+	uint64_t sent = 0, acks = 0;
+	double t0, elapsed;
+
+	while ((opt = getopt(argc, argv, "h:p:t:n:w:d:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'n': nodes = atoi(optarg); break;
+		case 'w': window = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-h host] [-p port] [-t threads] [-n nodes] [-w window] [-d seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (threads < 1)
+		threads = 1;
+	if (nodes < threads)
+		nodes = threads;
+	if (window < 2)
+		window = 2;
+
+	memset(&collector, 0, sizeof(collector));
+	collector.sin_family = AF_INET;
+	collector.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &collector.sin_addr) != 1) {
+		fprintf(stderr, "bad IPv4 address %s\n", host);
+		return 1;
+	}
+
+	senders = calloc(threads, sizeof(*senders));
+	for (i = 0; i < threads; i++) {
+		struct sender *s = &senders[i];
+		int j;
+
+		s->first = i * nodes / threads;
+		s->count = (i + 1) * nodes / threads - s->first;
+		s->socks = calloc(s->count, sizeof(int));
+		s->next_seq = calloc(s->count, sizeof(uint32_t));
+		s->acked = calloc(s->count, sizeof(uint32_t));
+		for (j = 0; j < s->count; j++)
+			s->socks[j] = open_node(s->first + j);
+	}
+
+	t0 = now_s();
+	for (i = 0; i < threads; i++)
+		pthread_create(&senders[i].thread, NULL, sender_main, &senders[i]);
+
+	sleep(seconds);
+	running = 0;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(senders[i].thread, NULL);
+		sent += senders[i].sent;
+		acks += senders[i].acks;
+	}
+	elapsed = now_s() - t0;
+
+	printf("nodes             : %d on %d threads\n", nodes, threads);
+	printf("frames sent       : %llu (%.0f/s)\n", (unsigned long long) sent, sent / elapsed);
+	printf("ACKs              : %llu (%.0f/s)\n", (unsigned long long) acks, acks / elapsed);
+	printf("ACK ratio         : %.3f\n", sent ? (double) acks / sent : 0.0);
+
+	return 0;
+}
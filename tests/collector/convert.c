@@ -0,0 +1,122 @@
+/*
+ * convert.c
+ *
+ * Raw readings to physical units, see convert.h.
+ */
+#include <string.h>
+
+#include "convert.h"
+
+void convert_cal_water(convert_cal_t *cal, const water_cal_t *msg)
+{
+	memset(cal, 0, sizeof(*cal));
+	memcpy(cal->ms5637, msg->caldata, sizeof(cal->ms5637));
+
+	// the node's local calibration values are sent as resistorVals
+	cal->si7210_range = msg->resistorVals[0];
+	cal->tcs3472_gain = msg->resistorVals[1] & 0x03;
+	cal->tcs3472_atime = msg->resistorVals[2];
+}
+
+void convert_cal_airborne(convert_cal_t *cal, const airborne_cal_t *msg)
+{
+	memset(cal, 0, sizeof(*cal));
+	memcpy(cal->ms5637, msg->caldata, sizeof(cal->ms5637));
+}
+
+void convert_ms5637(const convert_cal_t *cal, const uint32_t *restrict d1, const uint32_t *restrict d2, int n,
+                    float *restrict pressure, float *restrict temperature)
+{
+	const double c1 = cal->ms5637[0] * 65536.0;
+	const double c2 = cal->ms5637[1] * 131072.0;
+	const double c3 = cal->ms5637[2] / 128.0;
+	const double c4 = cal->ms5637[3] / 64.0;
+	const double c5 = cal->ms5637[4] * 256.0;
+	const double c6 = cal->ms5637[5] / 8388608.0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		// conversions are 24 bits, the signed conversion is the cheap one
+		double dt = (int32_t) d2[i] - c5;
+		double temp = 2000.0 + dt * c6;
+		double off = c2 + c4 * dt;
+		double sens = c1 + c3 * dt;
+		double lo = temp - 2000.0, vlo = temp + 1500.0;
+		double low = (temp < 2000.0) ? 1.0 : 0.0;
+		double very_low = (temp < -1500.0) ? 1.0 : 0.0;
+		double t2, off2, sens2;
+
+		// second order: every term is computed and weighed by the conditions, no branches
+		t2 = dt * dt * (5.0 / 274877906944.0 + low * (3.0 / 8589934592.0 - 5.0 / 274877906944.0));
+		off2 = lo * lo * low * (61.0 / 16.0) + vlo * vlo * very_low * 17.0;
+		sens2 = lo * lo * low * (29.0 / 16.0) + vlo * vlo * very_low * 9.0;
+
+		temp -= t2;
+		off -= off2;
+		sens -= sens2;
+
+		// P in 0.01 mbar, TEMP in 0.01 C
+		pressure[i] = (float) (((int32_t) d1[i] * sens / 2097152.0 - off) / (32768.0 * 100.0));
+		temperature[i] = (float) (temp / 100.0);
+	}
+}
+
+void convert_si7210(const convert_cal_t *cal, const int16_t *restrict raw, int n, float *restrict field)
+{
+	// sets 1 and 3 are the 200 mT ones
+	const float scale = (cal->si7210_range & 1) ? CONVERT_SI7210_200MT : CONVERT_SI7210_20MT;
+	int i;
+
+	for (i = 0; i < n; i++)
+		field[i] = (float) (raw[i] - CONVERT_SI7210_ZERO) * scale;
+}
+
+// DN40 coefficients, open air (GA = 1)
+#define DN40_R (0.136f)
+#define DN40_G (1.000f)
+#define DN40_B (-0.444f)
+#define DN40_DF (310.0f)
+#define DN40_CT (3810.0f)
+#define DN40_CT_OFFSET (1391.0f)
+
+void convert_tcs3472(const convert_cal_t *cal, const uint16_t *restrict r, const uint16_t *restrict g,
+                     const uint16_t *restrict b, const uint16_t *restrict c, int n,
+                     float *restrict lux, float *restrict cct)
+{
+	static const float gains[4] = { 1.0f, 4.0f, 16.0f, 60.0f };
+	const float atime_ms = (256 - cal->tcs3472_atime) * CONVERT_TCS3472_CYCLE_MS;
+	const float per_count = DN40_DF / (atime_ms * gains[cal->tcs3472_gain & 0x03]);
+	int i;
+
+	for (i = 0; i < n; i++) {
+		float rf = r[i], gf = g[i], bf = b[i];
+		float ir = (rf + gf + bf - (float) c[i]) * 0.5f;
+		float l, red, valid;
+
+		rf -= ir;
+		gf -= ir;
+		bf -= ir;
+
+		l = (DN40_R * rf + DN40_G * gf + DN40_B * bf) * per_count;
+		lux[i] = (l > 0.0f) ? l : 0.0f;
+
+		// computed for every row and zeroed where there is too little red, without branches
+		red = (rf >= 1.0f) ? rf : 1.0f;
+		valid = (rf >= 1.0f) ? 1.0f : 0.0f;
+		cct[i] = (DN40_CT * bf / red + DN40_CT_OFFSET) * valid;
+	}
+}
+
+void convert_si7020(const uint32_t *restrict humid, const uint32_t *restrict temp, int n,
+                    float *restrict rh, float *restrict temperature)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		float h = (int32_t) humid[i] * (125.0f / 65536.0f) - 6.0f;
+
+		h = (h > 0.0f) ? h : 0.0f;
+		rh[i] = (h < 100.0f) ? h : 100.0f;
+		temperature[i] = (int32_t) temp[i] * (175.72f / 65536.0f) - 46.85f;
+	}
+}
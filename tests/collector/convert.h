@@ -0,0 +1,73 @@
+/*
+ * convert.h
+ *
+ * Batch conversion of raw readings into physical units.
+ *
+ * The nodes send what their sensors report: MS5637 ADC counts (D1
+ * pressure, D2 temperature) with the PROM coefficients in the cal
+ * frame, the Si7210 15 bit field code, TCS3472 RGBC counts and Si7020
+ * humidity / temperature codes.  The functions here take a column of
+ * each raw value - the store's columns can be passed as they are (see
+ * store_block_column()) - and the node's calibration, and write one
+ * column per physical value.  The loops are branch free over plain
+ * arrays so the compiler can vectorise them.
+ *
+ * MS5637 compensation, second order included, follows the datasheet
+ * but is computed in double precision rather than with the datasheet's
+ * truncating integer shifts; the two agree to well below the sensor's
+ * resolution (convert_bench checks this).
+ */
+
+#ifndef TESTS_COLLECTOR_CONVERT_H_
+#define TESTS_COLLECTOR_CONVERT_H_
+
+#include <stdint.h>
+
+#include "message.h"
+
+// Si7210 field codes are offset by 2^14, 0.00125 mT per LSB in the 20 mT range
+#define CONVERT_SI7210_ZERO (16384)
+#define CONVERT_SI7210_20MT (0.00125f)
+#define CONVERT_SI7210_200MT (0.0125f)
+
+// TCS3472 integration cycle, ms
+#define CONVERT_TCS3472_CYCLE_MS (2.4f)
+
+typedef struct {
+	// MS5637 PROM, C1 .. C6
+	uint16_t ms5637[6];
+
+	// Si7210 OTP compensation set (local calibration 0), selects the range
+	uint16_t si7210_range;
+
+	// TCS3472 gain code (0 - 3: 1x, 4x, 16x, 60x) and ATIME register
+	uint8_t tcs3472_gain;
+	uint8_t tcs3472_atime;
+} convert_cal_t;
+
+// the calibration carried by a node's cal frame
+void convert_cal_water(convert_cal_t *cal, const water_cal_t *msg);
+void convert_cal_airborne(convert_cal_t *cal, const airborne_cal_t *msg);
+
+/*
+ * MS5637: d1 / d2 are the raw pressure and temperature conversions.
+ * Writes mbar and degrees C.
+ */
+void convert_ms5637(const convert_cal_t *cal, const uint32_t *d1, const uint32_t *d2, int n,
+                    float *pressure, float *temperature);
+
+// Si7210: raw field codes to mT
+void convert_si7210(const convert_cal_t *cal, const int16_t *raw, int n, float *field);
+
+/*
+ * TCS3472: illuminance (lux) and correlated colour temperature (K)
+ * from the RGBC counts, after the TAOS DN40 application note.  CCT is
+ * 0 where there is too little red to estimate it.
+ */
+void convert_tcs3472(const convert_cal_t *cal, const uint16_t *r, const uint16_t *g,
+                     const uint16_t *b, const uint16_t *c, int n, float *lux, float *cct);
+
+// Si7020: humidity (%RH, clamped to 0 - 100) and degrees C
+void convert_si7020(const uint32_t *humid, const uint32_t *temp, int n, float *rh, float *temperature);
+
+#endif /* TESTS_COLLECTOR_CONVERT_H_ */
@@ -0,0 +1,210 @@
+/*
+ * convert_bench.c
+ *
+ * Check and time the batch conversions (convert.h).
+ *
+ *   convert_bench [-n records] [-b batch] [-r rounds]
+ *
+ * The MS5637 conversion is first checked against the datasheet's worked
+ * example and against its integer reference code over -40 to 85 C.
+ * Then -n synthetic water readings are converted -r times in batches
+ * of -b records (a store block by default), and the rate of every
+ * conversion, and of all of them together, is reported in records per
+ * second on one core.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "convert.h"
+#include "store.h"
+
+static double now_s( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the datasheet's compensation, integer arithmetic; 0.01 mbar and 0.01 C
+static void ms5637_reference(const uint16_t *c, uint32_t d1, uint32_t d2, int32_t *p, int32_t *t)
+{
+	int64_t dt = (int64_t) d2 - ((int64_t) c[4] << 8);
+	int64_t temp = 2000 + ((dt * c[5]) >> 23);
+	int64_t off = ((int64_t) c[1] << 17) + ((c[3] * dt) >> 6);
+	int64_t sens = ((int64_t) c[0] << 16) + ((c[2] * dt) >> 7);
+	int64_t t2, off2, sens2;
+
+	if (temp < 2000) {
+		t2 = (3 * dt * dt) >> 33;
+		off2 = 61 * (temp - 2000) * (temp - 2000) / 16;
+		sens2 = 29 * (temp - 2000) * (temp - 2000) / 16;
+		if (temp < -1500) {
+			off2 += 17 * (temp + 1500) * (temp + 1500);
+			sens2 += 9 * (temp + 1500) * (temp + 1500);
+		}
+	}
+	else {
+		t2 = (5 * dt * dt) >> 38;
+		off2 = 0;
+		sens2 = 0;
+	}
+
+	temp -= t2;
+	off -= off2;
+	sens -= sens2;
+
+	*p = (((d1 * sens) >> 21) - off) >> 15;
+	*t = temp;
+}
+
+static int check_ms5637(const convert_cal_t *cal)
+{
+	uint32_t d1[1] = { 6465444 }, d2[1] = { 8077636 };
+	float p, t, dp = 0, dt = 0;
+	int32_t rp, rt;
+	int i, rc = 0;
+
+	// datasheet example: 20.00 C, 1100.02 mbar
+	convert_ms5637(cal, d1, d2, 1, &p, &t);
+	printf("datasheet example : %.2f mbar %.2f C (1100.02 mbar 20.00 C)\n", p, t);
+	if ((fabsf(p - 1100.02f) > 0.02f) || (fabsf(t - 20.0f) > 0.02f))
+		rc = -1;
+
+	// the whole temperature range, against the integer code
+	for (i = 0; i < 100000; i++) {
+		d1[0] = 4000000 + (uint32_t) i * 30;
+		d2[0] = 6200000 + (uint32_t) i * 38;
+
+		ms5637_reference(cal->ms5637, d1[0], d2[0], &rp, &rt);
+		convert_ms5637(cal, d1, d2, 1, &p, &t);
+		if (fabsf(p - rp / 100.0f) > dp)
+			dp = fabsf(p - rp / 100.0f);
+		if (fabsf(t - rt / 100.0f) > dt)
+			dt = fabsf(t - rt / 100.0f);
+	}
+	printf("against integer   : max difference %.4f mbar %.4f C\n", dp, dt);
+	if ((dp > 0.02f) || (dt > 0.02f))
+		rc = -1;
+
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, records = 1 << 20, batch = STORE_BLOCK_ROWS, rounds = 20, i, k, n;
+	uint32_t *d1, *d2;
+	uint16_t *r, *g, *b, *c;
+	int16_t *hall;
+	float *out1, *out2;
+	convert_cal_t cal;
+	double t0, t_ms, t_field, t_light, t_ref;
+	volatile int32_t sink = 0;
+
+	while ((opt = getopt(argc, argv, "n:b:r:")) != -1) {
+		switch (opt) {
+		case 'n': records = atoi(optarg); break;
+		case 'b': batch = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n records] [-b batch] [-r rounds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((records <= 0) || (batch <= 0) || (rounds <= 0))
+		return 1;
+
+	memset(&cal, 0, sizeof(cal));
+	cal.ms5637[0] = 46372;
+	cal.ms5637[1] = 43981;
+	cal.ms5637[2] = 29059;
+	cal.ms5637[3] = 27842;
+	cal.ms5637[4] = 31553;
+	cal.ms5637[5] = 28165;
+	cal.tcs3472_gain = 1;
+	cal.tcs3472_atime = 0xf6;
+
+	if (check_ms5637(&cal) < 0) {
+		printf("MS5637 CONVERSION MISMATCH\n");
+		return 1;
+	}
+
+	d1 = malloc(records * sizeof(*d1));
+	d2 = malloc(records * sizeof(*d2));
+	r = malloc(records * sizeof(*r));
+	g = malloc(records * sizeof(*g));
+	b = malloc(records * sizeof(*b));
+	c = malloc(records * sizeof(*c));
+	hall = malloc(records * sizeof(*hall));
+	out1 = malloc(records * sizeof(*out1));
+	out2 = malloc(records * sizeof(*out2));
+
+	srand(1);
+	for (i = 0; i < records; i++) {
+		d1[i] = 4000000 + rand() % 3000000;
+		d2[i] = 6200000 + rand() % 3800000;
+		r[i] = rand() % 4000;
+		g[i] = rand() % 4000;
+		b[i] = rand() % 4000;
+		c[i] = r[i] + g[i] + b[i] + rand() % 500;
+		hall[i] = CONVERT_SI7210_ZERO + rand() % 8000 - 4000;
+	}
+
+	t0 = now_s();
+	for (k = 0; k < rounds; k++) {
+		for (i = 0; i < records; i += batch) {
+			n = (records - i < batch) ? records - i : batch;
+			convert_ms5637(&cal, d1 + i, d2 + i, n, out1 + i, out2 + i);
+		}
+	}
+	t_ms = now_s() - t0;
+
+	t0 = now_s();
+	for (k = 0; k < rounds; k++) {
+		for (i = 0; i < records; i += batch) {
+			n = (records - i < batch) ? records - i : batch;
+			convert_si7210(&cal, hall + i, n, out1 + i);
+		}
+	}
+	t_field = now_s() - t0;
+
+	t0 = now_s();
+	for (k = 0; k < rounds; k++) {
+		for (i = 0; i < records; i += batch) {
+			n = (records - i < batch) ? records - i : batch;
+			convert_tcs3472(&cal, r + i, g + i, b + i, c + i, n, out1 + i, out2 + i);
+		}
+	}
+	t_light = now_s() - t0;
+
+	// the datasheet code, one record at a time, for comparison
+	t0 = now_s();
+	for (i = 0; i < records; i++) {
+		int32_t p, t;
+
+		ms5637_reference(cal.ms5637, d1[i], d2[i], &p, &t);
+		sink += p + t;
+	}
+	t_ref = now_s() - t0;
+
+	printf("records           : %d x %d rounds, batches of %d\n", records, rounds, batch);
+	printf("ms5637            : %6.1f M records/s (integer reference %.1f M records/s)\n",
+	       records / 1e6 * rounds / t_ms, records / 1e6 / t_ref);
+	printf("si7210            : %6.1f M records/s\n", records / 1e6 * rounds / t_field);
+	printf("tcs3472           : %6.1f M records/s\n", records / 1e6 * rounds / t_light);
+	printf("water, all three  : %6.1f M records/s\n", records / 1e6 * rounds / (t_ms + t_field + t_light));
+
+	free(d1);
+	free(d2);
+	free(r);
+	free(g);
+	free(b);
+	free(c);
+	free(hall);
+	free(out1);
+	free(out2);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * dedup.c
+ *
+ * Per node duplicate suppression, see dedup.h.
+ */
+#include <string.h>
+
+#include "dedup.h"
+
+static int seen(const dedup_t *d, uint32_t sequence)
+{
+	uint32_t pos = sequence % DEDUP_WINDOW;
+
+	return (d->bits[pos / 64] >> (pos % 64)) & 1;
+}
+
+static void mark(dedup_t *d, uint32_t sequence)
+{
+	uint32_t pos = sequence % DEDUP_WINDOW;
+
+	d->bits[pos / 64] |= 1ULL << (pos % 64);
+}
+
+static void restart(dedup_t *d, uint32_t sequence, int64_t now_ms)
+{
+	memset(d->bits, 0, sizeof(d->bits));
+	d->top = sequence;
+	d->since_ms = now_ms;
+	d->started = 1;
+	mark(d, sequence);
+}
+
+// move the top up to sequence, forgetting the positions it passes over
+static void slide(dedup_t *d, uint32_t sequence)
+{
+	uint32_t gap = sequence - d->top;
+	uint32_t from = d->top + 1;
+
+	if (gap >= DEDUP_WINDOW) {
+		memset(d->bits, 0, sizeof(d->bits));
+		gap = 0;
+	}
+
+	// a word at a time; the window divides 2^32, so positions carry on across the wrap
+	while (gap > 0) {
+		uint32_t pos = from % DEDUP_WINDOW;
+		uint32_t bit = pos % 64;
+		uint32_t n = (64 - bit < gap) ? 64 - bit : gap;
+		uint64_t mask = (n == 64) ? ~0ULL : ((1ULL << n) - 1) << bit;
+
+		d->bits[pos / 64] &= ~mask;
+		from += n;
+		gap -= n;
+	}
+
+	d->top = sequence;
+}
+
+enum dedup_result dedup_check(dedup_t *d, uint32_t sequence, int64_t now_ms)
+{
+	int32_t diff = (int32_t) (sequence - d->top);
+
+	if (!d->started) {
+		restart(d, sequence, now_ms);
+		return DEDUP_NEW;
+	}
+
+	if (diff > 0) {
+		slide(d, sequence);
+		mark(d, sequence);
+		return DEDUP_NEW;
+	}
+
+	// back to the start, too late for any frame of this run to be resent
+	if (((sequence == 0) || ((diff <= -DEDUP_WINDOW) && (sequence < DEDUP_WINDOW))) &&
+	    (now_ms - d->since_ms > DEDUP_RETRY_MS)) {
+		restart(d, sequence, now_ms);
+		return DEDUP_REBOOT;
+	}
+
+	// from before the window, nothing to tell it by
+	if (diff <= -DEDUP_WINDOW)
+		return DEDUP_NEW;
+
+	if (seen(d, sequence))
+		return DEDUP_DUPLICATE;
+
+	mark(d, sequence);
+	return DEDUP_NEW;
+}
@@ -0,0 +1,59 @@
+/*
+ * dedup.h
+ *
+ * Duplicate suppression for one node's sequence numbers.
+ *
+ * A node numbers everything it sends (a cal frame at boot, then one
+ * sequence per reading), carrying on from its last run's sequence after
+ * a reboot, and retransmits what is not ACK'd, so
+ * a lost ACK brings the same sequence back.  The window remembers the
+ * highest sequence seen and which of the DEDUP_WINDOW sequences up to it
+ * have arrived, as a bitmap indexed by sequence modulo the window.
+ * Sequences are compared with serial number arithmetic, so the window
+ * slides across the 32 bit wrap like anywhere else.  Every check and
+ * slide is a few word operations, and the state is a fixed DEDUP_WINDOW
+ * / 8 bytes per node.
+ *
+ * A node whose configuration was reset, or one on older firmware,
+ * restarts its sequence at 0 when it reboots.  A retransmit comes back
+ * within DEDUP_RETRY_MS of the frame's first transmission, so a
+ * sequence that went back to 0, or to near 0 from beyond the window,
+ * is a reboot once the current run has lasted longer than that.  The
+ * window then restarts from the new sequence.  A node that reboots
+ * sooner is taken for a retransmit and loses its first readings until
+ * it passes its old sequence.
+ *
+ * The window has to cover what a node sends within DEDUP_RETRY_MS; a
+ * sequence from further back cannot be told from a new one and is
+ * taken as new.
+ */
+
+#ifndef TESTS_COLLECTOR_DEDUP_H_
+#define TESTS_COLLECTOR_DEDUP_H_
+
+#include <stdint.h>
+
+// sequences remembered per node, a multiple of 64
+#define DEDUP_WINDOW (256)
+
+// how long after its first transmission a node can still resend a frame (8 attempts)
+#define DEDUP_RETRY_MS (120 * 1000)
+
+enum dedup_result {
+	DEDUP_NEW,
+	DEDUP_DUPLICATE,
+	DEDUP_REBOOT,		// new, and the node restarted its sequence
+};
+
+// 48 bytes, so a node's window sits in one cache line when aligned
+typedef struct {
+	int64_t since_ms;		// when the node's current run was first seen
+	uint32_t top;			// highest sequence seen
+	uint32_t started;
+	uint64_t bits[DEDUP_WINDOW / 64];
+} dedup_t;
+
+// check a sequence and record it as seen
+enum dedup_result dedup_check(dedup_t *d, uint32_t sequence, int64_t now_ms);
+
+#endif /* TESTS_COLLECTOR_DEDUP_H_ */
@@ -0,0 +1,170 @@
+/*
+ * dedup_bench.c
+ *
+ * Check and time the per node duplicate window (dedup.h).
+ *
+ *   dedup_bench [-n largest fleet] [-r rounds] [-d duplicate %]
+ *
+ * First the window is walked through retransmits, reordering, the 32
+ * bit wrap and both kinds of reboot.  Then fleets of 1000 nodes up to
+ * -n are fed -r sequences per node, interleaved across the fleet as a
+ * collector sees them, with -d percent of them repeated, and the cost
+ * per check and the state per node are reported.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dedup.h"
+
+static double now_s( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int failures;
+
+static void expect(dedup_t *d, uint32_t sequence, int64_t now_ms, enum dedup_result want, const char *what)
+{
+	static const char *names[] = { "new", "duplicate", "reboot" };
+	enum dedup_result got = dedup_check(d, sequence, now_ms);
+
+	if (got != want) {
+		printf("  %-40s sequence %u: %s, expected %s\n", what, sequence, names[got], names[want]);
+		failures++;
+	}
+}
+
+static void check( )
+{
+	dedup_t d;
+	uint32_t s;
+	int64_t t = 1000000;
+
+	memset(&d, 0, sizeof(d));
+	expect(&d, 0, t, DEDUP_NEW, "first frame");
+	expect(&d, 1, t, DEDUP_NEW, "next");
+	expect(&d, 1, t, DEDUP_DUPLICATE, "retransmit");
+	expect(&d, 0, t + 5000, DEDUP_DUPLICATE, "retransmit of the first frame");
+	expect(&d, 5, t, DEDUP_NEW, "gap");
+	expect(&d, 3, t, DEDUP_NEW, "late, inside the window");
+	expect(&d, 3, t, DEDUP_DUPLICATE, "late, repeated");
+	expect(&d, 0, t + DEDUP_RETRY_MS, DEDUP_DUPLICATE, "sequence 0 at the retry time");
+	t += DEDUP_RETRY_MS + 1;
+	expect(&d, 0, t, DEDUP_REBOOT, "sequence 0 after the retry time");
+	expect(&d, 1, t, DEDUP_NEW, "after a reboot");
+
+	// a fast node runs past its retransmits, only time tells a reboot
+	for (s = 2; s < 2000; s++)
+		dedup_check(&d, s, t);
+	expect(&d, 1999 - DEDUP_WINDOW + 1, t, DEDUP_DUPLICATE, "oldest in the window");
+	expect(&d, 1999 - DEDUP_WINDOW - 10, t, DEDUP_NEW, "older than the window");
+	expect(&d, 5, t + 1000, DEDUP_NEW, "near 0, within the retry time");
+	t += DEDUP_RETRY_MS + 1;
+	expect(&d, 0, t, DEDUP_REBOOT, "sequence 0 far behind");
+	for (s = 1; s < 100; s++)
+		dedup_check(&d, s, t);
+	t += DEDUP_RETRY_MS + 1;
+	expect(&d, 0, t, DEDUP_REBOOT, "sequence 0 inside the window");
+	for (s = 1; s < 1000; s++)
+		dedup_check(&d, s, t);
+	t += DEDUP_RETRY_MS + 1;
+	expect(&d, 7, t, DEDUP_REBOOT, "first frames of a reboot lost");
+
+	// a collector that joined a run late still knows sequence 0 is a reboot
+	memset(&d, 0, sizeof(d));
+	dedup_check(&d, 50, t);
+	expect(&d, 0, t + 1000, DEDUP_NEW, "sequence 0 of a run joined late");
+	expect(&d, 0, t + DEDUP_RETRY_MS + 1, DEDUP_REBOOT, "sequence 0 after a run joined late");
+
+	// across the wrap
+	memset(&d, 0, sizeof(d));
+	for (s = 0xfffffff0U; s != 0x10; s++)
+		expect(&d, s, t, DEDUP_NEW, "counting across the wrap");
+	expect(&d, 0xfffffff8U, t, DEDUP_DUPLICATE, "before the wrap, repeated");
+	expect(&d, 0x4, t, DEDUP_DUPLICATE, "after the wrap, repeated");
+
+	// a jump of exactly the window, and one word boundary at a time
+	memset(&d, 0, sizeof(d));
+	dedup_check(&d, 1000, t);
+	expect(&d, 1000 + DEDUP_WINDOW, t, DEDUP_NEW, "jump of the window");
+	expect(&d, 1000, t, DEDUP_NEW, "slid out of the window");
+	for (s = 1001 + DEDUP_WINDOW; s < 1001 + 3 * DEDUP_WINDOW; s += 63)
+		expect(&d, s, t, DEDUP_NEW, "sliding 63 at a time");
+	expect(&d, s - 63 - 62, t, DEDUP_NEW, "skipped over while sliding");
+
+	printf("window checks     : %s\n", failures ? "FAILED" : "ok");
+}
+
+int main(int argc, char **argv)
+{
+	int opt, largest = 1000000, rounds = 64, dup_pct = 10, nodes, r, i;
+	dedup_t *fleet;
+	uint32_t *order;
+	uint64_t checks, duplicates;
+	double t0, t;
+
+	while ((opt = getopt(argc, argv, "n:r:d:")) != -1) {
+		switch (opt) {
+		case 'n': largest = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		case 'd': dup_pct = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n largest fleet] [-r rounds] [-d duplicate %%]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	check();
+	if (failures)
+		return 1;
+
+	printf("state per node    : %zu bytes\n", sizeof(dedup_t));
+
+	for (nodes = 1000; nodes <= largest; nodes *= 10) {
+		fleet = calloc(nodes, sizeof(*fleet));
+		order = malloc(nodes * sizeof(*order));
+
+		// nodes report in a random order each round
+		for (i = 0; i < nodes; i++)
+			order[i] = i;
+		srand(1);
+		for (i = nodes - 1; i > 0; i--) {
+			int j = rand() % (i + 1);
+			uint32_t x = order[i];
+
+			order[i] = order[j];
+			order[j] = x;
+		}
+
+		checks = 0;
+		duplicates = 0;
+		t0 = now_s();
+		for (r = 0; r < rounds; r++) {
+			for (i = 0; i < nodes; i++) {
+				dedup_t *d = &fleet[order[(i + r * 7919) % nodes]];
+				uint32_t s = r;
+
+				// a lost ACK: the previous sequence comes back
+				if ((r > 0) && ((i * 37 + r) % 100 < dup_pct))
+					duplicates += dedup_check(d, s - 1, 1000) == DEDUP_DUPLICATE;
+				else
+					duplicates += dedup_check(d, s, 1000) == DEDUP_DUPLICATE;
+				checks++;
+			}
+		}
+		t = now_s() - t0;
+
+		printf("%8d nodes    : %.1f ns per check, %llu duplicates, %.1f MB of windows\n",
+		       nodes, t * 1e9 / checks, (unsigned long long) duplicates, nodes * sizeof(dedup_t) / 1e6);
+
+		free(fleet);
+		free(order);
+	}
+
+	return 0;
+}
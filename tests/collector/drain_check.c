@@ -0,0 +1,252 @@
+/*
+ * drain_check.c
+ *
+ * Check that a compressing node catches up after an outage that outlives
+ * the collector's delta references.
+ *
+ *   drain_check
+ *
+ * Runs ./collector on a private port and plays one water node against
+ * it the way modules/aggregate/aggregate.c codes its frames: a keyframe,
+ * then readings delta coded against the last one ACK'd.  The collector is stopped
+ * while the node goes on sampling; the node's frames time out and are
+ * backlogged as keyframes, behind a delta coded record as older firmware
+ * stored them.  The collector comes back without the node's references,
+ * the node's next frame is a keyframe, and the backlog is drained a
+ * burst at a time between live delta frames: every record has to be taken
+ * except the old delta one, which has to be refused (ACK_NO_REF) and not
+ * left unanswered, and the drained records must not push out the
+ * reference the live frames are coded against.  Last the collector is
+ * restarted under a running node, whose next delta frame has to be
+ * refused and the keyframe after it taken.
+ */
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "message.h"
+#include "message-codec.h"
+
+#define ACK_OK (1)
+#define PORT (17324)
+
+// backlog records, as backlog.c keeps them
+#define BACKLOG_MAX (32)
+
+// records drained per burst, backlog.c's BACKLOG_BURST
+#define BURST (4)
+
+#define NO_ANSWER (-1)
+
+struct record {
+	agg_delta_t frame;
+	int length;
+};
+
+// the node's coding state, as aggregate.c keeps it
+static water_reading_t ref;
+static int have_ref;
+static uint32_t next_sequence = 1000;
+
+static struct record backlog[BACKLOG_MAX];
+static int backlog_count;
+
+static int sock;
+static struct sockaddr_in collector_addr;
+static int failures;
+
+static pid_t start_collector( )
+{
+	char port[8];
+	pid_t pid;
+	int null;
+
+	snprintf(port, sizeof(port), "%d", PORT);
+	pid = fork();
+	if (pid == 0) {
+		null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		execl("./collector", "collector", "-p", port, "-t", "0", "-w", "1", "-i", "3600", (char *) NULL);
+		_exit(127);
+	}
+	// time to bind
+	usleep(300 * 1000);
+	return pid;
+}
+
+static void stop_collector(pid_t pid)
+{
+	kill(pid, SIGINT);
+	waitpid(pid, NULL, 0);
+}
+
+static void make_reading(water_reading_t *r, uint32_t sequence)
+{
+	memset(r, 0, sizeof(*r));
+	r->pressure = 101300 + sequence % 17;
+	r->temppressure = 2100 + sequence % 5;
+	r->battery = 3300 - sequence % 3;
+	r->color_clear = 400 + sequence % 11;
+	r->temperature = 2000 + sequence % 7;
+	r->hall = -(int16_t) (sequence % 13);
+}
+
+/*
+ * Send a frame the way the messenger does, a few tries, and return the
+ * collector's ack_value for it or NO_ANSWER.
+ */
+static int exchange(const void *frame, int length, uint32_t sequence, int tries)
+{
+	struct pollfd pfd = { sock, POLLIN, 0 };
+	ack_t ack;
+	int len;
+
+	while (tries-- > 0) {
+		sendto(sock, frame, length, 0, (struct sockaddr *) &collector_addr, sizeof(collector_addr));
+
+		while (poll(&pfd, 1, 300) > 0) {
+			len = recv(sock, &ack, sizeof(ack), 0);
+			// calibration requests and late answers to earlier frames
+			if ((len == sizeof(ack)) && (ack.header == ACK_HEADER) && (ack.ack_seq == sequence))
+				return ack.ack_value;
+		}
+	}
+	return NO_ANSWER;
+}
+
+static int encode(agg_delta_t *frame, uint32_t sequence, const water_reading_t *against, uint32_t ref_sequence,
+                  const water_reading_t *reading)
+{
+	int used;
+
+	memset(frame, 0, sizeof(*frame));
+	frame->header = WATER_AGG_HEADER;
+	frame->sequence = sequence;
+	frame->flags = AGG_FLAG_DELTA | (against ? 0 : AGG_FLAG_KEYFRAME);
+	frame->ref_sequence = against ? ref_sequence : 0;
+	frame->count = codec_encode_water(against, reading, 1, frame->data, sizeof(frame->data), &used);
+	return AGG_DELTA_HEADER_SIZE + used;
+}
+
+static void backlog_keyframe(uint32_t sequence, const water_reading_t *reading)
+{
+	struct record *rec = &backlog[backlog_count++];
+
+	rec->length = encode(&rec->frame, sequence, NULL, 0, reading);
+}
+
+/*
+ * Take and send one reading.  Returns the ack_value; what is not taken
+ * is backlogged as a keyframe and the node forgets its reference.
+ */
+static int live(int tries)
+{
+	static uint32_t ref_sequence;
+	water_reading_t reading;
+	agg_delta_t frame;
+	uint32_t sequence = next_sequence++;
+	int length, rc;
+
+	make_reading(&reading, sequence);
+	length = encode(&frame, sequence, have_ref ? &ref : NULL, ref_sequence, &reading);
+
+	rc = exchange(&frame, length, sequence, tries);
+	if (rc == ACK_OK) {
+		ref = reading;
+		ref_sequence = sequence;
+		have_ref = 1;
+	}
+	else {
+		have_ref = 0;
+		backlog_keyframe(sequence, &reading);
+	}
+	return rc;
+}
+
+static void expect(const char *what, int got, int want)
+{
+	if (got == want)
+		return;
+	printf("  %-40s got %d, expected %d\n", what, got, want);
+	failures++;
+}
+
+int main( )
+{
+	water_reading_t old_ref, reading;
+	struct sockaddr_in local;
+	struct record *rec;
+	pid_t pid;
+	int i, legacy, rc;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *) &local, sizeof(local)) < 0) {
+		perror("bind");
+		return 1;
+	}
+	collector_addr = local;
+	collector_addr.sin_port = htons(PORT);
+
+	pid = start_collector();
+
+	// a running node: a keyframe, then deltas
+	expect("first keyframe", live(3), ACK_OK);
+	for (i = 0; i < 3; i++)
+		expect("delta before the outage", live(3), ACK_OK);
+
+	// a record older firmware left in the backlog, coded against a reference nobody has
+	make_reading(&old_ref, 900);
+	make_reading(&reading, 901);
+	rec = &backlog[backlog_count++];
+	rec->length = encode(&rec->frame, 901, &old_ref, 900, &reading);
+	legacy = 0;
+
+	// the outage: the collector goes, the node backlogs
+	stop_collector(pid);
+	for (i = 0; i < 8; i++)
+		expect("frame during the outage", live(1), NO_ANSWER);
+
+	// back without the node's references, the next frame has to be a keyframe
+	pid = start_collector();
+	expect("reference dropped by the outage", have_ref, 0);
+	expect("keyframe after the outage", live(3), ACK_OK);
+
+	// drain a burst between live frames, as backlog_drain() runs beside the sensor loop
+	for (i = 0; i < backlog_count; i++) {
+		rc = exchange(&backlog[i].frame, backlog[i].length, backlog[i].frame.sequence, 3);
+		expect((i == legacy) ? "old delta record refused" : "backlogged keyframe", rc,
+		       (i == legacy) ? ACK_NO_REF : ACK_OK);
+		if ((i % BURST == BURST - 1) || (i == backlog_count - 1))
+			expect("live delta while draining", live(3), ACK_OK);
+	}
+	printf("outage and drain  : %d backlogged records, %d live frames\n", backlog_count,
+	       (int) (next_sequence - 1000));
+	backlog_count = 0;
+
+	// a restart under a running node: refused, then a keyframe resynchronises
+	stop_collector(pid);
+	pid = start_collector();
+	expect("delta after a restart", live(3), ACK_NO_REF);
+	expect("refused reading backlogged", backlog_count, 1);
+	expect("keyframe after the refusal", live(3), ACK_OK);
+	expect("delta after the keyframe", live(3), ACK_OK);
+	expect("refused reading drained", exchange(&backlog[0].frame, backlog[0].length,
+	                                           backlog[0].frame.sequence, 3), ACK_OK);
+	stop_collector(pid);
+
+	printf("drain checks      : %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * index.c
+ *
+ * Sparse time index over a store, see index.h.
+ */
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+static int series_cmp(const void *a, const void *b)
+{
+	const index_series_t *x = a, *y = b;
+	int c = strcmp(x->node, y->node);
+
+	return c ? c : (int) x->kind - (int) y->kind;
+}
+
+static void series_add(index_series_t *s, const store_block_t *b, uint32_t segment, uint32_t block)
+{
+	index_entry_t *e;
+
+	if (s->count == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 64;
+		s->entries = realloc(s->entries, s->cap * sizeof(*e));
+	}
+
+	e = &s->entries[s->count];
+	e->first = b->min[STORE_COL_TIME];
+	e->last = b->max[STORE_COL_TIME];
+	e->sequence = b->min[STORE_COL_SEQUENCE];
+	e->segment = segment;
+	e->block = block;
+	e->rows = b->rows;
+	e->reach = (s->count && (s->entries[s->count - 1].reach > e->last)) ? s->entries[s->count - 1].reach : e->last;
+	s->count++;
+}
+
+// floor needs the blocks after each one, so it is filled in once a series is complete
+static void series_finish(index_series_t *s)
+{
+	int64_t floor = INT64_MAX;
+	uint32_t i;
+
+	for (i = s->count; i-- > 0; ) {
+		if (s->entries[i].first < floor)
+			floor = s->entries[i].first;
+		s->entries[i].floor = floor;
+	}
+}
+
+static int load_series(store_index_t *idx, index_series_t *s)
+{
+	store_segment_t seg;
+	char path[512];
+	uint32_t n, b;
+
+	for (n = 0; ; n++) {
+		store_segment_path(path, sizeof(path), idx->root, s->node, s->kind, n);
+		if (store_segment_open(&seg, path) < 0)
+			break;
+
+		for (b = 0; b < seg.blocks; b++) {
+			const store_block_t *blk = store_segment_block(&seg, b);
+
+			if ((blk->magic != STORE_MAGIC) || (blk->rows == 0))
+				continue;
+			series_add(s, blk, n, b);
+			idx->blocks++;
+			idx->rows += blk->rows;
+		}
+		store_segment_close(&seg);
+	}
+
+	series_finish(s);
+	return s->count;
+}
+
+int index_build(store_index_t *idx, const char *root)
+{
+	DIR *dir;
+	struct dirent *de;
+	uint32_t cap = 0;
+	int k;
+
+	memset(idx, 0, sizeof(*idx));
+
+	dir = opendir(root);
+	if (dir == NULL) {
+		perror(root);
+		return -1;
+	}
+	idx->root = strdup(root);
+
+	while ((de = readdir(dir)) != NULL) {
+		if ((de->d_name[0] == '.') || (strlen(de->d_name) >= sizeof(idx->series[0].node)))
+			continue;
+
+		for (k = 0; k < STORE_KINDS; k++) {
+			index_series_t *s;
+
+			if (idx->count == cap) {
+				cap = cap ? cap * 2 : 256;
+				idx->series = realloc(idx->series, cap * sizeof(*s));
+			}
+			s = &idx->series[idx->count];
+			memset(s, 0, sizeof(*s));
+			strcpy(s->node, de->d_name);
+			s->kind = k;
+
+			if (load_series(idx, s) > 0)
+				idx->count++;
+			else
+				free(s->entries);
+		}
+	}
+	closedir(dir);
+
+	qsort(idx->series, idx->count, sizeof(idx->series[0]), series_cmp);
+	return 0;
+}
+
+void index_free(store_index_t *idx)
+{
+	uint32_t i;
+
+	for (i = 0; i < idx->count; i++)
+		free(idx->series[i].entries);
+	free(idx->series);
+	free(idx->root);
+	memset(idx, 0, sizeof(*idx));
+}
+
+const index_series_t *index_find(const store_index_t *idx, const char *node, enum store_kind kind)
+{
+	index_series_t key;
+
+	snprintf(key.node, sizeof(key.node), "%s", node);
+	key.kind = kind;
+	return bsearch(&key, idx->series, idx->count, sizeof(key), series_cmp);
+}
+
+int index_query(const index_series_t *s, int64_t from, int64_t to, index_visit_t visit, void *ctx)
+{
+	uint32_t lo = 0, hi = s->count, first, end, i;
+	int rc;
+
+	// first block whose reach gets to 'from' - nothing before it can
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (s->entries[mid].reach < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	first = lo;
+
+	// first block whose floor is past 'to' - nothing from it on can match
+	lo = first;
+	hi = s->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (s->entries[mid].floor <= to)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	end = lo;
+
+	for (i = first; i < end; i++) {
+		const index_entry_t *e = &s->entries[i];
+
+		if ((e->last < from) || (e->first > to))
+			continue;
+		if ((rc = visit(s, e, ctx)) != 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+struct scan {
+	const store_index_t *idx;
+	store_segment_t seg;
+	uint32_t mapped;		// segment number in seg, if seg.map is set
+	int64_t from, to;
+	index_row_t visit;
+	void *ctx;
+	uint64_t rows;
+};
+
+static int scan_block(const index_series_t *s, const index_entry_t *e, void *ctx)
+{
+	struct scan *sc = ctx;
+	const store_column_t *cols;
+	const store_block_t *b;
+	const int64_t *tm;
+	char path[512];
+	int ncols, r;
+
+	if ((sc->seg.map == NULL) || (sc->mapped != e->segment)) {
+		store_segment_close(&sc->seg);
+		store_segment_path(path, sizeof(path), sc->idx->root, s->node, s->kind, e->segment);
+		if (store_segment_open(&sc->seg, path) < 0)
+			return 0;
+		sc->mapped = e->segment;
+	}
+	if (e->block >= sc->seg.blocks)
+		return 0;
+
+	b = store_segment_block(&sc->seg, e->block);
+	cols = store_columns(s->kind, &ncols);
+	tm = store_block_column(b, cols, STORE_COL_TIME);
+
+	for (r = 0; r < b->rows; r++) {
+		if ((tm[r] < sc->from) || (tm[r] > sc->to))
+			continue;
+		if (sc->visit != NULL)
+			sc->visit(s, b, r, sc->ctx);
+		sc->rows++;
+	}
+
+	return 0;
+}
+
+uint64_t index_scan(const store_index_t *idx, const index_series_t *s, int64_t from, int64_t to,
+                    index_row_t visit, void *ctx)
+{
+	struct scan sc;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.idx = idx;
+	sc.from = from;
+	sc.to = to;
+	sc.visit = visit;
+	sc.ctx = ctx;
+
+	index_query(s, from, to, scan_block, &sc);
+	store_segment_close(&sc.seg);
+	return sc.rows;
+}
@@ -0,0 +1,77 @@
+/*
+ * index.h
+ *
+ * A sparse in-memory index over a store (see store.h), for time range
+ * queries on one node or on all of them.
+ *
+ * Each series (a node's readings of one kind) gets one checkpoint per
+ * block, i.e. every STORE_BLOCK_ROWS readings, in the order the blocks
+ * were written: where the block is (segment, block), its first sequence
+ * and its time span.  Readings need not arrive in time order (backlogs,
+ * aggregate ages), so each checkpoint also carries the latest time of
+ * all blocks up to it (reach) and the earliest of all blocks from it on
+ * (floor).  Both are monotonic, so two binary searches bound the blocks
+ * that may hold a time range, and only their own spans are checked.
+ *
+ * The index is rebuilt from the block headers when a store is opened;
+ * nothing but the segments is kept on disk.
+ */
+
+#ifndef TESTS_COLLECTOR_INDEX_H_
+#define TESTS_COLLECTOR_INDEX_H_
+
+#include <stdint.h>
+
+#include "store.h"
+
+typedef struct {
+	int64_t first;		// earliest time in the block
+	int64_t last;		// latest time in the block
+	int64_t reach;		// latest time in this block or any before it
+	int64_t floor;		// earliest time in this block or any after it
+	uint32_t sequence;	// lowest sequence in the block
+	uint32_t segment;
+	uint32_t block;
+	uint32_t rows;
+} index_entry_t;
+
+typedef struct {
+	char node[64];
+	enum store_kind kind;
+	index_entry_t *entries;
+	uint32_t count;
+	uint32_t cap;
+} index_series_t;
+
+typedef struct {
+	char *root;
+	index_series_t *series;		// sorted by node, then kind
+	uint32_t count;
+	uint64_t blocks;
+	uint64_t rows;
+} store_index_t;
+
+// scan the store's block headers, 0 on success
+int index_build(store_index_t *idx, const char *root);
+void index_free(store_index_t *idx);
+
+// a node's series of one kind, NULL if it has none
+const index_series_t *index_find(const store_index_t *idx, const char *node, enum store_kind kind);
+
+/*
+ * Call visit for every block of the series that may hold readings in
+ * [from, to] (ms), in the order they were written.  A non-zero return
+ * from visit stops the walk and is returned.
+ */
+typedef int (*index_visit_t)(const index_series_t *s, const index_entry_t *e, void *ctx);
+int index_query(const index_series_t *s, int64_t from, int64_t to, index_visit_t visit, void *ctx);
+
+/*
+ * Readings of a series in [from, to], row by row.  Segments are mapped
+ * as they are needed.  Returns the number of rows passed to visit.
+ */
+typedef void (*index_row_t)(const index_series_t *s, const store_block_t *b, int row, void *ctx);
+uint64_t index_scan(const store_index_t *idx, const index_series_t *s, int64_t from, int64_t to,
+                    index_row_t visit, void *ctx);
+
+#endif /* TESTS_COLLECTOR_INDEX_H_ */
@@ -0,0 +1,168 @@
+/*
+ * index_bench.c
+ *
+ * Measure the sparse index (index.h) on a synthetic store.
+ *
+ *   index_bench [-n nodes] [-r readings per node] [-q queries] [-d dir]
+ *
+ * Writes -r water readings for each of -n nodes, one a minute, with a
+ * backlog burst (readings an hour old) every 5000 readings so the series
+ * are not in time order.  Then it times rebuilding the index, random one
+ * hour queries on single nodes against a scan of every block header of
+ * the node, and an "all nodes, last hour" query.  Indexed and scanned
+ * results are compared.  An existing dataset in -d is reused.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "index.h"
+
+#define START_MS (1700000000000LL)
+#define STEP_MS (60 * 1000LL)
+#define HOUR_MS (3600 * 1000LL)
+
+static double now_s( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void node_of(char *buf, size_t len, int node)
+{
+	uint8_t addr[16] = { 0xfd };
+
+	addr[13] = node >> 16;
+	addr[14] = node >> 8;
+	addr[15] = node;
+	store_node_name(buf, len, addr, 0);
+}
+
+static void generate(const char *dir, int nodes, int readings)
+{
+	struct store *st = store_open(dir);
+	struct store_series *s;
+	water_reading_t r;
+	char name[64];
+	int i, j;
+	double t0 = now_s();
+
+	memset(&r, 0, sizeof(r));
+	for (i = 0; i < nodes; i++) {
+		node_of(name, sizeof(name), i);
+		s = store_series_open(st, name, STORE_WATER);
+		for (j = 0; j < readings; j++) {
+			int64_t t = START_MS + j * STEP_MS;
+
+			// a node catching up on its backlog
+			if (((j % 5000) >= 2000) && ((j % 5000) < 2100))
+				t -= HOUR_MS;
+			r.pressure = 5300000 + j;
+			store_append(s, t, j, 1, &r);
+		}
+		store_series_close(s);
+	}
+	store_close(st);
+
+	printf("generate          : %llu readings in %.2f s\n", (unsigned long long) nodes * readings, now_s() - t0);
+}
+
+// the same query without the index: every block header of the series
+static uint64_t scan_headers(const store_index_t *idx, const index_series_t *s, int64_t from, int64_t to)
+{
+	const store_column_t *cols;
+	store_segment_t seg;
+	char path[512];
+	uint64_t rows = 0;
+	uint32_t n, b;
+	int ncols, r;
+
+	cols = store_columns(s->kind, &ncols);
+	for (n = 0; ; n++) {
+		store_segment_path(path, sizeof(path), idx->root, s->node, s->kind, n);
+		if (store_segment_open(&seg, path) < 0)
+			break;
+		for (b = 0; b < seg.blocks; b++) {
+			const store_block_t *blk = store_segment_block(&seg, b);
+			const int64_t *tm;
+
+			if ((blk->max[STORE_COL_TIME] < from) || (blk->min[STORE_COL_TIME] > to))
+				continue;
+			tm = store_block_column(blk, cols, STORE_COL_TIME);
+			for (r = 0; r < blk->rows; r++)
+				rows += (tm[r] >= from) && (tm[r] <= to);
+		}
+		store_segment_close(&seg);
+	}
+	return rows;
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = "index-bench.d";
+	int opt, nodes = 1000, readings = 5000, queries = 2000, i;
+	store_index_t idx;
+	struct stat sb;
+	double t0, t_index = 0, t_scan = 0;
+	uint64_t rows_index = 0, rows_scan = 0, rows;
+	char name[64];
+
+	while ((opt = getopt(argc, argv, "n:r:q:d:")) != -1) {
+		switch (opt) {
+		case 'n': nodes = atoi(optarg); break;
+		case 'r': readings = atoi(optarg); break;
+		case 'q': queries = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-n nodes] [-r readings per node] [-q queries] [-d dir]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (stat(dir, &sb) < 0)
+		generate(dir, nodes, readings);
+
+	t0 = now_s();
+	if (index_build(&idx, dir) < 0)
+		return 1;
+	printf("index build       : %u series, %llu blocks, %llu readings in %.3f s, %.1f MB\n",
+	       idx.count, (unsigned long long) idx.blocks, (unsigned long long) idx.rows, now_s() - t0,
+	       idx.blocks * sizeof(index_entry_t) / 1e6);
+
+	srand(1);
+	for (i = 0; i < queries; i++) {
+		const index_series_t *s;
+		int64_t from = START_MS + (rand() % readings) * STEP_MS;
+
+		node_of(name, sizeof(name), rand() % nodes);
+		s = index_find(&idx, name, STORE_WATER);
+		if (s == NULL)
+			continue;
+
+		t0 = now_s();
+		rows_index += index_scan(&idx, s, from, from + HOUR_MS, NULL, NULL);
+		t_index += now_s() - t0;
+
+		t0 = now_s();
+		rows_scan += scan_headers(&idx, s, from, from + HOUR_MS);
+		t_scan += now_s() - t0;
+	}
+	printf("node, one hour    : %d queries, %.1f us indexed, %.1f us scanning headers%s\n",
+	       queries, t_index * 1e6 / queries, t_scan * 1e6 / queries,
+	       (rows_index == rows_scan) ? "" : "  RESULT MISMATCH");
+
+	// the newest hour over the whole fleet
+	t0 = now_s();
+	rows = 0;
+	for (i = 0; i < idx.count; i++)
+		rows += index_scan(&idx, &idx.series[i], START_MS + (readings - 60) * STEP_MS, INT64_MAX, NULL, NULL);
+	printf("all nodes, 1 hour : %llu readings in %.2f ms\n", (unsigned long long) rows, (now_s() - t0) * 1e3);
+
+	index_free(&idx);
+	return 0;
+}
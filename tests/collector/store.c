@@ -0,0 +1,339 @@
+/*
+ * store.c
+ *
+ * Append-only columnar storage, see store.h.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "store.h"
+
+#define COLUMN(type, field, sgn) { #field, sizeof(((type *) 0)->field), sgn, offsetof(type, field) }
+
+static const store_column_t water_columns[] = {
+	{ "time", 8, 1, 0 },
+	{ "sequence", 4, 0, 0 },
+	{ "calibration", 4, 0, 0 },
+	COLUMN(water_reading_t, pressure, 0),
+	COLUMN(water_reading_t, temppressure, 0),
+	COLUMN(water_reading_t, battery, 0),
+	COLUMN(water_reading_t, color_blue, 0),
+	COLUMN(water_reading_t, color_clear, 0),
+	COLUMN(water_reading_t, color_green, 0),
+	COLUMN(water_reading_t, color_red, 0),
+	COLUMN(water_reading_t, ambient, 0),
+	COLUMN(water_reading_t, range1, 0),
+	COLUMN(water_reading_t, range2, 0),
+	COLUMN(water_reading_t, range3, 0),
+	COLUMN(water_reading_t, range4, 0),
+	COLUMN(water_reading_t, range5, 0),
+	COLUMN(water_reading_t, temperature, 0),
+	COLUMN(water_reading_t, hall, 1),
+};
+
+static const store_column_t airborne_columns[] = {
+	{ "time", 8, 1, 0 },
+	{ "sequence", 4, 0, 0 },
+	{ "calibration", 4, 0, 0 },
+	COLUMN(airborne_reading_t, ms5637_pressure, 0),
+	COLUMN(airborne_reading_t, ms5637_temp, 0),
+	COLUMN(airborne_reading_t, si7020_humid, 0),
+	COLUMN(airborne_reading_t, si7020_temp, 0),
+	COLUMN(airborne_reading_t, battery, 0),
+	COLUMN(airborne_reading_t, i2cerror, 0),
+};
+
+static const struct {
+	const char *name;
+	const store_column_t *columns;
+	int count;
+} kinds[STORE_KINDS] = {
+	{ "water", water_columns, sizeof(water_columns) / sizeof(water_columns[0]) },
+	{ "airborne", airborne_columns, sizeof(airborne_columns) / sizeof(airborne_columns[0]) },
+};
+
+struct store {
+	char *root;
+};
+
+struct store_series {
+	struct store *st;
+	char node[64];
+	enum store_kind kind;
+	const store_column_t *columns;
+	int column_count;
+
+	uint32_t segment;		// segment being appended to
+	uint32_t blocks;		// complete blocks in it
+	int64_t last_ms;
+
+	store_block_t *block;	// the block being filled
+};
+
+const store_column_t *store_columns(enum store_kind kind, int *count)
+{
+	*count = kinds[kind].count;
+	return kinds[kind].columns;
+}
+
+int store_column_index(enum store_kind kind, const char *name)
+{
+	int i;
+
+	for (i = 0; i < kinds[kind].count; i++) {
+		if (strcmp(kinds[kind].columns[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *store_kind_name(enum store_kind kind)
+{
+	return kinds[kind].name;
+}
+
+size_t store_block_size(enum store_kind kind)
+{
+	size_t size = sizeof(store_block_t);
+	int i;
+
+	for (i = 0; i < kinds[kind].count; i++)
+		size += kinds[kind].columns[i].width * STORE_BLOCK_ROWS;
+	return size;
+}
+
+static int64_t widen(const void *p, int width, int is_signed)
+{
+	switch (width) {
+	case 1: return is_signed ? (int64_t) *(const int8_t *) p : (int64_t) *(const uint8_t *) p;
+	case 2: { uint16_t v; memcpy(&v, p, 2); return is_signed ? (int64_t) (int16_t) v : (int64_t) v; }
+	case 4: { uint32_t v; memcpy(&v, p, 4); return is_signed ? (int64_t) (int32_t) v : (int64_t) v; }
+	default: { int64_t v; memcpy(&v, p, 8); return v; }
+	}
+}
+
+int64_t store_value(const store_block_t *b, const store_column_t *cols, int col, int row)
+{
+	const uint8_t *p = store_block_column(b, cols, col);
+	return widen(p + row * cols[col].width, cols[col].width, cols[col].is_signed);
+}
+
+void store_node_name(char *buf, size_t len, const uint8_t addr[16], uint16_t port)
+{
+	int i, n = 0;
+
+	for (i = 0; (i < 16) && (n + 3 < len); i++)
+		n += snprintf(buf + n, len - n, "%02x", addr[i]);
+	if (port)
+		snprintf(buf + n, len - n, "-%u", port);
+}
+
+void store_segment_path(char *buf, size_t len, const char *root, const char *node,
+                        enum store_kind kind, uint32_t n)
+{
+	snprintf(buf, len, "%s/%s/%s-%06u.seg", root, node, kinds[kind].name, n);
+}
+
+struct store *store_open(const char *root)
+{
+	struct store *st;
+
+	if ((mkdir(root, 0755) < 0) && (errno != EEXIST)) {
+		perror(root);
+		return NULL;
+	}
+
+	st = calloc(1, sizeof(*st));
+	st->root = strdup(root);
+	return st;
+}
+
+void store_close(struct store *st)
+{
+	free(st->root);
+	free(st);
+}
+
+static void block_reset(struct store_series *s)
+{
+	memset(s->block, 0, store_block_size(s->kind));
+	s->block->magic = STORE_MAGIC;
+	s->block->kind = s->kind;
+	s->block->columns = s->column_count;
+	s->block->size = store_block_size(s->kind);
+}
+
+struct store_series *store_series_open(struct store *st, const char *node, enum store_kind kind)
+{
+	struct store_series *s;
+	char path[512];
+	struct stat sb;
+	size_t size = store_block_size(kind);
+
+	snprintf(path, sizeof(path), "%s/%s", st->root, node);
+	if ((mkdir(path, 0755) < 0) && (errno != EEXIST)) {
+		perror(path);
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	s->st = st;
+	snprintf(s->node, sizeof(s->node), "%s", node);
+	s->kind = kind;
+	s->columns = store_columns(kind, &s->column_count);
+	s->block = malloc(size);
+	block_reset(s);
+
+	// carry on after the last segment written
+	while (1) {
+		store_segment_path(path, sizeof(path), st->root, node, kind, s->segment);
+		if (stat(path, &sb) < 0)
+			break;
+
+		s->blocks = sb.st_size / size;
+		if (sb.st_size % size) {
+			// a block torn by a crash, appending after it would shift the rest
+			if (truncate(path, (off_t) s->blocks * size) < 0)
+				perror(path);
+		}
+		if (s->blocks < STORE_SEGMENT_BLOCKS)
+			break;
+		s->segment++;
+		s->blocks = 0;
+	}
+
+	return s;
+}
+
+int store_append(struct store_series *s, int64_t time_ms, uint32_t sequence, uint32_t calibration,
+                 const void *reading)
+{
+	store_block_t *b = s->block;
+	int row = b->rows, i;
+	uint8_t *col = (uint8_t *) (b + 1);
+	int64_t v;
+
+	for (i = 0; i < s->column_count; i++) {
+		const store_column_t *c = &s->columns[i];
+		uint8_t *dst = col + row * c->width;
+
+		if (i == STORE_COL_TIME)
+			memcpy(dst, &time_ms, 8);
+		else if (i == STORE_COL_SEQUENCE)
+			memcpy(dst, &sequence, 4);
+		else if (i == STORE_COL_CALIBRATION)
+			memcpy(dst, &calibration, 4);
+		else
+			memcpy(dst, (const uint8_t *) reading + c->offset, c->width);
+
+		v = widen(dst, c->width, c->is_signed);
+		if ((row == 0) || (v < b->min[i]))
+			b->min[i] = v;
+		if ((row == 0) || (v > b->max[i]))
+			b->max[i] = v;
+
+		col += c->width * STORE_BLOCK_ROWS;
+	}
+
+	b->rows++;
+	s->last_ms = time_ms;
+
+	if (b->rows == STORE_BLOCK_ROWS)
+		return store_series_flush(s);
+	return 0;
+}
+
+int store_series_flush(struct store_series *s)
+{
+	char path[512];
+	size_t size = store_block_size(s->kind);
+	int fd, rc = 0;
+
+	if (s->block->rows == 0)
+		return 0;
+
+	// one write() of a whole block, so a crash can only tear the last one
+	store_segment_path(path, sizeof(path), s->st->root, s->node, s->kind, s->segment);
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if ((fd < 0) || (write(fd, s->block, size) != size)) {
+		perror(path);
+		rc = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (rc == 0 && ++s->blocks >= STORE_SEGMENT_BLOCKS) {
+		s->segment++;
+		s->blocks = 0;
+	}
+
+	block_reset(s);
+	return rc;
+}
+
+void store_series_close(struct store_series *s)
+{
+	if (s == NULL)
+		return;
+
+	store_series_flush(s);
+	free(s->block);
+	free(s);
+}
+
+int64_t store_series_last(const struct store_series *s)
+{
+	return s->last_ms;
+}
+
+int store_segment_open(store_segment_t *seg, const char *path)
+{
+	const store_block_t *b;
+	struct stat sb;
+	int fd;
+
+	memset(seg, 0, sizeof(*seg));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if ((fstat(fd, &sb) < 0) || (sb.st_size < sizeof(store_block_t))) {
+		close(fd);
+		return -1;
+	}
+
+	seg->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg->map == MAP_FAILED) {
+		seg->map = NULL;
+		return -1;
+	}
+
+	b = (const store_block_t *) seg->map;
+	if ((b->magic != STORE_MAGIC) || (b->kind >= STORE_KINDS) || (b->size != store_block_size(b->kind))) {
+		munmap((void *) seg->map, sb.st_size);
+		seg->map = NULL;
+		return -1;
+	}
+
+	seg->size = sb.st_size;
+	seg->kind = b->kind;
+	seg->block_size = b->size;
+	seg->blocks = sb.st_size / b->size;
+	return 0;
+}
+
+void store_segment_close(store_segment_t *seg)
+{
+	if (seg->map != NULL)
+		munmap((void *) seg->map, seg->size);
+	seg->map = NULL;
+}
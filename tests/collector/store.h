@@ -0,0 +1,142 @@
+/*
+ * store.h
+ *
+ * Append-only columnar storage for the readings the collector receives.
+ *
+ * Every node has a directory under the store root, named after its
+ * address (store_node_name()), holding one series of segment files per
+ * reading kind: water-000000.seg, water-000001.seg, ...  A segment is a
+ * run of fixed-size blocks, so block i sits at i * store_block_size(kind)
+ * and a reader finds it without an index.  A block is a store_block_t
+ * header followed by the columns of up to STORE_BLOCK_ROWS rows, each
+ * column a packed array of its own width (see store_columns()).  The
+ * header carries the row count and each column's min / max, so a range
+ * scan can skip whole blocks on the header alone.
+ *
+ * Writers buffer one block per series and append it with a single
+ * write() when it fills up (or on store_series_flush(), which appends a
+ * short block).  Blocks are never rewritten.  A torn block at the end
+ * of a segment after a crash is ignored by the readers.
+ *
+ * Readers mmap() a whole segment (store_segment_open()) and use the
+ * columns in place.
+ */
+
+#ifndef TESTS_COLLECTOR_STORE_H_
+#define TESTS_COLLECTOR_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message.h"
+
+#define STORE_MAGIC (0x4b4c4253U)		// "SBLK"
+
+#define STORE_BLOCK_ROWS (128)
+#define STORE_MAX_COLUMNS (20)
+
+// blocks per segment file before the series moves to the next one
+#define STORE_SEGMENT_BLOCKS (8192)
+
+enum store_kind {
+	STORE_WATER, STORE_AIRBORNE, STORE_KINDS
+};
+
+// the first three columns of every kind
+#define STORE_COL_TIME (0)			// int64_t, ms since the epoch
+#define STORE_COL_SEQUENCE (1)		// uint32_t
+#define STORE_COL_CALIBRATION (2)	// uint32_t, the node's calibration version (calcache.h), 0 if unknown
+
+typedef struct {
+	const char *name;
+	uint8_t width;		// bytes per value: 1, 2, 4 or 8
+	uint8_t is_signed;
+	uint16_t offset;	// in the kind's reading struct, columns 3 on
+} store_column_t;
+
+typedef struct {
+	uint32_t magic;
+	uint8_t kind;
+	uint8_t columns;
+	uint16_t rows;
+	uint32_t size;		// bytes from this header to the next block
+	uint32_t reserved;
+
+	int64_t min[STORE_MAX_COLUMNS];
+	int64_t max[STORE_MAX_COLUMNS];
+} store_block_t;
+
+// the column layout of a kind, and the number of columns
+const store_column_t *store_columns(enum store_kind kind, int *count);
+int store_column_index(enum store_kind kind, const char *name);
+const char *store_kind_name(enum store_kind kind);
+
+// bytes per block of a kind, header included
+size_t store_block_size(enum store_kind kind);
+
+// the start of a column inside a block
+static inline const void *store_block_column(const store_block_t *b, const store_column_t *cols, int col)
+{
+	const uint8_t *p = (const uint8_t *) (b + 1);
+	int i;
+
+	for (i = 0; i < col; i++)
+		p += cols[i].width * STORE_BLOCK_ROWS;
+	return p;
+}
+
+// one value of a column, widened
+int64_t store_value(const store_block_t *b, const store_column_t *cols, int col, int row);
+
+// directory name for a node, from its address and (0 if unused) port
+void store_node_name(char *buf, size_t len, const uint8_t addr[16], uint16_t port);
+
+/*
+ * Writing
+ */
+struct store;
+struct store_series;
+
+struct store *store_open(const char *root);
+void store_close(struct store *st);
+
+// the series of one kind for a node, created on first use
+struct store_series *store_series_open(struct store *st, const char *node, enum store_kind kind);
+
+// append a reading (a water_reading_t or an airborne_reading_t), 0 on success
+int store_append(struct store_series *s, int64_t time_ms, uint32_t sequence, uint32_t calibration,
+                 const void *reading);
+
+// write out the rows buffered so far as a (short) block
+int store_series_flush(struct store_series *s);
+
+// flush and free
+void store_series_close(struct store_series *s);
+
+// the last time a row was appended, ms
+int64_t store_series_last(const struct store_series *s);
+
+/*
+ * Reading
+ */
+typedef struct {
+	const uint8_t *map;
+	size_t size;
+	enum store_kind kind;
+	size_t block_size;
+	uint32_t blocks;		// complete blocks in the file
+} store_segment_t;
+
+int store_segment_open(store_segment_t *seg, const char *path);
+void store_segment_close(store_segment_t *seg);
+
+static inline const store_block_t *store_segment_block(const store_segment_t *seg, uint32_t i)
+{
+	return (const store_block_t *) (seg->map + (size_t) i * seg->block_size);
+}
+
+// path of segment n of a node's series
+void store_segment_path(char *buf, size_t len, const char *root, const char *node,
+                        enum store_kind kind, uint32_t n);
+
+#endif /* TESTS_COLLECTOR_STORE_H_ */
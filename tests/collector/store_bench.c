@@ -0,0 +1,158 @@
+/*
+ * store_bench.c
+ *
+ * Measure the columnar store (store.h): ingest rate, and the rate of a
+ * range scan that uses the block min / max to skip blocks.
+ *
+ *   store_bench [-n nodes] [-r readings per node] [-d dir]
+ *
+ * Writes a random-walk water series for every node, one reading a
+ * minute, then scans all of them twice: a full pass summing the
+ * pressure column, and a pass counting the readings of the last tenth of
+ * the time range, which only touches the blocks whose time column can
+ * match.  The data is checked on the way.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store.h"
+
+#define START_MS (1700000000000LL)
+#define STEP_MS (60 * 1000LL)
+
+static double now_s( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void node_of(char *buf, size_t len, int node)
+{
+	uint8_t addr[16] = { 0xfd };
+
+	addr[14] = node >> 8;
+	addr[15] = node;
+	store_node_name(buf, len, addr, 0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = "store-bench.d";
+	int opt, nodes = 64, readings = 100000, i, j;
+	struct store *st;
+	struct store_series *s;
+	water_reading_t r;
+	char name[64], path[512];
+	double t0, t;
+	int64_t cutoff, sum = 0, expect = 0;
+	uint64_t rows = 0, matched = 0, blocks = 0, skipped = 0;
+	const store_column_t *cols;
+	int ncols, pcol;
+
+	while ((opt = getopt(argc, argv, "n:r:d:")) != -1) {
+		switch (opt) {
+		case 'n': nodes = atoi(optarg); break;
+		case 'r': readings = atoi(optarg); break;
+		case 'd': dir = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-n nodes] [-r readings per node] [-d dir]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	st = store_open(dir);
+	if (st == NULL)
+		return 1;
+
+	srand(1);
+	memset(&r, 0, sizeof(r));
+
+	t0 = now_s();
+	for (i = 0; i < nodes; i++) {
+		node_of(name, sizeof(name), i);
+		s = store_series_open(st, name, STORE_WATER);
+		r.pressure = 5300000;
+		for (j = 0; j < readings; j++) {
+			r.pressure += (rand() % 81) - 40;
+			r.temperature = 2000 + (j % 200);
+			expect += r.pressure;
+			if (store_append(s, START_MS + j * STEP_MS, j, 1, &r) < 0)
+				return 1;
+		}
+		store_series_close(s);
+	}
+	t = now_s() - t0;
+	printf("ingest            : %d x %d readings in %.2f s, %.0f readings/s\n",
+	       nodes, readings, t, (double) nodes * readings / t);
+
+	cols = store_columns(STORE_WATER, &ncols);
+	pcol = store_column_index(STORE_WATER, "pressure");
+	cutoff = START_MS + (int64_t) readings * STEP_MS * 9 / 10;
+
+	// full scan of one column
+	t0 = now_s();
+	for (i = 0; i < nodes; i++) {
+		node_of(name, sizeof(name), i);
+		for (j = 0; ; j++) {
+			store_segment_t seg;
+			uint32_t b;
+
+			store_segment_path(path, sizeof(path), dir, name, STORE_WATER, j);
+			if (store_segment_open(&seg, path) < 0)
+				break;
+			for (b = 0; b < seg.blocks; b++) {
+				const store_block_t *blk = store_segment_block(&seg, b);
+				const uint32_t *p = store_block_column(blk, cols, pcol);
+				int k;
+
+				for (k = 0; k < blk->rows; k++)
+					sum += p[k];
+				rows += blk->rows;
+			}
+			store_segment_close(&seg);
+		}
+	}
+	t = now_s() - t0;
+	printf("full scan         : %llu readings in %.3f s, %.0f readings/s%s\n",
+	       (unsigned long long) rows, t, rows / t, (sum == expect) ? "" : "  CHECKSUM MISMATCH");
+
+	// time range, pruned on the block headers
+	t0 = now_s();
+	for (i = 0; i < nodes; i++) {
+		node_of(name, sizeof(name), i);
+		for (j = 0; ; j++) {
+			store_segment_t seg;
+			uint32_t b;
+
+			store_segment_path(path, sizeof(path), dir, name, STORE_WATER, j);
+			if (store_segment_open(&seg, path) < 0)
+				break;
+			for (b = 0; b < seg.blocks; b++) {
+				const store_block_t *blk = store_segment_block(&seg, b);
+				const int64_t *tm;
+				int k;
+
+				blocks++;
+				if (blk->max[STORE_COL_TIME] < cutoff) {
+					skipped++;
+					continue;
+				}
+				tm = store_block_column(blk, cols, STORE_COL_TIME);
+				for (k = 0; k < blk->rows; k++)
+					matched += (tm[k] >= cutoff);
+			}
+			store_segment_close(&seg);
+		}
+	}
+	t = now_s() - t0;
+	printf("last 10%% of time  : %llu readings in %.4f s, %llu of %llu blocks skipped%s\n",
+	       (unsigned long long) matched, t, (unsigned long long) skipped, (unsigned long long) blocks,
+	       (matched == (uint64_t) nodes * (readings - readings * 9 / 10)) ? "" : "  COUNT MISMATCH");
+
+	store_close(st);
+	return 0;
+}
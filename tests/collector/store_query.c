@@ -0,0 +1,130 @@
+/*
+ * store_query.c
+ *
+ * Query the collector's store (collector -o) by node and time range.
+ *
+ *   store_query -d store [-n node] [-k water|airborne] [-f from] [-t to] [-a seconds] [-c]
+ *
+ * node is an IPv6 address (or the node's directory name in the store);
+ * without -n every node is queried.  from / to are seconds since the
+ * epoch, -a asks for the last 'seconds' up to now.  Matching readings
+ * are printed as CSV, or only counted with -c.  The index (index.h) is
+ * rebuilt from the block headers first; its cost is reported on stderr.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include "index.h"
+
+static int count_only;
+
+static double now_s( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_header(enum store_kind kind)
+{
+	const store_column_t *cols;
+	int n, i;
+
+	cols = store_columns(kind, &n);
+	printf("node,kind");
+	for (i = 0; i < n; i++)
+		printf(",%s", cols[i].name);
+	printf("\n");
+}
+
+static void print_row(const index_series_t *s, const store_block_t *b, int row, void *ctx)
+{
+	const store_column_t *cols;
+	int n, i;
+
+	cols = store_columns(s->kind, &n);
+	printf("%s,%s", s->node, store_kind_name(s->kind));
+	for (i = 0; i < n; i++)
+		printf(",%lld", (long long) store_value(b, cols, i, row));
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *root = NULL, *node = NULL;
+	int opt, kind = -1, k;
+	int64_t from = INT64_MIN, to = INT64_MAX;
+	store_index_t idx;
+	char name[64];
+	struct in6_addr addr;
+	double t0;
+	uint64_t total = 0;
+	uint32_t i;
+
+	while ((opt = getopt(argc, argv, "d:n:k:f:t:a:c")) != -1) {
+		switch (opt) {
+		case 'd': root = optarg; break;
+		case 'n': node = optarg; break;
+		case 'k': kind = (strcmp(optarg, "airborne") == 0) ? STORE_AIRBORNE : STORE_WATER; break;
+		case 'f': from = atoll(optarg) * 1000; break;
+		case 't': to = atoll(optarg) * 1000; break;
+		case 'a': from = time(NULL) * 1000LL - atoll(optarg) * 1000; break;
+		case 'c': count_only = 1; break;
+		default:
+			root = NULL;
+			break;
+		}
+	}
+
+	if (root == NULL) {
+		fprintf(stderr, "usage: %s -d store [-n node] [-k water|airborne] [-f from] [-t to] [-a seconds] [-c]\n", argv[0]);
+		return 1;
+	}
+
+	if ((node != NULL) && (inet_pton(AF_INET6, node, &addr) == 1)) {
+		store_node_name(name, sizeof(name), addr.s6_addr, 0);
+		node = name;
+	}
+
+	t0 = now_s();
+	if (index_build(&idx, root) < 0)
+		return 1;
+	fprintf(stderr, "index: %u series, %llu blocks, %llu readings in %.3f s\n", idx.count,
+	        (unsigned long long) idx.blocks, (unsigned long long) idx.rows, now_s() - t0);
+
+	for (k = 0; k < STORE_KINDS; k++) {
+		uint64_t rows = 0;
+
+		if ((kind >= 0) && (k != kind))
+			continue;
+
+		if (!count_only)
+			print_header(k);
+
+		if (node != NULL) {
+			const index_series_t *s = index_find(&idx, node, k);
+
+			if (s != NULL)
+				rows += index_scan(&idx, s, from, to, count_only ? NULL : print_row, NULL);
+		}
+		else {
+			for (i = 0; i < idx.count; i++) {
+				if (idx.series[i].kind == k)
+					rows += index_scan(&idx, &idx.series[i], from, to, count_only ? NULL : print_row, NULL);
+			}
+		}
+
+		if (count_only)
+			printf("%s %llu\n", store_kind_name(k), (unsigned long long) rows);
+		total += rows;
+	}
+
+	fprintf(stderr, "%llu readings\n", (unsigned long long) total);
+	index_free(&idx);
+	return 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * tcp_check.c
+ *
+ * Check the collector's side of the nodes' TCP messenger
+ * (message-sender-tcp.c).
+ *
+ *   tcp_check [-n messages]
+ *
+ * Runs ./collector on a private port and, as a node with sessions on,
+ * streams -n (200) length prefixed frames over one connection: one frame
+ * to a write, several to a write, and frames split across writes down to
+ * a byte at a time.  Every frame has to come back ACK'd, framed, in
+ * order, with the calibration request the first uncalibrated reading
+ * draws framed among the ACKs.  A bare message on a connection of its
+ * own (sessions off) has to get a bare ACK alone, and a length no frame
+ * can have has to end the session.
+ *
+ * The node's side of a collector that refuses the connection is
+ * checked by ../messenger/sender_check.
+ */
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "message.h"
+
+#define ACK_OK (1)
+#define PORT (17325)
+#define TCP_PORT (17326)
+
+// message-sender-tcp.c
+#define FRAME_PREFIX (2)
+
+static int failures;
+
+static pid_t start_collector( )
+{
+	char port[8], tcp_port[8];
+	pid_t pid;
+	int null;
+
+	snprintf(port, sizeof(port), "%d", PORT);
+	snprintf(tcp_port, sizeof(tcp_port), "%d", TCP_PORT);
+	pid = fork();
+	if (pid == 0) {
+		null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		execl("./collector", "collector", "-p", port, "-t", tcp_port, "-w", "1", "-i", "3600", (char *) NULL);
+		_exit(127);
+	}
+	// time to bind
+	usleep(300 * 1000);
+	return pid;
+}
+
+static void stop_collector(pid_t pid)
+{
+	kill(pid, SIGINT);
+	waitpid(pid, NULL, 0);
+}
+
+static int connect_collector( )
+{
+	struct sockaddr_in addr;
+	int s, on = 1;
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	// every write its own segment, so the splits reach the collector as made
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(TCP_PORT);
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	return s;
+}
+
+static void make_frame(water_data_t *m, uint32_t sequence)
+{
+	memset(m, 0, sizeof(*m));
+	m->header = WATER_DATA_HEADER;
+	m->sequence = sequence;
+	m->pressure = 101300 + sequence % 17;
+	m->battery = 3300;
+}
+
+/*
+ * Read until 'len' bytes are in or nothing more comes for a while.
+ * Returns the bytes read, -1 once the collector closed the connection.
+ */
+static int read_some(int s, uint8_t *buf, int len, int wait_ms)
+{
+	struct pollfd pfd = { s, POLLIN, 0 };
+	int got = 0, n;
+
+	while ((got < len) && (poll(&pfd, 1, wait_ms) > 0)) {
+		n = recv(s, buf + got, len - got, 0);
+		if (n <= 0)
+			return got ? got : -1;
+		got += n;
+	}
+	return got;
+}
+
+static void check(const char *what, int ok)
+{
+	if (ok)
+		return;
+	printf("  %s\n", what);
+	failures++;
+}
+
+/*
+ * One session: count frames, written in the pattern given by the
+ * chunk sizes (cycled), every one of them ACK'd.
+ */
+static void session(int count, const int *chunks, int nchunks)
+{
+	uint8_t *stream, *in, *p;
+	int s, len, i, c, off, got, acks = 0, cal_requests = 0, in_order = 1, flen;
+	uint32_t header, expect = 2000;
+	water_data_t m;
+
+	len = count * (FRAME_PREFIX + sizeof(m));
+	stream = malloc(len);
+	in = malloc(count * 2 * (FRAME_PREFIX + sizeof(ack_t)));
+
+	for (i = 0, p = stream; i < count; i++) {
+		make_frame(&m, 2000 + i);
+		p[0] = sizeof(m) >> 8;
+		p[1] = sizeof(m) & 0xff;
+		memcpy(p + FRAME_PREFIX, &m, sizeof(m));
+		p += FRAME_PREFIX + sizeof(m);
+	}
+
+	s = connect_collector();
+	for (off = 0, c = 0; off < len; off += i, c++) {
+		i = chunks[c % nchunks];
+		if (i > len - off)
+			i = len - off;
+		if (send(s, stream + off, i, 0) != i) {
+			perror("send");
+			exit(1);
+		}
+	}
+
+	// the replies are frames too, ACKs and the odd calibration request
+	got = read_some(s, in, count * (FRAME_PREFIX + sizeof(ack_t)) + FRAME_PREFIX + sizeof(cal_request_t), 1000);
+	for (off = 0; (got > 0) && (got - off >= FRAME_PREFIX); off += FRAME_PREFIX + flen) {
+		flen = (in[off] << 8) | in[off + 1];
+		if ((flen != sizeof(ack_t)) || (got - off < FRAME_PREFIX + flen))
+			break;
+
+		memcpy(&header, in + off + FRAME_PREFIX, sizeof(header));
+		if (header == CAL_REQUEST_HEADER) {
+			cal_requests++;
+			continue;
+		}
+		if ((header == ACK_HEADER) && (((ack_t *) (in + off + FRAME_PREFIX))->ack_value == ACK_OK)) {
+			in_order &= (((ack_t *) (in + off + FRAME_PREFIX))->ack_seq == expect++);
+			acks++;
+		}
+	}
+	check("replies are whole frames", off == got);
+	check("every frame ACK'd", acks == count);
+	check("ACKs in order", in_order);
+	check("one calibration request", cal_requests == 1);
+
+	printf("session           : %d frames in %d write%s, %d ACK'd, %d calibration request\n", count, c,
+	       (c == 1) ? "" : "s", acks, cal_requests);
+
+	close(s);
+	free(stream);
+	free(in);
+}
+
+int main(int argc, char **argv)
+{
+	const int one_each[] = { FRAME_PREFIX + sizeof(water_data_t) };
+	const int batched[] = { 7 * (FRAME_PREFIX + sizeof(water_data_t)) };
+	const int split[] = { 1, 1, 5, 13, 29, 2 };
+	uint8_t buf[64];
+	water_data_t m;
+	ack_t ack;
+	pid_t pid;
+	int opt, count = 200, s, got;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n': count = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n messages]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	// each session is a new collector, so each has its calibration request
+	pid = start_collector();
+	session(count, one_each, 1);
+	stop_collector(pid);
+
+	pid = start_collector();
+	session(count, batched, 1);
+	stop_collector(pid);
+
+	pid = start_collector();
+	session(count, split, sizeof(split) / sizeof(split[0]));
+
+	// sessions off: a bare message, a bare ACK and nothing else
+	s = connect_collector();
+	make_frame(&m, 5000);
+	send(s, &m, sizeof(m), 0);
+	got = read_some(s, buf, sizeof(buf), 500);
+	memcpy(&ack, buf, sizeof(ack));
+	check("bare message gets a bare ACK alone", (got == sizeof(ack)) && (ack.header == ACK_HEADER) &&
+	      (ack.ack_seq == 5000) && (ack.ack_value == ACK_OK));
+	close(s);
+
+	// a length no frame can have puts the session out of step
+	s = connect_collector();
+	make_frame(&m, 5001);
+	buf[0] = sizeof(m) >> 8;
+	buf[1] = sizeof(m) & 0xff;
+	memcpy(buf + FRAME_PREFIX, &m, sizeof(m));
+	buf[FRAME_PREFIX + sizeof(m)] = 0x02;
+	buf[FRAME_PREFIX + sizeof(m) + 1] = 0x00;
+	send(s, buf, FRAME_PREFIX + sizeof(m) + FRAME_PREFIX, 0);
+	got = read_some(s, buf, FRAME_PREFIX + sizeof(ack), 500);
+	check("frame ahead of a bad length ACK'd", got == FRAME_PREFIX + sizeof(ack));
+	check("bad length ends the session", read_some(s, buf, sizeof(buf), 1000) == -1);
+	close(s);
+
+	stop_collector(pid);
+
+	printf("tcp checks        : %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
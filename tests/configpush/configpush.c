@@ -0,0 +1,223 @@
+/*
+ * configpush.c
+ *
+ * Push configuration changes to a fleet of nodes (see push.h) and
+ * report how each node took them.
+ *
+ *   configpush [-f node file] [-p port] [-j parallel] [-r attempts]
+ *              [-t first timeout ms] [-T node timeout s] [-q]
+ *              TOKEN=value ... node ...
+ *
+ * Tokens are config.h's names, with or without the CONFIG_ prefix, or
+ * their numbers, e.g. SENSOR_INTERVAL=600 CAL2=1.  Changes are applied
+ * in the order given.  Nodes are IPv6 or IPv4 addresses, optionally
+ * with a port ([fd00::1]:5323, 127.2.0.1:5323), on the command line or
+ * one per line in -f ('#' starts a comment); -p is the port of nodes
+ * given without one (5323).
+ *
+ * Each node gets a line: its address, the outcome, the changes it
+ * confirmed, the datagrams sent to it and how long it took, and for a
+ * rejected change what the node reported instead.  -q leaves out the
+ * nodes that took every change.  The exit status is 0 only if they
+ * all did.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "push.h"
+
+#define MAX_CHANGES (32)
+
+static int parse_node(const char *text, int port, struct sockaddr_in6 *addr)
+{
+	char host[INET6_ADDRSTRLEN + 8], *colon;
+	struct in_addr v4;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin6_family = AF_INET6;
+
+	if (strlen(text) >= sizeof(host))
+		return -1;
+	strcpy(host, text);
+
+	// [v6]:port, or v4:port - a bare v6 address has more than one colon
+	if (host[0] == '[') {
+		colon = strstr(host, "]:");
+		if (colon != NULL) {
+			port = atoi(colon + 2);
+			*colon = '\0';
+		}
+		else if (host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = '\0';
+		}
+		memmove(host, host + 1, strlen(host));
+	}
+	else if (((colon = strchr(host, ':')) != NULL) && (strchr(colon + 1, ':') == NULL)) {
+		port = atoi(colon + 1);
+		*colon = '\0';
+	}
+
+	addr->sin6_port = htons(port);
+	if (inet_pton(AF_INET6, host, &addr->sin6_addr) == 1)
+		return 0;
+	if (inet_pton(AF_INET, host, &v4) != 1)
+		return -1;
+
+	// ::ffff:a.b.c.d
+	addr->sin6_addr.s6_addr[10] = 0xff;
+	addr->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&addr->sin6_addr.s6_addr[12], &v4, sizeof(v4));
+	return 0;
+}
+
+static void add_node(push_node_t **nodes, int *n, int *cap, const char *text, int port)
+{
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 256;
+		*nodes = realloc(*nodes, *cap * sizeof(push_node_t));
+	}
+	memset(&(*nodes)[*n], 0, sizeof(push_node_t));
+	if (parse_node(text, port, &(*nodes)[*n].addr) < 0) {
+		fprintf(stderr, "bad node address: %s\n", text);
+		exit(1);
+	}
+	(*n)++;
+}
+
+static void read_nodes(const char *path, push_node_t **nodes, int *n, int *cap, int port)
+{
+	char line[256], *p, *end;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for (p = line; (*p == ' ') || (*p == '\t'); p++)
+			;
+		for (end = p + strlen(p); (end > p) && ((end[-1] == '\n') || (end[-1] == '\r') ||
+		                                        (end[-1] == ' ') || (end[-1] == '\t')); end--)
+			;
+		*end = '\0';
+		if (*p != '\0')
+			add_node(nodes, n, cap, p, port);
+	}
+
+	fclose(f);
+}
+
+static void print_addr(const struct sockaddr_in6 *addr, char *out, size_t size)
+{
+	char host[INET6_ADDRSTRLEN];
+
+	if (IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr)) {
+		inet_ntop(AF_INET, &addr->sin6_addr.s6_addr[12], host, sizeof(host));
+		snprintf(out, size, "%s:%u", host, ntohs(addr->sin6_port));
+	}
+	else {
+		inet_ntop(AF_INET6, &addr->sin6_addr, host, sizeof(host));
+		snprintf(out, size, "[%s]:%u", host, ntohs(addr->sin6_port));
+	}
+}
+
+int main(int argc, char **argv)
+{
+	push_change_t changes[MAX_CHANGES];
+	push_options_t o;
+	push_node_t *nodes = NULL;
+	const char *file = NULL;
+	char *eq, name[64], where[INET6_ADDRSTRLEN + 16];
+	int opt, port = 5323, quiet = 0, count = 0, n = 0, cap = 0, token, i;
+	int tally[PUSH_ERROR + 1];
+	struct timespec t0, t1;
+
+	push_defaults(&o);
+
+	while ((opt = getopt(argc, argv, "f:p:j:r:t:T:q")) != -1) {
+		switch (opt) {
+		case 'f': file = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'j': o.parallel = atoi(optarg); break;
+		case 'r': o.attempts = atoi(optarg); break;
+		case 't': o.rto_ms = atoi(optarg); break;
+		case 'T': o.node_timeout_ms = atof(optarg) * 1000; break;
+		case 'q': quiet = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-f node file] [-p port] [-j parallel] [-r attempts]\n"
+			        "       [-t first timeout ms] [-T node timeout s] [-q] TOKEN=value ... node ...\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (o.parallel < 1)
+		o.parallel = 1;
+	if (o.attempts < 1)
+		o.attempts = 1;
+
+	for (i = optind; i < argc; i++) {
+		eq = strchr(argv[i], '=');
+		if (eq == NULL) {
+			add_node(&nodes, &n, &cap, argv[i], port);
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "%.*s", (int) (eq - argv[i]), argv[i]);
+		token = push_token(name);
+		if ((token < 0) || (count == MAX_CHANGES)) {
+			fprintf(stderr, "%s: %s\n", (token < 0) ? "unknown token" : "too many changes", argv[i]);
+			return 1;
+		}
+		changes[count].token = token;
+		changes[count].value = strtoul(eq + 1, NULL, 0);
+		count++;
+	}
+	if (file != NULL)
+		read_nodes(file, &nodes, &n, &cap, port);
+
+	if ((count == 0) || (n == 0)) {
+		fprintf(stderr, "nothing to do: %d changes for %d nodes\n", count, n);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (push_run(&o, changes, count, nodes, n) < 0) {
+		perror("socket");
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	memset(tally, 0, sizeof(tally));
+	for (i = 0; i < n; i++) {
+		push_node_t *p = &nodes[i];
+
+		tally[p->status]++;
+		if (quiet && (p->status == PUSH_OK))
+			continue;
+
+		print_addr(&p->addr, where, sizeof(where));
+		printf("%-40s %-8s %d/%d  %d sent  %lld ms", where, push_status_name(p->status), p->done, count,
+		       p->sends, (long long) p->elapsed_ms);
+		if (p->status == PUSH_REJECTED)
+			printf("  %s=%u reported %u", push_token_name(changes[p->done].token), changes[p->done].value,
+			       p->value);
+		printf("\n");
+	}
+
+	printf("%d nodes, %d changes: %d ok, %d rejected, %d timed out, %d errors in %.1f s (%d at a time)\n",
+	       n, count, tally[PUSH_OK], tally[PUSH_REJECTED], tally[PUSH_TIMEOUT], tally[PUSH_ERROR],
+	       (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9, o.parallel);
+
+	free(nodes);
+	return (tally[PUSH_OK] == n) ? 0 : 2;
+}
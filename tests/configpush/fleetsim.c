@@ -0,0 +1,83 @@
+/*
+ * fleetsim.c
+ *
+ * Run emulated nodes (nodesim.h) for configpush to talk to.
+ *
+ *   fleetsim [-b first address] [-n nodes] [-p port] [-l loss %] [-D reply delay ms] [-d seconds]
+ *
+ * Nodes answer on -p (5323) of consecutive IPv4 addresses from -b
+ * (127.2.0.1) for -d seconds, then the values each node ended with
+ * are printed for the tokens that differ from the first node's.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include "message.h"
+#include "nodesim.h"
+
+int main(int argc, char **argv)
+{
+	const char *base = "127.2.0.1";
+	nodesim_options_t o = { 0, 16, 5323, 0, 0, 1 };
+	int opt, seconds = 60, token, i;
+	struct in_addr first;
+	nodesim_t *sim;
+
+	while ((opt = getopt(argc, argv, "b:n:p:l:D:d:")) != -1) {
+		switch (opt) {
+		case 'b': base = optarg; break;
+		case 'n': o.count = atoi(optarg); break;
+		case 'p': o.port = atoi(optarg); break;
+		case 'l': o.loss = atof(optarg) / 100; break;
+		case 'D': o.delay_ms = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-b first address] [-n nodes] [-p port] [-l loss %%]"
+			        " [-D reply delay ms] [-d seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (inet_pton(AF_INET, base, &first) != 1) {
+		fprintf(stderr, "bad IPv4 address\n");
+		return 1;
+	}
+	o.first = ntohl(first.s_addr);
+
+	sim = nodesim_start(&o);
+	if (sim == NULL)
+		return 1;
+	printf("%d nodes from %s port %d for %d s\n", o.count, base, o.port, seconds);
+	fflush(stdout);
+
+	sleep(seconds);
+	nodesim_stop(sim);
+
+	printf("node 0:");
+	for (token = CONFIG_SENSOR_INTERVAL; token <= CONFIG_CAL8; token++) {
+		if (nodesim_value(sim, 0, token) != 0)
+			printf(" %d=%u", token, nodesim_value(sim, 0, token));
+	}
+	printf(", %u sets\n", nodesim_sets(sim, 0));
+
+	for (i = 1; i < o.count; i++) {
+		int differs = 0;
+
+		for (token = CONFIG_SENSOR_INTERVAL; token <= CONFIG_CAL8; token++) {
+			if (nodesim_value(sim, i, token) == nodesim_value(sim, 0, token))
+				continue;
+			if (!differs)
+				printf("node %d:", i);
+			printf(" %d=%u", token, nodesim_value(sim, i, token));
+			differs = 1;
+		}
+		if (differs)
+			printf(", %u sets\n", nodesim_sets(sim, i));
+	}
+
+	nodesim_free(sim);
+	return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * nodesim.c
+ *
+ * Emulated command port nodes, see nodesim.h.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "message.h"
+#include "nodesim.h"
+
+// message-service.c
+#define REPLY_CACHE (3)
+
+#define TOKENS (CONFIG_CAL8 + 1)
+#define MAX_REPLY (sizeof(command_reply_t) + sizeof(command_ret_t))
+
+struct reply_entry {
+	struct sockaddr_in addr;
+	uint16_t request_id;
+	uint16_t length;
+	uint8_t valid;
+	int64_t due;			// pending until then
+	uint8_t data[MAX_REPLY];
+};
+
+struct node {
+	int sock;
+	uint32_t config[TOKENS];
+	uint32_t sets;
+	struct reply_entry replies[REPLY_CACHE];
+	int next_reply;
+};
+
+struct nodesim {
+	pthread_t thread;
+	int running;
+	volatile int stop;
+	nodesim_options_t o;
+	struct node *nodes;
+};
+
+static int64_t now_ms( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static double chance(nodesim_t *s)
+{
+	return rand_r(&s->o.seed) / (RAND_MAX + 1.0);
+}
+
+static uint32_t clamp(uint32_t v, uint32_t lo, uint32_t hi)
+{
+	return (v < lo) ? lo : (v > hi) ? hi : v;
+}
+
+// config.c's setters
+static int store(struct node *n, uint8_t token, uint32_t value)
+{
+	switch (token) {
+	case CONFIG_SENSOR_INTERVAL: value = clamp(value, 5, 7200); break;
+	case CONFIG_MAX_FAILURES: value = (value < 10) ? 10 : value; break;
+	case CONFIG_RETRY_INTERVAL: value = clamp(value, 5, 30); break;
+	case CONFIG_SAMPLES_PER_SEND: value = clamp(value, 1, 16); break;
+	case CONFIG_COMPRESSION: value = (value != 0) ? 1 : 0; break;
+	case CONFIG_TRANSPORT: value = (value > CONFIG_TRANSPORT_AUTO) ? CONFIG_TRANSPORT_UDP : value; break;
+	case CONFIG_COLLECTOR_MODE: value = (value == CONFIG_COLLECTOR_HASHED) ? value : CONFIG_COLLECTOR_ORDERED; break;
+	case CONFIG_AIRTIME_RATE:
+	case CONFIG_AIRTIME_BURST:
+		break;
+
+	case CONFIG_CAL1: case CONFIG_CAL2: case CONFIG_CAL3: case CONFIG_CAL4:
+	case CONFIG_CAL5: case CONFIG_CAL6: case CONFIG_CAL7: case CONFIG_CAL8:
+		value = (uint16_t) value;
+		break;
+
+	default:
+		return 0;
+	}
+
+	n->config[token] = value;
+	return 1;
+}
+
+// command.c's command_handler(), 32 bit tokens only
+static int handle(struct node *n, const uint8_t *data, int len, uint8_t *out)
+{
+	const command_set_t *req = (const command_set_t *) data;
+	command_ret_t *ret = (command_ret_t *) out;
+
+	if ((len < sizeof(command_set_t)) || (req->header != CMD_SET_HEADER))
+		return 0;
+
+	memset(ret, 0, sizeof(*ret));
+	ret->header = CMD_RET_HEADER;
+	ret->token = req->token;
+	ret->length = sizeof(uint32_t);
+
+	if (req->config_type == CMD_SET_CONFIG) {
+		n->sets++;
+		if (store(n, req->token, req->value.intval)) {
+			ret->value.uivalue = n->config[req->token];
+			ret->valid = (ret->value.uivalue == req->value.intval) ? 1 : 0;
+		}
+		else {
+			ret->length = 4 * sizeof(uint32_t);
+		}
+	}
+	else if (req->config_type == CMD_REQ_CONFIG) {
+		ret->valid = (req->token < TOKENS) ? 1 : 0;
+		ret->value.uivalue = (req->token < TOKENS) ? n->config[req->token] : 0;
+	}
+	else {
+		return 0;
+	}
+
+	return 13 + ret->length;
+}
+
+static void send_reply(nodesim_t *s, struct node *n, struct reply_entry *e)
+{
+	if (chance(s) < s->o.loss)
+		return;
+	sendto(n->sock, e->data, e->length, MSG_DONTWAIT, (struct sockaddr *) &e->addr, sizeof(e->addr));
+}
+
+// message-service.c's command_udp_recv()
+static void receive(nodesim_t *s, struct node *n, int64_t now)
+{
+	uint8_t buf[256];
+	const command_request_t *req = (const command_request_t *) buf;
+	command_reply_t *reply;
+	struct reply_entry *e;
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	int len, i;
+
+	while (1) {
+		fromlen = sizeof(from);
+		len = recvfrom(n->sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen);
+		if (len < 0)
+			break;
+		if ((chance(s) < s->o.loss) || (len < sizeof(command_request_t)) || (req->header != UDP_COMMAND_HEADER))
+			continue;
+
+		for (i = 0; i < REPLY_CACHE; i++) {
+			e = &n->replies[i];
+			if (e->valid && (e->request_id == req->request_id) && (e->addr.sin_port == from.sin_port) &&
+			    (e->addr.sin_addr.s_addr == from.sin_addr.s_addr))
+				break;
+		}
+		if (i < REPLY_CACHE) {
+			// answered again, or dropped while the reply is still pending
+			if (e->due <= now)
+				send_reply(s, n, e);
+			continue;
+		}
+
+		e = &n->replies[n->next_reply];
+		n->next_reply = (n->next_reply + 1) % REPLY_CACHE;
+
+		reply = (command_reply_t *) e->data;
+		reply->header = UDP_REPLY_HEADER;
+		reply->request_id = req->request_id;
+
+		e->addr = from;
+		e->request_id = req->request_id;
+		e->valid = 1;
+		e->length = sizeof(command_reply_t) + handle(n, req->data, len - sizeof(command_request_t), reply->data);
+		e->due = now + s->o.delay_ms;
+		if (s->o.delay_ms == 0)
+			send_reply(s, n, e);
+	}
+}
+
+static void *thread_main(void *arg)
+{
+	nodesim_t *s = arg;
+	struct epoll_event ev, events[256];
+	int64_t now, next;
+	int ep, got, i, j;
+
+	ep = epoll_create1(0);
+	for (i = 0; i < s->o.count; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &s->nodes[i];
+		epoll_ctl(ep, EPOLL_CTL_ADD, s->nodes[i].sock, &ev);
+	}
+
+	next = now_ms();
+	while (!s->stop) {
+		now = now_ms();
+		got = epoll_wait(ep, events, 256, (next > now) ? ((next - now < 50) ? (int) (next - now) : 50) : 0);
+
+		now = now_ms();
+		for (i = 0; i < got; i++)
+			receive(s, events[i].data.ptr, now);
+
+		// delayed replies that are due
+		next = now + 50;
+		for (i = 0; (s->o.delay_ms > 0) && (i < s->o.count); i++) {
+			for (j = 0; j < REPLY_CACHE; j++) {
+				struct reply_entry *e = &s->nodes[i].replies[j];
+
+				if (!e->valid || (e->due == 0))
+					continue;
+				if (e->due <= now) {
+					send_reply(s, &s->nodes[i], e);
+					e->due = 0;
+				}
+				else if (e->due < next) {
+					next = e->due;
+				}
+			}
+		}
+	}
+
+	close(ep);
+	return NULL;
+}
+
+nodesim_t *nodesim_start(const nodesim_options_t *o)
+{
+	nodesim_t *s = calloc(1, sizeof(*s));
+	struct sockaddr_in addr;
+	int i, one = 1;
+
+	s->o = *o;
+	s->nodes = calloc(o->count, sizeof(struct node));
+
+	for (i = 0; i < o->count; i++) {
+		struct node *n = &s->nodes[i];
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(o->port);
+		addr.sin_addr.s_addr = htonl(o->first + i);
+
+		n->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		setsockopt(n->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if ((n->sock < 0) || (bind(n->sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+			perror("node socket");
+			s->o.count = i + (n->sock >= 0);
+			nodesim_stop(s);
+			nodesim_free(s);
+			return NULL;
+		}
+
+		// config.c's defaults
+		store(n, CONFIG_SENSOR_INTERVAL, 10);
+		store(n, CONFIG_MAX_FAILURES, 100);
+		store(n, CONFIG_RETRY_INTERVAL, 15);
+		store(n, CONFIG_SAMPLES_PER_SEND, 1);
+		store(n, CONFIG_AIRTIME_BURST, 512);
+	}
+
+	pthread_create(&s->thread, NULL, thread_main, s);
+	s->running = 1;
+	return s;
+}
+
+void nodesim_stop(nodesim_t *s)
+{
+	int i;
+
+	if (s->running) {
+		s->stop = 1;
+		pthread_join(s->thread, NULL);
+		s->running = 0;
+	}
+	for (i = 0; i < s->o.count; i++) {
+		if (s->nodes[i].sock >= 0)
+			close(s->nodes[i].sock);
+		s->nodes[i].sock = -1;
+	}
+}
+
+void nodesim_free(nodesim_t *s)
+{
+	free(s->nodes);
+	free(s);
+}
+
+uint32_t nodesim_value(const nodesim_t *s, int node, uint8_t token)
+{
+	return (token < TOKENS) ? s->nodes[node].config[token] : 0;
+}
+
+uint32_t nodesim_sets(const nodesim_t *s, int node)
+{
+	return s->nodes[node].sets;
+}
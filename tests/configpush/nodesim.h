@@ -0,0 +1,48 @@
+/*
+ * nodesim.h
+ *
+ * Emulated nodes answering the command protocol over UDP, to push
+ * configuration at without a deployment.
+ *
+ * Each node has its own socket on the command port of consecutive IPv4
+ * addresses from 'first' (127.x.y.z, so every node is told apart by
+ * address as on a mesh), and answers command_request_t frames carrying
+ * command_set_t as modules/command/command.c and message-service.c do:
+ * sets clamp the way config.c does and come back valid only when the
+ * value read back is the one asked for, gets report the value, and
+ * the last 3 replies are cached so a repeated request_id is answered
+ * again without running the set twice.  Replies go out 'delay_ms'
+ * after the request, a request repeated meanwhile is dropped as still
+ * pending, and 'loss' of the requests and of the replies is lost.
+ */
+
+#ifndef TESTS_CONFIGPUSH_NODESIM_H_
+#define TESTS_CONFIGPUSH_NODESIM_H_
+
+#include <stdint.h>
+
+typedef struct {
+	uint32_t first;			// IPv4 address of the first node, host order
+	int count;
+	int port;
+	double loss;			// 0 .. 1, each way
+	int delay_ms;
+	unsigned int seed;
+} nodesim_options_t;
+
+typedef struct nodesim nodesim_t;
+
+// bind the nodes and answer on a thread, NULL if a socket cannot be bound
+nodesim_t *nodesim_start(const nodesim_options_t *o);
+
+// stop answering; the nodes' state stays readable until nodesim_free()
+void nodesim_stop(nodesim_t *s);
+void nodesim_free(nodesim_t *s);
+
+// a node's current value of a token
+uint32_t nodesim_value(const nodesim_t *s, int node, uint8_t token);
+
+// the sets a node has run, repeats answered from the cache not counted
+uint32_t nodesim_sets(const nodesim_t *s, int node);
+
+#endif /* TESTS_CONFIGPUSH_NODESIM_H_ */
@@ -0,0 +1,318 @@
+/*
+ * push.c
+ *
+ * Concurrent configuration push, see push.h.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "message.h"
+#include "push.h"
+
+// message-sender-udp.c
+#define RTO_MAX (8000)
+
+// header, token, valid and length ahead of the value
+#define RET_FIXED (13)
+
+struct active {
+	push_node_t *node;
+	int change;
+	uint16_t id;
+	int attempt;
+	int64_t rto;
+	int64_t next_send;
+	int64_t started;
+	int64_t deadline;
+};
+
+// the 32 bit tokens command.c sets
+static const struct {
+	const char *name;
+	uint8_t token;
+} tokens[] = {
+	{ "SENSOR_INTERVAL", CONFIG_SENSOR_INTERVAL },
+	{ "MAX_FAILURES", CONFIG_MAX_FAILURES },
+	{ "RETRY_INTERVAL", CONFIG_RETRY_INTERVAL },
+	{ "SAMPLES_PER_SEND", CONFIG_SAMPLES_PER_SEND },
+	{ "COMPRESSION", CONFIG_COMPRESSION },
+	{ "TRANSPORT", CONFIG_TRANSPORT },
+	{ "AIRTIME_RATE", CONFIG_AIRTIME_RATE },
+	{ "AIRTIME_BURST", CONFIG_AIRTIME_BURST },
+	{ "COLLECTOR_MODE", CONFIG_COLLECTOR_MODE },
+	{ "CAL1", CONFIG_CAL1 },
+	{ "CAL2", CONFIG_CAL2 },
+	{ "CAL3", CONFIG_CAL3 },
+	{ "CAL4", CONFIG_CAL4 },
+	{ "CAL5", CONFIG_CAL5 },
+	{ "CAL6", CONFIG_CAL6 },
+	{ "CAL7", CONFIG_CAL7 },
+	{ "CAL8", CONFIG_CAL8 },
+};
+
+#define TOKEN_COUNT (sizeof(tokens) / sizeof(tokens[0]))
+
+static int64_t now_ms( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void push_defaults(push_options_t *o)
+{
+	o->parallel = 16;
+	o->attempts = 5;
+	o->rto_ms = 2000;
+	o->node_timeout_ms = 30000;
+}
+
+const char *push_status_name(enum push_status status)
+{
+	static const char *names[] = { "pending", "ok", "rejected", "timeout", "error" };
+
+	return ((unsigned) status < sizeof(names) / sizeof(names[0])) ? names[status] : "?";
+}
+
+int push_token(const char *name)
+{
+	char *end;
+	long v;
+	int i;
+
+	if (!strncmp(name, "CONFIG_", 7))
+		name += 7;
+	for (i = 0; i < TOKEN_COUNT; i++) {
+		if (!strcmp(name, tokens[i].name))
+			return tokens[i].token;
+	}
+
+	v = strtol(name, &end, 0);
+	return ((*name != '\0') && (*end == '\0') && (v >= 0) && (v <= UINT8_MAX)) ? (int) v : -1;
+}
+
+const char *push_token_name(uint8_t token)
+{
+	static char number[8];
+	int i;
+
+	for (i = 0; i < TOKEN_COUNT; i++) {
+		if (tokens[i].token == token)
+			return tokens[i].name;
+	}
+	snprintf(number, sizeof(number), "%u", token);
+	return number;
+}
+
+static int transmit(int sock, struct active *a, const push_change_t *change, int64_t now)
+{
+	uint8_t frame[sizeof(command_request_t) + sizeof(command_set_t)];
+	command_request_t *req = (command_request_t *) frame;
+	command_set_t set;
+
+	memset(&set, 0, sizeof(set));
+	set.header = CMD_SET_HEADER;
+	set.config_type = CMD_SET_CONFIG;
+	set.token = change->token;
+	set.value.intval = change->value;
+
+	req->header = UDP_COMMAND_HEADER;
+	req->request_id = a->id;
+	memcpy(req->data, &set, sizeof(set));
+
+	a->node->sends++;
+	a->next_send = now + a->rto;
+
+	// a full socket buffer is a lost datagram, the resend takes care of it
+	if ((sendto(sock, frame, sizeof(frame), MSG_DONTWAIT, (struct sockaddr *) &a->node->addr,
+	            sizeof(a->node->addr)) < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+		return -1;
+	return 0;
+}
+
+static void finish(struct active *a, enum push_status status, int64_t now)
+{
+	a->node->status = status;
+	a->node->elapsed_ms = now - a->started;
+	a->node = NULL;
+}
+
+// on to the node's next change, or done with it
+static void advance(int sock, struct active *a, const push_change_t *changes, int count, uint16_t *next_id,
+                    const push_options_t *o, int64_t now)
+{
+	if (a->change == count) {
+		finish(a, PUSH_OK, now);
+		return;
+	}
+
+	a->id = (*next_id)++;
+	a->attempt = 0;
+	a->rto = o->rto_ms;
+	if (transmit(sock, a, &changes[a->change], now) < 0)
+		finish(a, PUSH_ERROR, now);
+}
+
+static void reply(int sock, struct active *actives, int parallel, const uint8_t *data, int len,
+                  const struct sockaddr_in6 *from, const push_change_t *changes, int count,
+                  uint16_t *next_id, const push_options_t *o, int64_t now)
+{
+	const command_reply_t *rep = (const command_reply_t *) data;
+	const command_ret_t *ret = (const command_ret_t *) rep->data;
+	const push_change_t *change;
+	struct active *a = NULL;
+	int i;
+
+	if ((len < sizeof(command_reply_t)) || (rep->header != UDP_REPLY_HEADER))
+		return;
+
+	for (i = 0; i < parallel; i++) {
+		if ((actives[i].node != NULL) && (actives[i].node->addr.sin6_port == from->sin6_port) &&
+		    !memcmp(&actives[i].node->addr.sin6_addr, &from->sin6_addr, sizeof(from->sin6_addr))) {
+			a = &actives[i];
+			break;
+		}
+	}
+
+	// late answers to a change already confirmed are dropped with the id
+	if ((a == NULL) || (rep->request_id != a->id))
+		return;
+
+	change = &changes[a->change];
+
+	// an older node answers a set with the header alone
+	if ((len < sizeof(command_reply_t) + RET_FIXED + sizeof(uint32_t)) ||
+	    (ret->header != CMD_RET_HEADER) || (ret->token != change->token)) {
+		finish(a, PUSH_ERROR, now);
+		return;
+	}
+
+	a->node->value = ret->value.uivalue;
+	if (!ret->valid || (ret->value.uivalue != change->value)) {
+		finish(a, PUSH_REJECTED, now);
+		return;
+	}
+
+	a->node->done++;
+	a->change++;
+	advance(sock, a, changes, count, next_id, o, now);
+}
+
+int push_run(const push_options_t *o, const push_change_t *changes, int count, push_node_t *nodes, int n)
+{
+	struct active *actives;
+	struct sockaddr_in6 local, from;
+	socklen_t fromlen;
+	struct pollfd pfd;
+	uint8_t buf[512];
+	uint16_t next_id;
+	int64_t now, next;
+	int sock, off = 0, started = 0, busy, ok = 0, len, i;
+
+	sock = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (sock < 0)
+		return -1;
+
+	// v4-mapped addresses reach IPv4 nodes from the same socket
+	setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	memset(&local, 0, sizeof(local));
+	local.sin6_family = AF_INET6;
+	if (bind(sock, (struct sockaddr *) &local, sizeof(local)) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	/*
+	 * Not from 0: a node caches replies by address, port and id, and an
+	 * earlier push may have used the same port.
+	 */
+	next_id = (uint16_t) (time(NULL) ^ getpid());
+
+	actives = calloc(o->parallel, sizeof(*actives));
+	for (i = 0; i < n; i++) {
+		nodes[i].status = PUSH_PENDING;
+		nodes[i].done = 0;
+		nodes[i].sends = 0;
+		nodes[i].elapsed_ms = 0;
+		nodes[i].value = 0;
+	}
+
+	while (1) {
+		now = now_ms();
+
+		// keep every slot busy while there are nodes left
+		busy = 0;
+		for (i = 0; i < o->parallel; i++) {
+			struct active *a = &actives[i];
+
+			while ((a->node == NULL) && (started < n)) {
+				memset(a, 0, sizeof(*a));
+				a->node = &nodes[started++];
+				a->started = now;
+				a->deadline = now + o->node_timeout_ms;
+				advance(sock, a, changes, count, &next_id, o, now);
+			}
+			busy += (a->node != NULL);
+		}
+		if (!busy)
+			break;
+
+		// resends and give ups
+		next = now + 1000;
+		for (i = 0; i < o->parallel; i++) {
+			struct active *a = &actives[i];
+
+			if (a->node == NULL)
+				continue;
+
+			if (now >= a->deadline) {
+				finish(a, PUSH_TIMEOUT, now);
+				continue;
+			}
+			if (now >= a->next_send) {
+				if (a->attempt + 1 >= o->attempts) {
+					finish(a, PUSH_TIMEOUT, now);
+					continue;
+				}
+				a->attempt++;
+				a->rto = (a->rto >= RTO_MAX / 2) ? RTO_MAX : a->rto * 2;
+				if (transmit(sock, a, &changes[a->change], now) < 0) {
+					finish(a, PUSH_ERROR, now);
+					continue;
+				}
+			}
+			if (a->next_send < next)
+				next = a->next_send;
+			if (a->deadline < next)
+				next = a->deadline;
+		}
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		poll(&pfd, 1, (next > now) ? (int) (next - now) : 0);
+
+		now = now_ms();
+		while (1) {
+			fromlen = sizeof(from);
+			len = recvfrom(sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen);
+			if (len < 0)
+				break;
+			if (from.sin6_family == AF_INET6)
+				reply(sock, actives, o->parallel, buf, len, &from, changes, count, &next_id, o, now);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		ok += (nodes[i].status == PUSH_OK);
+
+	free(actives);
+	close(sock);
+	return ok;
+}
@@ -0,0 +1,80 @@
+/*
+ * push.h
+ *
+ * Push configuration changes to many nodes at once.
+ *
+ * Each change is a command_set_t (CMD_SET_CONFIG) sent to the node's
+ * command port over UDP, wrapped in a command_request_t.  A node gets
+ * its changes one after the other, in order, and the next one only
+ * once the previous command_ret_t came back with valid set and the
+ * value asked for; a node clamps or refuses what it cannot take, and
+ * the push stops there for that node.  Up to 'parallel' nodes are
+ * worked on at a time from a single socket.
+ *
+ * A request that gets no reply is resent with the same request_id,
+ * the timeout doubling each time, so the node answers from its reply
+ * cache instead of running the set again (see message-service.c).  A
+ * node that needs more than 'attempts' sends for one change, or more
+ * than 'node_timeout_ms' overall, is given up on.
+ *
+ * Only 32 bit values are pushed; the address tokens (CONFIG_ROUTER,
+ * CONFIG_COLLECTOR2/3) are not.
+ */
+
+#ifndef TESTS_CONFIGPUSH_PUSH_H_
+#define TESTS_CONFIGPUSH_PUSH_H_
+
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+typedef struct {
+	uint8_t token;			// configtype_t
+	uint32_t value;
+} push_change_t;
+
+enum push_status {
+	PUSH_PENDING,			// not reached (yet)
+	PUSH_OK,				// every change confirmed
+	PUSH_REJECTED,			// a change came back not valid, or with another value
+	PUSH_TIMEOUT,			// out of attempts or time
+	PUSH_ERROR,				// reply not understood, or the send failed
+};
+
+typedef struct {
+	struct sockaddr_in6 addr;	// IPv4 nodes as v4-mapped addresses
+
+	// filled in by push_run()
+	enum push_status status;
+	int done;				// changes confirmed
+	int sends;				// datagrams sent, retries included
+	int64_t elapsed_ms;		// from the first send to the outcome
+	uint32_t value;			// what the node reported for the change that stopped it
+} push_node_t;
+
+typedef struct {
+	int parallel;			// nodes worked on at once
+	int attempts;			// sends per change before giving up
+	int rto_ms;				// first reply timeout, doubled on each resend
+	int node_timeout_ms;	// for all of a node's changes
+} push_options_t;
+
+// 16 at a time, 5 sends from 2 s up to 30 s per node, like the node's own sender
+void push_defaults(push_options_t *o);
+
+/*
+ * Apply count changes to every node.  Returns the number of nodes that
+ * ended PUSH_OK, or -1 if no socket could be opened.
+ */
+int push_run(const push_options_t *o, const push_change_t *changes, int count, push_node_t *nodes, int n);
+
+const char *push_status_name(enum push_status status);
+
+/*
+ * A settable token by name, with or without the CONFIG_ prefix, or by
+ * number; -1 if there is no such token.
+ */
+int push_token(const char *name);
+const char *push_token_name(uint8_t token);
+
+#endif /* TESTS_CONFIGPUSH_PUSH_H_ */
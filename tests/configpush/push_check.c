@@ -0,0 +1,190 @@
+/*
+ * push_check.c
+ *
+ * Check and time the configuration push (push.h) against emulated
+ * nodes (nodesim.h).
+ *
+ *   push_check [-n nodes] [-l loss %] [-D reply delay ms]
+ *
+ * First -n nodes with -l percent loss each way take three changes
+ * while three addresses nobody answers on time out: every node has to
+ * end with the values pushed, each set run once however often it was
+ * resent.  Then a clamped value and a token the node does not set have
+ * to come back rejected, stopping the node's later changes.  Last, a
+ * lossless push to every node is timed at several parallelisms, each
+ * reply -D ms after its request as over a radio hop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include "message.h"
+#include "nodesim.h"
+#include "push.h"
+
+#define FIRST (0x7f030001U)		// 127.3.0.1
+#define PORT (15323)
+#define DEAD (3)
+
+static int failures;
+
+static double now_s( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, int node, const push_node_t *p)
+{
+	printf("  %-36s node %d: %s, %d done, %d sent, reported %u\n", what, node, push_status_name(p->status),
+	       p->done, p->sends, p->value);
+	failures++;
+}
+
+static push_node_t *make_nodes(int count)
+{
+	push_node_t *nodes = calloc(count, sizeof(push_node_t));
+	uint32_t v4;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		nodes[i].addr.sin6_family = AF_INET6;
+		nodes[i].addr.sin6_port = htons(PORT);
+		nodes[i].addr.sin6_addr.s6_addr[10] = 0xff;
+		nodes[i].addr.sin6_addr.s6_addr[11] = 0xff;
+		v4 = htonl(FIRST + i);
+		memcpy(&nodes[i].addr.sin6_addr.s6_addr[12], &v4, sizeof(v4));
+	}
+	return nodes;
+}
+
+static void check(int count, double loss, int delay_ms)
+{
+	const push_change_t changes[] = {
+		{ CONFIG_SENSOR_INTERVAL, 600 },
+		{ CONFIG_CAL2, 3 },
+		{ CONFIG_RETRY_INTERVAL, 20 },
+	};
+	const push_change_t clamped[] = {
+		{ CONFIG_SENSOR_INTERVAL, 1 },
+		{ CONFIG_CAL1, 7 },
+	};
+	const push_change_t unknown[] = {
+		{ CONFIG_DEVTYPE, 1 },
+	};
+	nodesim_options_t so = { FIRST, count, PORT, loss, delay_ms, 1 };
+	push_options_t o;
+	push_node_t *nodes;
+	nodesim_t *sim;
+	int i, j;
+	uint64_t sends = 0;
+
+	sim = nodesim_start(&so);
+	if (sim == NULL)
+		exit(1);
+	nodes = make_nodes(count + DEAD);
+
+	// short timeouts, so the dead addresses do not hold the check up
+	push_defaults(&o);
+	o.parallel = 32;
+	o.attempts = 10;
+	o.rto_ms = 100;
+	o.node_timeout_ms = 5000;
+
+	push_run(&o, changes, 3, nodes, count + DEAD);
+	for (i = 0; i < count; i++) {
+		if ((nodes[i].status != PUSH_OK) || (nodes[i].done != 3)) {
+			fail("lossy push", i, &nodes[i]);
+			continue;
+		}
+		for (j = 0; j < 3; j++) {
+			if (nodesim_value(sim, i, changes[j].token) != changes[j].value)
+				fail("value on the node", i, &nodes[i]);
+		}
+		if (nodesim_sets(sim, i) != 3)
+			fail("set run more than once", i, &nodes[i]);
+		sends += nodes[i].sends;
+	}
+	for (i = count; i < count + DEAD; i++) {
+		if ((nodes[i].status != PUSH_TIMEOUT) || (nodes[i].elapsed_ms > o.node_timeout_ms + 100))
+			fail("no answer", i, &nodes[i]);
+	}
+	printf("lossy push        : %d nodes, %.1f%% loss each way, %.2f sends per change\n",
+	       count, loss * 100, (double) sends / (count * 3));
+
+	// clamped to 5 by the node: rejected, and CAL1 never sent
+	push_run(&o, clamped, 2, nodes, 1);
+	if ((nodes[0].status != PUSH_REJECTED) || (nodes[0].done != 0) || (nodes[0].value != 5) ||
+	    (nodesim_value(sim, 0, CONFIG_CAL1) != 0))
+		fail("clamped value", 0, &nodes[0]);
+
+	push_run(&o, unknown, 1, nodes, 1);
+	if ((nodes[0].status != PUSH_REJECTED) || (nodes[0].done != 0))
+		fail("token the node does not set", 0, &nodes[0]);
+
+	nodesim_stop(sim);
+	nodesim_free(sim);
+	free(nodes);
+
+	printf("push checks       : %s\n", failures ? "FAILED" : "ok");
+}
+
+int main(int argc, char **argv)
+{
+	int opt, count = 200, delay_ms = 20, parallel, i, ok;
+	double loss = 0.1, t;
+	nodesim_options_t so;
+	push_options_t o;
+	push_change_t change;
+	push_node_t *nodes;
+	nodesim_t *sim;
+
+	while ((opt = getopt(argc, argv, "n:l:D:")) != -1) {
+		switch (opt) {
+		case 'n': count = atoi(optarg); break;
+		case 'l': loss = atof(optarg) / 100; break;
+		case 'D': delay_ms = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-n nodes] [-l loss %%] [-D reply delay ms]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	check(count, loss, delay_ms);
+	if (failures)
+		return 1;
+
+	so.first = FIRST;
+	so.count = count;
+	so.port = PORT;
+	so.loss = 0;
+	so.delay_ms = delay_ms;
+	so.seed = 1;
+	sim = nodesim_start(&so);
+	if (sim == NULL)
+		return 1;
+	nodes = make_nodes(count);
+	push_defaults(&o);
+
+	for (parallel = 1, i = 0; parallel <= count; parallel *= 8, i++) {
+		o.parallel = parallel;
+		change.token = CONFIG_SENSOR_INTERVAL;
+		change.value = 300 + i;
+
+		t = now_s();
+		ok = push_run(&o, &change, 1, nodes, count);
+		t = now_s() - t;
+
+		printf("%4d at a time    : %d of %d nodes in %.2f s, %.0f nodes/s\n", parallel, ok, count, t, ok / t);
+	}
+
+	nodesim_stop(sim);
+	nodesim_free(sim);
+	free(nodes);
+	return 0;
+}
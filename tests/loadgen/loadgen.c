@@ -0,0 +1,581 @@
+/*
+ * loadgen.c
+ *
+ * Emulate a fleet of nodes against a collector and measure how it keeps
+ * up: ACK latency percentiles, delivered messages per second, and what
+ * the nodes had to retransmit or gave up on.
+ *
+ *   loadgen [-h host] [-p port] [-n nodes] [-t threads] [-i interval] [-d seconds]
+ *           [-a airborne %] [-l uplink loss %] [-L downlink loss %] [-W window]
+ *           [-b first source address] [-s seed]
+ *
+ * Every virtual node has its own UDP socket.  It sends its calibration
+ * frame (water_cal_t or airborne_cal_t) when it starts, then a
+ * water_data_t or airborne_t reading every -i seconds (a fraction is
+ * fine, the phase of each node is random).  Frames use the layouts of
+ * modules/command/message.h.
+ *
+ * Delivery follows modules/messenger/message-sender-udp.c: a queue of 8
+ * messages, at most -W of them awaiting an ACK, an RFC 6298 RTT
+ * estimator (2 s initial RTO, clamped to 0.25 .. 8 s) sampled under
+ * Karn's rule, the RTO doubling on each resend, and a message dropped
+ * after 8 attempts.  An ACK matches the whole 32 bit sequence as on the
+ * node, and a cal_request_t queues the calibration frame again.
+ * -l and -L drop that percentage of frames and of ACKs.
+ *
+ * Nodes' sockets bind to consecutive IPv4 addresses from -b (e.g.
+ * 127.1.0.1, so the collector tells them apart by address), otherwise
+ * to ephemeral ports (run the collector with -P).
+ *
+ * Latency is measured from a message's first transmission to its ACK,
+ * so it includes any retransmits.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "message.h"
+
+#define ACK_OK (1)
+
+// message-sender-udp.c, in ms
+#define MAX_ATTEMPTS (8)
+#define QUEUE_SIZE (8)
+#define RTO_INITIAL (2000)
+#define RTO_MIN (250)
+#define RTO_MAX (8000)
+
+#define MAX_FRAME (64)
+
+struct slot {
+	uint8_t used;
+	uint8_t sent;
+	uint8_t attempt;
+	uint32_t sequence;
+	int length;
+	int64_t queued_at;
+	int64_t first_send;
+	int64_t next_send;
+	int64_t rto;
+	uint8_t data[MAX_FRAME];
+};
+
+struct node {
+	int sock;
+	int airborne;
+	uint32_t sequence;
+	int64_t next_reading;
+
+	// RTT estimator, scaled as on the node: srtt x8, rttvar x4
+	int64_t srtt, rttvar, rto;
+	int samples;
+
+	struct slot slots[QUEUE_SIZE];
+	int queued;
+	uint32_t walk;
+};
+
+struct counters {
+	uint64_t readings;
+	uint64_t overflow;		// queue full, reading lost
+	uint64_t frames;		// datagrams put on the (emulated) air
+	uint64_t retransmits;
+	uint64_t dropped_up;
+	uint64_t dropped_down;
+	uint64_t delivered;
+	uint64_t failed;		// gave up after MAX_ATTEMPTS
+	uint64_t strays;		// ACKs matching nothing
+	uint64_t cal_requests;	// the collector asked for the calibration again
+};
+
+struct thread {
+	pthread_t thread;
+	struct node *nodes;
+	int count;
+	unsigned int seed;
+
+	struct counters c;
+
+	uint32_t *latency_us;
+	size_t latencies, latency_cap;
+};
+
+static struct sockaddr_in collector;
+static int window = 4;
+static double loss_up, loss_down;
+static int64_t interval_ms = 10000;
+static int airborne_pct = 50;
+static int64_t stop_at;
+
+static int64_t now_ms( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_us( )
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static double chance(struct thread *t)
+{
+	return rand_r(&t->seed) / (RAND_MAX + 1.0);
+}
+
+static void rtt_sample(struct node *n, int64_t rtt)
+{
+	int64_t delta;
+
+	if (n->samples == 0) {
+		n->srtt = rtt << 3;
+		n->rttvar = rtt << 1;
+	}
+	else {
+		delta = rtt - (n->srtt >> 3);
+		n->srtt += delta;
+		if (delta < 0)
+			delta = -delta;
+		n->rttvar += delta - (n->rttvar >> 2);
+	}
+	n->samples++;
+
+	n->rto = (n->srtt >> 3) + ((n->rttvar > 1) ? n->rttvar : 1);
+	n->rto = (n->rto < RTO_MIN) ? RTO_MIN : (n->rto > RTO_MAX) ? RTO_MAX : n->rto;
+}
+
+// queue a frame, lowest free slot - the node sends oldest first
+static void enqueue(struct thread *t, struct node *n, uint32_t sequence, const void *frame, int length, int64_t now)
+{
+	struct slot *s = NULL;
+	int i;
+
+	for (i = 0; i < QUEUE_SIZE; i++) {
+		if (!n->slots[i].used) {
+			s = &n->slots[i];
+			break;
+		}
+	}
+	if (s == NULL) {
+		t->c.overflow++;
+		return;
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->used = 1;
+	s->sequence = sequence;
+	s->length = length;
+	s->queued_at = now;
+	memcpy(s->data, frame, length);
+	n->queued++;
+}
+
+static void make_reading(struct thread *t, struct node *n, int64_t now)
+{
+	n->walk += (rand_r(&t->seed) % 81) - 40;
+
+	if (n->airborne) {
+		airborne_t m;
+
+		memset(&m, 0, sizeof(m));
+		m.header = AIRBORNE_HEADER;
+		m.sequence = n->sequence;
+		m.rssi = -70;
+		m.ms5637_pressure = 5300000 + n->walk;
+		m.ms5637_temp = 8400000;
+		m.si7020_humid = 30000;
+		m.si7020_temp = 25000;
+		m.battery = 3000;
+		enqueue(t, n, n->sequence++, &m, sizeof(m), now);
+	}
+	else {
+		water_data_t m;
+
+		memset(&m, 0, sizeof(m));
+		m.header = WATER_DATA_HEADER;
+		m.sequence = n->sequence;
+		m.rssi = -70;
+		m.pressure = 5300000 + n->walk;
+		m.temppressure = 8400000;
+		m.battery = 3000;
+		m.temperature = 2100;
+		enqueue(t, n, n->sequence++, &m, sizeof(m), now);
+	}
+	t->c.readings++;
+}
+
+static void make_cal(struct thread *t, struct node *n, int64_t now)
+{
+	if (n->airborne) {
+		airborne_cal_t m;
+
+		memset(&m, 0, sizeof(m));
+		m.header = AIRBORNE_CAL_HEADER;
+		m.sequence = n->sequence;
+		m.caldata[0] = 46372;
+		m.caldata[1] = 43981;
+		m.caldata[2] = 29059;
+		m.caldata[3] = 27842;
+		m.caldata[4] = 31553;
+		m.caldata[5] = 28165;
+		enqueue(t, n, n->sequence++, &m, sizeof(m), now);
+	}
+	else {
+		water_cal_t m;
+
+		memset(&m, 0, sizeof(m));
+		m.header = WATER_CAL_HEADER;
+		m.sequence = n->sequence;
+		m.caldata[0] = 46372;
+		m.caldata[1] = 43981;
+		m.caldata[2] = 29059;
+		m.caldata[3] = 27842;
+		m.caldata[4] = 31553;
+		m.caldata[5] = 28165;
+		enqueue(t, n, n->sequence++, &m, sizeof(m), now);
+	}
+}
+
+static void transmit(struct thread *t, struct node *n, struct slot *s, int64_t now)
+{
+	if (s->attempt == 0) {
+		s->first_send = now_us();
+		s->rto = n->rto;
+	}
+	else {
+		s->rto = (s->rto >= RTO_MAX / 2) ? RTO_MAX : s->rto * 2;
+		t->c.retransmits++;
+	}
+
+	t->c.frames++;
+	if (chance(t) < loss_up)
+		t->c.dropped_up++;
+	else if (sendto(n->sock, s->data, s->length, MSG_DONTWAIT, (struct sockaddr *) &collector, sizeof(collector)) < 0)
+		t->c.dropped_up++;
+
+	s->sent = 1;
+	s->next_send = now + s->rto;
+}
+
+/*
+ * The node's send loop: resend what timed out, start queued messages
+ * while the window allows.  Returns when it next needs to run.
+ */
+static int64_t service(struct thread *t, struct node *n, int64_t now)
+{
+	int64_t next = n->next_reading;
+	int in_flight = 0, i, oldest;
+
+	for (i = 0; i < QUEUE_SIZE; i++) {
+		struct slot *s = &n->slots[i];
+
+		if (!s->used || !s->sent)
+			continue;
+
+		if (now >= s->next_send) {
+			if (s->attempt + 1 >= MAX_ATTEMPTS) {
+				t->c.failed++;
+				s->used = 0;
+				n->queued--;
+				continue;
+			}
+			s->attempt++;
+			transmit(t, n, s, now);
+		}
+		in_flight++;
+		if (s->next_send < next)
+			next = s->next_send;
+	}
+
+	// oldest queued message first
+	while (in_flight < window) {
+		oldest = -1;
+		for (i = 0; i < QUEUE_SIZE; i++) {
+			struct slot *s = &n->slots[i];
+			if (s->used && !s->sent && ((oldest < 0) || (s->queued_at < n->slots[oldest].queued_at)))
+				oldest = i;
+		}
+		if (oldest < 0)
+			break;
+		transmit(t, n, &n->slots[oldest], now);
+		in_flight++;
+		if (n->slots[oldest].next_send < next)
+			next = n->slots[oldest].next_send;
+	}
+
+	return next;
+}
+
+static void record_latency(struct thread *t, int64_t us)
+{
+	if (t->latencies == t->latency_cap) {
+		t->latency_cap = t->latency_cap ? t->latency_cap * 2 : 65536;
+		t->latency_us = realloc(t->latency_us, t->latency_cap * sizeof(uint32_t));
+	}
+	t->latency_us[t->latencies++] = (us > UINT32_MAX) ? UINT32_MAX : us;
+}
+
+static void receive(struct thread *t, struct node *n, int64_t now)
+{
+	ack_t ack;
+	int i, len;
+
+	while ((len = recv(n->sock, &ack, sizeof(ack), MSG_DONTWAIT)) > 0) {
+		if (chance(t) < loss_down) {
+			t->c.dropped_down++;
+			continue;
+		}
+		// as on the node, a calibration request makes it send the cal frame again
+		if ((len == sizeof(ack)) && (ack.header == CAL_REQUEST_HEADER)) {
+			t->c.cal_requests++;
+			make_cal(t, n, now);
+			continue;
+		}
+		if ((len != sizeof(ack)) || (ack.header != ACK_HEADER) || (ack.ack_value != ACK_OK)) {
+			t->c.strays++;
+			continue;
+		}
+
+		for (i = 0; i < QUEUE_SIZE; i++) {
+			struct slot *s = &n->slots[i];
+
+			if (s->used && s->sent && (s->sequence == ack.ack_seq)) {
+				int64_t us = now_us() - s->first_send;
+
+				// Karn's rule
+				if (s->attempt == 0)
+					rtt_sample(n, us / 1000);
+				record_latency(t, us);
+				t->c.delivered++;
+				s->used = 0;
+				n->queued--;
+				break;
+			}
+		}
+		if (i == QUEUE_SIZE)
+			t->c.strays++;
+	}
+}
+
+static void *thread_main(void *arg)
+{
+	struct thread *t = arg;
+	struct epoll_event ev, events[256];
+	int64_t now, next, due;
+	int ep, i, got, wait_ms, busy = 1;
+
+	ep = epoll_create1(0);
+	for (i = 0; i < t->count; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &t->nodes[i];
+		epoll_ctl(ep, EPOLL_CTL_ADD, t->nodes[i].sock, &ev);
+	}
+
+	next = now_ms();
+	while (1) {
+		now = now_ms();
+		if ((now >= stop_at) && !busy)
+			break;
+
+		wait_ms = (next > now) ? (int) (next - now) : 0;
+		if (wait_ms > 100)
+			wait_ms = 100;
+		got = epoll_wait(ep, events, 256, wait_ms);
+
+		now = now_ms();
+		for (i = 0; i < got; i++)
+			receive(t, events[i].data.ptr, now);
+
+		// every node, but only the ones with something due do any work
+		next = now + 100;
+		busy = 0;
+		for (i = 0; i < t->count; i++) {
+			struct node *n = &t->nodes[i];
+
+			if ((now >= n->next_reading) && (now < stop_at)) {
+				make_reading(t, n, now);
+				n->next_reading += interval_ms;
+			}
+			due = service(t, n, now);
+			if (due < next)
+				next = due;
+
+			// past the end only what is still queued keeps the thread going
+			busy |= (n->queued > 0);
+		}
+	}
+
+	close(ep);
+	return NULL;
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const uint32_t *v, size_t n, double p)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0;
+	i = (size_t) (p / 100.0 * (n - 1) + 0.5);
+	return v[i] / 1000.0;
+}
+
+static int open_node(uint32_t source)
+{
+	struct sockaddr_in addr;
+	int s = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(source);
+
+	if ((s < 0) || (bind(s, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+		perror("node socket");
+		exit(1);
+	}
+	return s;
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1", *base = NULL;
+	int opt, port = 5323, nodes = 100, threads = 1, seconds = 30, i, j;
+	unsigned int seed = 1;
+	double interval = 10;
+	struct thread *ts;
+	struct counters c;
+	struct rlimit rl;
+	struct in_addr first;
+	uint32_t *all;
+	size_t total = 0;
+	int64_t started;
+	double elapsed;
+
+	while ((opt = getopt(argc, argv, "h:p:n:t:i:d:a:l:L:W:b:s:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': nodes = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'i': interval = atof(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'a': airborne_pct = atoi(optarg); break;
+		case 'l': loss_up = atof(optarg) / 100; break;
+		case 'L': loss_down = atof(optarg) / 100; break;
+		case 'W': window = atoi(optarg); break;
+		case 'b': base = optarg; break;
+		case 's': seed = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-h host] [-p port] [-n nodes] [-t threads] [-i interval] [-d seconds]\n"
+			        "       [-a airborne %%] [-l uplink loss %%] [-L downlink loss %%] [-W window]\n"
+			        "       [-b first source address] [-s seed]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (threads < 1)
+		threads = 1;
+	if (nodes < threads)
+		nodes = threads;
+	if ((window < 1) || (window > QUEUE_SIZE))
+		window = QUEUE_SIZE;
+	interval_ms = (interval * 1000 < 1) ? 1 : interval * 1000;
+
+	memset(&collector, 0, sizeof(collector));
+	collector.sin_family = AF_INET;
+	collector.sin_port = htons(port);
+	if ((inet_pton(AF_INET, host, &collector.sin_addr) != 1) ||
+	    ((base != NULL) && (inet_pton(AF_INET, base, &first) != 1))) {
+		fprintf(stderr, "bad IPv4 address\n");
+		return 1;
+	}
+
+	// a socket per node
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < nodes + 64) {
+		rl.rlim_cur = (rl.rlim_max < nodes + 64) ? rl.rlim_max : nodes + 64;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	started = now_ms();
+	stop_at = started + seconds * 1000LL;
+
+	ts = calloc(threads, sizeof(*ts));
+	for (i = 0; i < threads; i++) {
+		struct thread *t = &ts[i];
+		int from = i * nodes / threads;
+
+		t->count = (i + 1) * nodes / threads - from;
+		t->nodes = calloc(t->count, sizeof(struct node));
+		t->seed = seed + i;
+
+		for (j = 0; j < t->count; j++) {
+			struct node *n = &t->nodes[j];
+
+			n->sock = open_node((base != NULL) ? ntohl(first.s_addr) + from + j : INADDR_ANY);
+			n->airborne = (rand_r(&t->seed) % 100) < airborne_pct;
+			n->rto = RTO_INITIAL;
+			n->next_reading = started + rand_r(&t->seed) % interval_ms;
+			make_cal(t, n, started);
+		}
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_create(&ts[i].thread, NULL, thread_main, &ts[i]);
+
+	memset(&c, 0, sizeof(c));
+	for (i = 0; i < threads; i++) {
+		uint64_t *sum = (uint64_t *) &c, *part = (uint64_t *) &ts[i].c;
+
+		pthread_join(ts[i].thread, NULL);
+		for (j = 0; j < sizeof(c) / sizeof(uint64_t); j++)
+			sum[j] += part[j];
+		total += ts[i].latencies;
+	}
+	elapsed = (now_ms() - started) / 1000.0;
+
+	all = malloc((total + 1) * sizeof(uint32_t));
+	for (i = 0, total = 0; i < threads; i++) {
+		memcpy(all + total, ts[i].latency_us, ts[i].latencies * sizeof(uint32_t));
+		total += ts[i].latencies;
+	}
+	qsort(all, total, sizeof(uint32_t), latency_cmp);
+
+	printf("nodes             : %d on %d threads, a reading every %.3f s, window %d\n",
+	       nodes, threads, interval_ms / 1000.0, window);
+	printf("run               : %.1f s (%d s of readings)\n", elapsed, seconds);
+	printf("readings          : %llu, %llu lost to full queues\n",
+	       (unsigned long long) c.readings, (unsigned long long) c.overflow);
+	printf("frames sent       : %llu (%.0f/s), %llu retransmits\n",
+	       (unsigned long long) c.frames, c.frames / elapsed, (unsigned long long) c.retransmits);
+	printf("emulated loss     : %llu frames, %llu ACKs\n",
+	       (unsigned long long) c.dropped_up, (unsigned long long) c.dropped_down);
+	printf("delivered         : %llu (%.0f/s), %llu failed after %d attempts, %llu stray ACKs\n",
+	       (unsigned long long) c.delivered, c.delivered / elapsed, (unsigned long long) c.failed,
+	       MAX_ATTEMPTS, (unsigned long long) c.strays);
+	printf("cal requests      : %llu\n", (unsigned long long) c.cal_requests);
+	printf("ACK latency ms    : p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+	       percentile(all, total, 50), percentile(all, total, 90), percentile(all, total, 99),
+	       percentile(all, total, 99.9), percentile(all, total, 100));
+
+	return 0;
+}
@@ -0,0 +1,7 @@
+/*
+ * contiki-lib.h
+ *
+ * Stand-in, see contiki.h.
+ */
+
+#include "contiki.h"
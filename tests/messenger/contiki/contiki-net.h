@@ -0,0 +1,92 @@
+/*
+ * contiki-net.h
+ *
+ * Stand-ins for the Contiki network API the message service uses (see
+ * contiki.h).  A tcp_socket keeps what was sent on it and whether it
+ * was closed, for the checks to look at.
+ */
+
+#ifndef TESTS_MESSENGER_CONTIKI_NET_H_
+#define TESTS_MESSENGER_CONTIKI_NET_H_
+
+#include <string.h>
+
+#include "contiki.h"
+
+#define NETSTACK_CONF_WITH_IPV6 1
+#define UIP_CONF_ROUTER 1
+#define UIP_CONF_IPV6_RPL 1
+
+typedef union {
+	uint8_t u8[16];
+	uint16_t u16[8];
+} uip_ip6addr_t;
+
+typedef uip_ip6addr_t uip_ipaddr_t;
+
+#define uip_ipaddr_cmp(a, b) (memcmp(a, b, sizeof(uip_ipaddr_t)) == 0)
+#define uip_ipaddr_copy(dest, src) (*(dest) = *(src))
+
+struct simple_udp_connection;
+
+typedef void (*simple_udp_callback)(struct simple_udp_connection *c,
+		const uip_ipaddr_t *source_addr, uint16_t source_port,
+		const uip_ipaddr_t *dest_addr, uint16_t dest_port,
+		const uint8_t *data, uint16_t datalen);
+
+struct simple_udp_connection {
+	uint16_t local_port;
+	simple_udp_callback receive_callback;
+};
+
+int simple_udp_register(struct simple_udp_connection *c, uint16_t local_port,
+		uip_ipaddr_t *remote_addr, uint16_t remote_port, simple_udp_callback receive_callback);
+int simple_udp_sendto_port(struct simple_udp_connection *c, const void *data, uint16_t datalen,
+		const uip_ipaddr_t *to, uint16_t to_port);
+
+typedef enum {
+	TCP_SOCKET_CONNECTED,
+	TCP_SOCKET_CLOSED,
+	TCP_SOCKET_TIMEDOUT,
+	TCP_SOCKET_ABORTED,
+	TCP_SOCKET_DATA_SENT
+} tcp_socket_event_t;
+
+struct tcp_socket;
+
+typedef int (*tcp_socket_data_callback_t)(struct tcp_socket *s, void *ptr,
+		const uint8_t *input_data_ptr, int input_data_len);
+typedef void (*tcp_socket_event_callback_t)(struct tcp_socket *s, void *ptr, tcp_socket_event_t event);
+
+struct tcp_socket {
+	tcp_socket_data_callback_t input_callback;
+	tcp_socket_event_callback_t event_callback;
+
+	// what the service did with the connection
+	uint8_t sent[256];
+	int sent_len;
+	int closed;
+	int connects;
+};
+
+int tcp_socket_register(struct tcp_socket *s, void *ptr,
+		uint8_t *input_databuf, int input_databuf_size,
+		uint8_t *output_databuf, int output_databuf_size,
+		tcp_socket_data_callback_t input_callback, tcp_socket_event_callback_t event_callback);
+int tcp_socket_listen(struct tcp_socket *s, uint16_t port);
+int tcp_socket_connect(struct tcp_socket *s, const uip_ipaddr_t *ipaddr, uint16_t port);
+int tcp_socket_max_sendlen(struct tcp_socket *s);
+int tcp_socket_send(struct tcp_socket *s, const uint8_t *dataptr, int datalen);
+int tcp_socket_close(struct tcp_socket *s);
+
+typedef int radio_value_t;
+
+#define RADIO_PARAM_LAST_RSSI (0)
+
+struct radio_driver {
+	int (*get_value)(int param, radio_value_t *value);
+};
+
+extern const struct radio_driver NETSTACK_RADIO;
+
+#endif /* TESTS_MESSENGER_CONTIKI_NET_H_ */
@@ -0,0 +1,98 @@
+/*
+ * contiki.h
+ *
+ * Stand-ins for the parts of Contiki the message service
+ * (modules/messenger/message-service.c) uses, so it can be built and
+ * driven on the host by defer_check, its TCP sender by sender_check,
+ * and the reading aggregation (modules/aggregate) by
+ * ../aggregate/agg_check.  Processes never run: the checks call the
+ * modules' functions themselves and move the clock.
+ */
+
+#ifndef TESTS_MESSENGER_CONTIKI_H_
+#define TESTS_MESSENGER_CONTIKI_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CLOCK_SECOND (128)
+#define CLOCK_LT(a, b) ((signed long) ((a) - (b)) < 0)
+
+typedef unsigned long clock_time_t;
+
+clock_time_t clock_time(void);
+unsigned long clock_seconds(void);
+
+typedef unsigned char process_event_t;
+typedef void *process_data_t;
+
+#define PROCESS_EVENT_POLL (0x82)
+
+// a protothread, as far as a process that never runs needs one
+struct pt {
+	unsigned short lc;
+};
+
+struct process {
+	struct process *next;
+	const char *name;
+	char (*thread)(struct pt *, process_event_t, process_data_t);
+};
+
+#define PROCESS_THREAD(name, ev, data) \
+	static char process_thread_##name(struct pt *process_pt, process_event_t ev, process_data_t data)
+#define PROCESS(name, strname) \
+	PROCESS_THREAD(name, ev, data); \
+	struct process name = { NULL, strname, process_thread_##name }
+#define PROCESS_NAME(name) extern struct process name
+
+#define PROCESS_BEGIN() switch (process_pt->lc) { case 0:
+#define PROCESS_END() } return 3
+#define PROCESS_WAIT_EVENT() do { process_pt->lc = __LINE__; return 1; case __LINE__:; } while (0)
+
+extern struct process *process_current;
+
+void process_start(struct process *p, process_data_t data);
+void process_poll(struct process *p);
+int process_post(struct process *p, process_event_t ev, process_data_t data);
+
+struct etimer {
+	clock_time_t start, interval;
+};
+
+void etimer_set(struct etimer *et, clock_time_t interval);
+void etimer_stop(struct etimer *et);
+int etimer_expired(struct etimer *et);
+
+struct memb {
+	unsigned short size;
+	unsigned short num;
+	char *count;
+	void *mem;
+};
+
+#define MEMB(name, structure, n) \
+	static char name##_memb_count[n]; \
+	static structure name##_memb_mem[n]; \
+	static struct memb name = { sizeof(structure), n, name##_memb_count, (void *) name##_memb_mem }
+
+void memb_init(struct memb *m);
+void *memb_alloc(struct memb *m);
+int memb_free(struct memb *m, void *ptr);
+
+// a list of structs that start with their next pointer
+typedef void **list_t;
+
+#define LIST(name) \
+	static void *name##_list = NULL; \
+	static list_t name = (list_t) &name##_list
+
+void list_init(list_t list);
+void *list_head(list_t list);
+void *list_item_next(void *item);
+int list_length(list_t list);
+void list_push(list_t list, void *item);
+void list_insert(list_t list, void *previtem, void *newitem);
+void list_remove(list_t list, void *item);
+
+#endif /* TESTS_MESSENGER_CONTIKI_H_ */
@@ -0,0 +1,7 @@
+/*
+ * tcpip.h
+ *
+ * Stand-in, see contiki-net.h.
+ */
+
+#include "contiki-net.h"
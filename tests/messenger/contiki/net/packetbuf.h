@@ -0,0 +1,7 @@
+/*
+ * packetbuf.h
+ *
+ * Stand-in, see contiki-net.h.
+ */
+
+#include "contiki-net.h"
@@ -0,0 +1,7 @@
+/*
+ * clock.h
+ *
+ * Stand-in, see contiki.h.
+ */
+
+#include "contiki.h"
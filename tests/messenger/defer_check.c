@@ -0,0 +1,304 @@
+/*
+ * defer_check.c
+ *
+ * Check the message service's deferred replies (messenger_defer() /
+ * messenger_complete() in modules/messenger/message-service.c), built
+ * on the host against the stand-ins in contiki/.
+ *
+ *   defer_check
+ *
+ * A sample handler defers its answer the way waterNode.c's does.  Over
+ * UDP a deferred request must draw nothing until it is completed, its
+ * retries dropped meanwhile and answered from the reply cache after;
+ * over TCP the connection has to stay open until the answer and close
+ * with it.  A request nobody completes has to be answered with a
+ * command_error_t at the timeout, a late completion refused, and a
+ * remote that disconnects has to free its request.  A handler claiming
+ * to defer without messenger_defer() has to draw an error at once, and
+ * one that defers but answers straight away must not hold a slot.
+ */
+#include <stdio.h>
+
+#include "../../modules/messenger/message-service.c"
+
+// handlers of our own, as the nodes never register these headers
+#define BROKEN_HEADER (0x0beed2eU)
+#define HASTY_HEADER (0x0beed2fU)
+
+#define NO_REPLY (0xffffffffU)
+
+#define REMOTE_PORT (4000)
+
+static clock_time_t now = 1000;
+
+static uint8_t datagram[REPLYBUFSIZE];
+static int datagram_len;
+
+static uip_ipaddr_t remote;
+
+static int sample_request = -1;
+
+static int failures;
+
+/*
+ * The stand-ins contiki/ declares.
+ */
+clock_time_t clock_time(void) { return now; }
+
+void process_start(struct process *p, process_data_t data) { }
+void process_poll(struct process *p) { }
+
+void etimer_set(struct etimer *et, clock_time_t interval) { }
+void etimer_stop(struct etimer *et) { }
+int etimer_expired(struct etimer *et) { return 0; }
+
+void *memb_alloc(struct memb *m)
+{
+	int i;
+
+	for (i = 0; i < m->num; i++) {
+		if (!m->count[i]) {
+			m->count[i] = 1;
+			return (char *) m->mem + i * m->size;
+		}
+	}
+	return NULL;
+}
+
+int memb_free(struct memb *m, void *ptr)
+{
+	m->count[((char *) ptr - (char *) m->mem) / m->size] = 0;
+	return 0;
+}
+
+int simple_udp_register(struct simple_udp_connection *c, uint16_t local_port,
+		uip_ipaddr_t *remote_addr, uint16_t remote_port, simple_udp_callback receive_callback)
+{
+	c->local_port = local_port;
+	c->receive_callback = receive_callback;
+	return 1;
+}
+
+int simple_udp_sendto_port(struct simple_udp_connection *c, const void *data, uint16_t datalen,
+		const uip_ipaddr_t *to, uint16_t to_port)
+{
+	memcpy(datagram, data, datalen);
+	datagram_len = datalen;
+	return datalen;
+}
+
+int tcp_socket_register(struct tcp_socket *s, void *ptr,
+		uint8_t *input_databuf, int input_databuf_size,
+		uint8_t *output_databuf, int output_databuf_size,
+		tcp_socket_data_callback_t input_callback, tcp_socket_event_callback_t event_callback)
+{
+	s->input_callback = input_callback;
+	s->event_callback = event_callback;
+	return 1;
+}
+
+int tcp_socket_listen(struct tcp_socket *s, uint16_t port) { return 1; }
+
+int tcp_socket_send(struct tcp_socket *s, const uint8_t *dataptr, int datalen)
+{
+	memcpy(s->sent + s->sent_len, dataptr, datalen);
+	s->sent_len += datalen;
+	return datalen;
+}
+
+int tcp_socket_close(struct tcp_socket *s)
+{
+	s->closed = 1;
+	return 1;
+}
+
+// the sender half of the messenger is not under test
+void messenger_airtime_charge(int bytes) { }
+void messenger_sender_init( ) { }
+
+/*
+ * The handlers.
+ */
+static int sample_handler(const uint8_t *inputdata, int inputlength, uint8_t *outputdata, int *maxoutputlen)
+{
+	sample_request = messenger_defer( );
+	return (sample_request < 0) ? 0 : MESSENGER_PENDING;
+}
+
+static int broken_handler(const uint8_t *inputdata, int inputlength, uint8_t *outputdata, int *maxoutputlen)
+{
+	return MESSENGER_PENDING;
+}
+
+static int hasty_handler(const uint8_t *inputdata, int inputlength, uint8_t *outputdata, int *maxoutputlen)
+{
+	messenger_defer( );
+	memcpy(outputdata, inputdata, sizeof(uint32_t));
+	*maxoutputlen = sizeof(uint32_t);
+	return 1;
+}
+
+static int sample(uint32_t sequence)
+{
+	water_data_t reading;
+
+	memset(&reading, 0, sizeof(reading));
+	reading.header = WATER_DATA_HEADER;
+	reading.sequence = sequence;
+	return messenger_complete(sample_request, &reading, sizeof(reading));
+}
+
+static void timeout( )
+{
+	clock_time_t next;
+
+	now += PENDING_TIMEOUT;
+	expire_pending(&next);
+}
+
+/*
+ * Send a UDP command, and return the header of what it drew (0 for an
+ * empty reply) or NO_REPLY.
+ */
+static uint32_t udp_request(uint16_t id, uint32_t header)
+{
+	uint8_t buf[sizeof(command_request_t) + sizeof(header)];
+	command_request_t *req = (command_request_t *) buf;
+
+	req->header = UDP_COMMAND_HEADER;
+	req->request_id = id;
+	memcpy(req->data, &header, sizeof(header));
+
+	datagram_len = 0;
+	command_udp_recv(&cmd_conn, &remote, REMOTE_PORT, &remote, COMMAND_SERVER_PORT, buf, sizeof(buf));
+	return datagram_len ? 0 : NO_REPLY;
+}
+
+// the header of the last UDP reply, if it answers request 'id'
+static uint32_t udp_reply(uint16_t id)
+{
+	const command_reply_t *reply = (const command_reply_t *) datagram;
+	uint32_t header = 0;
+
+	if ((datagram_len < sizeof(command_reply_t)) || (reply->header != UDP_REPLY_HEADER) || (reply->request_id != id))
+		return NO_REPLY;
+	if (datagram_len >= sizeof(command_reply_t) + sizeof(header))
+		memcpy(&header, reply->data, sizeof(header));
+	return header;
+}
+
+static uint32_t tcp_request(struct tcp_socket *s, uint32_t header)
+{
+	s->sent_len = 0;
+	s->closed = 0;
+	message_recv_bytes(s, NULL, (const uint8_t *) &header, sizeof(header));
+	return s->sent_len ? 0 : NO_REPLY;
+}
+
+static uint32_t tcp_reply(struct tcp_socket *s)
+{
+	uint32_t header;
+
+	if (s->sent_len < sizeof(header))
+		return NO_REPLY;
+	memcpy(&header, s->sent, sizeof(header));
+	return header;
+}
+
+// the error a reply carries, or -1 if it is not a command_error_t
+static int error_of(const uint8_t *data, int length)
+{
+	const command_error_t *e = (const command_error_t *) data;
+
+	if ((length != sizeof(command_error_t)) || (e->header != CMD_ERROR_HEADER))
+		return -1;
+	return (e->request == CMD_SAMPLE_HEADER) || (e->request == BROKEN_HEADER) ? e->error : -1;
+}
+
+static void check(const char *what, int ok)
+{
+	if (ok)
+		return;
+	printf("  %s\n", what);
+	failures++;
+}
+
+int main( )
+{
+	struct tcp_socket *s0 = &rx_sockets[0].socket, *s1 = &rx_sockets[1].socket;
+	int i, requests[MAX_PENDING];
+
+	remote.u8[0] = 0xfd;
+	remote.u8[15] = 1;
+
+	messenger_init( );
+	messenger_add_handler(CMD_SAMPLE_HEADER, sizeof(uint32_t), sizeof(uint32_t), sample_handler);
+	messenger_add_handler(BROKEN_HEADER, sizeof(uint32_t), sizeof(uint32_t), broken_handler);
+	messenger_add_handler(HASTY_HEADER, sizeof(uint32_t), sizeof(uint32_t), hasty_handler);
+	// the receiver process would register the sockets
+	for (i = 0; i < RX_SOCKETS; i++)
+		tcp_socket_register(&rx_sockets[i].socket, NULL, NULL, 0, NULL, 0, message_recv_bytes, message_recv_event);
+
+	// UDP: nothing until the sample is taken, retries dropped meanwhile
+	check("udp request deferred", udp_request(1, CMD_SAMPLE_HEADER) == NO_REPLY);
+	check("udp retry while pending dropped", udp_request(1, CMD_SAMPLE_HEADER) == NO_REPLY);
+	check("udp completion taken", sample(77) == 1);
+	check("udp completion answers", (udp_reply(1) == WATER_DATA_HEADER) &&
+	      (datagram_len == sizeof(command_reply_t) + sizeof(water_data_t)) &&
+	      (((water_data_t *) ((command_reply_t *) datagram)->data)->sequence == 77));
+	check("udp retry answered from the cache", (udp_request(1, CMD_SAMPLE_HEADER) == 0) &&
+	      (udp_reply(1) == WATER_DATA_HEADER));
+	check("completed request gone", sample(78) == 0);
+
+	// UDP: never completed, an error at the timeout and for its retries
+	udp_request(2, CMD_SAMPLE_HEADER);
+	timeout( );
+	check("udp timeout answered with an error", (udp_reply(2) == CMD_ERROR_HEADER) &&
+	      (error_of(((command_reply_t *) datagram)->data, datagram_len - sizeof(command_reply_t)) == CMD_ERROR_TIMEOUT));
+	check("late completion refused", sample(79) == 0);
+	check("udp retry after the timeout gets the error", (udp_request(2, CMD_SAMPLE_HEADER) == 0) &&
+	      (udp_reply(2) == CMD_ERROR_HEADER));
+	printf("udp deferral      : answered, cached, timed out\n");
+
+	// TCP: the connection stays open until the answer, and closes with it
+	check("tcp request deferred", (tcp_request(s0, CMD_SAMPLE_HEADER) == NO_REPLY) && !s0->closed);
+	check("tcp completion taken", sample(80) == 1);
+	check("tcp completion answers and closes", (tcp_reply(s0) == WATER_DATA_HEADER) &&
+	      (s0->sent_len == sizeof(water_data_t)) && s0->closed);
+
+	tcp_request(s0, CMD_SAMPLE_HEADER);
+	timeout( );
+	check("tcp timeout answered with an error and closed", (error_of(s0->sent, s0->sent_len) == CMD_ERROR_TIMEOUT) &&
+	      s0->closed);
+
+	// a remote that goes away takes its request with it
+	tcp_request(s1, CMD_SAMPLE_HEADER);
+	message_recv_event(s1, NULL, TCP_SOCKET_CLOSED);
+	check("disconnected request gone", sample(81) == 0);
+	printf("tcp deferral      : answered, timed out, disconnected\n");
+
+	// PENDING without a deferral: an error now, not silence
+	check("udp bogus pending answered", (udp_request(3, BROKEN_HEADER) == 0) &&
+	      (error_of(((command_reply_t *) datagram)->data, datagram_len - sizeof(command_reply_t)) == CMD_ERROR_HANDLER));
+	check("tcp bogus pending answered and closed", (tcp_request(s0, BROKEN_HEADER) == 0) &&
+	      (error_of(s0->sent, s0->sent_len) == CMD_ERROR_HANDLER) && s0->closed);
+
+	// deferred but answered at once: the answer goes out, the slot is free
+	check("udp hasty answer", (udp_request(4, HASTY_HEADER) == 0) && (udp_reply(4) == HASTY_HEADER));
+	check("tcp hasty answer", (tcp_request(s0, HASTY_HEADER) == 0) && (tcp_reply(s0) == HASTY_HEADER) && s0->closed);
+
+	// every slot free again: MAX_PENDING requests park, the next is answered now
+	for (i = 0; i < MAX_PENDING; i++) {
+		check("slot free", udp_request(10 + i, CMD_SAMPLE_HEADER) == NO_REPLY);
+		requests[i] = sample_request;
+	}
+	check("no slot left, answered now", (udp_request(20, CMD_SAMPLE_HEADER) == 0) && (udp_reply(20) == 0));
+	for (i = 0; i < MAX_PENDING; i++) {
+		sample_request = requests[i];
+		check("parked request completed", (sample(90 + i) == 1) && (udp_reply(10 + i) == WATER_DATA_HEADER));
+	}
+	printf("slots             : %d, freed by every outcome\n", MAX_PENDING);
+
+	printf("defer checks      : %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * sender_check.c
+ *
+ * Check how the messenger's TCP sender (modules/messenger/
+ * message-sender-tcp.c) takes a collector that is not there, built on
+ * the host against the stand-ins in contiki/.
+ *
+ *   sender_check
+ *
+ * A message is queued for the collector and every connection it draws
+ * is refused (the socket aborted by the collector's RST), times out in
+ * the stack, is given up at the sender's own deadline, or cannot be
+ * started at all.  Each connection that never opens has to use up an
+ * attempt and count against the collector, and the message has to be
+ * reported failed after its attempts, not reconnect for ever.  A
+ * connection that does open must not use one up.
+ */
+#include <stdio.h>
+
+#include "../../modules/messenger/message-sender-tcp.c"
+
+// how a connection goes when the sender opens it
+enum {
+	CONNECT_REFUSED, CONNECT_TIMEDOUT, CONNECT_SILENT, CONNECT_ERROR, CONNECT_OK
+};
+
+static clock_time_t now = 1000;
+
+static int connect_as;
+static int timeouts;
+static int reports;
+static messenger_result_t last;
+
+static struct process node;
+
+static int failures;
+
+/*
+ * The stand-ins contiki/ declares.
+ */
+clock_time_t clock_time(void) { return now; }
+
+struct process *process_current = &node;
+
+void process_start(struct process *p, process_data_t data) { }
+void process_poll(struct process *p) { }
+int process_post(struct process *p, process_event_t ev, process_data_t data) { return 0; }
+
+void etimer_set(struct etimer *et, clock_time_t interval) { }
+void etimer_stop(struct etimer *et) { }
+int etimer_expired(struct etimer *et) { return 0; }
+
+void memb_init(struct memb *m)
+{
+	memset(m->count, 0, m->num);
+}
+
+void *memb_alloc(struct memb *m)
+{
+	int i;
+
+	for (i = 0; i < m->num; i++) {
+		if (!m->count[i]) {
+			m->count[i] = 1;
+			return (char *) m->mem + i * m->size;
+		}
+	}
+	return NULL;
+}
+
+int memb_free(struct memb *m, void *ptr)
+{
+	m->count[((char *) ptr - (char *) m->mem) / m->size] = 0;
+	return 0;
+}
+
+// each item starts with its next pointer
+void list_init(list_t list) { *list = NULL; }
+void *list_head(list_t list) { return *list; }
+void *list_item_next(void *item) { return (item == NULL) ? NULL : *(void **) item; }
+
+int list_length(list_t list)
+{
+	void *item;
+	int n = 0;
+
+	for (item = *list; item != NULL; item = list_item_next(item))
+		n++;
+	return n;
+}
+
+void list_push(list_t list, void *item)
+{
+	*(void **) item = *list;
+	*list = item;
+}
+
+void list_insert(list_t list, void *previtem, void *newitem)
+{
+	*(void **) newitem = *(void **) previtem;
+	*(void **) previtem = newitem;
+}
+
+void list_remove(list_t list, void *item)
+{
+	void **link;
+
+	for (link = list; *link != NULL; link = (void **) *link) {
+		if (*link == item) {
+			*link = *(void **) item;
+			return;
+		}
+	}
+}
+
+static int get_value(int param, radio_value_t *value)
+{
+	*value = -70;
+	return 0;
+}
+
+const struct radio_driver NETSTACK_RADIO = { get_value };
+
+int tcp_socket_register(struct tcp_socket *s, void *ptr,
+		uint8_t *input_databuf, int input_databuf_size,
+		uint8_t *output_databuf, int output_databuf_size,
+		tcp_socket_data_callback_t input_callback, tcp_socket_event_callback_t event_callback)
+{
+	s->input_callback = input_callback;
+	s->event_callback = event_callback;
+	return 1;
+}
+
+int tcp_socket_listen(struct tcp_socket *s, uint16_t port) { return 1; }
+
+int tcp_socket_connect(struct tcp_socket *s, const uip_ipaddr_t *ipaddr, uint16_t port)
+{
+	s->connects++;
+	s->closed = 0;
+	s->sent_len = 0;
+	return (connect_as == CONNECT_ERROR) ? -1 : 1;
+}
+
+int tcp_socket_max_sendlen(struct tcp_socket *s)
+{
+	return sizeof(s->sent) - s->sent_len;
+}
+
+int tcp_socket_send(struct tcp_socket *s, const uint8_t *dataptr, int datalen)
+{
+	memcpy(s->sent + s->sent_len, dataptr, datalen);
+	s->sent_len += datalen;
+	return datalen;
+}
+
+int tcp_socket_close(struct tcp_socket *s)
+{
+	s->closed = 1;
+	return 1;
+}
+
+/*
+ * The messenger's front end, message-sender.c.
+ */
+process_event_t sender_start_event = 0x90;
+process_event_t sender_fin_event = 0x91;
+
+void messenger_report(struct process *requestor, const messenger_result_t *result)
+{
+	last = *result;
+	reports++;
+}
+
+void messenger_class_queued(messenger_prio_t prio) { }
+void messenger_class_sent(messenger_prio_t prio, clock_time_t waited) { }
+void messenger_class_done(messenger_prio_t prio) { }
+int messenger_class_admit(messenger_prio_t prio, int used, int size) { return used < size; }
+clock_time_t messenger_airtime_wait(int bytes, uint8_t *deferred) { return 0; }
+int messenger_get_window( ) { return 4; }
+
+void messenger_get_collector(uip_ipaddr_t *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->u8[0] = 0xfd;
+	addr->u8[15] = 1;
+}
+
+void messenger_collector_ack(const uip_ipaddr_t *addr) { }
+void messenger_collector_timeout(const uip_ipaddr_t *addr) { timeouts++; }
+
+// config.c
+void config_set_calibration_change( ) { }
+
+static void check(const char *what, int ok)
+{
+	if (ok)
+		return;
+	printf("  %s\n", what);
+	failures++;
+}
+
+// the socket's event, as the stack raises it, and the poll it posts
+static void socket_event(tcp_socket_event_t ev)
+{
+	snd_socket.event_callback(&snd_socket, NULL, ev);
+	service_queue( );
+}
+
+// the collector ACKs the message written on the session
+static void collector_ack(uint32_t sequence)
+{
+	uint8_t frame[FRAME_PREFIX + sizeof(ack_t)];
+	ack_t *ack = (ack_t *) (frame + FRAME_PREFIX);
+
+	frame[0] = 0;
+	frame[1] = sizeof(ack_t);
+	memset(ack, 0, sizeof(*ack));
+	ack->header = ACK_HEADER;
+	ack->ack_seq = sequence;
+	ack->ack_value = ACK_OK;
+	snd_socket.input_callback(&snd_socket, NULL, frame, sizeof(frame));
+	service_queue( );
+}
+
+/*
+ * Queue one message and open connections for it the given way until it
+ * is reported, or well past its attempts.
+ */
+static void deliver(const char *name, int how)
+{
+	uint32_t sequence = 100 + how;
+	uint8_t data[32];
+	int connects = snd_socket.connects;
+	int tries;
+
+	connect_as = how;
+	timeouts = 0;
+	reports = 0;
+	memset(data, 0, sizeof(data));
+
+	check("message queued", tcp_transport.send(NULL, sequence, data, sizeof(data), MESSENGER_PRIO_DATA));
+
+	for (tries = 0; (reports == 0) && (tries < 3 * MAX_ATTEMPTS); tries++) {
+		// past any reconnect pause
+		now += 20 * CLOCK_SECOND;
+		service_queue( );
+
+		switch (how) {
+		case CONNECT_REFUSED:
+			socket_event(TCP_SOCKET_ABORTED);
+			break;
+		case CONNECT_TIMEDOUT:
+			socket_event(TCP_SOCKET_TIMEDOUT);
+			break;
+		case CONNECT_SILENT:
+			// the sender's deadline, then the close it asked for
+			now += ACK_TIMEOUT;
+			service_queue( );
+			socket_event(TCP_SOCKET_CLOSED);
+			break;
+		case CONNECT_OK:
+			socket_event(TCP_SOCKET_CONNECTED);
+			collector_ack(sequence);
+			break;
+		}
+	}
+
+	connects = snd_socket.connects - connects;
+	if (how == CONNECT_OK) {
+		check("reported once", reports == 1);
+		check("ACK'd", last.ok);
+		check("one attempt", last.attempts == 1);
+		check("no timeouts", timeouts == 0);
+
+		// closed when idle, so the next check starts without a session
+		now += TCP_IDLE;
+		service_queue( );
+		socket_event(TCP_SOCKET_CLOSED);
+	}
+	else {
+		check("reported once", reports == 1);
+		check("reported failed", (reports == 1) && !last.ok);
+		check("every attempt used", last.attempts == MAX_ATTEMPTS);
+		check("each connection counted against the collector", timeouts == MAX_ATTEMPTS);
+		check("no connection past the attempts", connects == MAX_ATTEMPTS);
+	}
+	check("nothing left queued", list_head(send_queue) == NULL);
+
+	printf("%-18s: %d connections, %d timeouts, %s after %d attempts\n", name, connects, timeouts,
+			(reports == 0) ? "not reported" : last.ok ? "ACK'd" : "failed", last.attempts);
+}
+
+int main( )
+{
+	tcp_transport.init( );
+	process_thread_tcp_sender(&(struct pt) { 0 }, 0, NULL);
+
+	deliver("refused", CONNECT_REFUSED);
+	deliver("timed out", CONNECT_TIMEDOUT);
+	deliver("no answer", CONNECT_SILENT);
+	deliver("connect error", CONNECT_ERROR);
+	deliver("connected", CONNECT_OK);
+
+	printf("sender checks     : %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
@@ -52,6 +52,8 @@
 #include "../modules/config/config.h"
 #include "../modules/echo/echo.h"
 #include "../modules/messenger/message-service.h"
+#include "../modules/backlog/backlog.h"
+#include "../modules/aggregate/aggregate.h"
 #include "../modules/command/message.h"
 #include "../modules/command/command.h"
 #include "../modules/sensors/analog.h"
@@ -70,10 +72,13 @@
 #define LOG_MODULE "H20"
 #define LOG_LEVEL LOG_LEVEL_DBG
 
-static int sequence = 0;
 static int failure_counter = 0;
 
 static int sensor_done_evt = 0;
+
+// readings on their way into frames
+static aggregate_t readings;
+
 PROCESS_NAME(sensor_process);
 
 
@@ -118,6 +123,57 @@ PROCESS_THREAD(sysmon, ev, data)
 }
 
 
+// on-demand sample requests (CMD_SAMPLE_HEADER) waiting for the next reading
+#define SAMPLE_WAITERS (2)
+static int sample_waiters[SAMPLE_WAITERS] = { -1, -1 };
+
+/**
+ * \brief answer a sample request with a fresh reading
+ *
+ * Reading the sensors takes about a second, so the request is deferred
+ * and a run started; send_data_proc answers it with the reading taken.
+ */
+static int sample_handler(const uint8_t *inputdata, int inputlength, uint8_t *outputdata, int *maxoutputlen)
+{
+	int i;
+
+	for (i = 0; i < SAMPLE_WAITERS; i++) {
+		if (sample_waiters[i] < 0)
+			break;
+	}
+
+	if ((i == SAMPLE_WAITERS) || ((sample_waiters[i] = messenger_defer( )) < 0)) {
+		LOG_WARN("Too many sample requests, ignored\n");
+		return 0;
+	}
+
+	process_post(&sensor_process, config_cmd_run, 0);
+	return MESSENGER_PENDING;
+}
+
+static int sample_waiting( )
+{
+	int i;
+
+	for (i = 0; i < SAMPLE_WAITERS; i++) {
+		if (sample_waiters[i] >= 0)
+			return 1;
+	}
+	return 0;
+}
+
+static void sample_complete(const water_data_t *message)
+{
+	int i;
+
+	for (i = 0; i < SAMPLE_WAITERS; i++) {
+		if (sample_waiters[i] >= 0)
+			messenger_complete(sample_waiters[i], message, sizeof(*message));
+		sample_waiters[i] = -1;
+	}
+}
+
+
 /**
  * \brief sends calibration data to the server
  *
@@ -151,6 +207,7 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 
 	// result
 	static bool rc = false;
+	static int queued = 0;
 
 	PROCESS_BEGIN( );
 
@@ -172,7 +229,7 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 
 	memset (&message, 0, sizeof(message));
 	message.header = WATER_CAL_HEADER;
-	message.sequence = sequence++;
+	message.sequence = config_use_sequence(1);
 	message.rssi = messenger_recvd_rssi();
 
 	message.caldata[0] = mcal.sens;
@@ -209,15 +266,16 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 		LOG_INFO("**************************\n");
 	}
 
-	// dispatch the message to the message queue
-	static uip_ip6addr_t addr;
-	config_get_receiver (&addr);
-
-	messenger_send (&addr, message.sequence, (void*) &message, sizeof(message));
-	etimer_set(&et, config_get_retry_interval() * CLOCK_SECOND);
+	// dispatch the message to the message queue, the messenger reports
+	// once it has the ACK or has given up retrying (however long that takes)
+	queued = messenger_send (NULL, message.sequence, (void*) &message, sizeof(message), MESSENGER_PRIO_CAL);
+	if (!queued) {
+		LOG_INFO("calibration data could not be queued\n");
+		failure_counter++;
+	}
 
 
-	while(1) {
+	while(queued) {
 		PROCESS_WAIT_EVENT();
 
 
@@ -225,6 +283,11 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 		// messenger responded...
 		if (ev == PROCESS_EVENT_MSG) {
 
+			// completion for some other queued message, keep waiting
+			if (((messenger_result_t *) data)->sequence != message.sequence) {
+				continue;
+			}
+
 			LOG_DBG("Found event message\n");
 
 			if (messenger_last_result_okack ()) {
@@ -243,12 +306,6 @@ PROCESS_THREAD(send_cal_proc, ev, data)
 			break;
 		}
 
-		else if (etimer_expired(&et)) {
-			failure_counter++;
-			LOG_DBG("timeout waiting for remote, failures: %u\n", (unsigned int ) failure_counter);
-			break;
-		}
-
 		else {
 			LOG_DBG("Unknown event, ignoring\n");
 			continue;
@@ -291,14 +348,19 @@ PROCESS_THREAD(send_data_proc, ev, data)
 	static clock_t start = 0;
 	static clock_t now = 0;
 
-	static uip_ip6addr_t addr;
 	static bool rc = false;
+	static int queued = 0;
+
+	// what is actually handed to the messenger
+	static const void *payload = NULL;
+	static int payload_len = 0;
+	static uint32_t payload_seq = 0;
 
 
 	// start preparing the message to send
 	memset (&message, 0, sizeof(message));
 	message.header = WATER_DATA_HEADER;
-	message.sequence = sequence++;
+	message.sequence = config_get_sequence();
 	message.rssi = messenger_recvd_rssi();
 
 	// turn on the auxillary bus
@@ -437,19 +499,34 @@ PROCESS_THREAD(send_data_proc, ev, data)
 	LOG_INFO("* Internal Temp : %10u      *\n", (unsigned int ) message.temppressure);
 	LOG_INFO("***********************************\n");
 
-	config_get_receiver (&addr);
+	// answer anyone who asked for this reading
+	sample_complete(&message);
 
 	// dispatch the message to the messenger service for delivery
 	green = 1;
-	messenger_send (&addr, message.sequence, (void*) &message, sizeof(message));
+	payload = aggregate_take(&readings, &message, sizeof(message), &payload_len, &payload_seq);
+
+	// no timer of our own: the messenger's report is the only outcome, so a
+	// message is never backlogged while it still holds it
+	rc = (payload == NULL);
+	queued = (payload != NULL) && messenger_send (NULL, payload_seq, payload, payload_len, MESSENGER_PRIO_DATA);
+	if ((payload != NULL) && !queued) {
+		LOG_INFO("sensor data could not be queued\n");
+		failure_counter++;
+	}
 
 
-	while(1) {
+	while(queued) {
 		PROCESS_WAIT_EVENT();
 
 		// messenger responded...
 		if (ev == PROCESS_EVENT_MSG) {
 
+			// completion for some other queued message, keep waiting
+			if (((messenger_result_t *) data)->sequence != payload_seq) {
+				continue;
+			}
+
 
 			if (messenger_last_result_okack ()) {
 				LOG_INFO("sensor data sent OK\n");
@@ -459,7 +536,10 @@ PROCESS_THREAD(send_data_proc, ev, data)
 			}
 			// calibration did not send
 			else {
-				LOG_INFO("sensor data sent, NAK\n");
+				if (((messenger_result_t *) data)->refused)
+					LOG_INFO("sensor data refused, the collector has no reference\n");
+				else
+					LOG_INFO("sensor data sent, NAK\n");
 				failure_counter++;
 				rc = false;
 			}
@@ -467,13 +547,6 @@ PROCESS_THREAD(send_data_proc, ev, data)
 			break;
 		}
 
-		else if (etimer_expired(&et)) {
-			failure_counter++;
-			LOG_DBG("timeout waiting for remote, failures: %u\n", (unsigned int ) failure_counter);
-			rc = false;
-			break;
-		}
-
 		else {
 			LOG_DBG("Unknown event, ignoring\n");
 			continue;
@@ -481,6 +554,12 @@ PROCESS_THREAD(send_data_proc, ev, data)
 
 	} // end while ... event processing loop
 
+	// keep what the server did not get, catch up once it answers again
+	// (a reading held for the next aggregate was not sent at all)
+	aggregate_result(&readings, payload, payload_len, rc == true);
+	if ((payload != NULL) && (rc == true))
+		backlog_drain( );
+
 	// report our success
 	process_post(&sensor_process, sensor_done_evt, &rc);
 
@@ -527,6 +606,12 @@ PROCESS_THREAD(sensor_process, ev, data)
 
 	config_init ( WATER_SENSOR_DEVTYPE);
 
+	// readings that could not be delivered are kept in flash
+	backlog_init( );
+
+	// readings sent several to a frame, CONFIG_SAMPLES_PER_SEND
+	aggregate_init(&readings, &aggregate_water);
+
 	// initialize the messenger service - used for bidirectional comms with server
 	messenger_init ();
 
@@ -536,6 +621,9 @@ PROCESS_THREAD(sensor_process, ev, data)
 	// enable the "command" service - respond to remote requests over messenger connections
 	command_init ();
 
+	// answer on-demand sample requests with a fresh reading
+	messenger_add_handler(CMD_SAMPLE_HEADER, sizeof(uint32_t), sizeof(uint32_t), sample_handler);
+
 	process_start(&sysmon, NULL);
 
 	// enter the main state machine loop
@@ -588,6 +676,11 @@ PROCESS_THREAD(sensor_process, ev, data)
 					red = 1;
 				}
 			}
+
+			// a sample request that came in during a calibration run, or too
+			// late for the reading just sent, is answered by another run
+			if (sample_waiting( ))
+				process_post(&sensor_process, config_cmd_run, 0);
 		}
 	} // end while loop;
 